@@ -8,8 +8,10 @@ do_commands(int argc, char **argv)
 	printf("Available commands:\n");
 	printf("  bolo agent        Run the bolo agent process, for submitting measurements.\n");
 	printf("  bolo commands     Print this list of all available commands.\n");
+	printf("  bolo compact      Rewrite a bolo database into densely packed blocks.\n");
 	printf("  bolo core         Run the bolo core aggregator, which receives measurements.\n");
 	printf("  bolo dbinfo       Print low-level information about a bolo database.\n");
+	printf("  bolo fsck         Check (and quarantine) corrupt blocks in a bolo database.\n");
 	printf("  bolo help         Print help and usage information.\n");
 	printf("  bolo idxinfo      Print low-level information about a bolo index block.\n");
 	printf("  bolo import       Import time series and their measurements from standard input.\n");
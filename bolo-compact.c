@@ -0,0 +1,86 @@
+#include "bolo.h"
+#include <getopt.h>
+
+int
+do_compact(int argc, char **argv)
+{
+	struct db *db;
+	struct dbkey *key;
+	struct compaction c;
+
+	{
+		char *key_str = NULL;
+		int idx = 0;
+		char c, *shorts = "hDk:";
+		struct option longs[] = {
+			{"help",      no_argument,       0, 'h'},
+			{"debug",     no_argument,       0, 'D'},
+			{"key",       required_argument, 0, 'k'},
+			{0, 0, 0, 0},
+		};
+
+		while ((c = getopt_long(argc, argv, shorts, longs, &idx)) >= 0) {
+			switch (c) {
+			case 'h':
+				printf("USAGE: %s compact --key \"key-in-hex\" [--debug] /path/to/db/\n\n", argv[0]);
+				printf("Rewrites every time series in a bolo database into densely packed,\n");
+				printf("contiguous blocks, and then removes the slab files they came from.\n");
+				printf("Blocks that have been quarantined (see `bolo fsck`) are dropped.\n");
+				printf("The database must not be in use by a running bolo core.\n\n");
+				printf("OPTIONS\n\n");
+				printf("  -h, --help              Show this help screen.\n\n");
+				printf("  -k, --key KEY-IN-HEX    The literal, hex-encoded database encryption key.\n\n");
+				printf("  -D, --debug             Enable debugging mode.\n"
+					   "                          (mostly useful only to bolo devs).\n\n");
+				return 0;
+
+			case 'D':
+				debugto(fileno(stderr));
+				break;
+
+			case 'k':
+				free(key_str);
+				key_str = strdup(optarg);
+				break;
+			}
+		}
+
+		if (!key_str) {
+			fprintf(stderr, "USAGE: %s compact --key \"key-in-hex\" [--debug] /path/to/db/\n\n", argv[0]);
+			return 1;
+		}
+		key = read_key(key_str);
+		if (!key) {
+			fprintf(stderr, "invalid database encryption key given\n");
+			return 1;
+		}
+	}
+
+	if (argc != optind+2) {
+		fprintf(stderr, "USAGE: %s compact --key \"key-in-hex\" [--debug] /path/to/db/\n\n", argv[0]);
+		return 1;
+	}
+
+	db = db_mount(deslash(argv[optind+1]), key);
+	if (!db) {
+		fprintf(stderr, "%s: %s\n", argv[optind+1], error(errno));
+		return 2;
+	}
+
+	if (db_compact(db, &c) != 0) {
+		fprintf(stderr, "%s: compaction failed: %s\n", argv[optind+1], error(errno));
+		return 2;
+	}
+
+	fprintf(stdout, "%s:\n", argv[optind+1]);
+	fprintf(stdout, "  %lu time series rewritten (%lu measurements)\n", c.series, c.cells);
+	fprintf(stdout, "  %lu tblocks before, %lu after\n", c.before, c.after);
+	fprintf(stdout, "  %lu quarantined tblocks dropped\n", c.dropped);
+	fprintf(stdout, "  %lu tslabs reclaimed\n", c.reclaimed);
+
+	if (db_unmount(db) != 0) {
+		fprintf(stderr, "warning: had trouble unmounting database at %s: %s\n",
+		                argv[optind+1], error(errno));
+	}
+	return 0;
+}
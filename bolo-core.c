@@ -4,14 +4,32 @@
 #include <sys/socket.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <time.h>
 
 #ifndef DEFAULT_CONFIG_FILE
 #define DEFAULT_CONFIG_FILE "/etc/bolo.conf"
 #endif
 
+/* how wide a time window each tslab covers, in databases
+   that we initialize ourselves with retention policies */
+#ifndef DEFAULT_PARTITION
+#define DEFAULT_PARTITION (86400 * 1000)
+#endif
+
+/* how often (ms) to look for stale rollups to rebuild */
+#ifndef ROLLUP_REBUILD_INTERVAL
+#define ROLLUP_REBUILD_INTERVAL 1000
+#endif
+
 static struct core_config cfg;
 static struct db         *db;
 static pthread_mutex_t    db_lock;
+static pthread_t          warm_tid;
+static pthread_t          rollup_tid;
+static pthread_t          scrub_tid;
+static pthread_t          retention_tid;
+static pthread_t          commit_tid;
+static pthread_t          checkpoint_tid;
 
 static struct qlsnr {
 	int                fd;
@@ -21,6 +39,174 @@ static struct qlsnr {
 	struct fdpoll     *poll;
 } qlsnr;
 
+static void
+s_sleepms(int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec  = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+/* map the rest of the database in, a little at a time,
+   while the listeners are already up and taking data. */
+static void *
+warmup_thread(void *_u)
+{
+	int rc;
+
+	do {
+		pthread_mutex_lock(&db_lock);
+		rc = db_warmup(db, 16);
+		pthread_mutex_unlock(&db_lock);
+	} while (rc > 0);
+
+	if (rc != 0)
+		errnof("database warm-up failed (continuing on-demand)");
+	else
+		infof("database warm-up complete");
+	return NULL;
+}
+
+/* rebuild the rollups that have gone stale (after a crash,
+   or a quarantine), a few series at a time, so
+   that queries never have to wait on it; they read the raw
+   measurements until then. */
+static void *
+rollup_thread(void *_u)
+{
+	int rc;
+
+	for (;;) {
+		s_sleepms(ROLLUP_REBUILD_INTERVAL);
+
+		do {
+			pthread_mutex_lock(&db_lock);
+			rc = db_rebuild(db, 16);
+			pthread_mutex_unlock(&db_lock);
+		} while (rc > 0);
+
+		if (rc != 0) {
+			errnof("unable to rebuild rollups");
+			return NULL;
+		}
+	}
+}
+
+/* check every sealed tblock's HMAC, every scrub.interval,
+   within the configured I/O and CPU budgets.  blocks that
+   fail are quarantined, so queries stop returning them. */
+static void *
+scrub_thread(void *_u)
+{
+	struct scrub s;
+
+	for (;;) {
+		s_sleepms(cfg.scrub_interval);
+
+		memset(&s, 0, sizeof(s));
+		s.db      = db;
+		s.lock    = &db_lock;
+		s.threads = cfg.scrub_threads;
+		s.rate    = cfg.scrub_rate;
+		s.duty    = cfg.scrub_duty;
+
+		infof("starting integrity scrub of database at %s", cfg.db_data_root);
+		if (scrub_run(&s) != 0) {
+			errnof("integrity scrub failed");
+			return NULL;
+		}
+		infof("integrity scrub complete: %lu tblocks checked, %lu skipped, %lu quarantined",
+			s.checked, s.skipped, s.bad);
+	}
+}
+
+/* drop whole tslabs that have outlived their retention
+   policies, every retention.interval. */
+static void *
+retention_thread(void *_u)
+{
+	size_t n;
+	int rc;
+
+	for (;;) {
+		s_sleepms(cfg.retention_interval);
+
+		pthread_mutex_lock(&db_lock);
+		rc = db_expire(db, bolo_ms(NULL), &n);
+		pthread_mutex_unlock(&db_lock);
+
+		if (rc != 0) {
+			errnof("unable to expire old data");
+			return NULL;
+		}
+		if (n > 0)
+			infof("expired %lu tslabs that outlived their retention", n);
+	}
+}
+
+/* commit whatever measurements have been logged (but not yet
+   committed) to the write-ahead log, every wal.interval; this
+   bounds how much a crash can lose, for one fdatasync().  a
+   commit that fails keeps its frame, for the next one to retry. */
+static void *
+commit_thread(void *_u)
+{
+	int rc, failed;
+
+	failed = 0;
+	for (;;) {
+		s_sleepms(cfg.wal_interval);
+
+		pthread_mutex_lock(&db_lock);
+		rc = db_commit(db);
+		pthread_mutex_unlock(&db_lock);
+
+		if (rc != 0) {
+			errnof("unable to commit the write-ahead log (will retry in %dms)", cfg.wal_interval);
+			failed = 1;
+		} else if (failed) {
+			infof("committed the write-ahead log, after an earlier failure");
+			failed = 0;
+		}
+	}
+	return NULL;
+}
+
+/* write out tslabs, btrees and main.db, every checkpoint.interval,
+   so that the write-ahead log can be emptied.  a checkpoint that
+   fails leaves the log (and block journal) as they were, and the
+   next one tries again; until one succeeds, both keep growing.
+
+   the sync runs under db_lock, so ingest and queries wait on the
+   whole of it; what it takes off of the ingest path is the
+   per-insert cost, not the pause. */
+static void *
+checkpoint_thread(void *_u)
+{
+	int rc, failed;
+
+	failed = 0;
+	for (;;) {
+		s_sleepms(cfg.checkpoint_interval);
+
+		pthread_mutex_lock(&db_lock);
+		rc = db_sync(db);
+		pthread_mutex_unlock(&db_lock);
+
+		if (rc != 0) {
+			errnof("unable to checkpoint the database (will retry in %dms)", cfg.checkpoint_interval);
+			failed = 1;
+		} else if (failed) {
+			infof("checkpointed the database, after an earlier failure");
+			failed = 0;
+		}
+	}
+	return NULL;
+}
+
 static void *
 qlsnr_thread(void *_u)
 {
@@ -183,10 +369,14 @@ metric_handler(int fd, void *_u)
 		}
 	}
 
-	debugf("syncing database...");
-	if (db_sync(db) != 0) {
-		errnof("failed to sync database after updating metric measurements");
-		goto lockfail;
+	/* everything is in the write-ahead log; the checkpoint
+	   thread gets it into the tslabs (and main.db) later. */
+	if (cfg.wal_interval == 0) {
+		debugf("committing write-ahead log...");
+		if (db_commit(db) != 0) {
+			errnof("failed to commit write-ahead log after updating metric measurements");
+			goto lockfail;
+		}
 	}
 	pthread_mutex_unlock(&db_lock);
 
@@ -238,6 +428,7 @@ do_core(int argc, char **argv)
 {
 	int i;
 	struct dbkey *key;
+	struct dbopts opts;
 
 	{
 		char *key_str;
@@ -317,7 +508,10 @@ do_core(int argc, char **argv)
 	if (!db && (errno == BOLO_ENODBROOT || errno == BOLO_ENOMAINDB)) {
 		warningf("unable to mount database; doesn't look like %s has been initialized yet", cfg.db_data_root);
 		infof("initializing database at %s...", cfg.db_data_root);
-		db = db_init(cfg.db_data_root, key);
+		memset(&opts, 0, sizeof(opts));
+		if (cfg.nretention > 0)
+			opts.partition = DEFAULT_PARTITION;
+		db = db_init(cfg.db_data_root, key, &opts);
 		if (!db) {
 			errnof("unable to create new bolo database at %s", cfg.db_data_root);
 			return 2;
@@ -328,6 +522,18 @@ do_core(int argc, char **argv)
 		return 2;
 	}
 
+	if (db_wal(db, cfg.wal_group) != 0) {
+		errnof("unable to open write-ahead log for bolo database at %s", cfg.db_data_root);
+		return 2;
+	}
+
+	for (i = 0; i < (int)cfg.nretention; i++)
+		if (db_retain(db, cfg.retention[i].pattern, cfg.retention[i].keep) != 0)
+			bail("unable to set up retention policies.");
+	if (cfg.nretention > 0 && !db->partition)
+		warningf("database at %s is not partitioned by time (see `bolo init --partition'); "
+		         "retention policies will not be enforced", cfg.db_data_root);
+
 	/* configure query listener */
 	qlsnr.nconn = cfg.query_max_connections;
 	qlsnr.conn  = xalloc(qlsnr.nconn, sizeof(*qlsnr.conn));
@@ -367,9 +573,19 @@ do_core(int argc, char **argv)
 	/* initialize mutices */
 	pthread_mutex_init(&db_lock, NULL);
 
-	/* spin both threads */
+	/* spin both threads, and warm up the rest of the database
+	   in the background (db_mount() only read the headers) */
 	pthread_create(&qlsnr.tid, NULL, qlsnr_thread, &qlsnr);
 	pthread_create(&mlsnr.tid, NULL, mlsnr_thread, &mlsnr);
+	pthread_create(&warm_tid, NULL, warmup_thread, NULL);
+	pthread_create(&rollup_tid, NULL, rollup_thread, NULL);
+	if (cfg.scrub_interval > 0)
+		pthread_create(&scrub_tid, NULL, scrub_thread, NULL);
+	if (cfg.retention_interval > 0 && cfg.nretention > 0 && db->partition)
+		pthread_create(&retention_tid, NULL, retention_thread, NULL);
+	if (cfg.wal_interval > 0)
+		pthread_create(&commit_tid, NULL, commit_thread, NULL);
+	pthread_create(&checkpoint_tid, NULL, checkpoint_thread, NULL);
 	pthread_join(qlsnr.tid, NULL);
 	return 0;
 }
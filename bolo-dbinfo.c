@@ -10,6 +10,7 @@ do_dbinfo(int argc, char **argv)
 	struct idx *idx;
 	struct multidx *set;
 	const char *k;
+	int i;
 
 	{
 		char *key_str = NULL;
@@ -66,7 +67,14 @@ do_dbinfo(int argc, char **argv)
 	}
 
 	fprintf(stdout, "%s:\n", argv[optind+1]);
-	fprintf(stdout, "next tblock #: [%#06lx]\n", db->next_tblock);
+	fprintf(stdout, "block format: BLOKv%d\n", db->block_format);
+	fprintf(stdout, "sealed with:  %s\n", mac_name(db->mac));
+	fprintf(stdout, "next tslab #: [%#06lx]\n", db->next_slab);
+	for (i = 0; i < TBLOCK_CLASSES; i++) {
+		if (db->tail[i])
+			fprintf(stdout, "  %4dk tblocks go into tslab [%#06lx]\n",
+				tblock_class_size(i) / 1024, db->tail[i]->number);
+	}
 
 	if (isempty(&db->slab)) {
 		fprintf(stdout, "slabs: (none)\n");
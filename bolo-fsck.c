@@ -0,0 +1,121 @@
+#include "bolo.h"
+#include <getopt.h>
+
+int
+do_fsck(int argc, char **argv)
+{
+	struct db *db;
+	struct dbkey *key;
+	struct scrub s;
+	size_t i, freed;
+	int threads, upgrade;
+
+	{
+		char *key_str = NULL;
+		int idx = 0;
+		char c, *shorts = "hDk:j:U";
+		struct option longs[] = {
+			{"help",      no_argument,       0, 'h'},
+			{"debug",     no_argument,       0, 'D'},
+			{"key",       required_argument, 0, 'k'},
+			{"threads",   required_argument, 0, 'j'},
+			{"upgrade",   no_argument,       0, 'U'},
+			{0, 0, 0, 0},
+		};
+
+		threads = upgrade = 0;
+		while ((c = getopt_long(argc, argv, shorts, longs, &idx)) >= 0) {
+			switch (c) {
+			case 'h':
+				printf("USAGE: %s fsck --key \"key-in-hex\" [--threads N] [--upgrade] [--debug] /path/to/db/\n\n", argv[0]);
+				printf("Checks the integrity seal (HMAC) of every block in a bolo database,\n");
+				printf("and quarantines any that fail, so that queries stop reading them.\n");
+				printf("Blocks that no time series refers to are freed, for reuse.\n");
+				printf("The database must not be in use by a running bolo core.\n\n");
+				printf("OPTIONS\n\n");
+				printf("  -h, --help              Show this help screen.\n\n");
+				printf("  -k, --key KEY-IN-HEX    The literal, hex-encoded database encryption key.\n\n");
+				printf("  -j, --threads N         How many blocks to check at once.\n"
+				       "                          (defaults to one per CPU core).\n\n");
+				printf("  -U, --upgrade           Reseal tslab headers that still carry the\n"
+				       "                          old-style seal, which a normal mount refuses.\n\n");
+				printf("  -D, --debug             Enable debugging mode.\n"
+					   "                          (mostly useful only to bolo devs).\n\n");
+				return 0;
+
+			case 'D':
+				debugto(fileno(stderr));
+				break;
+
+			case 'k':
+				free(key_str);
+				key_str = strdup(optarg);
+				break;
+
+			case 'j':
+				threads = atoi(optarg);
+				break;
+
+			case 'U':
+				upgrade = 1;
+				break;
+			}
+		}
+
+		if (!key_str) {
+			fprintf(stderr, "USAGE: %s fsck --key \"key-in-hex\" [--threads N] [--upgrade] [--debug] /path/to/db/\n\n", argv[0]);
+			return 1;
+		}
+		key = read_key(key_str);
+		if (!key) {
+			fprintf(stderr, "invalid database encryption key given\n");
+			return 1;
+		}
+	}
+
+	if (argc != optind+2) {
+		fprintf(stderr, "USAGE: %s fsck --key \"key-in-hex\" [--threads N] [--upgrade] [--debug] /path/to/db/\n\n", argv[0]);
+		return 1;
+	}
+
+	db = upgrade ? db_upgrade(deslash(argv[optind+1]), key)
+	             : db_mount(deslash(argv[optind+1]), key);
+	if (!db) {
+		fprintf(stderr, "%s: %s\n", argv[optind+1], error(errno));
+		return 2;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.db      = db;
+	s.threads = threads;
+	if (scrub_run(&s) != 0) {
+		fprintf(stderr, "%s: integrity check failed: %s\n", argv[optind+1], error(errno));
+		return 2;
+	}
+
+	if (db_sweep(db, &freed) != 0 || db_sync(db) != 0) {
+		fprintf(stderr, "%s: unable to free unreferenced tblocks: %s\n", argv[optind+1], error(errno));
+		return 2;
+	}
+
+	fprintf(stdout, "%s:\n", argv[optind+1]);
+	fprintf(stdout, "  %lu tblocks checked\n", s.checked);
+	fprintf(stdout, "  %lu tblocks skipped (unsealed, quarantined, or free)\n", s.skipped);
+	fprintf(stdout, "  %lu tblocks failed their integrity checks\n", s.bad);
+	fprintf(stdout, "  %lu tblocks were unreferenced, and have been freed for reuse\n", freed);
+	fprintf(stdout, "  %lu tblocks free in all\n", db->nfree);
+
+	if (db->nquarantined == 0) {
+		fprintf(stdout, "quarantine: (none)\n");
+	} else {
+		fprintf(stdout, "quarantine:\n");
+		for (i = 0; i < db->nquarantined; i++)
+			fprintf(stdout, "  - [%#06lx]\n", db->quarantine[i]);
+	}
+
+	if (db_unmount(db) != 0) {
+		fprintf(stderr, "warning: had trouble unmounting database at %s: %s\n",
+		                argv[optind+1], error(errno));
+	}
+	return s.bad ? 3 : 0;
+}
@@ -62,7 +62,7 @@ do_import(int argc, char **argv)
 
 	db = db_mount(deslash(argv[optind+1]), key);
 	if (!db && (errno == BOLO_ENODBROOT || errno == BOLO_ENOMAINDB))
-		db = db_init(argv[optind+1], key);
+		db = db_init(argv[optind+1], key, NULL);
 	if (!db) {
 		errorf("%s: %s", argv[optind+1], error(errno));
 		return 2;
@@ -6,25 +6,42 @@ do_init(int argc, char **argv)
 {
 	struct db *db;
 	struct dbkey *key;
+	struct dbopts opts;
 
+	memset(&opts, 0, sizeof(opts));
 	{
 		char *key_str;
 		int idx = 0;
-		char c, *shorts = "hDk:";
+		char c, *shorts = "hDk:F:m:p:";
 		struct option longs[] = {
 			{"help",      no_argument,       0, 'h'},
 			{"debug",     no_argument,       0, 'D'},
 			{"key",       required_argument, 0, 'k'},
+			{"format",    required_argument, 0, 'F'},
+			{"mac",       required_argument, 0, 'm'},
+			{"partition", required_argument, 0, 'p'},
 			{0, 0, 0, 0},
 		};
 
 		while ((c = getopt_long(argc, argv, shorts, longs, &idx)) >= 0) {
 			switch (c) {
 			case 'h':
-				printf("USAGE: %s init [--key \"key-in-hex\"] [--debug] /path/to/db/\n\n", argv[0]);
+				printf("USAGE: %s init [--key \"key-in-hex\"] [--format N] [--mac ALGORITHM] [--partition DURATION] [--debug] /path/to/db/\n\n", argv[0]);
 				printf("OPTIONS\n\n");
 				printf("  -h, --help              Show this help screen.\n\n");
 				printf("  -k, --key KEY-IN-HEX    The literal, hex-encoded database encryption key.\n");
+				printf("  -F, --format N          Block storage format to use for new data;\n"
+				       "                          2 for fixed-size cells (the default),\n"
+				       "                          3 for compressed (Gorilla-style) cells,\n"
+				       "                          4 for columnar cells (faster range scans).\n");
+				printf("  -m, --mac ALGORITHM     Keyed MAC to seal blocks with, for tamper\n"
+				       "                          detection; `hmac-sha512' (the default), or\n"
+				       "                          `blake2b' (much faster).\n");
+				printf("  -p, --partition DURATION\n"
+				       "                          Split new data into a set of slabs per\n"
+				       "                          window of time (like `1d' or `6h'), so\n"
+				       "                          that retention policies can drop whole\n"
+				       "                          slabs once they age out.\n");
 				printf("  -D, --debug             Enable debugging mode.\n"
 					   "                          (mostly useful only to bolo devs).\n\n");
 				return 0;
@@ -37,6 +54,30 @@ do_init(int argc, char **argv)
 				free(key_str);
 				key_str = strdup(optarg);
 				break;
+
+			case 'F':
+				opts.block_format = atoi(optarg);
+				if (opts.block_format < 1 || opts.block_format > 4) {
+					fprintf(stderr, "invalid block format '%s' given\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'm':
+				if (mac_parse(optarg) < 0) {
+					fprintf(stderr, "invalid MAC algorithm '%s' given\n", optarg);
+					return 1;
+				}
+				opts.mac = optarg;
+				break;
+
+			case 'p':
+				opts.partition = bolo_duration(optarg);
+				if (opts.partition == INVALID_MS || opts.partition == 0) {
+					fprintf(stderr, "invalid partition duration '%s' given\n", optarg);
+					return 1;
+				}
+				break;
 			}
 		}
 
@@ -57,11 +98,11 @@ do_init(int argc, char **argv)
 	}
 
 	if (argc != optind+2) {
-		printf("USAGE: %s init [--key \"key-in-hex\"] [--debug] /path/to/db/\n\n", argv[0]);
+		printf("USAGE: %s init [--key \"key-in-hex\"] [--format N] [--mac ALGORITHM] [--partition DURATION] [--debug] /path/to/db/\n\n", argv[0]);
 		return 1;
 	}
 
-	db = db_init(argv[optind+1], key);
+	db = db_init(argv[optind+1], key, &opts);
 	if (!db) {
 		fprintf(stderr, "%s: %s\n", argv[optind+1], error(errno));
 		return 2;
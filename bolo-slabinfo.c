@@ -7,9 +7,9 @@ do_slabinfo(int argc, char **argv)
 {
 	struct tslab slab;
 	const char *path;
-	int i, j, k, rc, fd;
+	int i, j, rc, fd;
 	int tcells, nvalid;
-	double full, bitsper;
+	double full, tfull, bitsper, encbits, tbits;
 	char unit;
 
 	{
@@ -58,6 +58,7 @@ do_slabinfo(int argc, char **argv)
 		}
 
 		tcells = nvalid = 0;
+		tfull = tbits = 0.0;
 		for (j = 0; j < TBLOCKS_PER_TSLAB; j++) {
 			if (!slab.blocks[j].valid)
 				break;
@@ -65,10 +66,17 @@ do_slabinfo(int argc, char **argv)
 		}
 
 		fprintf(stdout, "%s:\n", path);
-		fprintf(stdout, "slab %lu (%#016lx) %dk %d/%d blocks present\n",
-			slab.number, slab.number, slab.block_size / 1024, nvalid, TBLOCKS_PER_TSLAB);
+		fprintf(stdout, "slab %lu (%#016lx) %dk %d/%d blocks present (%d free), sealed with %s\n",
+			slab.number, slab.number, slab.block_size / 1024, nvalid, TBLOCKS_PER_TSLAB, slab.nfree, mac_name(slab.mac));
+		if (slab.until) {
+			if (slab.keep)
+				fprintf(stdout, "  window [%lu, %lu), kept for %lums after\n", slab.from, slab.until, slab.keep);
+			else
+				fprintf(stdout, "  window [%lu, %lu), kept forever\n", slab.from, slab.until);
+		}
 		for (j = 0; j < TBLOCKS_PER_TSLAB; j++) {
-			uint32_t span, tmp;
+			struct tcursor c;
+			uint32_t span;
 			char date[64];
 			struct tm tm;
 			time_t ts;
@@ -77,22 +85,30 @@ do_slabinfo(int argc, char **argv)
 			if (!slab.blocks[j].valid)
 				break;
 
+			/* compressed (v3) blocks fill up by bits, not by cells */
+			if (slab.blocks[j].version == 3) {
+				full    = 100.0 * slab.blocks[j].enc.bits / tblock_v3bits(slab.blocks+j);
+				encbits = slab.blocks[j].enc.bits;
+			} else {
+				full    = 100.0 * slab.blocks[j].cells / tblock_capacity(slab.blocks+j);
+				encbits = slab.blocks[j].cells * 96.0;
+			}
 			tcells += slab.blocks[j].cells;
-			full = 100.0 * slab.blocks[j].cells / TCELLS_PER_TBLOCK;
+			tfull  += full;
+			tbits  += encbits;
 
 			unit = 'b';
-			bitsper = (TBLOCK_SIZE * 8.0) / slab.blocks[j].cells;
+			bitsper = (slab.block_size * 8.0) / slab.blocks[j].cells;
 			if (bitsper > 1024.0) {
 				bitsper /= 1024.0;
 				unit = 'k';
 			}
 
 			span = 0;
-			for (k = 0; k < slab.blocks[j].cells; k++) {
-				tmp = tblock_read32(slab.blocks+j, 32 + k * 12);
-				if (tmp > span)
-					span = tmp;
-			}
+			tcursor_init(&c, slab.blocks+j);
+			while (tcursor_next(&c) == 0)
+				if (c.ts - slab.blocks[j].base > span)
+					span = c.ts - slab.blocks[j].base;
 			ms = span % 1000; span /= 1000;
 			s  = span % 60;   span /= 60;
 			m  = span % 60;   span /= 60;
@@ -105,27 +121,30 @@ do_slabinfo(int argc, char **argv)
 			else
 				strftime(date, 64, "%a, %d %b %Y %H:%M:%S%z", &tm);
 
-			fprintf(stdout, "    @%lu (%#016lx) ts %lu [%s] % 6i measurements;"
+			fprintf(stdout, "    @%lu (%#016lx) v%d ts %lu [%s] % 6i measurements;"
 			                   " %6.2lf%% full, spanning %2ud %02u:%02u:%02u.%04u;"
-			                   " %7.2lf%c/measurement\n",
+			                   " %7.2lf%c/measurement (%6.2lfb encoded)%s\n",
 				slab.blocks[j].number, slab.blocks[j].number,
-				slab.blocks[j].base, date,
+				slab.blocks[j].version, slab.blocks[j].base, date,
 				slab.blocks[j].cells,
 				full, d, h, m, s, ms,
-				bitsper, unit);
+				bitsper, unit,
+				slab.blocks[j].cells ? encbits / slab.blocks[j].cells : 0.0,
+				tslab_isfree(&slab, slab.number | j) ? " (free)" : "");
 		}
 
 		/* totals */
-		full = 100.0 * tcells / (TCELLS_PER_TBLOCK * nvalid);
+		full = nvalid ? tfull / nvalid : 0.0;
 
 		unit = 'b';
-		bitsper = (nvalid * TBLOCK_SIZE * 8.0) / tcells;
+		bitsper = (nvalid * slab.block_size * 8.0) / tcells;
 		if (bitsper > 1024.0) {
 			bitsper /= 1024.0;
 			unit = 'k';
 		}
 		fprintf(stdout, "  total %i measurements (%6.2lf%% full)\n", tcells, full);
-		fprintf(stdout, "  average %0.2lf%c/measurement\n", bitsper, unit);
+		fprintf(stdout, "  average %0.2lf%c/measurement (%0.2lfb encoded)\n", bitsper, unit,
+			tcells ? tbits / tcells : 0.0);
 
 		if (tslab_unmap(&slab) != 0)
 			fprintf(stderr, "failed to unmap %s...\n", path);
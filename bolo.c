@@ -3,8 +3,10 @@
 #define EXT(x) extern int do_ ## x (int argc, char **argv)
 EXT(agent);         /* bolo agent [-c CONFIG] [-l LEVEL] [-D] */
 EXT(commands);      /* bolo commands */
+EXT(compact);       /* bolo compact --key KEY DATADIR */
 EXT(core);          /* bolo core [-c PATH] [-l LEVEL] [-D] */
 EXT(dbinfo);        /* bolo dbinfo DATADIR */
+EXT(fsck);          /* bolo fsck --key KEY DATADIR */
 EXT(help);          /* bolo help */
 EXT(idxinfo);       /* bolo idxinfo DATADIR/idx/INDEXFILE */
 EXT(import);        /* bolo import DATADIR <INPUT */
@@ -94,8 +96,10 @@ int main(int argc, char **argv)
 	#define RUN(c) if (streq(command, #c)) return do_ ## c (argc, argv)
 	RUN(agent);
 	RUN(commands);
+	RUN(compact);
 	RUN(core);
 	RUN(dbinfo);
+	RUN(fsck);
 	RUN(idxinfo);
 	RUN(import);
 	RUN(init);
@@ -39,6 +39,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 
 
 #ifndef DEFAULT_QUERY_SAMPLES
@@ -98,6 +99,7 @@ uint64_t urand64();
 int urand(void *buf, size_t len);
 
 int mktree(int dirfd, const char *path, mode_t mode) RETURNS;
+int fprealloc(int fd, off_t offset, size_t len);
 char * deslash(char *s);
 
 struct list {
@@ -148,6 +150,11 @@ typedef uint32_t bolo_sec_t;
 bolo_msec_t bolo_ms(const struct timeval *tv) RETURNS;
 bolo_msec_t bolo_s (const struct timeval *tv) RETURNS;
 
+/* parse a duration like "90s", "36h" or "30d" (one of the
+   units ms, s, m, h, d or w; no units means seconds) into
+   milliseconds; returns INVALID_MS if it can't. */
+bolo_msec_t bolo_duration(const char *s) RETURNS;
+
 /*****************************************************************  config  ***/
 
 #define AGENT_CONFIG 1
@@ -189,6 +196,24 @@ struct core_config {
 	/* metric.* - metric listener settings */
 	char *metric_listen;
 	int   metric_max_connections;
+
+	/* scrub.* - background integrity scrubber settings */
+	int   scrub_interval;  /* ms between passes (0 = disabled) */
+	int   scrub_rate;      /* bytes / second */
+	int   scrub_duty;      /* percent of CPU */
+	int   scrub_threads;
+
+	/* retention.* - data retention settings */
+	int               retention_interval; /* ms between expiries (0 = disabled) */
+	struct retention *retention;          /* policies, in the order given */
+	size_t            nretention;
+
+	/* wal.* - write-ahead log settings */
+	int   wal_interval;    /* ms between commits (0 = every batch) */
+	int   wal_group;       /* measurements per commit, at most */
+
+	/* checkpoint.* - settings for syncing tslabs / btrees / main.db */
+	int   checkpoint_interval; /* ms between checkpoints */
 };
 
 int configure(int type, void *, int fd) RETURNS;
@@ -210,16 +235,30 @@ void sha512_init(struct sha512 *c);
 void sha512_feed(struct sha512 *c, const void *buf, size_t len);
 void sha512_done(struct sha512 *c);
 
+/* feed each of n contexts its own buffer, digesting several
+   of them at once (on CPUs that can) wherever they line up. */
+void sha512_feedn(struct sha512 **c, const void **buf, const size_t *len, int n);
+
 int sha512_raw(struct sha512 *c, void *digest, size_t len) RETURNS;
 int sha512_hex(struct sha512 *c, void *digest, size_t len) RETURNS;
 
 /***********************************************************  HMAC-SHA-512  ***/
 
+/* the SHA-512 states after absorbing K^ipad and K^opad;
+   computing these once per key saves two SHA-512 block
+   transforms (plus the key prep) on every HMAC. */
+struct hmac_sha512_key {
+	uint64_t inner[8];
+	uint64_t outer[8];
+};
+
 struct hmac_sha512 {
 	struct sha512 sha;
-	char key[128];
+	uint64_t outer[8];
 };
 
+void hmac_sha512_key(struct hmac_sha512_key *k, const char *key, size_t len);
+void hmac_sha512_start(struct hmac_sha512 *c, const struct hmac_sha512_key *k);
 void hmac_sha512_init(struct hmac_sha512 *c, const char *key, size_t len);
 void hmac_sha512_feed(struct hmac_sha512 *c, const void *buf, size_t len);
 void hmac_sha512_done(struct hmac_sha512 *c);
@@ -229,8 +268,27 @@ int hmac_sha512_hex(struct hmac_sha512 *c, void *hmac, size_t len) RETURNS;
 
 void hmac_sha512_seal (const char *key, size_t klen, const void *buf, size_t len);
 int  hmac_sha512_check(const char *key, size_t klen, const void *buf, size_t len) RETURNS;
-#define hmac_seal  hmac_sha512_seal
-#define hmac_check hmac_sha512_check
+
+void hmac_sha512_kseal (const struct hmac_sha512_key *k, const void *buf, size_t len);
+int  hmac_sha512_kcheck(const struct hmac_sha512_key *k, const void *buf, size_t len) RETURNS;
+
+
+/****************************************************************  BLAKE2b  ***/
+
+#define BLAKE2B_DIGEST  64
+#define BLAKE2B_BLOCK  128
+
+struct blake2b {
+	uint64_t state[8];
+	uint64_t bytes[2];
+	uint8_t  block[BLAKE2B_BLOCK];
+	size_t   used;
+};
+
+/* key may be NULL (len 0) for a plain, unkeyed digest */
+void blake2b_init(struct blake2b *c, const void *key, size_t len);
+void blake2b_feed(struct blake2b *c, const void *buf, size_t len);
+void blake2b_done(struct blake2b *c, void *digest);
 
 
 /*****************************************************************  fdpoll  ***/
@@ -313,13 +371,29 @@ struct page {
 	int     fd;
 	void   *data;
 	size_t  len;
+	int     borrowed; /* is this a window into another page's mapping? */
 };
 
+/* access pattern hints, for page_advise() */
+#define PAGE_NORMAL     0
+#define PAGE_SEQUENTIAL 1  /* about to be read front-to-back */
+#define PAGE_WILLNEED   2  /* about to be read; start paging it in */
+#define PAGE_HUGE       3  /* back with transparent huge pages, if possible */
 
 int page_map  (struct page *p, int fd, off_t start, size_t len) RETURNS;
 int page_unmap(struct page *p) RETURNS;
 int page_sync (struct page *p) RETURNS;
 
+/* msync just [offset, offset+len) of a mapping, instead of the
+   whole thing.  offset must be page-aligned. */
+int page_syncrange(struct page *p, size_t offset, size_t len) RETURNS;
+
+/* point `p` at [offset, offset+len) of an existing mapping;
+   borrowed pages share the parent's mapping, and unmapping
+   them leaves the parent alone.  offset must be page-aligned. */
+void page_borrow(struct page *p, struct page *from, size_t offset, size_t len);
+int page_advise(struct page *p, int hint);
+
 uint8_t  page_read8  (struct page *p, size_t o);
 uint16_t page_read16 (struct page *p, size_t o);
 uint32_t page_read32 (struct page *p, size_t o);
@@ -384,13 +458,19 @@ struct btree {
 
 	uint64_t id;   /* identity of this block, on-disk */
 
+	int dirty;     /* has this node changed since it was
+	                  last written out?  (btree_write() skips
+	                  the msync of clean nodes) */
+
 	struct btree *kids[BTREE_DEGREE+1];
 
 	struct page page;
 };
 
 int btree_write(struct btree *t);
+int btree_isdirty(struct btree *t) RETURNS;
 int btree_close(struct btree *t);
+int btree_load(struct btree *t);
 
 void btree_print(struct btree *t);
 
@@ -400,15 +480,31 @@ int btree_isempty(struct btree *t);
 bolo_msec_t btree_first(struct btree *t);
 bolo_msec_t btree_last(struct btree *t);
 
+/* find the first key after *key; on success, *key and *dst
+   are updated to that key and its value. */
+int btree_next(struct btree *t, uint64_t *dst, bolo_msec_t *key);
+
+/* forget every key before `key`.  the pages of interior
+   nodes that only covered those keys are not reused. */
+int btree_prune(struct btree *t, bolo_msec_t key);
+
 /********************************************************  btree allocator  ***/
 
 #define BTBLOCK_DENSITY 4096
 
+/* how much of a btree block file to reserve on-disk
+   at a time (see fprealloc); defaults to the whole file. */
+#ifndef BTREE_PREALLOC
+#define BTREE_PREALLOC (BTBLOCK_DENSITY * BTREE_PAGE_SIZE)
+#endif
+
 struct btblock {
 	struct list l;       /* list handle for btallocator->blocks */
 	struct list btrees;  /* list of all btree nodes in this block */
 
 	int fd;              /* file descriptor for this block file */
+	uint64_t id;         /* node ID of the first page in this file;
+	                        the lower 32 bits are always zero */
 
 	size_t used;         /* how many btree nodes have been allocated
 	                        on this block.  once BTBLOCK_DENSITY is
@@ -432,9 +528,30 @@ struct btree * btfind(struct btallocator *a, uint64_t id) RETURNS;
 #define TSLAB_MAX_SIZE    (1 << 30)
 #define TSLAB_HEADER_SIZE 88
 
-/* a BLOCK in a SLAB is exactly 512k
+/* a SLAB that belongs to a single window of time (magic
+   "SLABv2") also records that window, and how long to keep
+   it around after the window closes, ahead of the MAC. */
+#define TSLAB_V2_HEADER_SIZE 112
+
+/* the back half of a SLAB's header page is its FREE MAP:
+   the slab number, one bit per block (set = free for reuse),
+   and a MAC of its own, since it changes far more often
+   than the header proper does. */
+#define TSLAB_FREEMAP_OFFSET 2048
+#define TSLAB_FREEMAP_SIZE   (8 + TBLOCKS_PER_TSLAB / 8 + MAC_DIGEST)
+
+/* how much of a SLAB file to reserve on-disk at a time,
+   as blocks are extended (see fprealloc).  setting this
+   to TSLAB_MAX_SIZE reserves the whole slab up front. */
+#ifndef TSLAB_PREALLOC
+#define TSLAB_PREALLOC (64 << 20)
+#endif
+
+/* a BLOCK in a SLAB is (at most) 512k
    with a 32b header and an HMAC-SHA512
-   footer, leaving 524,192b for data */
+   footer, leaving 524,192b for data.
+   The TBLOCK_* / TCELLS_* constants below
+   describe these largest, 512k, blocks. */
 #define TBLOCK_SIZE         (1 << 19)
 #define TBLOCK_HEADER_SIZE  32
 #define TBLOCK_DATA_SIZE    (TBLOCK_SIZE - TBLOCK_HEADER_SIZE - SHA512_DIGEST)
@@ -446,6 +563,75 @@ struct btree * btfind(struct btallocator *a, uint64_t id) RETURNS;
 #define TBLOCKS_PER_TSLAB (TSLAB_MAX_SIZE  / TBLOCK_SIZE)
 #define TCELLS_PER_TBLOCK (TBLOCK_DATA_SIZE / TCELL_SIZE)
 
+/* every block in a SLAB is the same size, but different
+   SLABs can hold different sizes (or classes) of blocks,
+   so that sparse series don't each tie up a full 512k.
+   A new series starts out in the smallest class, and each
+   successive block is sized so that, at the rate the last
+   block filled up, it ought to last TBLOCK_TARGET_SPAN ms. */
+#define TBLOCK_CLASSES       3
+#define tblock_class_log2(c) ((c) == 0 ? 14 : (c) == 1 ? 16 : 19)
+#define tblock_class_size(c) (1u << tblock_class_log2(c))
+
+#ifndef TBLOCK_TARGET_SPAN
+#define TBLOCK_TARGET_SPAN (86400 * 1000ul)
+#endif
+
+/* a BLOKv2 block splits its data region into 8k CHUNKs,
+   and keeps a SHA-512 digest of each chunk in a table that
+   sits right before the footer.  The footer is then an HMAC
+   over the header and the chunk table, so that appending a
+   cell only requires re-hashing the (dirty) tail chunk. */
+#define TBLOCK_CHUNK_SIZE      8192
+#define TBLOCK_CHUNKS          64
+#define TBLOCK_CHUNK_TABLE     (TBLOCK_SIZE - SHA512_DIGEST - TBLOCK_CHUNKS * SHA512_DIGEST)
+#define TBLOCK_V2_DATA_SIZE    (TBLOCK_DATA_SIZE - TBLOCK_CHUNKS * SHA512_DIGEST - TBLOCK_SUMMARY_SIZE)
+#define TCELLS_PER_TBLOCK_V2   ((TBLOCK_V2_DATA_SIZE - 4) / TCELL_SIZE)
+
+/* BLOKv2 (and later) blocks also keep a running SUMMARY of
+   all of their cells, in the 64b right before the chunk
+   table, so that queries can skip over (or consolidate)
+   whole blocks without ever reading their cells. */
+#define TBLOCK_SUMMARY_SIZE    64
+
+/* a BLOKv3 block stores its cells as a compressed bitstream
+   (delta-of-delta timestamps, XOR'd values) instead of as
+   fixed-size 12b cells.  It has a 64b header, to make room
+   for the (persistent) state of the streaming encoder, and
+   is sealed the same way as a BLOKv2 block.  No single cell
+   will ever take more than TBLOCK_V3_MAX_CELL_BITS to encode. */
+#define TBLOCK_V3_HEADER_SIZE    64
+#define TBLOCK_V3_DATA_BITS      ((TBLOCK_CHUNK_TABLE - TBLOCK_SUMMARY_SIZE - TBLOCK_V3_HEADER_SIZE) * 8)
+#define TBLOCK_V3_MAX_CELL_BITS  160
+
+/* a BLOKv4 block holds the same cells as a BLOKv2 block,
+   sealed the same way, but stored as columns: an array of
+   all the 4b relative timestamps, followed (after up to 4b
+   of padding, for alignment) by an array of all the 8b values.
+   This keeps range scans in contiguous memory, and lets
+   them use the vectorized scan_*() kernels. */
+#define TBLOCK_V4_VALUES  ((TBLOCK_HEADER_SIZE + 4 * TCELLS_PER_TBLOCK_V2 + 7) & ~7)
+
+#define tblock_tscol(b)  ((const uint32_t *)((uint8_t *)(b)->page.data + TBLOCK_HEADER_SIZE))
+#define tblock_valcol(b) ((const double   *)((uint8_t *)(b)->page.data + tblock_v4values(b)))
+
+/* the layout of each block format scales with the size of
+   the block; these give the per-block equivalents of the
+   (512k-only) constants above. */
+#define tblock_size(b)       ((b)->page.len)
+#define tblock_nchunks(b)    (tblock_size(b) / TBLOCK_CHUNK_SIZE)
+#define tblock_chunktable(b) (tblock_size(b) - SHA512_DIGEST - tblock_nchunks(b) * SHA512_DIGEST)
+#define tblock_summaryat(b)  (tblock_chunktable(b) - TBLOCK_SUMMARY_SIZE)
+#define tblock_v3bits(b)     ((tblock_summaryat(b) - TBLOCK_V3_HEADER_SIZE) * 8)
+#define tblock_v4values(b)   ((TBLOCK_HEADER_SIZE + 4 * tblock_capacity(b) + 7) & ~7)
+
+/* new databases write blocks in this format, unless they
+   are initialized with another.  (databases without a
+   settings file predate it, and stick with BLOKv1) */
+#ifndef TBLOCK_DEFAULT_VERSION
+#define TBLOCK_DEFAULT_VERSION 2
+#endif
+
 #define tslab_number(x)  ((x) & ~0x7ff)
 #define tblock_number(x) ((x) &  0x7ff)
 
@@ -456,18 +642,80 @@ struct btree * btfind(struct btallocator *a, uint64_t id) RETURNS;
 struct dbkey {
 	char   *key;
 	size_t  len;
+
+	/* keyed MAC states, derived from key (see mac_key) */
+	struct hmac_sha512_key hmac;
+	struct blake2b         blake2b;
 };
 
 /* these are part of db.o */
 struct dbkey * rand_key(size_t len) RETURNS;
 struct dbkey * read_key(const char *s) RETURNS;
 
+/* which keyed MAC seals the slabs and blocks of a database;
+   the algorithm ID is recorded in each slab header.  all of
+   them produce MAC_DIGEST octets. */
+#define MAC_HMAC_SHA512  0
+#define MAC_BLAKE2B      1
+#define MAC_DIGEST      64
+
+#ifndef MAC_DEFAULT
+#define MAC_DEFAULT MAC_HMAC_SHA512
+#endif
+
+struct mac {
+	int alg;
+	union {
+		struct hmac_sha512 hmac;
+		struct blake2b     blake2b;
+	} u;
+};
+
+const char * mac_name(int alg);
+int mac_parse(const char *name);
+
+void mac_key(struct dbkey *k);
+void mac_start(struct mac *m, struct dbkey *k, int alg);
+void mac_feed(struct mac *m, const void *buf, size_t len);
+void mac_done(struct mac *m, void *digest);
+
+void mac_seal (struct dbkey *k, int alg, const void *buf, size_t len);
+int  mac_check(struct dbkey *k, int alg, const void *buf, size_t len) RETURNS;
+
 /********************************************************  database blocks  ***/
 
 typedef double bolo_value_t;
 
+struct tsummary {
+	uint32_t tsmin;    /* earliest relative timestamp in the block */
+	uint32_t tsmax;    /* latest relative timestamp in the block */
+	double   min;      /* smallest value */
+	double   max;      /* largest value */
+	double   sum;      /* sum of all values */
+	double   sumsq;    /* sum of the squares of all values */
+	double   first;    /* first value inserted */
+	double   last;     /* last (most recent) value inserted */
+	uint32_t flags;    /* TSUMMARY_* flags */
+};
+
+#define TSUMMARY_UNSORTED 0x01 /* cells were not inserted in time order */
+
 struct tblock {
 	int valid;         /* is this block real? */
+	int version;       /* on-disk format (1 = BLOKv1, 2 = BLOKv2, ...) */
+	int dirty;         /* has this block changed since it was
+	                      last sealed?  (sealing is deferred to
+	                      sync / unmap time, or until full) */
+	int unsynced;      /* has this block changed since it was
+	                      last msync'd?  (tblock_sync() and
+	                      tslab_sync() skip the blocks that haven't) */
+	uint64_t chunks;   /* bitmap of chunks (one bit per chunk) that
+	                      must be re-hashed at the next seal. */
+	int journaled;     /* has the database journaled what this block
+	                      held at the last checkpoint, before changing
+	                      it?  (0 = not yet; see db.c) */
+	int kept;          /* how many cells (from the front) are still
+	                      the ones it held at the last checkpoint */
 	int cells;         /* how many cells are in use? */
 	bolo_msec_t base;  /* base timestamp (ms) for this block */
 
@@ -477,7 +725,20 @@ struct tblock {
 	uint64_t next;     /* block number of the next logical block
 	                      in the (chronologically ordered) series */
 
+	struct tsummary summary; /* running summary of all cells
+	                            (BLOKv2 and later only) */
+
+	struct {           /* BLOKv3 streaming encoder state */
+		uint32_t bits;   /* length of the encoded stream, in bits */
+		uint32_t rel;    /* relative timestamp of the last cell */
+		int64_t  delta;  /* difference between the last two timestamps */
+		uint64_t value;  /* raw IEEE-754 bits of the last value */
+		uint8_t  lead;   /* leading / trailing zero bits of the */
+		uint8_t  trail;  /* current XOR window (lead 0xff = none) */
+	} enc;
+
 	struct dbkey *key; /* encryption key to use */
+	int mac;           /* which MAC to seal with (MAC_*) */
 	struct page page;  /* backing data page */
 };
 
@@ -494,16 +755,85 @@ struct tblock {
 #define tblock_write64f(b,o,v) page_write64f(&(b)->page, (o), (v))
 
 int tblock_map(struct tblock *b, int fd, off_t offset, size_t len) RETURNS;
-void tblock_init(struct tblock *b, uint64_t number, bolo_msec_t base);
+int tblock_borrow(struct tblock *b, struct page *from, size_t offset, size_t len) RETURNS;
+void tblock_init(struct tblock *b, int version, uint64_t number, bolo_msec_t base);
 int tblock_isfull(struct tblock *b) RETURNS;
 int tblock_canhold(struct tblock *b, bolo_msec_t when) RETURNS;
 int tblock_insert(struct tblock *b, bolo_msec_t when, bolo_value_t what) RETURNS;
 void tblock_next(struct tblock *b, struct tblock *next);
-#define tblock_unmap(b) page_unmap(&(b)->page)
-#define tblock_sync(b)  page_sync(&(b)->page)
+void tblock_rehash(struct tblock *b);
+int tblock_unmap(struct tblock *b) RETURNS;
+int tblock_sync(struct tblock *b) RETURNS;
+
+void tblock_seal(struct tblock *b);
+int tblock_check(struct tblock *b, struct dbkey *k) RETURNS;
+
+#define tblock_capacity(b) ((int)((b)->version == 1 \
+                            ? (tblock_size(b) - TBLOCK_HEADER_SIZE - SHA512_DIGEST) / TCELL_SIZE \
+                            : (tblock_summaryat(b) - TBLOCK_HEADER_SIZE - 4) / TCELL_SIZE))
+#define tblock_hdrsize(b)  ((b)->version == 3 ? TBLOCK_V3_HEADER_SIZE : TBLOCK_HEADER_SIZE)
 
-#define tblock_seal( b,k) hmac_seal ((k)->key,(k)->len,(b)->page.data,(b)->page.len)
-#define tblock_check(b,k) hmac_check((k)->key,(k)->len,(b)->page.data,(b)->page.len)
+/* a tcursor walks the cells of a single tblock, in
+   order, regardless of how that block is encoded:
+
+     struct tcursor c;
+     tcursor_init(&c, block);
+     while (tcursor_next(&c) == 0)
+       ... c.ts, c.value ...
+ */
+struct tcursor {
+	struct tblock *block;  /* the block being read */
+	int            n;      /* how many cells have been read */
+
+	uint32_t bit;          /* BLOKv3 decoder state, */
+	uint32_t rel;          /* mirroring the encoder */
+	int64_t  delta;        /* state in struct tblock */
+	uint64_t raw;
+	uint8_t  lead, trail;
+
+	bolo_msec_t  ts;       /* timestamp of the current cell */
+	bolo_value_t value;    /* value of the current cell */
+};
+
+void tcursor_init(struct tcursor *c, struct tblock *b);
+int tcursor_next(struct tcursor *c) RETURNS;
+
+/* position a fresh cursor so that the next call to tcursor_next()
+   yields the first cell at or after `when`.  this binary-searches
+   sorted fixed-size blocks, and decodes forward through sorted
+   BLOKv3 blocks; it does nothing for unsorted (or BLOKv1) blocks,
+   which must be filtered by the caller. */
+void tcursor_seek(struct tcursor *c, bolo_msec_t when);
+
+/* are a block's cells known to be in time order? */
+#define tblock_issorted(b) ((b)->version != 1 && !((b)->summary.flags & TSUMMARY_UNSORTED))
+
+/* vectorized range-filter / reduce kernels, over the
+   columns of a BLOKv4 block.  [lo, hi] is inclusive. */
+struct scan {
+	size_t count;  /* how many cells were in range? */
+	double min;    /* smallest in-range value (+inf if none) */
+	double max;    /* largest in-range value (-inf if none) */
+	double sum;    /* sum of all in-range values */
+};
+
+void scan_init(struct scan *r);
+size_t scan_count(const uint32_t *ts, size_t n, uint32_t lo, uint32_t hi);
+void scan_reduce(const uint32_t *ts, const double *v, size_t n, uint32_t lo, uint32_t hi, struct scan *r);
+
+/* count / reduce the cells of a block whose timestamps
+   fall within [from, until]; BLOKv4 blocks use the scan
+   kernels, all other formats fall back to a tcursor. */
+size_t tblock_count(struct tblock *b, bolo_msec_t from, bolo_msec_t until);
+void tblock_reduce(struct tblock *b, bolo_msec_t from, bolo_msec_t until, struct scan *r);
+
+/* classify a block's cells against [from, until], using
+   only its summary; BLOKv1 blocks have no summary, and
+   always (conservatively) report TBLOCK_OVERLAPS. */
+#define TBLOCK_DISJOINT 0  /* no cells in range */
+#define TBLOCK_OVERLAPS 1  /* some cells may be in range */
+#define TBLOCK_WITHIN   2  /* every cell is in range */
+int tblock_overlap(struct tblock *b, bolo_msec_t from, bolo_msec_t until);
 
 #define tblock_value(b,n)              tblock_read64f((b), 32 + (n) * 12 + 4)
 #define tblock_ts(b,n)    ((b)->base + tblock_read32 ((b), 32 + (n) * 12))
@@ -519,6 +849,37 @@ struct tslab {
 	                            11-bits cleared. */
 
 	struct dbkey *key;       /* encryption key to use */
+	int mac;                 /* MAC algorithm (MAC_*) that seals the
+	                            header and all of the blocks; new
+	                            slabs record it in their header */
+	int block_format;        /* format of newly-allocated blocks
+	                            (0 = TBLOCK_DEFAULT_VERSION) */
+
+	bolo_msec_t from;        /* the window of time [from, until) that */
+	bolo_msec_t until;       /* every block in a partitioned slab starts
+	                            in (until = 0 for unpartitioned slabs) */
+	bolo_msec_t keep;        /* how long (ms) to keep the slab after its
+	                            window closes (0 = forever) */
+
+	struct page map;         /* one mapping for the whole slab; each
+	                            block borrows its window from here */
+	off_t reserved;          /* how far into the file have we asked
+	                            the filesystem to preallocate?  (the
+	                            logical size is still the file size) */
+
+	int lazy;                /* if set before tslab_map(), only read
+	                            the header; blocks get picked up on
+	                            first use, by tslab_load() */
+	int loaded;              /* have the blocks been picked up yet? */
+	int upgrade;             /* if set before tslab_map(), take (and
+	                            reseal) an old-style header seal */
+
+	uint8_t freemap[TBLOCKS_PER_TSLAB / 8]; /* blocks that nothing refers
+	                                           to anymore (bit set = free) */
+	int nfree;               /* how many bits are set in freemap */
+	int freedirty;           /* does the on-disk free map need rewriting? */
+	int retired;             /* on its way out (see db_compact()); no new
+	                            blocks get allocated from it */
 
 	struct tblock                 /* list of all blocks in this slab.    */
 	  blocks[TBLOCKS_PER_TSLAB];  /* present blocks will have .valid = 1 */
@@ -526,18 +887,94 @@ struct tslab {
 
 int tslab_map(struct tslab *s, int fd) RETURNS;
 int tslab_unmap(struct tslab *s) RETURNS;
+int tslab_load(struct tslab *s) RETURNS;
 int tslab_sync(struct tslab *s) RETURNS;
+int tslab_isdirty(struct tslab *s) RETURNS;
 int tslab_init(struct tslab *s, int fd, uint64_t number, uint32_t block_size) RETURNS;
 int tslab_isfull(struct tslab *s) RETURNS;
 int tslab_extend(struct tslab *s, bolo_msec_t base);
 struct tblock * tslab_tblock(struct tslab *s, uint64_t id, bolo_msec_t ts);
+int tslab_free(struct tslab *s, uint64_t id) RETURNS;
+int tslab_isfree(struct tslab *s, uint64_t id);
+struct tblock * tslab_reuse(struct tslab *s, uint64_t id, bolo_msec_t ts);
+
+/*******************************************************  write-ahead log  ***/
+
+/* every measurement inserted into a database is appended to
+   its write-ahead log first, in frames of many measurements
+   apiece; each frame costs one fdatasync().  after a crash,
+   the log is replayed at mount, so the (expensive) sync of
+   tslabs and btrees can happen far less often. */
+#ifndef WAL_GROUP
+#define WAL_GROUP 4096 /* measurements per frame, at most */
+#endif
+
+struct wal {
+	int fd;                 /* file descriptor of the log */
+	struct dbkey *key;      /* key to seal each frame with (or NULL) */
+	int mac;                /* MAC algorithm (MAC_*) for the seals */
+
+	uint8_t *buf;           /* the frame being built up */
+	size_t   len;           /* how much of buf is in use */
+	size_t   cap;           /* how big buf is */
+	size_t   pending;       /* measurements in buf, not yet committed */
+	size_t   group;         /* commit once this many are pending (0 = never) */
+
+	size_t   committed;     /* octets of the log that are on-disk */
+};
+
+typedef int (*wal_replay_fn)(const char *name, bolo_msec_t when, bolo_value_t what, void *udata);
+
+int wal_open(struct wal *w, int dirfd, const char *path, struct dbkey *key, int mac) RETURNS;
+int wal_close(struct wal *w);
+int wal_append(struct wal *w, const char *name, bolo_msec_t when, bolo_value_t what) RETURNS;
+int wal_commit(struct wal *w) RETURNS;
+int wal_replay(struct wal *w, wal_replay_fn fn, void *udata) RETURNS;
+int wal_reset(struct wal *w) RETURNS;
 
 /***************************************************************  database  ***/
 
+/* measurements are held (per time series) in a small, sorted
+   reorder buffer until they are REORDER_WINDOW milliseconds
+   older than the newest measurement seen, the buffer fills
+   up, or the database is synced.  this lets slightly jittery
+   submissions land in their tblocks in time order. */
+#ifndef REORDER_WINDOW
+#define REORDER_WINDOW (60 * 1000ul)
+#endif
+
+#ifndef REORDER_MAX
+#define REORDER_MAX 64
+#endif
+
+struct reorder {
+	int          n;                    /* how many measurements are buffered */
+	bolo_msec_t  newest;               /* newest timestamp ever buffered */
+	bolo_msec_t  ts[REORDER_MAX];      /* buffered timestamps, in order */
+	bolo_value_t value[REORDER_MAX];   /* buffered values */
+};
+
 struct idx {
 	struct list l;         /* list hook for database idxrefs */
 	struct btree *btree;   /* balanced B-tree of ts -> slabid */
 	uint64_t number;       /* unique identifier for this index */
+
+	struct reorder *rob;   /* reorder buffer (NULL until first insert) */
+	bolo_msec_t mark;      /* newest timestamp written to a tblock;
+	                          anything older has to be merged in */
+	int marked;            /* is .mark known yet? */
+	bolo_msec_t keep;      /* retention (ms) for new tblocks; 0 = forever */
+	struct tier *rollups;  /* rollup tiers (NULL until first needed,
+	                          or while they are stale) */
+	int rollstale;         /* are the rollups waiting on db_rebuild()? */
+};
+
+/* a retention policy keeps the measurements of every metric
+   whose name matches `pattern` (an fnmatch(3) glob) for `keep`
+   milliseconds.  the first matching policy wins. */
+struct retention {
+	char        *pattern;
+	bolo_msec_t  keep;
 };
 
 struct multidx {
@@ -549,27 +986,209 @@ struct multidx {
 struct db {
 	int           rootfd;   /* file descriptor of database root directory */
 	struct hash  *main;     /* primary time series (name|tag,tags,... => <block-id>) */
+	int           maindirty; /* does main.db need rewriting, in full? */
+	size_t        mainlen;  /* how much of main.db is intact, on-disk */
+	char        **fresh;    /* series added since main.db was last */
+	size_t        nfresh;   /* written, to be appended at the next sync */
 	struct hash  *tags;     /* auxiliary tag lookup (tag => [idx], tag=value => [idx]) */
 	struct hash  *metrics;  /* auxiliary metric lookup (name => [idx]) */
 
 	struct list   idx;      /* unsorted list of time series indices */
 	struct list   slab;     /* unsorted list of tslab structures */
+	struct tslab **slabtab; /* the same tslabs, indexed by tslab number
+	                           >> 11, for constant-time lookups (with
+	                           NULLs for numbers that have no tslab) */
+	size_t         slabtablen;
 	struct list   multidx;  /* list of allocated multidx's, for freeing later */
 
 	struct dbkey *key;      /* database integrity signing key */
+	int mac;                /* MAC algorithm (MAC_*) for new slabs */
 
-	uint64_t next_tblock;   /* ID of the next tblock to hand out */
+	uint64_t next_slab;     /* number of the next tslab to create */
+	size_t nfree;           /* how many tblocks (across every tslab)
+	                           are free to be reused */
+	struct tslab *tail[TBLOCK_CLASSES]; /* newest tslab of each size
+	                                       class, for new tblocks */
+	int block_format;       /* format version for new tblocks */
 
 	struct btallocator bta; /* btree allocator */
+
+	struct list  *warm;     /* next time series index for db_warmup() */
+
+	uint64_t *quarantine;   /* tblocks that failed integrity checks, */
+	size_t    nquarantined; /* and are no longer read from */
+
+	bolo_msec_t partition;  /* width (ms) of the time windows that tslabs
+	                           are split along; 0 = unpartitioned */
+	struct retention *retention; /* retention policies, in order */
+	size_t            nretention;
+
+	struct wal *wal;        /* write-ahead log (NULL = not logging) */
+
+	size_t nstale;          /* how many series' rollups are stale */
+
+	int       journal;      /* block journal, opened on first use (0 = not
+	                           yet); see s_journal() */
+	uint64_t *journaled;    /* tblocks it has a say in, to be forgotten */
+	size_t    njournaled;   /* at the next checkpoint */
+};
+
+/* database-wide settings, fixed at db_init() time and
+   persisted alongside main.db, in the `settings` file. */
+struct dbopts {
+	int block_format;       /* tblock format version (0 = default) */
+	const char *mac;        /* MAC algorithm, by name (NULL = default) */
+	bolo_msec_t partition;  /* tslab time window, in ms (0 = none) */
 };
 
 struct db * db_mount(const char *path, struct dbkey *k) RETURNS;
-struct db * db_init(const char *path, struct dbkey *k) RETURNS;
+struct db * db_upgrade(const char *path, struct dbkey *k) RETURNS;
+struct db * db_init(const char *path, struct dbkey *k, struct dbopts *o) RETURNS;
 int db_sync(struct db *db) RETURNS;
 int db_unmount(struct db *db) RETURNS;
+int db_warmup(struct db *db, int n) RETURNS;
+int db_rebuild(struct db *db, int n) RETURNS;
+int db_quarantine(struct db *db, uint64_t blkid) RETURNS;
+int db_isquarantined(struct db *db, uint64_t blkid) RETURNS;
 int db_insert(struct db *, char *name, bolo_msec_t when, bolo_value_t what) RETURNS;
 struct tblock * db_findblock(struct db *, uint64_t blkid);
 
+/* start logging every db_insert() to the write-ahead log,
+   committing (at most) every `group` measurements on their
+   own.  db_commit() commits whatever is still pending; after
+   that, those measurements survive a crash, even if db_sync()
+   never gets to them. */
+int db_wal(struct db *db, size_t group) RETURNS;
+int db_commit(struct db *db) RETURNS;
+
+/* what a db_compact() did */
+struct compaction {
+	size_t series;     /* how many time series were rewritten */
+	size_t cells;      /* ... measurements were copied over */
+	size_t before;     /* ... tblocks there were, beforehand */
+	size_t after;      /* ... tblocks it took to hold everything */
+	size_t dropped;    /* ... (quarantined) tblocks were left out */
+	size_t reclaimed;  /* ... old tslabs were removed */
+};
+
+int db_compact(struct db *db, struct compaction *c) RETURNS;
+int db_sweep(struct db *db, size_t *freed) RETURNS;
+
+/* add a retention policy, and (re-)apply the policies to every
+   time series in the database.  only tslabs created from here
+   on out are affected; older tslabs keep the `keep` they were
+   created with. */
+int db_retain(struct db *db, const char *pattern, bolo_msec_t keep) RETURNS;
+
+/* drop every (partitioned) tslab whose window, plus its
+   retention period, lies entirely before `now`, and prune the
+   time series indices that pointed into them.  the number of
+   tslabs removed is stored in `*dropped`, if given. */
+int db_expire(struct db *db, bolo_msec_t now, size_t *dropped) RETURNS;
+
+/* a cursor over the cells of a single time series that fall within
+   [from, until].  blocks are visited in chain (chronological) order,
+   starting from the one the series' btree points at for `from`, and
+   the walk stops as soon as a block starts after `until`. */
+struct series_cursor {
+	struct db     *db;
+	struct idx    *idx;
+	struct tblock *block;   /* current block (NULL before the first) */
+	struct tblock *next;    /* next block to visit (NULL at the end) */
+	struct tcursor cell;    /* position within the current block */
+	bolo_msec_t    from;
+	bolo_msec_t    until;
+
+	bolo_msec_t    ts;      /* timestamp of the current cell */
+	bolo_value_t   value;   /* value of the current cell */
+};
+
+int series_open(struct series_cursor *c, struct db *db, struct idx *idx, bolo_msec_t from, bolo_msec_t until) RETURNS;
+struct tblock * series_nextblock(struct series_cursor *c);
+int series_next(struct series_cursor *c) RETURNS;
+
+
+/****************************************************************  rollups  ***/
+
+/* every time series keeps a few tiers of pre-consolidated
+   buckets (1m, 1h, and 1d wide) alongside its raw data, so
+   that queries over long windows of time can consolidate
+   from a handful of bucket summaries instead of every
+   single measurement.  the tiers are kept up to date as
+   measurements are written into tblocks. */
+#define ROLLUP_TIERS 3
+
+struct rollup {
+	bolo_msec_t     start;    /* first millisecond of the bucket */
+	uint64_t        count;    /* how many measurements are in it */
+	struct tsummary summary;  /* min / max / sum / ... of those; tsmin
+	                             and tsmax are relative to .start */
+};
+
+struct tier {
+	bolo_msec_t    width;     /* how many milliseconds each bucket spans */
+	bolo_msec_t    newest;    /* newest timestamp ever rolled up */
+	struct rollup *r;         /* buckets, in time order */
+	size_t         n;         /* how many buckets are in r[] */
+	size_t         cap;       /* ... and how many it has room for */
+	size_t         dirty;     /* first bucket not yet written out */
+	size_t         ondisk;    /* how many buckets were last written out */
+};
+
+#define rollup_isdirty(t) ((t)->dirty < (t)->n || (t)->ondisk != (t)->n)
+
+void rollup_init(struct tier *t, int tier);
+void rollup_free(struct tier *t);
+const char * rollup_name(int tier);
+bolo_msec_t rollup_width(int tier);
+
+void rollup_add(struct tier *t, bolo_msec_t when, bolo_value_t what);
+size_t rollup_find(struct tier *t, bolo_msec_t ts);
+void rollup_trim(struct tier *t, bolo_msec_t before);
+
+int rollup_read(struct tier *t, int fd) RETURNS;
+int rollup_write(struct tier *t, int fd) RETURNS;
+
+/* the rollup tiers of a time series, read in the first time
+   they're needed; NULL if they are missing or out of date, and
+   waiting on db_rebuild() (read the raw measurements instead) */
+struct tier * db_rollups(struct db *db, struct idx *idx);
+
+
+/**************************************************************  scrubbing  ***/
+
+/* a scrub walks every tblock of every tslab in a database,
+   checking seals (HMACs), and quarantining the blocks that
+   fail.  the same engine backs the background scrubber in
+   `bolo core` (throttled) and `bolo fsck` (flat out). */
+struct scrub {
+	struct db       *db;
+	pthread_mutex_t *lock;    /* if set, held while picking (and copying)
+	                             each block to check, and quarantining it,
+	                             for sharing the db with other threads */
+
+	int    threads;           /* verifier threads (0 = one per CPU) */
+	size_t rate;              /* I/O budget, in bytes of tblock checked
+	                             per second (0 = unlimited) */
+	int    duty;              /* CPU budget, as the percentage of time
+	                             each verifier may spend checking
+	                             (0 or 100 = unlimited) */
+
+	/* results */
+	size_t checked;           /* how many tblocks were checked */
+	size_t skipped;           /* ... skipped (unsealed, or quarantined) */
+	size_t bad;               /* ... failed, and were quarantined */
+
+	/* internal state */
+	pthread_mutex_t mutex;
+	struct tslab   *slab;
+	int             block;
+	size_t          bytes;
+	double          started;
+};
+
+int scrub_run(struct scrub *s) RETURNS;
+
 
 /****************************************************************  tagging  ***/
 
@@ -605,6 +1224,7 @@ void cf_free(struct cf *cf);
 
 void cf_reset(struct cf *cf);
 void cf_sample(struct cf *cf, double v);
+int cf_summary(struct cf *cf, size_t n, const struct tsummary *s) RETURNS;
 double cf_value(struct cf *cf);
 
 
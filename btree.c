@@ -5,6 +5,12 @@
 
 #define BTREE_LEAF 0x80
 
+/* interior nodes flagged BTREE_PAGEIDS point to their children
+   by node ID (see btnode_file() / btnode_page(), below); older
+   nodes pointed to them by byte offset into their own file, and
+   get upgraded the first time they are mapped. */
+#define BTREE_PAGEIDS 0x01
+
 /* where do the keys start in the mapped page? */
 #define BTREE_KEYS_OFFSET (BTREE_HEADER_SIZE)
 /* where do the values start in the mapped page? */
@@ -16,8 +22,8 @@
 #define keyat(t,i)   (page_read64(&(t)->page, koffset(i)))
 #define valueat(t,i) (page_read64(&(t)->page, voffset(i)))
 
-#define setkeyat(t,i,k)   (page_write64(&(t)->page, koffset(i), k))
-#define setvalueat(t,i,v) (page_write64(&(t)->page, voffset(i), v))
+#define setkeyat(t,i,k)   ((t)->dirty = 1, page_write64(&(t)->page, koffset(i), k))
+#define setvalueat(t,i,v) ((t)->dirty = 1, page_write64(&(t)->page, voffset(i), v))
 #define setchildat(t,i,c) do {\
   setvalueat((t),(i),(c)->id); \
   (t)->kids[(i)] = (c); \
@@ -63,19 +69,49 @@ btree_print(struct btree *bt)
 	_print(bt, 0);
 }
 
+/* btree node IDs are composite; the upper 32 bits identify
+   the idx/ file the node lives in (shifted to its file number),
+   and the lower 32 bits are the page index inside that file. */
+#define btnode_file(id)   ((id) & ~0xfffffffful)
+#define btnode_page(id)   ((id) &  0xfffffffful)
+#define btnode_offset(id) ((off_t)btnode_page(id) * BTREE_PAGE_SIZE)
+
+/* rewrite the child pointers of an interior node from byte
+   offsets to node IDs.  a page index can never reach
+   BTBLOCK_DENSITY, so anything at or past that is an offset;
+   anything under it is already a node ID (including offset 0,
+   which is page 0 either way). */
+static void
+s_upgrade(struct btree *t)
+{
+	uint64_t v;
+	int i;
+
+	for (i = 0; i <= t->used; i++) {
+		v = valueat(t,i);
+		if (btnode_page(v) >= BTBLOCK_DENSITY)
+			setvalueat(t,i, btnode_file(t->id) | (v / BTREE_PAGE_SIZE));
+	}
+	t->dirty = 1; /* s_flush() sets BTREE_PAGEIDS */
+}
+
 static struct btree *
-s_mapat1(int fd, off_t offset)
+s_mapat1(int fd, uint64_t id)
 {
 	struct btree *t;
+	uint8_t flags;
 
 	t = xmalloc(sizeof(*t));
-	t->id = (uint64_t)offset;
+	t->id = id;
 
-	if (page_map(&t->page, fd, offset, BTREE_PAGE_SIZE) != 0)
+	if (page_map(&t->page, fd, btnode_offset(id), BTREE_PAGE_SIZE) != 0)
 		goto fail;
 
-	t->leaf = page_read8 (&t->page, 5) & BTREE_LEAF;
+	flags   = page_read8 (&t->page, 5);
+	t->leaf = flags & BTREE_LEAF;
 	t->used = page_read16(&t->page, 6);
+	if (!t->leaf && !(flags & BTREE_PAGEIDS))
+		s_upgrade(t);
 	return t;
 
 fail:
@@ -83,49 +119,48 @@ fail:
 	return NULL;
 }
 
+/* interior nodes only map their children on first use;
+   a NULL kid just means "not mapped yet", and the page
+   still has the child's node ID in it. */
 static struct btree *
-s_mapat(int fd, off_t offset)
+s_kid(struct btree *t, int i)
 {
-	struct btree *t;
-	int i;
+	CHECK(!t->leaf,    "btree child lookup attempted on a leaf node");
+	CHECK(i <= t->used, "btree child lookup given an out-of-range index");
 
-	t = s_mapat1(fd, offset);
-	if (!t)
-		return NULL;
-
-	if (t->leaf)
-		return t;
-
-	for (i = 0; i <= t->used; i++) {
-		t->kids[i] = s_mapat(fd, valueat(t,i));
-		if (!t->kids[i]) {
-			/* clean up the ones that succeeded */
-			for (i = i - 1; i >= 0; i--)
-				free(t->kids[i]);
-			free(t);
-			return NULL;
-		}
-	}
-
-	return t;
+	if (!t->kids[i])
+		t->kids[i] = s_mapat1(t->page.fd, valueat(t,i));
+	return t->kids[i];
 }
 
 static struct btree *
-s_extend(int fd)
+s_extend(int fd, uint64_t file)
 {
-	uint64_t id;
+	struct btree *t;
+	off_t off;
+
+	off = lseek(fd, 0, SEEK_END);
+	if (off < 0)
+		return NULL;
+
+	/* reserve contiguous space for the next run of nodes;
+	   if the filesystem can't, we just grow page-by-page */
+	if (off % BTREE_PREALLOC == 0)
+		(void)fprealloc(fd, off, BTREE_PREALLOC);
 
-	id = lseek(fd, 0, SEEK_END);
 	lseek(fd, BTREE_PAGE_SIZE - 1, SEEK_CUR);
 	if (write(fd, "\0", 1) != 1)
 		return NULL;
 
 	lseek(fd, -1 * BTREE_PAGE_SIZE, SEEK_END);
 	CHECK(BTREE_HEADER_SIZE == 8, "BTREE_HEADER_SIZE constant is under- or oversized");
-	if (write(fd, "BTREE\x80\x00\x00", BTREE_HEADER_SIZE) != BTREE_HEADER_SIZE)
+	if (write(fd, "BTREE\x81\x00\x00", BTREE_HEADER_SIZE) != BTREE_HEADER_SIZE)
 		return NULL;
 
-	return s_mapat(fd, id);
+	t = s_mapat1(fd, btnode_file(file) | (off / BTREE_PAGE_SIZE));
+	if (t)
+		t->dirty = 1;
+	return t;
 }
 
 static int
@@ -134,9 +169,17 @@ s_flush(struct btree *t)
 	CHECK(t != NULL,            "btree_write() given a NULL btree to flush");
 	CHECK(t->page.data != NULL, "btree_write() given a btree without a backing page");
 
-	page_write8 (&t->page, 5, t->leaf ? BTREE_LEAF : 0);
+	/* a node that hasn't changed is already on-disk */
+	if (!t->dirty)
+		return 0;
+
+	page_write8 (&t->page, 5, (t->leaf ? BTREE_LEAF : 0) | BTREE_PAGEIDS);
 	page_write16(&t->page, 6, t->used);
-	return page_sync(&t->page);
+	if (page_sync(&t->page) != 0)
+		return -1;
+
+	t->dirty = 0;
+	return 0;
 }
 
 int
@@ -151,14 +194,50 @@ btree_write(struct btree *t)
 	if (s_flush(t) != 0)
 		rc = -1;
 
+	/* unmapped children can't have changed */
 	if (!t->leaf)
 		for (i = 0; i <= t->used; i++)
-			if (btree_write(t->kids[i]) != 0)
+			if (t->kids[i] && btree_write(t->kids[i]) != 0)
 				rc = -1;
 
 	return rc;
 }
 
+/* does btree_write() have anything to write out? */
+int
+btree_isdirty(struct btree *t)
+{
+	int i;
+
+	CHECK(t != NULL, "btree_isdirty() given a NULL btree to check");
+
+	if (t->dirty)
+		return 1;
+
+	if (!t->leaf)
+		for (i = 0; i <= t->used; i++)
+			if (t->kids[i] && btree_isdirty(t->kids[i]))
+				return 1;
+	return 0;
+}
+
+int
+btree_load(struct btree *t)
+{
+	int i;
+
+	CHECK(t != NULL, "btree_load() given a NULL btree to load");
+
+	if (t->leaf)
+		return 0;
+
+	for (i = 0; i <= t->used; i++)
+		if (!s_kid(t, i) || btree_load(t->kids[i]) != 0)
+			return -1;
+
+	return 0;
+}
+
 int
 btree_close(struct btree *t)
 {
@@ -204,11 +283,22 @@ s_shift(struct btree *t, int n)
 	if (t->used - n <= 0)
 		return;
 
+	t->dirty = 1;
+
 	/* slide all keys above [n] one slot to the right */
 	memmove((uint8_t *)t->page.data + koffset(n + 1),
 	        (uint8_t *)t->page.data + koffset(n),
 	        sizeof(bolo_msec_t) * (t->used - n));
 
+	/* leaves pair each value with its key; interior
+	   nodes keep child [n+1] to the right of key [n] */
+	if (t->leaf) {
+		memmove((uint8_t *)t->page.data + voffset(n + 1),
+		        (uint8_t *)t->page.data + voffset(n),
+		        sizeof(uint64_t) * (t->used - n));
+		return;
+	}
+
 	/* slide all values above [n] one slot to the right */
 	memmove((uint8_t *)t->page.data + voffset(n + 2),
 	        (uint8_t *)t->page.data + voffset(n + 1),
@@ -223,7 +313,7 @@ s_clone(struct btree *t)
 {
 	struct btree *c;
 
-	c = s_extend(t->page.fd);
+	c = s_extend(t->page.fd, t->id);
 	if (!c)
 		bail("btree extension failed");
 
@@ -243,6 +333,23 @@ s_divide(struct btree *l, struct btree *r, int mid)
 	CHECK(mid != 0,                     "btree_insert() divide attempted to divide with midpoint of 0");
 	CHECK(l->used >= mid,               "btree_insert() divide attempted to divide with out-of-range midpoint");
 
+	l->dirty = r->dirty = 1;
+
+	if (l->leaf) {
+		/* leaves keep the median (and its value) on the
+		   right; the parent only gets a copy of the key */
+		r->used = l->used - mid;
+		l->used = mid;
+
+		memmove((uint8_t *)r->page.data + koffset(0),
+		        (uint8_t *)l->page.data + koffset(mid),
+		        sizeof(bolo_msec_t) * r->used);
+		memmove((uint8_t *)r->page.data + voffset(0),
+		        (uint8_t *)l->page.data + voffset(mid),
+		        sizeof(uint64_t) * r->used);
+		return;
+	}
+
 	r->used = l->used - mid - 1;
 	l->used = mid;
 
@@ -298,9 +405,9 @@ s_insert(struct btree *t, bolo_msec_t key, uint64_t block_number, bolo_msec_t *m
 		setvalueat(t,i,block_number);
 
 	} else { /* insert in child */
-		if (!t->kids[i])
-			t->kids[i] = s_extend(t->page.fd);
-		if (!t->kids[i])
+		if (i < t->used && keyat(t,i) == key)
+			i++; /* keys equal to the median live to its right */
+		if (!s_kid(t, i))
 			return NULL; /* FIXME this is wrong */
 
 		r = s_insert(t->kids[i], key, block_number, median);
@@ -342,6 +449,7 @@ btree_insert(struct btree *t, bolo_msec_t key, uint64_t block_number)
 		l->leaf = t->leaf;
 		memmove(l->kids, t->kids, sizeof(t->kids));
 		memmove(l->page.data, t->page.data, BTREE_PAGE_SIZE);
+		l->dirty = 1;
 
 		/* re-initialize root as [ l . m . r ] */
 		t->used = 1;
@@ -375,8 +483,10 @@ btree_find(struct btree *t, uint64_t *dst, bolo_msec_t key)
 		return 0;
 	}
 
-	return t->kids[i] ? btree_find(t->kids[i], dst, key)
-	                  : -1;
+	if (i < t->used && keyat(t,i) == key)
+		i++; /* keys equal to the median live to its right */
+	return s_kid(t, i) ? btree_find(t->kids[i], dst, key)
+	                   : -1;
 }
 
 int
@@ -393,7 +503,8 @@ btree_first(struct btree *t)
 	CHECK(!btree_isempty(t), "btree_first() given an empty btree");
 
 	while (!t->leaf)
-		t = t->kids[0];
+		if (!(t = s_kid(t, 0)))
+			bail("btree child lookup failed");
 	return keyat(t, 0);
 }
 
@@ -404,19 +515,168 @@ btree_last(struct btree *t)
 	CHECK(!btree_isempty(t), "btree_last() given an empty btree");
 
 	while (!t->leaf)
-		t = t->kids[t->used];
+		if (!(t = s_kid(t, t->used)))
+			bail("btree child lookup failed");
 	return keyat(t, t->used - 1);
 }
 
+int
+btree_next(struct btree *t, uint64_t *dst, bolo_msec_t *key)
+{
+	int i;
+
+	CHECK(t != NULL,   "btree_next() given a NULL btree node");
+	CHECK(dst != NULL, "btree_next() told to place results in a NULL pointer");
+	CHECK(key != NULL, "btree_next() given a NULL key pointer");
+
+	i = s_find(t, *key);
+	if (i < t->used && keyat(t,i) == *key)
+		i++;
+
+	if (t->leaf) {
+		if (i >= t->used)
+			return -1;
+		*key = keyat(t,i);
+		*dst = valueat(t,i);
+		return 0;
+	}
+
+	/* the next key is either further along in the child
+	   that covers *key, or the first key of a later child */
+	for (; i <= t->used; i++) {
+		if (!s_kid(t, i))
+			return -1;
+		if (btree_next(t->kids[i], dst, key) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+/* slide keys [n, used) (and their values / children)
+   down to the front of the node, forgetting [0, n) */
+static void
+s_unshift(struct btree *t, int n)
+{
+	int i;
+
+	if (n <= 0)
+		return;
+
+	t->dirty = 1;
+	memmove((uint8_t *)t->page.data + koffset(0),
+	        (uint8_t *)t->page.data + koffset(n),
+	        sizeof(bolo_msec_t) * (t->used - n));
+
+	if (t->leaf) {
+		memmove((uint8_t *)t->page.data + voffset(0),
+		        (uint8_t *)t->page.data + voffset(n),
+		        sizeof(uint64_t) * (t->used - n));
+		t->used -= n;
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		(void)btree_close(t->kids[i]);
+	memmove((uint8_t *)t->page.data + voffset(0),
+	        (uint8_t *)t->page.data + voffset(n),
+	        sizeof(uint64_t) * (t->used - n + 1));
+	memmove(&t->kids[0],
+	        &t->kids[n],
+	        sizeof(struct btree *) * (t->used - n + 1));
+	memset(&t->kids[t->used - n + 1], 0, sizeof(struct btree *) * n);
+	t->used -= n;
+}
+
+static int
+s_prune(struct btree *t, bolo_msec_t key)
+{
+	int i;
+
+	i = s_find(t, key);
+	if (t->leaf) {
+		s_unshift(t, i);
+		return 0;
+	}
+
+	/* child [j] only holds keys below key [j]; every child
+	   to the left of the one that covers `key` can go. */
+	if (i < t->used && keyat(t,i) == key)
+		i++;
+	s_unshift(t, i);
+
+	if (!s_kid(t, 0) || s_prune(t->kids[0], key) != 0)
+		return -1;
+
+	/* that child might not have had anything at or after
+	   `key` in it, if `key` fell between it and the next */
+	if (t->used > 0 && t->kids[0]->used == 0 && t->kids[0]->leaf)
+		s_unshift(t, 1);
+	return 0;
+}
+
+int
+btree_prune(struct btree *t, bolo_msec_t key)
+{
+	struct btree *kid;
+	int i;
+
+	CHECK(t != NULL, "btree_prune() given a NULL btree node");
+
+	if (btree_isempty(t) && t->leaf)
+		return 0;
+
+	if (key > btree_last(t)) {
+		/* nothing left */
+		if (!t->leaf)
+			for (i = 0; i <= t->used; i++)
+				(void)btree_close(t->kids[i]);
+		memset(t->kids, 0, sizeof(t->kids));
+		t->leaf  = 1;
+		t->used  = 0;
+		t->dirty = 1;
+		return 0;
+	}
+
+	if (s_prune(t, key) != 0)
+		return -1;
+
+	/* an interior root with a single child has nothing
+	   to tell us; pull the child up into the root node */
+	while (!t->leaf && t->used == 0) {
+		kid = t->kids[0];
+		t->used = kid->used;
+		t->leaf = kid->leaf;
+		memmove(t->kids, kid->kids, sizeof(t->kids));
+		memmove(t->page.data, kid->page.data, BTREE_PAGE_SIZE);
+		t->dirty = 1;
+
+		memset(kid->kids, 0, sizeof(kid->kids));
+		kid->leaf = 1;
+		(void)btree_close(kid);
+	}
+	return 0;
+}
+
+static void
+s_btpath(char *path, size_t len, uint64_t id)
+{
+	snprintf(path, len, "idx/%04lx.%04lx/%04lx.%04lx.%04lx.%04lx.idx",
+		((id & 0xffff000000000000ul) >> 48),
+		((id & 0x0000ffff00000000ul) >> 32),
+		/* --- */
+		((id & 0xffff000000000000ul) >> 48),
+		((id & 0x0000ffff00000000ul) >> 32),
+		((id & 0x00000000ffff0000ul) >> 16),
+		((id & 0x000000000000fffful)));
+}
+
 int
 btallocator(struct btallocator *a, int rootfd)
 {
 	int fd;
-	unsigned int i;
 	off_t off;
 	uint64_t id;
 	struct btblock *blk;
-	struct btree *t;
 	char path[64];
 
 	CHECK(a != NULL,   "btallocator() given a NULL allocator object to initialize");
@@ -425,16 +685,8 @@ btallocator(struct btallocator *a, int rootfd)
 	a->rootfd = rootfd;
 	empty(&a->blocks);
 
-	for (id = 0; ; id += BTREE_PAGE_SIZE * BTBLOCK_DENSITY) {
-
-		snprintf(path, sizeof(path), "idx/%04lx.%04lx/%04lx.%04lx.%04lx.%04lx.idx",
-			((id & 0xffff000000000000ul) >> 48),
-			((id & 0x0000ffff00000000ul) >> 32),
-			/* --- */
-			((id & 0xffff000000000000ul) >> 48),
-			((id & 0x0000ffff00000000ul) >> 32),
-			((id & 0x00000000ffff0000ul) >> 16),
-			((id & 0x000000000000fffful)));
+	for (id = 0; ; id += 1ul << 32) {
+		s_btpath(path, sizeof(path), id);
 
 		fd = openat(a->rootfd, path, O_RDWR);
 		if (fd < 0)
@@ -450,33 +702,16 @@ btallocator(struct btallocator *a, int rootfd)
 
 		blk = xmalloc(sizeof(*blk));
 		blk->fd = fd;
+		blk->id = id;
 		blk->used = off / BTREE_PAGE_SIZE;
-		push(&a->blocks, &blk->l);
 		empty(&blk->btrees);
-
-		/* map all of the btrees */
-		for (i = 0; i < blk->used; i++) {
-			CHECK(BTREE_HEADER_SIZE == 8, "BTREE_HEADER_SIZE constant is under- or oversized");
-			if (write(blk->fd, "BTREE\x80\x00\x00", BTREE_HEADER_SIZE) != BTREE_HEADER_SIZE)
-				return -1;
-
-			/* map the btree region */
-			t = xmalloc(sizeof(*t));
-			memset(t, 0, sizeof(*t));
-			if (page_map(&t->page, blk->fd, i * BTREE_PAGE_SIZE, BTREE_PAGE_SIZE) != 0)
-				return -1;
-
-			/* initialize the btree node */
-			t->id = id + i;
-			t->leaf = page_read8 (&t->page, 5) & BTREE_LEAF;
-			t->used = page_read16(&t->page, 6);
-		}
+		push(&a->blocks, &blk->l);
 	}
 
 	return 0;
 
 fail:
-	/* FIXME: deallocate memory */
+	close(fd);
 	return -1;
 }
 
@@ -486,7 +721,6 @@ btmake(struct btallocator *a)
 	off_t off;
 	uint64_t id;
 	struct btblock *blk;
-	struct btree *t;
 	char path[64];
 
 	CHECK(a != NULL, "btmake() given a NULL btallocator");
@@ -495,80 +729,53 @@ btmake(struct btallocator *a)
 	for_each(blk, &a->blocks, l) {
 		if (blk->used < BTBLOCK_DENSITY)
 			goto alloc;
-		id += BTREE_PAGE_SIZE;
+		id += 1ul << 32;
 	}
 
 	/* we have no empty blocks; allocate a new one, starting at `id` */
-	blk = xmalloc(sizeof(*blk));
-	push(&a->blocks, &blk->l);
-
-	snprintf(path, sizeof(path), "idx/%04lx.%04lx/%04lx.%04lx.%04lx.%04lx.idx",
-		((id & 0xffff000000000000ul) >> 48),
-		((id & 0x0000ffff00000000ul) >> 32),
-		/* --- */
-		((id & 0xffff000000000000ul) >> 48),
-		((id & 0x0000ffff00000000ul) >> 32),
-		((id & 0x00000000ffff0000ul) >> 16),
-		((id & 0x000000000000fffful)));
+	s_btpath(path, sizeof(path), id);
 	if (mktree(a->rootfd, path, 0777) != 0)
 		return NULL;
 
+	blk = xmalloc(sizeof(*blk));
+	blk->id = id;
+	empty(&blk->btrees);
 	blk->fd = openat(a->rootfd, path, O_RDWR|O_CREAT, 0666);
-	if (blk->fd < 0)
+	if (blk->fd < 0) {
+		free(blk);
 		return NULL;
+	}
+	push(&a->blocks, &blk->l);
 
 alloc:
-	/* extend the underlying fd */
+	/* extend the underlying fd, and map the new node */
 	off = lseek(blk->fd, 0, SEEK_END);
-	lseek(blk->fd, BTREE_PAGE_SIZE - 1, SEEK_CUR);
-	if (write(blk->fd, "\0", 1) != 1)
+	if (off < 0)
 		return NULL;
-	lseek(blk->fd, -1 * BTREE_PAGE_SIZE, SEEK_END);
-	CHECK(BTREE_HEADER_SIZE == 8, "BTREE_HEADER_SIZE constant is under- or oversized");
-	if (write(blk->fd, "BTREE\x80\x00\x00", BTREE_HEADER_SIZE) != BTREE_HEADER_SIZE)
-		return NULL;
-
-	/* map the btree region */
-	t = xmalloc(sizeof(*t));
-	if (page_map(&t->page, blk->fd, off, BTREE_PAGE_SIZE) != 0)
-		goto fail;
-
-	/* initialize the btree node */
-	t->id = id;
-	t->leaf = page_read8 (&t->page, 5) & BTREE_LEAF;
-	t->used = page_read16(&t->page, 6);
-
-	/* increment the block reference counter */
-	blk->used++;
-	return t;
 
-fail:
-	free(t);
-	return NULL;
+	blk->used = off / BTREE_PAGE_SIZE + 1;
+	return s_extend(blk->fd, blk->id);
 }
 
 struct btree *
 btfind(struct btallocator *a, uint64_t id)
 {
 	struct btblock *blk;
-	struct btree *t;
+
+	CHECK(a != NULL, "btfind() given a NULL btallocator");
 
 	for_each(blk, &a->blocks, l) {
-		if (id > blk->used) {
-			id -= blk->used;
+		if (blk->id != btnode_file(id))
 			continue;
-		}
 
-		for_each(t, &blk->btrees, l) {
-			if (id > 0) {
-				id--;
-				continue;
-			}
+		errno = BOLO_EBADTREE;
+		if (btnode_page(id) >= blk->used)
+			return NULL;
 
-			return t;
-		}
+		return s_mapat1(blk->fd, id); /* children map on demand */
 	}
 
+	errno = BOLO_EBADTREE;
 	return NULL;
 }
 
@@ -599,6 +806,111 @@ iszero(const void *buf, off_t offset, size_t size)
 }
 
 TESTS {
+	subtest {
+		struct btallocator a;
+		struct btree *t;
+		char dir[] = "/tmp/bolo-btree-XXXXXX", cmd[64];
+		bolo_msec_t key;
+		uint64_t value;
+		int fd, n, bad;
+
+		if (!mkdtemp(dir))
+			BAIL_OUT("failed to create a temporary directory");
+		fd = open(dir, O_RDONLY | O_DIRECTORY);
+		if (fd < 0 || btallocator(&a, fd) != 0 || !(t = btmake(&a)))
+			BAIL_OUT("failed to allocate a btree");
+
+		/* enough keys to split the root a few times over */
+		for (key = 0; key < 5000; key++)
+			if (btree_insert(t, key * 10, key) != 0)
+				BAIL_OUT("btree_insert() failed");
+		ok(!t->leaf, "5000 keys should split the root");
+
+		key = 0; n = bad = 0;
+		while (btree_next(t, &value, &key) == 0) {
+			if (value != key / 10 || key != (bolo_msec_t)(n + 1) * 10)
+				bad++;
+			n++;
+		}
+		is_int(n, 4999, "btree_next() should visit every key after the first");
+		is_int(bad, 0, "btree_next() should visit keys in order");
+
+		ok(btree_prune(t, 20000) == 0, "btree_prune() should succeed");
+		is_unsigned(btree_first(t), 20000, "btree_prune() should leave the key it was given");
+		ok(btree_find(t, &value, 0) == 0 && value == 2000, "lookups before the pruned keys should find the first one left");
+		ok(btree_find(t, &value, 33333) == 0 && value == 3333, "lookups after the pruned keys should be unaffected");
+		key = 20000; n = 0;
+		while (btree_next(t, &value, &key) == 0)
+			n++;
+		is_int(n, 2999, "btree_prune() should leave every later key");
+
+		ok(btree_prune(t, 40005) == 0, "btree_prune() should succeed between keys");
+		is_unsigned(btree_first(t), 40010, "btree_prune() should drop keys before one that isn't there");
+		ok(btree_insert(t, 50005, 1) == 0 && btree_find(t, &value, 50007) == 0 && value == 1,
+			"btree_insert() should still work after pruning");
+
+		ok(btree_prune(t, 49900) == 0, "btree_prune() should succeed");
+		ok(t->leaf, "btree_prune() should pull a lone leaf up into the root");
+		ok(btree_find(t, &value, 49950) == 0 && value == 4995, "lookups should still work in a collapsed btree");
+
+		ok(btree_prune(t, ~(bolo_msec_t)0) == 0, "btree_prune() past the end should succeed");
+		ok(t->leaf && btree_isempty(t), "btree_prune() past the end should empty the btree");
+		ok(btree_find(t, &value, 0) != 0, "lookups in an emptied btree should fail");
+
+		(void)btree_close(t);
+		close(fd);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		if (system(cmd) != 0)
+			diag("failed to clean up %s", dir);
+	}
+
+	subtest {
+		struct btallocator a;
+		struct btree *t;
+		char dir[] = "/tmp/bolo-btree-XXXXXX", cmd[64];
+		bolo_msec_t key;
+		uint64_t id, value;
+		int fd, i, bad;
+
+		if (!mkdtemp(dir))
+			BAIL_OUT("failed to create a temporary directory");
+		fd = open(dir, O_RDONLY | O_DIRECTORY);
+		if (fd < 0 || btallocator(&a, fd) != 0 || !(t = btmake(&a)))
+			BAIL_OUT("failed to allocate a btree");
+
+		for (key = 0; key < 2000; key++)
+			if (btree_insert(t, key * 10, key) != 0)
+				BAIL_OUT("btree_insert() failed");
+		if (t->leaf || btree_write(t) != 0)
+			BAIL_OUT("failed to set up a multi-level btree");
+
+		/* make the root look like it was written by an older
+		   bolo, which pointed to children by byte offset */
+		for (i = 0; i <= t->used; i++)
+			page_write64(&t->page, BTREE_VALS_OFFSET + i * 8,
+				btnode_page(valueat(t,i)) * BTREE_PAGE_SIZE);
+		page_write8(&t->page, 5, 0);
+		id = t->id;
+		(void)btree_close(t);
+
+		t = btfind(&a, id);
+		if (!t)
+			BAIL_OUT("btfind() failed to find the root again");
+		ok(t->dirty, "an old-style interior node should be upgraded when it is mapped");
+		for (bad = 0, key = 0; key < 2000; key++)
+			if (btree_find(t, &value, key * 10) != 0 || value != key)
+				bad++;
+		is_int(bad, 0, "an old-style interior node should find its children");
+		ok(btree_write(t) == 0, "btree_write() should succeed");
+		ok(page_read8(&t->page, 5) & BTREE_PAGEIDS, "an upgraded node should be written out with BTREE_PAGEIDS");
+
+		(void)btree_close(t);
+		close(fd);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		if (system(cmd) != 0)
+			diag("failed to clean up %s", dir);
+	}
+
 #if 0
 	subtest {
 		int fd;
@@ -646,8 +958,13 @@ TESTS {
 		}
 		pass("lookups should succeed");
 
+		ok(btree_isdirty(t), "btrees should be dirty after insertions");
 		if (btree_write(t) != 0)
 			BAIL_OUT("btree_write failed");
+		ok(!btree_isdirty(t), "btrees should be clean after btree_write()");
+		if (btree_insert(t, KEYEND + 1, KEYEND + 1 + PERTURB) != 0)
+			BAIL_OUT("btree_insert failed");
+		ok(btree_isdirty(t), "btrees should be dirty again after another insertion");
 
 #if 0
 		tmp = t;
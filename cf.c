@@ -109,6 +109,60 @@ cf_sample(struct cf *cf, double v)
 	cf->n++;
 }
 
+int
+cf_summary(struct cf *cf, size_t n, const struct tsummary *s)
+{
+	double mean_b, m2_b, delta;
+
+	CHECK(cf != NULL, "cf_summary() given a NULL cf context to sample into");
+	CHECK(s  != NULL, "cf_summary() given a NULL block summary to sample");
+
+	if (n == 0)
+		return 0;
+
+	switch (cf->type) {
+	case CF_MIN: if (cf->n == 0 || s->min < cf->rsv[0]) cf->rsv[0] = s->min; break;
+	case CF_MAX: if (cf->n == 0 || s->max > cf->rsv[0]) cf->rsv[0] = s->max; break;
+
+	case CF_SUM: cf->rsv[0] += s->sum; break;
+
+	case CF_DELTA:
+		if (cf->n == 0) cf->rsv[0] = (cf->active ? cf->carry : s->first);
+		cf->rsv[1] = s->last;
+		break;
+
+	case CF_MEAN:
+	case CF_STDEV:
+	case CF_VAR:
+		/* merge the summary into our running Welford state,
+		   using Chan et al's pairwise combination; the summary
+		   only tracks the sum and the sum of squares, so we
+		   have to derive its mean and m2 from those. */
+#define count (cf->n)
+#define mean  (cf->rsv[0])
+#define m2    (cf->rsv[1])
+		mean_b = s->sum / n;
+		m2_b   = s->sumsq - n * mean_b * mean_b;
+		if (m2_b < 0.0)
+			m2_b = 0.0; /* rounding error */
+
+		delta = mean_b - mean;
+		m2    = m2 + m2_b + delta * delta * count * n / (count + n);
+		mean  = mean + delta * n / (count + n);
+#undef count
+#undef mean
+#undef m2
+		break;
+
+	default:
+		/* reservoir sampling needs every single value */
+		return -1;
+	}
+
+	cf->n += n;
+	return 0;
+}
+
 static int
 cmp_sorted(const void *_a, const void *_b)
 {
@@ -381,6 +435,45 @@ TESTS {
 
 		cf_free(cf);
 	}
+
+	subtest {
+		struct cf *cf;
+		struct tsummary s;
+		int i, t;
+		int types[] = { CF_MIN, CF_MAX, CF_SUM, CF_DELTA, CF_MEAN, CF_STDEV, CF_VAR };
+		double want[] = { 2.0, 38.0, 155.0, 11.0, 22.142857, 13.2844, 176.47619 };
+		double a[] = { 10.0, 2.0, 38.0 };
+		double b[] = { 23.0, 38.0, 23.0, 21.0 };
+
+		memset(&s, 0, sizeof(s));
+		s.min = 21.0; s.max = 38.0; s.first = 23.0; s.last = 21.0;
+		for (i = 0; i < 4; i++) {
+			s.sum   += b[i];
+			s.sumsq += b[i] * b[i];
+		}
+
+		for (t = 0; t < 7; t++) {
+			cf = cf_new(types[t], 5);
+			cf->active = 0;
+			for (i = 0; i < 3; i++)
+				cf_sample(cf, a[i]);
+			ok(cf_summary(cf, 4, &s) == 0, "cf_summary() should handle cf type %d", types[t]);
+			is_unsigned(cf->n, 7, "cf_summary() counts all summarized values");
+			is_within(cf_value(cf), want[t], 0.001,
+				"cf type %d of (10,2,38) + summary(23,38,23,21) is %lf", types[t], want[t]);
+			cf_free(cf);
+		}
+
+		cf = cf_new(CF_MIN, 5);
+		ok(cf_summary(cf, 0, &s) == 0, "cf_summary() of an empty summary should succeed");
+		ok(isnan(cf_value(cf)), "cf_summary() of an empty summary is a no-op");
+		cf_free(cf);
+
+		cf = cf_new(CF_MEDIAN, 5);
+		ok(cf_summary(cf, 4, &s) != 0, "cf_summary() cannot summarize into a median");
+		is_unsigned(cf->n, 0, "a failed cf_summary() leaves the cf untouched");
+		cf_free(cf);
+	}
 }
 /* LCOV_EXCL_STOP */
 #endif
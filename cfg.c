@@ -29,6 +29,38 @@
 #define DEFAULT_CORE_DB_DATA_ROOT "/var/lib/bolo/db"
 #endif
 
+#ifndef DEFAULT_CORE_SCRUB_INTERVAL
+#define DEFAULT_CORE_SCRUB_INTERVAL (86400 * 1000)
+#endif
+
+#ifndef DEFAULT_CORE_SCRUB_RATE
+#define DEFAULT_CORE_SCRUB_RATE (8*1024*1024)
+#endif
+
+#ifndef DEFAULT_CORE_SCRUB_DUTY
+#define DEFAULT_CORE_SCRUB_DUTY 10
+#endif
+
+#ifndef DEFAULT_CORE_SCRUB_THREADS
+#define DEFAULT_CORE_SCRUB_THREADS 1
+#endif
+
+#ifndef DEFAULT_CORE_RETENTION_INTERVAL
+#define DEFAULT_CORE_RETENTION_INTERVAL (3600 * 1000)
+#endif
+
+#ifndef DEFAULT_CORE_WAL_INTERVAL
+#define DEFAULT_CORE_WAL_INTERVAL 1000
+#endif
+
+#ifndef DEFAULT_CORE_WAL_GROUP
+#define DEFAULT_CORE_WAL_GROUP 4096
+#endif
+
+#ifndef DEFAULT_CORE_CHECKPOINT_INTERVAL
+#define DEFAULT_CORE_CHECKPOINT_INTERVAL (60 * 1000)
+#endif
+
 #ifndef DEFAULT_AGENT_SCHEDULE_SPLAY
 #define DEFAULT_AGENT_SCHEDULE_SPLAY 30
 #endif
@@ -392,6 +424,117 @@ s_core_kv(void *u, struct string *k, struct string *v)
 		return 0;
 	}
 
+	if (strncmp("scrub.interval", k->data, k->len) == 0) {
+		if (s_parsetime(v, &cfg->scrub_interval) != 0) {
+			errorf("failed to read configuration: scrub.interval value '%.*s' is not a positive number", v->len, v->data);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strncmp("scrub.rate", k->data, k->len) == 0) {
+		if (s_parsebytes(v, &cfg->scrub_rate) != 0) {
+			errorf("failed to read configuration: invalid scrub.rate value '%.*s'", v->len, v->data);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strncmp("scrub.duty", k->data, k->len) == 0) {
+		if (s_parseint(v, &cfg->scrub_duty) != 0) {
+			errorf("failed to read configuration: scrub.duty value '%.*s' is not a positive number", v->len, v->data);
+			return -1;
+		}
+		if (cfg->scrub_duty < 1 || cfg->scrub_duty > 100) {
+			errorf("failed to read configuration: scrub.duty value '%.*s' must be between 1 and 100 (percent)", v->len, v->data);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strncmp("scrub.threads", k->data, k->len) == 0) {
+		if (s_parseint(v, &cfg->scrub_threads) != 0) {
+			errorf("failed to read configuration: scrub.threads value '%.*s' is not a positive number", v->len, v->data);
+			return -1;
+		}
+		if (cfg->scrub_threads < 1) {
+			errorf("failed to read configuration: scrub.threads value '%.*s' must be at least 1", v->len, v->data);
+			return -1;
+		}
+		return 0;
+	}
+
+	/* (this has to come before retention.interval, since
+	    directives are matched on the length of the key) */
+	if (strncmp("retention", k->data, k->len) == 0) {
+		struct retention *r;
+		char *pattern, *age;
+
+		pattern = strndup(v->data, v->len);
+		age = strpbrk(pattern, " \t");
+		if (age) {
+			*age++ = '\0';
+			age += strspn(age, " \t");
+		}
+		if (!age || !*pattern || bolo_duration(age) == INVALID_MS) {
+			errorf("failed to read configuration: retention value '%.*s' should be a metric pattern and a duration (like `cpu* 30d')", v->len, v->data);
+			free(pattern);
+			return -1;
+		}
+
+		r = realloc(cfg->retention, (cfg->nretention + 1) * sizeof(struct retention));
+		if (!r) {
+			errorf("failed to read configuration: could not allocate memory");
+			free(pattern);
+			return -1;
+		}
+		cfg->retention = r;
+		cfg->retention[cfg->nretention].pattern = pattern;
+		cfg->retention[cfg->nretention].keep    = bolo_duration(age);
+		cfg->nretention++;
+		return 0;
+	}
+
+	if (strncmp("retention.interval", k->data, k->len) == 0) {
+		if (s_parsetime(v, &cfg->retention_interval) != 0) {
+			errorf("failed to read configuration: retention.interval value '%.*s' is not a positive number", v->len, v->data);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strncmp("wal.interval", k->data, k->len) == 0) {
+		if (s_parsetime(v, &cfg->wal_interval) != 0) {
+			errorf("failed to read configuration: wal.interval value '%.*s' is not a positive number", v->len, v->data);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strncmp("wal.group", k->data, k->len) == 0) {
+		if (s_parseint(v, &cfg->wal_group) != 0) {
+			errorf("failed to read configuration: wal.group value '%.*s' is not a positive number", v->len, v->data);
+			return -1;
+		}
+		if (cfg->wal_group < 1) {
+			errorf("failed to read configuration: wal.group value '%.*s' must be at least 1", v->len, v->data);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strncmp("checkpoint.interval", k->data, k->len) == 0) {
+		if (s_parsetime(v, &cfg->checkpoint_interval) != 0) {
+			errorf("failed to read configuration: checkpoint.interval value '%.*s' is not a positive number", v->len, v->data);
+			return -1;
+		}
+		if (cfg->checkpoint_interval < 1) {
+			errorf("failed to read configuration: checkpoint.interval value '%.*s' must be more than 0", v->len, v->data);
+			return -1;
+		}
+		return 0;
+	}
+
 	errorf("failed to read configuration: unrecognized configuration directive '%.*s'", k->len, k->data);
 	return -1;
 }
@@ -411,6 +554,14 @@ s_configure_core(struct core_config *cfg, int fd)
 	cfg->log_level = DEFAULT_CORE_LOG_LEVEL;
 	cfg->query_max_connections = DEFAULT_CORE_QUERY_MAX_CONNECTIONS;
 	cfg->metric_max_connections = DEFAULT_CORE_METRIC_MAX_CONNECTIONS;
+	cfg->scrub_interval = DEFAULT_CORE_SCRUB_INTERVAL;
+	cfg->scrub_rate     = DEFAULT_CORE_SCRUB_RATE;
+	cfg->scrub_duty     = DEFAULT_CORE_SCRUB_DUTY;
+	cfg->scrub_threads  = DEFAULT_CORE_SCRUB_THREADS;
+	cfg->retention_interval = DEFAULT_CORE_RETENTION_INTERVAL;
+	cfg->wal_interval        = DEFAULT_CORE_WAL_INTERVAL;
+	cfg->wal_group           = DEFAULT_CORE_WAL_GROUP;
+	cfg->checkpoint_interval = DEFAULT_CORE_CHECKPOINT_INTERVAL;
 
 	cfg->db_data_root = strdup(DEFAULT_CORE_DB_DATA_ROOT);
 	if (!cfg->db_data_root) return -1;
@@ -553,6 +704,11 @@ s_deconfigure_core(struct core_config *config)
 
 	free(config->metric_listen);
 	config->metric_listen = NULL;
+
+	while (config->nretention > 0)
+		free(config->retention[--config->nretention].pattern);
+	free(config->retention);
+	config->retention = NULL;
 }
 
 static void
@@ -661,6 +817,15 @@ TESTS {
 		default_ok("query.max_connections",  unsigned, cfg.query_max_connections,  DEFAULT_CORE_QUERY_MAX_CONNECTIONS);
 		default_ok("metric.listen",          string,   cfg.metric_listen,          DEFAULT_CORE_METRIC_LISTEN);
 		default_ok("metric.max_connections", unsigned, cfg.metric_max_connections, DEFAULT_CORE_METRIC_MAX_CONNECTIONS);
+		default_ok("scrub.interval",         unsigned, cfg.scrub_interval,         DEFAULT_CORE_SCRUB_INTERVAL);
+		default_ok("scrub.rate",             unsigned, cfg.scrub_rate,             DEFAULT_CORE_SCRUB_RATE);
+		default_ok("scrub.duty",             unsigned, cfg.scrub_duty,             DEFAULT_CORE_SCRUB_DUTY);
+		default_ok("scrub.threads",          unsigned, cfg.scrub_threads,          DEFAULT_CORE_SCRUB_THREADS);
+		default_ok("retention.interval",     unsigned, cfg.retention_interval,     DEFAULT_CORE_RETENTION_INTERVAL);
+		default_ok("retention",              unsigned, cfg.nretention,             0);
+		default_ok("wal.interval",           unsigned, cfg.wal_interval,           DEFAULT_CORE_WAL_INTERVAL);
+		default_ok("wal.group",              unsigned, cfg.wal_group,              DEFAULT_CORE_WAL_GROUP);
+		default_ok("checkpoint.interval",    unsigned, cfg.checkpoint_interval,    DEFAULT_CORE_CHECKPOINT_INTERVAL);
 #undef default_ok
 		deconfigure(CORE_CONFIG, &cfg);
 	}
@@ -785,6 +950,67 @@ TESTS {
 		deconfigure(CORE_CONFIG, &cfg);
 	}
 
+	subtest {
+		struct core_config cfg;
+
+		try(CORE_CONFIG, cfg, "scrub.interval = 6h");
+		is_unsigned(cfg.scrub_interval, 6 * 3600 * 1000, "scrub.interval accepts time units");
+		deconfigure(CORE_CONFIG, &cfg);
+
+		try(CORE_CONFIG, cfg, "scrub.interval = 0");
+		is_unsigned(cfg.scrub_interval, 0, "scrub.interval of 0 disables the scrubber");
+		deconfigure(CORE_CONFIG, &cfg);
+
+		try(CORE_CONFIG, cfg, "scrub.rate = 32M");
+		is_unsigned(cfg.scrub_rate, 32 * 1024 * 1024, "scrub.rate accepts size units");
+		deconfigure(CORE_CONFIG, &cfg);
+
+		try(CORE_CONFIG, cfg, "scrub.duty = 25");
+		is_unsigned(cfg.scrub_duty, 25, "scrub.duty accepts percentages");
+		deconfigure(CORE_CONFIG, &cfg);
+
+		try(CORE_CONFIG, cfg, "scrub.threads = 2");
+		is_unsigned(cfg.scrub_threads, 2, "scrub.threads accepts positive integers");
+		deconfigure(CORE_CONFIG, &cfg);
+	}
+
+	subtest {
+		struct core_config cfg;
+
+		try(CORE_CONFIG, cfg, "retention.interval = 15m");
+		is_unsigned(cfg.retention_interval, 15 * 60 * 1000, "retention.interval accepts time units");
+		deconfigure(CORE_CONFIG, &cfg);
+
+		try(CORE_CONFIG, cfg, "retention = cpu* 30d\n"
+		                      "retention = *    1w\n");
+		is_unsigned(cfg.nretention, 2, "retention can be given more than once");
+		is_string(cfg.retention[0].pattern, "cpu*", "retention policies keep their metric patterns");
+		is_unsigned(cfg.retention[0].keep, 30 * 86400 * 1000ul, "retention accepts day units");
+		is_string(cfg.retention[1].pattern, "*", "retention policies are kept in order");
+		is_unsigned(cfg.retention[1].keep, 7 * 86400 * 1000ul, "retention accepts week units");
+		deconfigure(CORE_CONFIG, &cfg);
+	}
+
+	subtest {
+		struct core_config cfg;
+
+		try(CORE_CONFIG, cfg, "wal.interval = 250ms");
+		is_unsigned(cfg.wal_interval, 250, "wal.interval accepts time units");
+		deconfigure(CORE_CONFIG, &cfg);
+
+		try(CORE_CONFIG, cfg, "wal.interval = 0");
+		is_unsigned(cfg.wal_interval, 0, "wal.interval of 0 commits every batch");
+		deconfigure(CORE_CONFIG, &cfg);
+
+		try(CORE_CONFIG, cfg, "wal.group = 10,000");
+		is_unsigned(cfg.wal_group, 10000, "wal.group accepts positive integers");
+		deconfigure(CORE_CONFIG, &cfg);
+
+		try(CORE_CONFIG, cfg, "checkpoint.interval = 5m");
+		is_unsigned(cfg.checkpoint_interval, 5 * 60 * 1000, "checkpoint.interval accepts time units");
+		deconfigure(CORE_CONFIG, &cfg);
+	}
+
 
 
 
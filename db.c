@@ -2,15 +2,49 @@
 
 #include <ctype.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/wait.h>
 
 #define INITIAL_SLAB (uint64_t)(1 << 11)
 #define PATH_TO_MAINDB "main.db"
+#define PATH_TO_SETTINGS "settings"
+#define PATH_TO_QUARANTINE "quarantine"
+#define PATH_TO_ROLLUPS "rollups"
+#define PATH_TO_WAL "wal"
+
+/* how many threads to map slabs with, at mount time;
+   0 means one per online CPU. */
+#ifndef MOUNT_THREADS
+#define MOUNT_THREADS 0
+#endif
+
+/* how many threads (at most) to seal and msync tslabs,
+   and write out btrees and rollups with, in db_sync(). */
+#ifndef SYNC_THREADS
+#define SYNC_THREADS 4
+#endif
 
 /* Used as a callback for the directory traversal logic.
    Since the ts/slabs directories use the same structure, we
    reuse the traverseal logic in a single s_scandir function,
    and the customization is provided by the fs_handler. */
-typedef int(*fs_handler)(struct db *, uint64_t, int);
+typedef int(*fs_handler)(struct db *, uint64_t, int, void *);
+
+/* write out every buffered measurement, of every series */
+static int s_drainall(struct db *db);
+
+/* series_open(), without writing out the reorder buffer first */
+static int s_seriesopen(struct series_cursor *c, struct db *db, struct idx *idx, bolo_msec_t from, bolo_msec_t until);
+
+/* the tblock that follows `block` in its chain, if any */
+static struct tblock * s_chainnext(struct db *db, struct idx *idx, struct tblock *block);
+
+struct cell {
+	bolo_msec_t  ts;
+	bolo_value_t value;
+	int          seq;
+};
 
 struct dbkey *
 rand_key(size_t len)
@@ -26,6 +60,7 @@ rand_key(size_t len)
 	if (urand(k->key, k->len) != 0)
 		goto fail;
 
+	mac_key(k);
 	return k;
 
 fail:
@@ -75,6 +110,8 @@ read_key(const char *s)
 				goto fail;
 		}
 	}
+	if (k->len)
+		mac_key(k);
 	return k;
 
 fail:
@@ -83,39 +120,192 @@ fail:
 	return NULL;
 }
 
+/* which size class do tblocks of this size belong to? */
+static int
+s_class(uint32_t block_size)
+{
+	int c;
+
+	for (c = 0; c < TBLOCK_CLASSES; c++)
+		if (tblock_class_size(c) == block_size)
+			return c;
+	return -1;
+}
+
+/* slabs found by s_scandir(), waiting to be mapped */
+struct slabent {
+	struct tslab *slab;
+	int           fd;
+	int           err;  /* errno from tslab_map(), or 0 */
+};
+
+struct slabq {
+	size_t          n, len;
+	struct slabent *ent;
+
+	size_t          next;   /* next slab for a worker to map */
+	pthread_mutex_t lock;
+
+	int             upgrade; /* mounting via db_upgrade()? */
+};
+
 static int
-s_handle_slab(struct db *db, uint64_t id, int fd)
+s_queue_slab(struct db *db, uint64_t id, int fd, void *_q)
 {
-	int i, esave;
+	struct slabq *q;
 	struct tslab *slab;
-	uint64_t max_tblock;
+
+	q = (struct slabq *)_q;
+	if (q->n == q->len) {
+		q->len = q->len ? q->len * 2 : 64;
+		q->ent = realloc(q->ent, q->len * sizeof(*q->ent));
+		insist(q->ent != NULL, "s_queue_slab() unable to allocate memory for the slab queue");
+	}
 
 	slab = xmalloc(sizeof(*slab));
 	slab->key = db->key;
-
+	slab->mac = db->mac; /* (until tslab_map() reads the header) */
+	slab->block_format = db->block_format;
+	slab->lazy = 1; /* map blocks on first use, or db_warmup() */
+	slab->upgrade = q->upgrade;
 	slab->number = id;
-	if (tslab_map(slab, fd) != 0)
-		goto fail;
+
+	q->ent[q->n].slab = slab;
+	q->ent[q->n].fd   = fd;
+	q->ent[q->n].err  = 0;
+	q->n++;
+	return 0;
+}
+
+static void *
+s_map_slabs(void *_q)
+{
+	struct slabq *q;
+	size_t i;
+
+	q = (struct slabq *)_q;
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		i = q->next++;
+		pthread_mutex_unlock(&q->lock);
+
+		if (i >= q->n)
+			return NULL;
+
+		/* header read, HMAC / endian check, and mmap */
+		if (tslab_map(q->ent[i].slab, q->ent[i].fd) != 0)
+			q->ent[i].err = errno;
+	}
+}
+
+static int
+s_slabcmp(const void *_a, const void *_b)
+{
+	uint64_t a, b;
+
+	a = ((const struct slabent *)_a)->slab->number;
+	b = ((const struct slabent *)_b)->slab->number;
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+/* where in db->slabtab does the tslab for tblock `id` go? */
+#define s_slabtab(id) (tslab_number(id) / TBLOCKS_PER_TSLAB)
+
+/* file `slab` into db->slabtab, growing it as needed.  tslab
+   numbers are handed out in order (see s_newblock()), so the
+   table stays dense, save for the gaps that compaction and
+   expiry leave behind them. */
+static void
+s_tabslab(struct db *db, struct tslab *slab)
+{
+	size_t i, n;
+
+	i = s_slabtab(slab->number);
+	if (i >= db->slabtablen) {
+		for (n = db->slabtablen ? db->slabtablen : 64; n <= i; n *= 2)
+			;
+		db->slabtab = realloc(db->slabtab, n * sizeof(*db->slabtab));
+		insist(db->slabtab != NULL, "s_tabslab() unable to allocate memory for the tslab lookup table");
+		memset(db->slabtab + db->slabtablen, 0, (n - db->slabtablen) * sizeof(*db->slabtab));
+		db->slabtablen = n;
+	}
+	db->slabtab[i] = slab;
+}
+
+static void
+s_handle_slab(struct db *db, struct tslab *slab)
+{
+	int c;
 
 	push(&db->slab, &slab->l);
+	s_tabslab(db, slab);
 
-	max_tblock = slab->number;
-	for (i = 1; i < TBLOCKS_PER_TSLAB; i++) {
-		if (!slab->blocks[i].valid)
+	/* new tblocks of each class go into the newest slab of that class */
+	c = s_class(slab->block_size);
+	CHECK(c >= 0, "s_handle_slab() found a tslab with a non-standard block size");
+	if (!db->tail[c] || db->tail[c]->number < slab->number)
+		db->tail[c] = slab;
+
+	if (slab->number >= db->next_slab)
+		db->next_slab = slab->number + TBLOCKS_PER_TSLAB;
+	db->nfree += slab->nfree;
+}
+
+/* map every queued slab, spread across a pool of threads,
+   and then fold them into the database in slab order, so
+   that the result doesn't depend on who finished first. */
+static int
+s_mount_slabs(struct db *db, struct slabq *q)
+{
+	pthread_t *tids;
+	long nthreads;
+	size_t i;
+	int esave, ok;
+
+	nthreads = MOUNT_THREADS > 0 ? MOUNT_THREADS : sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if ((size_t)nthreads > q->n)
+		nthreads = q->n;
+
+	q->next = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	tids = xcalloc(nthreads + 1, sizeof(*tids));
+	for (i = 0; i < (size_t)nthreads; i++)
+		if (pthread_create(&tids[i], NULL, s_map_slabs, q) != 0)
 			break;
-		max_tblock++;
-	}
-	if (max_tblock >= db->next_tblock)
-		db->next_tblock = max_tblock + 1;
+	s_map_slabs(q); /* lend a hand (or do it all, if we're out of threads) */
+	while (i-- > 0)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	pthread_mutex_destroy(&q->lock);
+
+	/* the first failure (in slab order) fails the whole mount */
+	qsort(q->ent, q->n, sizeof(*q->ent), s_slabcmp);
+	esave = 0;
+	for (i = 0; i < q->n && !esave; i++)
+		esave = q->ent[i].err;
 
-	return 0;
+	ok = 0;
+	for (i = 0; i < q->n; i++) {
+		if (!esave) {
+			s_handle_slab(db, q->ent[i].slab);
+			continue;
+		}
 
-fail:
-	esave = errno;
-	free(slab);
-	close(fd);
-	errno = esave;
-	return -1;
+		if (q->ent[i].err)
+			close(q->ent[i].fd);
+		else if (tslab_unmap(q->ent[i].slab) != 0)
+			ok = -1;
+		free(q->ent[i].slab);
+	}
+	free(q->ent);
+
+	if (esave) {
+		errno = esave;
+		return -1;
+	}
+	return ok;
 }
 
 static int
@@ -189,7 +379,7 @@ s_isdatfile(const char *name, const char *suffix)
 }
 
 static int
-s_scandir(struct db *db, const char *path, const char *suffix, fs_handler fn)
+s_scandir(struct db *db, const char *path, const char *suffix, fs_handler fn, void *udata)
 {
 	/* directory structure is as follows:
 
@@ -261,7 +451,7 @@ s_scandir(struct db *db, const char *path, const char *suffix, fs_handler fn)
 				continue;
 			}
 
-			if (fn(db, id, fd) != 0)
+			if (fn(db, id, fd, udata) != 0)
 				goto fail;
 		}
 		closedir(dh2);
@@ -339,13 +529,6 @@ fail:
 	return 0;
 }
 
-static uint64_t
-s_maindb_writer(const char *key, void *_idx, void *_)
-{
-	CHECK(_idx != NULL, "main.db writer given a NULL time series index to convert");
-	return ((struct idx *)_idx)->number;
-}
-
 static void
 s_setmetric(struct db *db, char *name, struct idx *idx)
 {
@@ -439,154 +622,6 @@ s_maindb_reader(const char *key, uint64_t id, void *udata)
 	return idx;
 }
 
-struct db *
-db_mount(const char *path, struct dbkey *key)
-{
-	struct db *db;
-	int fd, cwd;
-	int esave;
-
-	db = NULL;
-	fd = cwd = -1;
-
-	cwd = s_cwd();
-	if (cwd < 0)
-		goto fail;
-
-	infof("mounting bolo database at %s", path);
-	fd = openat(cwd, path, O_RDONLY | O_DIRECTORY);
-	if (fd < 0) {
-		if (errno == ENOENT)
-			errno = BOLO_ENODBROOT;
-		goto fail;
-	}
-
-	db = xalloc(1, sizeof(struct db));
-	db->rootfd = fd;
-	db->key = key;
-	db->next_tblock = 0x800;
-
-	infof("checking for main.db index file at %s/%s", path, PATH_TO_MAINDB);
-	fd = openat(db->rootfd, PATH_TO_MAINDB, O_RDONLY);
-	if (fd < 0) {
-		if (errno == ENOENT)
-			errno = BOLO_ENOMAINDB;
-		goto fail;
-	}
-
-	/* first, we have to scan the time series indices */
-	infof("scanning time series time index files at %s/idx", path);
-	if (btallocator(&db->bta, db->rootfd) != 0)
-		goto fail;
-
-	empty(&db->idx);
-	empty(&db->multidx);
-	db->tags = hash_new(0);
-	db->metrics = hash_new(0);
-
-	infof("mounting main.db index file at %s/%s", path, PATH_TO_MAINDB);
-	db->main = hash_read(fd, s_maindb_reader, db);
-	if (!db->main)
-		goto fail;
-	close(fd);
-
-	infof("scanning time series slab storage files at %s/slabs", path);
-	empty(&db->slab);
-	s_ensure_dirat(db->rootfd, "slabs", 0777);
-	if (s_scandir(db, "slabs", ".slab", s_handle_slab) != 0)
-		goto fail;
-
-	infof("database mounted successfully");
-	close(cwd);
-	return db;
-
-fail:
-	esave = errno;
-	if (cwd >= 0) close(cwd);
-	if (fd  >= 0) close(fd);
-	if (db) {
-		if (db->rootfd <= 0) close(db->rootfd);
-		hash_free(db->main);
-		free(db);
-	}
-	errno = esave;
-	return NULL;
-}
-
-struct db *
-db_init(const char *path, struct dbkey *key)
-{
-	struct db *db;
-	int cwd, fd;
-	int esave;
-
-	CHECK(path != NULL, "db_init() given a NULL path to read from");
-
-	db = NULL;
-	fd = cwd = -1;
-
-	cwd = s_cwd();
-	if (cwd < 0)
-		goto fail;
-
-	/* make sure we have a root directory */
-	s_ensure_dirat(cwd, path, 0777);
-	fd = openat(cwd, path, O_RDONLY | O_DIRECTORY);
-	if (fd < 0)
-		goto fail;
-
-	/* make sure the root dir is empty */
-	if (!s_dirempty(fd))
-		goto fail;
-
-	db = xalloc(1, sizeof(*db));
-
-	if (!key)
-		key = rand_key(DEFAULT_KEY_SIZE);
-	if (!key)
-		goto fail;
-	db->key = key;
-
-	db->rootfd = fd;
-	fd = -1;
-	db->main    = hash_new(0);
-	db->tags    = hash_new(0);
-	db->metrics = hash_new(0);
-
-	/* create the main.db index */
-	fd = openat(db->rootfd, PATH_TO_MAINDB, O_WRONLY|O_CREAT, 0666);
-	if (fd < 0) {
-		if (errno == ENOENT)
-			errno = BOLO_ENOMAINDB;
-		goto fail;
-	}
-	if (hash_write(db->main, fd, s_maindb_writer, db) != 0)
-		goto fail;
-	close(fd);
-	fd = -1;
-
-	empty(&db->idx);
-	empty(&db->multidx);
-	empty(&db->slab);
-	db->next_tblock = 0x800;
-
-	return db;
-
-fail:
-	esave = errno;
-	if (cwd >= 0) close(cwd);
-	if (fd  >= 0) close(fd);
-	if (db) {
-		if (db->rootfd >= 0) close(db->rootfd);
-		hash_free(db->main);
-		hash_free(db->tags);
-		hash_free(db->metrics);
-		free(db);
-	}
-	errno = esave;
-	return NULL;
-}
-
 static char *
 s_tmpcopyof(const char *path)
 {
@@ -633,439 +668,4813 @@ fail:
 	return -1;
 }
 
-int
-db_sync(struct db *db)
+/* main.db format:
+
+   main.db is a journal of every time series in the database,
+   and the number of the btree that indexes it.
+
+     0 "MAINv1" (6)  (resv) (2)
+     8 ENDIAN CANARY (4)  (resv) (4)
+    16 records ...
+
+   each record is the btree number (8), the length of the
+   name (2), and the metric|tagset name itself (not NUL-
+   terminated).  series added since the last db_sync() are
+   appended to the end; the whole file is only rewritten
+   when series are renumbered (by db_compact()), or when it
+   needs repairing / upgrading from the older, plain-text
+   "name\tnumber\n" format.  everything is in host byte order. */
+#define MAINDB_HEADER   16
+#define MAINDB_RECORD   10
+#define MAINDB_NAME_MAX 0xffff
+#define ENDIAN_MAGIC 2127639116U
+
+static void
+s_mainheader(uint8_t *header)
 {
-	struct tslab *slab;
-	struct idx   *idx;
-	char *copy;
-	int fd;
+	memset(header, 0, MAINDB_HEADER);
+	memcpy(header, "MAINv1", 6);
+	write32(header, 8, ENDIAN_MAGIC);
+}
+
+/* read every record in main.db, in a single pass over a
+   read-only mapping of the whole file */
+static int
+s_readmain(struct db *db, int fd)
+{
+	struct page p;
+	struct stat st;
+	struct idx *idx;
+	char name[MAINDB_NAME_MAX + 1];
+	size_t off, n;
 	int esave;
 
-	fd = -1;
-	copy = NULL;
+	if (fstat(fd, &st) != 0)
+		return -1;
 
-	for_each(slab, &db->slab, l)
-		if (tslab_sync(slab) != 0)
-			goto fail;
+	if (st.st_size < MAINDB_HEADER || pread(fd, name, 6, 0) != 6 || memcmp(name, "MAINv1", 6) != 0) {
+		/* the old, plain-text format; upgrade at the next sync */
+		db->main = hash_read(fd, s_maindb_reader, db);
+		if (!db->main)
+			return -1;
+		db->maindirty = 1;
+		return 0;
+	}
 
-	for_each(idx, &db->idx, l)
-		if (btree_write(idx->btree) != 0)
-			goto fail;
+	memset(&p, 0, sizeof(p));
+	if (page_map(&p, fd, 0, st.st_size) != 0)
+		return -1;
 
-	fd = s_tmpcopyat(db->rootfd, PATH_TO_MAINDB, O_WRONLY, &copy);
-	if (fd < 0)
+	errno = BOLO_EENDIAN;
+	if (read32(p.data, 8) != ENDIAN_MAGIC)
 		goto fail;
 
-	if (hash_write(db->main, fd, s_maindb_writer, db) != 0)
-		goto fail;
+	db->main = hash_new(0);
+	for (off = MAINDB_HEADER; off + MAINDB_RECORD <= p.len; off += MAINDB_RECORD + n) {
+		/* a record that doesn't fit (or is all zeroes)
+		   was torn off the end by a crash */
+		n = read16(p.data, off + 8);
+		if (n == 0 || off + MAINDB_RECORD + n > p.len)
+			break;
 
-	if (renameat(db->rootfd, copy, db->rootfd, PATH_TO_MAINDB) != 0)
-		goto fail;
+		memcpy(name, (uint8_t *)p.data + off + MAINDB_RECORD, n);
+		name[n] = '\0';
 
-	close(fd);
-	free(copy);
-	return 0;
+		errno = BOLO_EBADHASH;
+		if (strlen(name) != n || hash_isset(db->main, name))
+			goto fail;
+
+		idx = s_maindb_reader(name, read64(p.data, off), db);
+		if (!idx || hash_set(db->main, name, idx) != 0)
+			goto fail;
+	}
+
+	db->mainlen = off;
+	if (off < p.len) {
+		errorf("ignoring %lu octets of main.db past the last intact record (at offset %lu)",
+			p.len - off, off);
+		db->maindirty = 1; /* rewrite it without them, at the next sync */
+	}
+	return page_unmap(&p);
 
 fail:
 	esave = errno;
-	if (fd >= 0) close(fd);
-	free(copy);
+	if (page_unmap(&p) != 0)
+		errorf("unable to unmap main.db: %s", error(errno));
 	errno = esave;
 	return -1;
 }
 
-int
-db_unmount(struct db *db)
+/* rewrite main.db from scratch, and rename it into place */
+static int
+s_writemain(struct db *db)
 {
-	struct tslab   *slab, *tmp_slab;
-	struct idx     *idx,  *tmp_idx;
-	struct multidx *set,  *tmp_set;
-	int ok;
+	uint8_t header[MAINDB_HEADER], rec[MAINDB_RECORD];
+	struct idx *idx;
+	char *name, *copy;
+	size_t n, len;
+	FILE *out;
+	int fd, esave;
 
-	CHECK(db != NULL, "db_unmount() given a NULL db pointer to unmount");
+	out = NULL;
+	fd = s_tmpcopyat(db->rootfd, PATH_TO_MAINDB, O_WRONLY, &copy);
+	if (fd < 0)
+		return -1;
 
-	ok = 0;
-	for_eachx(slab, tmp_slab, &db->slab, l) {
-		if (tslab_unmap(slab) != 0)
-			ok = -1;
-		free(slab);
-	}
+	out = fdopen(fd, "w");
+	if (!out)
+		goto fail;
 
-	for_eachx(idx, tmp_idx, &db->idx, l) {
-		if (btree_close(idx->btree) != 0)
-			ok = -1;
-		free(idx);
+	s_mainheader(header);
+	fwrite(header, MAINDB_HEADER, 1, out);
+	len = MAINDB_HEADER;
+
+	hash_each(db->main, &name, &idx) {
+		n = strlen(name);
+		write64(rec, 0, idx->number);
+		write16(rec, 8, n);
+		fwrite(rec, MAINDB_RECORD, 1, out);
+		fwrite(name, n, 1, out);
+		len += MAINDB_RECORD + n;
 	}
 
-	for_eachx(set, tmp_set, &db->multidx, l) {
-		free(set);
-	}
+	if (fflush(out) != 0 || ferror(out) || fsync(fd) != 0)
+		goto fail;
 
-	hash_free(db->main);
-	hash_free(db->tags);
-	hash_free(db->metrics);
-	close(db->rootfd);
-	free(db);
-	return ok;
+	if (renameat(db->rootfd, copy, db->rootfd, PATH_TO_MAINDB) != 0
+	 || fsync(db->rootfd) != 0)
+		goto fail;
+
+	fclose(out);
+	free(copy);
+	db->mainlen   = len;
+	db->maindirty = 0;
+	return 0;
+
+fail:
+	esave = errno;
+	if (out) fclose(out);
+	else     close(fd);
+	(void)unlinkat(db->rootfd, copy, 0);
+	free(copy);
+	errno = esave;
+	return -1;
 }
 
+/* append the series added since the last sync to main.db */
 static int
-s_newidx(struct db *db, struct idx **idx, uint64_t *id)
+s_appendmain(struct db *db)
 {
-	CHECK(db  != NULL, "s_newidx() given a NULL db pointer to work with");
-	CHECK(idx != NULL, "s_newidx() given a NULL destination pointer for the new time series index");
-	CHECK(id  != NULL, "s_newidx() given a NULL detination pointer for the new time series id number");
+	struct idx *idx;
+	uint8_t *buf;
+	size_t i, n, len;
+	ssize_t nwrit;
+	int fd, esave;
 
-	*idx = xmalloc(sizeof(**idx));
-	if (!((*idx)->btree = btmake(&db->bta)))
-		goto fail;
+	for (len = 0, i = 0; i < db->nfresh; i++)
+		len += MAINDB_RECORD + strlen(db->fresh[i]);
 
-	*id = (*idx)->number = (*idx)->btree->id;
+	buf = xmalloc(len);
+	for (len = 0, i = 0; i < db->nfresh; i++) {
+		if (hash_get(db->main, &idx, db->fresh[i]) != 0)
+			bail("s_appendmain() found a new series that isn't in the main.db hash");
 
-	push(&db->idx, &(*idx)->l);
+		n = strlen(db->fresh[i]);
+		write64(buf, len,     idx->number);
+		write16(buf, len + 8, n);
+		memcpy(buf + len + MAINDB_RECORD, db->fresh[i], n);
+		len += MAINDB_RECORD + n;
+	}
+
+	fd = openat(db->rootfd, PATH_TO_MAINDB, O_WRONLY);
+	if (fd < 0) {
+		free(buf);
+		return -1;
+	}
+
+	for (i = 0; i < len; i += nwrit) {
+		nwrit = pwrite(fd, buf + i, len - i, db->mainlen + i);
+		if (nwrit < 0 && errno == EINTR)
+			nwrit = 0;
+		else if (nwrit <= 0)
+			goto fail;
+	}
+	if (fdatasync(fd) != 0)
+		goto fail;
+
+	close(fd);
+	free(buf);
+	db->mainlen += len;
 	return 0;
 
 fail:
-	free(*idx);
+	/* don't leave half of a record behind */
+	esave = errno;
+	(void)ftruncate(fd, db->mainlen);
+	close(fd);
+	free(buf);
+	errno = esave;
 	return -1;
 }
 
-static struct tslab *
-s_findslab(struct db *db, uint64_t id)
+/* bring main.db up to date with db->main */
+static int
+s_syncmain(struct db *db)
 {
-	struct tslab *slab;
+	size_t i;
 
-	CHECK(db != NULL, "s_findslab() given a NULL db pointer to work with");
+	if (db->maindirty) {
+		if (s_writemain(db) != 0)
+			return -1;
+	} else if (db->nfresh) {
+		if (s_appendmain(db) != 0)
+			return -1;
+	}
 
-	id = tslab_number(id);
-	for_each(slab, &db->slab, l)
-		if (slab->number == id)
-			return slab;
+	for (i = 0; i < db->nfresh; i++)
+		free(db->fresh[i]);
+	db->nfresh = 0;
+	return 0;
+}
 
-	errno = BOLO_ENOSLAB;
-	return NULL;
+/* the settings file is a plain-text list of `key value`
+   lines; unrecognized keys are ignored.  a missing file (or
+   key) means the database predates it, and its blocks are
+   all BLOKv1; TBLOCK_DEFAULT_VERSION is only for db_init(). */
+static int
+s_readsettings(struct db *db)
+{
+	FILE *io;
+	int fd;
+	char k[64];
+	long v;
+
+	db->block_format = 1;
+	db->mac = MAC_HMAC_SHA512; /* (databases from before there was a choice) */
+
+	fd = openat(db->rootfd, PATH_TO_SETTINGS, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	io = fdopen(fd, "r");
+	if (!io) {
+		close(fd);
+		return -1;
+	}
+
+	while (fscanf(io, "%63s %li", k, &v) == 2) {
+		if (streq(k, "block-format"))
+			db->block_format = (int)v;
+		else if (streq(k, "mac"))
+			db->mac = (int)v;
+		else if (streq(k, "partition"))
+			db->partition = (bolo_msec_t)v;
+	}
+	fclose(io);
+
+	errno = BOLO_EBADCONF;
+	if (db->block_format < 1 || db->block_format > 4)
+		return -1;
+	if (!mac_name(db->mac))
+		return -1;
+	return 0;
 }
 
-static struct tslab *
-s_newslab(struct db *db, uint64_t id)
+/* the quarantine file is a plain-text list of tblock
+   numbers (in hex), one per line, that failed their
+   integrity checks; a missing file means "none". */
+static int
+s_readquarantine(struct db *db)
 {
-	int fd, esave;
-	char path[64];
-	struct tslab *slab;
+	FILE *io;
+	int fd;
+	uint64_t id;
 
-	CHECK(db != NULL, "s_newslab() given a NULL db pointer to work with");
+	fd = openat(db->rootfd, PATH_TO_QUARANTINE, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
 
-	fd = -1;
-	slab = xmalloc(sizeof(*slab));
-	slab->key = db->key;
+	io = fdopen(fd, "r");
+	if (!io) {
+		close(fd);
+		return -1;
+	}
 
-	/* formulate a path, relative to db root, for this slab */
-	snprintf(path, sizeof(path), "slabs/%04lx.%04lx/%04lx.%04lx.%04lx.%04lx.slab",
-		((id & 0xffff000000000000ul) >> 48),
-		((id & 0x0000ffff00000000ul) >> 32),
-		/* --- */
-		((id & 0xffff000000000000ul) >> 48),
-		((id & 0x0000ffff00000000ul) >> 32),
-		((id & 0x00000000ffff0000ul) >> 16),
-		((id & 0x000000000000fffful)));
+	while (fscanf(io, "%lx", &id) == 1) {
+		if (db_isquarantined(db, id))
+			continue;
+		db->quarantine = realloc(db->quarantine, (db->nquarantined + 1) * sizeof(*db->quarantine));
+		insist(db->quarantine != NULL, "s_readquarantine() unable to allocate memory for the quarantine list");
+		db->quarantine[db->nquarantined++] = id;
+	}
+	fclose(io);
+	return 0;
+}
 
-	/* create the parent directory, if necessary */
-	if (mktree(db->rootfd, path, 0777) != 0)
-		goto fail;
+static int
+s_writesettings(struct db *db)
+{
+	FILE *io;
+	int fd;
 
-	/* create the slab file itself */
-	fd = openat(db->rootfd, path, O_RDWR|O_CREAT, 0666);
+	fd = openat(db->rootfd, PATH_TO_SETTINGS, O_WRONLY|O_CREAT|O_TRUNC, 0666);
 	if (fd < 0)
-		goto fail;
+		return -1;
 
-	/* initialize the slab file with tslab headers */
-	if (tslab_init(slab, fd, tslab_number(id), TBLOCK_SIZE) != 0)
-		goto fail;
+	io = fdopen(fd, "w");
+	if (!io) {
+		close(fd);
+		return -1;
+	}
 
-	/* keep track of the slab */
-	push(&db->slab, &slab->l);
+	fprintf(io, "block-format %d\n", db->block_format);
+	fprintf(io, "mac %d\n", db->mac);
+	if (db->partition)
+		fprintf(io, "partition %lu\n", db->partition);
+	return fclose(io) == 0 ? 0 : -1;
+}
 
-	return slab;
+/* the block journal remembers what each tblock that has changed
+   since the last checkpoint (db_sync()) held as of that checkpoint,
+   so that replaying the write-ahead log after a crash can tell the
+   logged measurements that made it into a tblock from the ones
+   that didn't.  a record is written (synchronously) just before a
+   block first changes, and the journal is emptied at every sync.
+
+   the journal is a run of records:
+
+     0 "JRNLv1" (6)  TYPE (1)  (resv) (1)
+     8 TBLOCK NUMBER (8)
+    16 KEPT (4)  COUNT (4)
+    24 cells ...
+       MAC (64)
+
+   JOURNAL_NEW is for a block that was just (re-)allocated, and so
+   held nothing that matters.  JOURNAL_KEPT is for a block about to
+   be appended to, or re-pointed at a new next block; its first KEPT
+   cells are the ones it held.  JOURNAL_IMAGE is for a block about
+   to be rewritten in time order (see s_rewrite()), after which the
+   order of its cells says nothing; the record lists the COUNT cells
+   it held, as a TIMESTAMP (8) and VALUE (8) each.  the MAC (of
+   whatever kind the database seals its tslabs with) covers the rest
+   of the record; anything short of that was torn by a crash.
+   everything is in host byte order. */
+#define PATH_TO_JOURNAL "journal"
+#define JOURNAL_HEADER  24
+#define JOURNAL_CELL    16
+
+#define JOURNAL_NEW     1
+#define JOURNAL_KEPT    2
+#define JOURNAL_IMAGE   3
+
+/* journal what `block` held as of the last checkpoint, unless
+   that's already been done, before it changes in the way that
+   `type` says it is about to. */
+static int
+s_journal(struct db *db, struct tblock *block, int type)
+{
+	struct tcursor c;
+	uint8_t *rec;
+	size_t len, n, i;
+	ssize_t nwrit;
+	off_t off, at;
+	int was;
+
+	if (!db->key)
+		return 0; /* (nothing changes without a key) */
+
+	was = block->journaled;
+	switch (type) {
+	case JOURNAL_KEPT:
+		if (was)
+			return 0;
+		block->kept = block->cells;
+		n = 0;
+		break;
+
+	case JOURNAL_IMAGE:
+		if (was == JOURNAL_IMAGE)
+			return 0;
+		if (!was)
+			block->kept = block->cells;
+		if (block->kept == 0) {
+			block->journaled = JOURNAL_IMAGE; /* (nothing to list) */
+			return 0;
+		}
+		n = block->kept;
+		break;
+
+	default:
+		block->kept = 0;
+		n = 0;
+		break;
+	}
+
+	len = JOURNAL_HEADER + n * JOURNAL_CELL + MAC_DIGEST;
+	rec = xmalloc(len);
+	memcpy(rec, "JRNLv1", 6);
+	rec[6] = type;
+	write64(rec,  8, block->number);
+	write32(rec, 16, block->kept);
+	write32(rec, 20, n);
+
+	tcursor_init(&c, block);
+	for (i = 0; i < n && tcursor_next(&c) == 0; i++) {
+		write64 (rec, JOURNAL_HEADER + i * JOURNAL_CELL,     c.ts);
+		write64f(rec, JOURNAL_HEADER + i * JOURNAL_CELL + 8, c.value);
+	}
+	mac_seal(db->key, db->mac, rec, len);
+
+	if (!db->journal) {
+		db->journal = openat(db->rootfd, PATH_TO_JOURNAL, O_WRONLY|O_CREAT|O_APPEND, 0666);
+		if (db->journal < 0) {
+			db->journal = 0;
+			goto fail;
+		}
+	}
+
+	off = lseek(db->journal, 0, SEEK_END);
+	if (off < 0)
+		goto fail;
+	for (at = 0; at < (off_t)len; at += nwrit) {
+		nwrit = write(db->journal, rec + at, len - at);
+		if (nwrit < 0 && errno == EINTR)
+			nwrit = 0;
+		else if (nwrit <= 0) {
+			/* don't strand the next record behind half of this one */
+			(void)ftruncate(db->journal, off);
+			goto fail;
+		}
+	}
+	free(rec);
+
+	block->journaled = type == JOURNAL_IMAGE ? JOURNAL_IMAGE : JOURNAL_KEPT;
+	if (!was) {
+		db->journaled = realloc(db->journaled, (db->njournaled + 1) * sizeof(*db->journaled));
+		insist(db->journaled != NULL, "s_journal() unable to allocate memory for the list of journaled tblocks");
+		db->journaled[db->njournaled++] = block->number;
+	}
+	return 0;
 
 fail:
-	esave = errno;
-	if (fd >= 0) close(fd);
-	free(slab);
-	errno = esave;
-	return NULL;
+	free(rec);
+	return -1;
 }
 
-/*
-   s_newblock()
+/* a checkpoint makes every journal record moot */
+static int
+s_forget(struct db *db)
+{
+	struct tblock *block;
+	size_t i;
 
-   Extend the database to include the next available tblock.
-   If a new tslab needs to be allocated to accommodate the
-   new block, that happens transparently to the caller.
- */
-static struct tblock *
-s_newblock(struct db *db, bolo_msec_t ts)
+	if (db->journal && ftruncate(db->journal, 0) != 0)
+		return -1;
+
+	for (i = 0; i < db->njournaled; i++)
+		if ((block = db_findblock(db, db->journaled[i])) != NULL)
+			block->journaled = block->kept = 0;
+	db->njournaled = 0;
+	return 0;
+}
+
+/* what a rewritten tblock held at the last checkpoint */
+struct image {
+	uint64_t     number;
+	struct cell *cells;
+	size_t       n;
+};
+
+/* the measurements that made it into a series' tblocks since
+   the last checkpoint, sorted by s_samecmp(); replay claims them
+   (by setting .seq) as it comes across them in the log. */
+struct delta {
+	struct cell *cells;
+	size_t       n;
+};
+
+struct replay {
+	struct db    *db;
+	struct image *images;  /* sorted by tblock number */
+	size_t        nimages;
+	struct hash  *deltas;  /* metric|tagset => struct delta */
+};
+
+static int
+s_imagecmp(const void *_a, const void *_b)
+{
+	const struct image *a = _a, *b = _b;
+	return a->number < b->number ? -1 : a->number > b->number ? 1 : 0;
+}
+
+/* cells that are the same measurement (down to the bits of a
+   NaN) sort next to one another */
+static int
+s_samecmp(const void *_a, const void *_b)
+{
+	const struct cell *a = _a, *b = _b;
+	uint64_t x, y;
+
+	if (a->ts != b->ts)
+		return a->ts < b->ts ? -1 : 1;
+	memcpy(&x, &a->value, sizeof(x));
+	memcpy(&y, &b->value, sizeof(y));
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* read the journal back in after a crash, and pick up where it
+   left off: every block it mentions is still changed since the
+   last checkpoint, and a later rewrite of it has to know what it
+   held as of then. */
+static int
+s_readjournal(struct db *db, struct replay *r)
 {
-	uint64_t id;
-	struct tslab *slab;
 	struct tblock *block;
+	struct stat st;
+	uint8_t header[JOURNAL_HEADER], *rec;
+	size_t off, len, n, i;
+	int fd, type;
 
-	CHECK(db != NULL, "s_newblock() given a NULL db pointer to work with");
+	fd = openat(db->rootfd, PATH_TO_JOURNAL, O_RDWR|O_APPEND);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	db->journal = fd;
 
-	id = db->next_tblock;
-	slab = s_findslab(db, tslab_number(id));
-	if (!slab)
-		slab = s_newslab(db, tslab_number(id));
-	if (!slab)
-		return NULL;
+	for (off = 0; off < (size_t)st.st_size; off += len) {
+		if (pread(fd, header, JOURNAL_HEADER, off) != JOURNAL_HEADER
+		 || memcmp(header, "JRNLv1", 6) != 0)
+			break;
 
-	block = tslab_tblock(slab, id, ts);
-	if (!block)
-		return NULL;
+		type = header[6];
+		n    = read32(header, 20);
+		len  = JOURNAL_HEADER + n * JOURNAL_CELL + MAC_DIGEST;
+		if (type < JOURNAL_NEW || type > JOURNAL_IMAGE || off + len > (size_t)st.st_size)
+			break;
 
-	db->next_tblock++;
-	CHECK(db->next_tblock >= 0x800, "s_newblock() apparently rolled over to a tblock of < 0x800 (we never thought we'd hit this boundary)");
-	return block;
+		rec = xmalloc(len);
+		if (pread(fd, rec, len, off) != (ssize_t)len
+		 || mac_check(db->key, db->mac, rec, len) != 0) {
+			free(rec);
+			break;
+		}
+
+		block = db_findblock(db, read64(rec, 8));
+		if (!block || !block->valid) {
+			free(rec);
+			continue; /* (expired since) */
+		}
+
+		if (!block->journaled) {
+			db->journaled = realloc(db->journaled, (db->njournaled + 1) * sizeof(*db->journaled));
+			insist(db->journaled != NULL, "s_readjournal() unable to allocate memory for the list of journaled tblocks");
+			db->journaled[db->njournaled++] = block->number;
+
+			/* whatever changed it may not have lived to seal it */
+			tblock_rehash(block);
+		}
+
+		/* the first word on a block is the one that counts */
+		if (type == JOURNAL_NEW) {
+			block->journaled = JOURNAL_KEPT;
+			block->kept      = 0;
+
+		} else if (type == JOURNAL_KEPT && !block->journaled) {
+			block->journaled = JOURNAL_KEPT;
+			block->kept      = read32(rec, 16);
+
+		} else if (type == JOURNAL_IMAGE && block->journaled != JOURNAL_IMAGE) {
+			block->journaled = JOURNAL_IMAGE;
+			block->kept      = n;
+
+			r->images = realloc(r->images, (r->nimages + 1) * sizeof(*r->images));
+			insist(r->images != NULL, "s_readjournal() unable to allocate memory for journaled tblock images");
+			r->images[r->nimages].number = block->number;
+			r->images[r->nimages].cells  = xcalloc(n, sizeof(struct cell));
+			r->images[r->nimages].n      = n;
+			for (i = 0; i < n; i++) {
+				r->images[r->nimages].cells[i].ts    = read64 (rec, JOURNAL_HEADER + i * JOURNAL_CELL);
+				r->images[r->nimages].cells[i].value = read64f(rec, JOURNAL_HEADER + i * JOURNAL_CELL + 8);
+			}
+			r->nimages++;
+		}
+		free(rec);
+	}
+	if (r->nimages)
+		qsort(r->images, r->nimages, sizeof(*r->images), s_imagecmp);
+
+	if (off < (size_t)st.st_size) {
+		errorf("discarding %lu octets of block journal past the last intact record (at offset %lu)",
+			st.st_size - off, off);
+		if (ftruncate(fd, off) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* work out which measurements made it into the tblocks of a
+   series since the last checkpoint: everything in its journaled
+   blocks, less what they held at that checkpoint. */
+static struct delta *
+s_delta(struct replay *r, struct idx *idx)
+{
+	struct delta *d;
+	struct tblock *block;
+	struct tcursor c;
+	struct image key, *img;
+	struct cell *gone;
+	size_t n, ngone, i, j, k, seen;
+	uint64_t id;
+
+	d = xcalloc(1, sizeof(*d));
+	if (btree_isempty(idx->btree))
+		return d;
+
+	n = ngone = 0;
+	gone = NULL;
+	seen = 0;
+	block = btree_find(idx->btree, &id, btree_first(idx->btree)) == 0 ? db_findblock(r->db, id) : NULL;
+	for (; block && seen++ <= r->db->slabtablen * TBLOCKS_PER_TSLAB; block = s_chainnext(r->db, idx, block)) {
+		if (!block->journaled)
+			continue;
+
+		tcursor_init(&c, block);
+		for (i = 0; tcursor_next(&c) == 0; i++) {
+			if (block->journaled == JOURNAL_KEPT && i < (size_t)block->kept)
+				continue; /* (there all along) */
+			d->cells = realloc(d->cells, (n + 1) * sizeof(struct cell));
+			insist(d->cells != NULL, "s_delta() unable to allocate memory for replay bookkeeping");
+			d->cells[n].ts    = c.ts;
+			d->cells[n].value = c.value;
+			d->cells[n].seq   = 0;
+			n++;
+		}
+
+		key.number = block->number;
+		img = block->journaled == JOURNAL_IMAGE && r->nimages
+		    ? bsearch(&key, r->images, r->nimages, sizeof(*r->images), s_imagecmp)
+		    : NULL;
+		if (img) {
+			gone = realloc(gone, (ngone + img->n) * sizeof(struct cell));
+			insist(gone != NULL, "s_delta() unable to allocate memory for replay bookkeeping");
+			memcpy(gone + ngone, img->cells, img->n * sizeof(struct cell));
+			ngone += img->n;
+		}
+	}
+
+	/* whatever a rewrite only moved around (even into another
+	   block, by way of a spill) was there all along, too */
+	qsort(d->cells, n, sizeof(struct cell), s_samecmp);
+	qsort(gone, ngone, sizeof(struct cell), s_samecmp);
+	for (i = j = k = 0; i < n; i++) {
+		while (j < ngone && s_samecmp(&gone[j], &d->cells[i]) < 0)
+			j++;
+		if (j < ngone && s_samecmp(&gone[j], &d->cells[i]) == 0)
+			j++;
+		else
+			d->cells[k++] = d->cells[i];
+	}
+	d->n = k;
+	free(gone);
+	return d;
+}
+
+/* claim a measurement that made it into a tblock, if it did */
+static int
+s_claim(struct delta *d, bolo_msec_t when, bolo_value_t what)
+{
+	struct cell want;
+	size_t lo, hi, mid;
+
+	want.ts    = when;
+	want.value = what;
+	for (lo = 0, hi = d->n; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (s_samecmp(&d->cells[mid], &want) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < d->n && s_samecmp(&d->cells[lo], &want) == 0; lo++)
+		if (!d->cells[lo].seq) {
+			d->cells[lo].seq = 1;
+			return 1;
+		}
+	return 0;
 }
 
-static struct tblock *
-s_findblock(struct db *db, uint64_t id, bolo_msec_t ts)
-{
-	struct tslab *slab;
+/* a measurement out of the write-ahead log; some of what the
+   log holds may well have made it into a tblock before the
+   crash, so only insert the ones that didn't. */
+static int
+s_replayed(const char *name, bolo_msec_t when, bolo_value_t what, void *_r)
+{
+	struct replay *r;
+	struct delta *d;
+	struct idx *idx;
+	char *copy;
+	int rc;
+
+	/* (work out a series' delta before replay adds to it) */
+	r = (struct replay *)_r;
+	if (hash_get(r->deltas, &d, name) != 0) {
+		d = hash_get(r->db->main, &idx, name) == 0
+		  ? s_delta(r, idx)
+		  : xcalloc(1, sizeof(*d)); /* (new since the checkpoint) */
+		if (hash_set(r->deltas, name, d) != 0)
+			return -1;
+	}
+	if (s_claim(d, when, what))
+		return 0;
+
+	copy = strdup(name); /* db_insert() splits it up */
+	rc = db_insert(r->db, copy, when, what);
+	free(copy);
+	return rc;
+}
+
+/* replay whatever the write-ahead log committed after the
+   last db_sync(), and then sync, so the log can be emptied
+   and every block the journal names is resealed. */
+static int
+s_replay(struct db *db)
+{
+	struct replay r;
+	struct delta *d;
+	struct wal w;
+	struct stat st;
+	char *name;
+	size_t i;
+	int rc, esave;
+
+	if (!db->key) {
+		if (fstatat(db->rootfd, PATH_TO_WAL, &st, 0) == 0 && st.st_size > 0)
+			errorf("not replaying %lu octets of write-ahead log without a database key; "
+			       "the next read-write mount will", (unsigned long)st.st_size);
+		return 0;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.db = db;
+	if (s_readjournal(db, &r) != 0)
+		return -1;
+
+	rc = 0;
+	if (fstatat(db->rootfd, PATH_TO_WAL, &st, 0) != 0) {
+		if (errno != ENOENT)
+			rc = -1;
+	} else if (st.st_size > 0) {
+		rc = wal_open(&w, db->rootfd, PATH_TO_WAL, db->key, db->mac);
+		if (rc == 0) {
+			r.deltas = hash_new(0);
+			rc = wal_replay(&w, s_replayed, &r);
+			if (rc == 0)
+				rc = db_sync(db);
+			if (rc == 0)
+				rc = wal_reset(&w);
+
+			esave = errno;
+			wal_close(&w);
+			hash_each(r.deltas, &name, &d) {
+				free(d->cells);
+				free(d);
+			}
+			hash_free(r.deltas);
+			errno = esave;
+		}
+	}
+
+	/* an empty log still leaves journaled blocks to reseal */
+	if (rc == 0 && db->njournaled)
+		rc = db_sync(db);
+
+	for (i = 0; i < r.nimages; i++)
+		free(r.images[i].cells);
+	free(r.images);
+	return rc;
+}
+
+static struct db *
+s_mount(const char *path, struct dbkey *key, int upgrade)
+{
+	struct db *db;
+	struct slabq q;
+	size_t i;
+	int fd, cwd;
+	int esave;
+
+	db = NULL;
+	fd = cwd = -1;
+
+	cwd = s_cwd();
+	if (cwd < 0)
+		goto fail;
+
+	infof("mounting bolo database at %s", path);
+	fd = openat(cwd, path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			errno = BOLO_ENODBROOT;
+		goto fail;
+	}
+
+	db = xalloc(1, sizeof(struct db));
+	db->rootfd = fd;
+	db->key = key;
+	db->next_slab = INITIAL_SLAB;
+
+	if (s_readsettings(db) != 0)
+		goto fail;
+
+	if (s_readquarantine(db) != 0)
+		goto fail;
+
+	infof("checking for main.db index file at %s/%s", path, PATH_TO_MAINDB);
+	fd = openat(db->rootfd, PATH_TO_MAINDB, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			errno = BOLO_ENOMAINDB;
+		goto fail;
+	}
+
+	/* write down the format of an older database, so that
+	   it stays put even if the default changes again */
+	if (db->key && faccessat(db->rootfd, PATH_TO_SETTINGS, F_OK, 0) != 0) {
+		infof("recording block format BLOKv%d in %s/%s", db->block_format, path, PATH_TO_SETTINGS);
+		if (s_writesettings(db) != 0)
+			goto fail;
+	}
+
+	/* first, we have to scan the time series indices */
+	infof("scanning time series time index files at %s/idx", path);
+	if (btallocator(&db->bta, db->rootfd) != 0)
+		goto fail;
+
+	empty(&db->idx);
+	empty(&db->multidx);
+	db->tags = hash_new(0);
+	db->metrics = hash_new(0);
+
+	infof("mounting main.db index file at %s/%s", path, PATH_TO_MAINDB);
+	if (s_readmain(db, fd) != 0)
+		goto fail;
+	close(fd);
+	fd = -1;
+
+	infof("scanning time series slab storage files at %s/slabs", path);
+	empty(&db->slab);
+	s_ensure_dirat(db->rootfd, "slabs", 0777);
+	memset(&q, 0, sizeof(q));
+	q.upgrade = upgrade;
+	if (s_scandir(db, "slabs", ".slab", s_queue_slab, &q) != 0) {
+		for (i = 0; i < q.n; i++) {
+			close(q.ent[i].fd);
+			free(q.ent[i].slab);
+		}
+		free(q.ent);
+		goto fail;
+	}
+
+	infof("mapping %lu time series slab storage files", q.n);
+	if (s_mount_slabs(db, &q) != 0)
+		goto fail;
+
+	infof("replaying write-ahead log at %s/%s", path, PATH_TO_WAL);
+	if (s_replay(db) != 0)
+		goto fail;
+
+	infof("database mounted successfully");
+	close(cwd);
+	return db;
+
+fail:
+	esave = errno;
+	if (cwd >= 0) close(cwd);
+	if (fd  >= 0) close(fd);
+	if (db) {
+		if (db->rootfd <= 0) close(db->rootfd);
+		hash_free(db->main);
+		free(db->quarantine);
+		free(db);
+	}
+	errno = esave;
+	return NULL;
+}
+
+struct db *
+db_mount(const char *path, struct dbkey *key)
+{
+	return s_mount(path, key, 0);
+}
+
+/* mount a database for an explicit upgrade of older on-disk
+   formats that db_mount() refuses, fixing them as it goes:
+   right now, that is tslab headers sealed by the sha512_feed()
+   that clobbered them (see tslab.c) */
+struct db *
+db_upgrade(const char *path, struct dbkey *key)
+{
+	return s_mount(path, key, 1);
+}
+
+struct db *
+db_init(const char *path, struct dbkey *key, struct dbopts *opts)
+{
+	struct db *db;
+	uint8_t header[MAINDB_HEADER];
+	int cwd, fd;
+	int esave;
+
+	CHECK(path != NULL, "db_init() given a NULL path to read from");
+	CHECK(!opts || (opts->block_format >= 0 && opts->block_format <= 4),
+	      "db_init() given an unrecognized block format version");
+	CHECK(!opts || !opts->mac || mac_parse(opts->mac) >= 0,
+	      "db_init() given an unrecognized MAC algorithm");
+
+	db = NULL;
+	fd = cwd = -1;
+
+	cwd = s_cwd();
+	if (cwd < 0)
+		goto fail;
+
+	/* make sure we have a root directory */
+	s_ensure_dirat(cwd, path, 0777);
+	fd = openat(cwd, path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		goto fail;
+
+	/* make sure the root dir is empty */
+	if (!s_dirempty(fd))
+		goto fail;
+
+	db = xalloc(1, sizeof(*db));
+
+	if (!key)
+		key = rand_key(DEFAULT_KEY_SIZE);
+	if (!key)
+		goto fail;
+	db->key = key;
+
+	db->rootfd = fd;
+	fd = -1;
+
+	db->block_format = TBLOCK_DEFAULT_VERSION;
+	if (opts && opts->block_format)
+		db->block_format = opts->block_format;
+	db->mac = MAC_DEFAULT;
+	if (opts && opts->mac)
+		db->mac = mac_parse(opts->mac);
+	if (opts)
+		db->partition = opts->partition;
+	if (s_writesettings(db) != 0)
+		goto fail;
+
+	db->main    = hash_new(0);
+	db->tags    = hash_new(0);
+	db->metrics = hash_new(0);
+
+	/* create the (empty) main.db index */
+	fd = openat(db->rootfd, PATH_TO_MAINDB, O_WRONLY|O_CREAT, 0666);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			errno = BOLO_ENOMAINDB;
+		goto fail;
+	}
+	s_mainheader(header);
+	if (write(fd, header, MAINDB_HEADER) != MAINDB_HEADER)
+		goto fail;
+	close(fd);
+	fd = -1;
+	db->mainlen = MAINDB_HEADER;
+
+	empty(&db->idx);
+	empty(&db->multidx);
+	empty(&db->slab);
+	db->next_slab = INITIAL_SLAB;
+
+	if (btallocator(&db->bta, db->rootfd) != 0)
+		goto fail;
+
+	return db;
+
+fail:
+	esave = errno;
+	if (cwd >= 0) close(cwd);
+	if (fd  >= 0) close(fd);
+	if (db) {
+		if (db->rootfd >= 0) close(db->rootfd);
+		hash_free(db->main);
+		hash_free(db->tags);
+		hash_free(db->metrics);
+		free(db);
+	}
+	errno = esave;
+	return NULL;
+}
+
+/* formulate a path, relative to db root, for one rollup tier of a series */
+static void
+s_rollpath(char *path, size_t len, uint64_t number, int tier)
+{
+	snprintf(path, len, PATH_TO_ROLLUPS "/%016lx.%s", number, rollup_name(tier));
+}
+
+/* write out whatever changed in the rollup tiers of a series */
+static int
+s_rollsync(struct db *db, struct idx *idx)
+{
+	char path[64];
+	int i, fd, rc, esave;
+
+	if (!idx->rollups)
+		return 0;
+
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		if (!rollup_isdirty(&idx->rollups[i]))
+			continue;
+
+		s_ensure_dirat(db->rootfd, PATH_TO_ROLLUPS, 0777);
+		s_rollpath(path, sizeof(path), idx->number, i);
+		fd = openat(db->rootfd, path, O_RDWR|O_CREAT, 0666);
+		if (fd < 0)
+			return -1;
+
+		rc = rollup_write(&idx->rollups[i], fd);
+		esave = errno;
+		close(fd);
+		errno = esave;
+		if (rc != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* a series' index got a new number (see db_compact());
+   bring its rollup files along with it. */
+static int
+s_rollmove(struct db *db, uint64_t from, uint64_t to)
+{
+	char old[64], new[64];
+	int i;
+
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		s_rollpath(old, sizeof(old), from, i);
+		s_rollpath(new, sizeof(new), to,   i);
+		if (renameat(db->rootfd, old, db->rootfd, new) != 0 && errno != ENOENT)
+			return -1;
+	}
+	return 0;
+}
+
+/* set the rollups of a series aside until db_rebuild() gets to
+   them; queries read the raw measurements in the meantime. */
+static void
+s_rollstale(struct db *db, struct idx *idx)
+{
+	int i;
+
+	if (idx->rollups) {
+		for (i = 0; i < ROLLUP_TIERS; i++)
+			rollup_free(&idx->rollups[i]);
+		free(idx->rollups);
+		idx->rollups = NULL;
+	}
+	if (!idx->rollstale) {
+		idx->rollstale = 1;
+		db->nstale++;
+	}
+}
+
+/* ... and remove their files as well, for when they still look
+   current, but count measurements that are no longer there */
+static void
+s_rollpurge(struct db *db, struct idx *idx)
+{
+	char path[64];
+	int i;
+
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		s_rollpath(path, sizeof(path), idx->number, i);
+		(void)unlinkat(db->rootfd, path, 0);
+	}
+	s_rollstale(db, idx);
+}
+
+/* the tslabs and series that db_sync() has to write out;
+   each one is independent of the rest, so a pool of threads
+   can split them up between themselves. */
+struct syncq {
+	struct db     *db;
+	struct tslab **slab;
+	size_t         nslab;
+	struct idx   **idx;
+	size_t         nidx;
+
+	size_t          next;   /* next item for a worker to write out */
+	int             err;    /* errno of the first failure, or 0 */
+	pthread_mutex_t lock;
+};
+
+static void *
+s_sync_items(void *_q)
+{
+	struct syncq *q;
+	struct idx *idx;
+	size_t i;
+	int rc;
+
+	q = (struct syncq *)_q;
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		i = q->next++;
+		pthread_mutex_unlock(&q->lock);
+
+		if (i >= q->nslab + q->nidx)
+			return NULL;
+
+		if (i < q->nslab) {
+			rc = tslab_sync(q->slab[i]);
+		} else {
+			idx = q->idx[i - q->nslab];
+			rc = btree_write(idx->btree);
+			if (rc == 0)
+				rc = s_rollsync(q->db, idx);
+		}
+
+		if (rc != 0) {
+			pthread_mutex_lock(&q->lock);
+			if (!q->err)
+				q->err = errno;
+			pthread_mutex_unlock(&q->lock);
+		}
+	}
+}
+
+/* has anything in this series changed since the last db_sync()? */
+static int
+s_idxdirty(struct idx *idx)
+{
+	int i;
+
+	if (btree_isdirty(idx->btree))
+		return 1;
+
+	if (idx->rollups)
+		for (i = 0; i < ROLLUP_TIERS; i++)
+			if (rollup_isdirty(&idx->rollups[i]))
+				return 1;
+	return 0;
+}
+
+static int
+s_syncall(struct db *db)
+{
+	struct syncq q;
+	struct tslab *slab;
+	struct idx *idx;
+	pthread_t tids[SYNC_THREADS];
+	size_t i, n;
+
+	/* only what changed since the last sync needs writing out */
+	memset(&q, 0, sizeof(q));
+	q.db = db;
+	for_each(slab, &db->slab, l) {
+		if (!tslab_isdirty(slab))
+			continue;
+		q.slab = realloc(q.slab, (q.nslab + 1) * sizeof(*q.slab));
+		insist(q.slab != NULL, "db_sync() unable to allocate memory for the list of tslabs to sync");
+		q.slab[q.nslab++] = slab;
+	}
+	for_each(idx, &db->idx, l) {
+		if (!s_idxdirty(idx))
+			continue;
+		q.idx = realloc(q.idx, (q.nidx + 1) * sizeof(*q.idx));
+		insist(q.idx != NULL, "db_sync() unable to allocate memory for the list of series to sync");
+		q.idx[q.nidx++] = idx;
+	}
+
+	/* the calling thread is worker #0; a single
+	   item isn't worth starting any others for */
+	n = q.nslab + q.nidx;
+	if (n > SYNC_THREADS)
+		n = SYNC_THREADS;
+
+	pthread_mutex_init(&q.lock, NULL);
+	for (i = 1; i < n; i++)
+		if (pthread_create(&tids[i], NULL, s_sync_items, &q) != 0)
+			break;
+	s_sync_items(&q);
+	while (--i > 0)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&q.lock);
+
+	free(q.slab);
+	free(q.idx);
+
+	if (q.err) {
+		errno = q.err;
+		return -1;
+	}
+	return 0;
+}
+
+int
+db_sync(struct db *db)
+{
+	if (s_drainall(db) != 0)
+		return -1;
+
+	if (s_syncall(db) != 0)
+		return -1;
+
+	/* main.db only changes when series are added
+	   (or get renumbered, by compaction) */
+	if (s_syncmain(db) != 0)
+		return -1;
+
+	/* everything the log was holding onto is on-disk now */
+	if (db->wal && wal_reset(db->wal) != 0)
+		return -1;
+
+	/* (and only then can we forget what the blocks held
+	    before any of it went into them) */
+	if (s_forget(db) != 0)
+		return -1;
+
+	return 0;
+}
+
+int
+db_unmount(struct db *db)
+{
+	struct tslab   *slab, *tmp_slab;
+	struct idx     *idx,  *tmp_idx;
+	struct multidx *set,  *tmp_set;
+	size_t i;
+	int ok;
+
+	CHECK(db != NULL, "db_unmount() given a NULL db pointer to unmount");
+
+	/* checkpoint on the way out, so that everything the log holds
+	   is in the slabs (and the log is empty) before we let go of it;
+	   if that fails, the log is still committed, for replay. */
+	ok = 0;
+	if (db->key ? db_sync(db) != 0 : s_drainall(db) != 0)
+		ok = -1;
+
+	if (db->wal) {
+		if (wal_commit(db->wal) != 0)
+			ok = -1;
+		if (wal_close(db->wal) != 0)
+			ok = -1;
+		free(db->wal);
+	}
+	if (db->journal && close(db->journal) != 0)
+		ok = -1;
+	free(db->journaled);
+
+	for_eachx(slab, tmp_slab, &db->slab, l) {
+		if (tslab_unmap(slab) != 0)
+			ok = -1;
+		free(slab);
+	}
+
+	for_eachx(idx, tmp_idx, &db->idx, l) {
+		if (btree_close(idx->btree) != 0)
+			ok = -1;
+		if (idx->rollups)
+			for (i = 0; i < ROLLUP_TIERS; i++)
+				rollup_free(&idx->rollups[i]);
+		free(idx->rollups);
+		free(idx->rob);
+		free(idx);
+	}
+
+	for_eachx(set, tmp_set, &db->multidx, l) {
+		free(set);
+	}
+
+	for (i = 0; i < db->nretention; i++)
+		free(db->retention[i].pattern);
+	free(db->retention);
+
+	hash_free(db->main);
+	hash_free(db->tags);
+	hash_free(db->metrics);
+	for (i = 0; i < db->nfresh; i++)
+		free(db->fresh[i]);
+	free(db->fresh);
+	free(db->slabtab);
+	free(db->quarantine);
+	close(db->rootfd);
+	free(db);
+	return ok;
+}
+
+int
+db_isquarantined(struct db *db, uint64_t blkid)
+{
+	size_t i;
+
+	CHECK(db != NULL, "db_isquarantined() given a NULL db pointer to check");
+
+	for (i = 0; i < db->nquarantined; i++)
+		if (db->quarantine[i] == blkid)
+			return 1;
+	return 0;
+}
+
+/* the series a tblock belongs to, if any: look for it along each
+   series' chain, from wherever its index would put the block */
+static struct idx *
+s_owner(struct db *db, uint64_t blkid)
+{
+	struct tblock *block, *b;
+	struct idx *idx;
+	uint64_t id;
+	int n;
+
+	block = db_findblock(db, blkid);
+	if (!block)
+		return NULL;
+
+	for_each(idx, &db->idx, l) {
+		/* (start from just before it, in case its neighbors
+		    share its base timestamp) */
+		if (btree_find(idx->btree, &id, block->base ? block->base - 1 : 0) != 0)
+			continue;
+
+		b = db_findblock(db, id);
+		for (n = 0; b && b->base <= block->base && n < TBLOCKS_PER_TSLAB; n++) {
+			if (b->number == blkid)
+				return idx;
+			b = s_chainnext(db, idx, b);
+		}
+	}
+	return NULL;
+}
+
+/* set a (presumably corrupt) tblock aside, so that queries
+   stop reading it.  this is recorded on-disk right away,
+   since the whole point is to survive a restart. */
+int
+db_quarantine(struct db *db, uint64_t blkid)
+{
+	struct idx *idx;
+	char buf[32];
+	int fd, n;
+
+	CHECK(db != NULL, "db_quarantine() given a NULL db pointer to work with");
+
+	if (db_isquarantined(db, blkid))
+		return 0;
+
+	fd = openat(db->rootfd, PATH_TO_QUARANTINE, O_WRONLY|O_APPEND|O_CREAT, 0666);
+	if (fd < 0)
+		return -1;
+
+	n = snprintf(buf, sizeof(buf), "%lx\n", blkid);
+	if (write(fd, buf, n) != n || fsync(fd) != 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	db->quarantine = realloc(db->quarantine, (db->nquarantined + 1) * sizeof(*db->quarantine));
+	insist(db->quarantine != NULL, "db_quarantine() unable to allocate memory for the quarantine list");
+	db->quarantine[db->nquarantined++] = blkid;
+
+	/* its measurements are no longer read, so they can't stay
+	   in its series' rollups, either */
+	if ((idx = s_owner(db, blkid)) != NULL)
+		s_rollpurge(db, idx);
+	return 0;
+}
+
+/*
+   db_warmup()
+
+   Mounting only reads slab headers and btree root nodes;
+   everything else is mapped the first time it's needed.
+   db_warmup() does up to `n` more units of that work (a
+   whole slab, or a whole time series index) ahead of time,
+   so that the first queries after a restart don't have to.
+
+   Returns 1 if there is more to do, 0 if everything is
+   mapped, and -1 on failure.
+ */
+int
+db_warmup(struct db *db, int n)
+{
+	struct tslab *slab;
+	struct idx *idx;
+
+	CHECK(db != NULL, "db_warmup() given a NULL db pointer to warm up");
+
+	for_each(slab, &db->slab, l) {
+		if (slab->loaded)
+			continue;
+		if (n-- <= 0)
+			return 1;
+		if (tslab_load(slab) != 0)
+			return -1;
+	}
+
+	/* indices created since mount are already fully mapped,
+	   so we only need to make one pass through the list */
+	if (!db->warm)
+		db->warm = db->idx.next;
+	while (db->warm != &db->idx) {
+		if (n-- <= 0)
+			return 1;
+		idx = item(db->warm, struct idx, l);
+		if (btree_load(idx->btree) != 0)
+			return -1;
+		db->warm = db->warm->next;
+	}
+
+	return 0;
+}
+
+static int
+s_newidx(struct db *db, struct idx **idx, uint64_t *id)
+{
+	int i;
+
+	CHECK(db  != NULL, "s_newidx() given a NULL db pointer to work with");
+	CHECK(idx != NULL, "s_newidx() given a NULL destination pointer for the new time series index");
+	CHECK(id  != NULL, "s_newidx() given a NULL detination pointer for the new time series id number");
+
+	*idx = xmalloc(sizeof(**idx));
+	if (!((*idx)->btree = btmake(&db->bta)))
+		goto fail;
+	(*idx)->marked = 1; /* brand new; nothing written yet */
+
+	(*idx)->rollups = xcalloc(ROLLUP_TIERS, sizeof(struct tier));
+	for (i = 0; i < ROLLUP_TIERS; i++)
+		rollup_init(&(*idx)->rollups[i], i);
+
+	*id = (*idx)->number = (*idx)->btree->id;
+
+	push(&db->idx, &(*idx)->l);
+	return 0;
+
+fail:
+	free((*idx)->rollups);
+	free(*idx);
+	return -1;
+}
+
+static struct tslab *
+s_findslab(struct db *db, uint64_t id)
+{
+	CHECK(db != NULL, "s_findslab() given a NULL db pointer to work with");
+
+	if (s_slabtab(id) < db->slabtablen && db->slabtab[s_slabtab(id)])
+		return db->slabtab[s_slabtab(id)];
+
+	errno = BOLO_ENOSLAB;
+	return NULL;
+}
+
+/* formulate a path, relative to db root, for a slab */
+static void
+s_slabpath(char *path, size_t len, uint64_t id)
+{
+	snprintf(path, len, "slabs/%04lx.%04lx/%04lx.%04lx.%04lx.%04lx.slab",
+		((id & 0xffff000000000000ul) >> 48),
+		((id & 0x0000ffff00000000ul) >> 32),
+		/* --- */
+		((id & 0xffff000000000000ul) >> 48),
+		((id & 0x0000ffff00000000ul) >> 32),
+		((id & 0x00000000ffff0000ul) >> 16),
+		((id & 0x000000000000fffful)));
+}
+
+/* is `slab` the one for tblocks of series kept for `keep` ms,
+   that start in the time partition beginning at `from`? */
+static int
+s_inwindow(struct tslab *slab, bolo_msec_t from, bolo_msec_t keep)
+{
+	return slab && slab->from == from && slab->until && slab->keep == keep;
+}
+
+/* can `block` take a measurement at `when`, without straying
+   out of the time partition that it (and its slab) belongs to? */
+static int
+s_inpartition(struct db *db, struct tblock *block, bolo_msec_t when)
+{
+	return !db->partition || when / db->partition == block->base / db->partition;
+}
+
+static struct tslab *
+s_newslab(struct db *db, uint64_t id, uint32_t block_size, bolo_msec_t from, bolo_msec_t keep)
+{
+	int fd, esave;
+	char path[64];
+	struct tslab *slab;
+
+	CHECK(db != NULL, "s_newslab() given a NULL db pointer to work with");
+
+	fd = -1;
+	slab = xmalloc(sizeof(*slab));
+	slab->key = db->key;
+	slab->mac = db->mac;
+	slab->block_format = db->block_format;
+	if (db->partition) {
+		slab->from  = from;
+		slab->until = from + db->partition;
+		slab->keep  = keep;
+	}
+
+	s_slabpath(path, sizeof(path), id);
+
+	/* create the parent directory, if necessary */
+	if (mktree(db->rootfd, path, 0777) != 0)
+		goto fail;
+
+	/* create the slab file itself */
+	fd = openat(db->rootfd, path, O_RDWR|O_CREAT, 0666);
+	if (fd < 0)
+		goto fail;
+
+	/* initialize the slab file with tslab headers */
+	if (tslab_init(slab, fd, tslab_number(id), block_size) != 0)
+		goto fail;
+
+	/* keep track of the slab */
+	push(&db->slab, &slab->l);
+	s_tabslab(db, slab);
+
+	return slab;
+
+fail:
+	esave = errno;
+	if (fd >= 0) close(fd);
+	free(slab);
+	errno = esave;
+	return NULL;
+}
+
+/* can new tblocks of `class`, starting at `ts` (in partition
+   window `from`), for series `idx`, be allocated from `slab`? */
+static int
+s_fits(struct db *db, struct tslab *slab, struct idx *idx, bolo_msec_t from, int class)
+{
+	return !slab->retired && slab->block_size == tblock_class_size(class)
+	    && (!db->partition || s_inwindow(slab, from, idx->keep));
+}
+
+/* find the free tblock that can be reused for a new tblock of
+   `class`, closest (by number) to `near`, which is usually the
+   block that the new one will follow in its series.  nearby
+   blocks tend to be in the same slab, and close together in it,
+   which keeps a series' blocks clustered on-disk. */
+static struct tblock *
+s_reuse(struct db *db, struct idx *idx, bolo_msec_t ts, int class, uint64_t near)
+{
+	struct tslab *slab, *best;
+	uint64_t id, dist, bestid, bestdist;
+	bolo_msec_t from;
+	struct tblock *block;
+	int i;
+
+	if (!db->nfree)
+		return NULL;
+
+	from = db->partition ? ts - ts % db->partition : 0;
+	best = NULL;
+	bestid = bestdist = 0;
+	for_each(slab, &db->slab, l) {
+		if (!slab->nfree || !s_fits(db, slab, idx, from, class))
+			continue;
+
+		for (i = 0; i < TBLOCKS_PER_TSLAB; i++) {
+			if (!slab->freemap[i / 8]) {
+				i += 7; /* skip the whole (empty) octet */
+				continue;
+			}
+			if (!(slab->freemap[i / 8] & (1 << (i % 8))))
+				continue;
+
+			id   = slab->number | i;
+			dist = id > near ? id - near : near - id;
+			if (!best || dist < bestdist) {
+				best     = slab;
+				bestid   = id;
+				bestdist = dist;
+			}
+		}
+	}
+	if (!best)
+		return NULL;
+
+	block = tslab_reuse(best, bestid, ts);
+	if (block) {
+		infof("reusing free tblock [%#lx] for idx %lu @%lu", bestid, idx->number, ts);
+		db->nfree--;
+	}
+	return block;
+}
+
+/*
+   s_newblock()
+
+   Find room in the database for a new tblock of the given size
+   class, preferably by reusing a free tblock close to `near`
+   (see s_reuse()), and otherwise by extending the database to
+   include the next available tblock.  If a new tslab needs to
+   be allocated to accommodate the new block, that happens
+   transparently to the caller.
+ */
+static struct tblock *
+s_newblock(struct db *db, struct idx *idx, bolo_msec_t ts, int class, uint64_t near)
+{
+	int i;
+	bolo_msec_t from;
+	struct tslab *slab;
+	struct tblock *block;
+
+	CHECK(db != NULL, "s_newblock() given a NULL db pointer to work with");
+	CHECK(idx != NULL, "s_newblock() given a NULL time series index to allocate for");
+	CHECK(class >= 0 && class < TBLOCK_CLASSES, "s_newblock() given an invalid tblock size class");
+
+	block = s_reuse(db, idx, ts, class, near);
+	if (block)
+		return s_journal(db, block, JOURNAL_NEW) == 0 ? block : NULL;
+
+	slab = db->tail[class];
+	from = db->partition ? ts - ts % db->partition : 0;
+	if (db->partition && !s_inwindow(slab, from, idx->keep)) {
+		/* late data for an older window (or a series that is kept
+		   for a different length of time) might still have room
+		   in a slab we already have */
+		for_each(slab, &db->slab, l)
+			if (s_fits(db, slab, idx, from, class) && !tslab_isfull(slab))
+				break;
+		if (&slab->l == &db->slab)
+			slab = NULL;
+	}
+
+	if (!slab || slab->retired || tslab_isfull(slab)) {
+		slab = s_newslab(db, db->next_slab, tblock_class_size(class), from, idx->keep);
+		if (!slab)
+			return NULL;
+
+		db->next_slab += TBLOCKS_PER_TSLAB;
+		CHECK(db->next_slab > slab->number, "s_newblock() apparently rolled over the tslab numbering (we never thought we'd hit this boundary)");
+	}
+	db->tail[class] = slab;
+
+	for (i = 0; i < TBLOCKS_PER_TSLAB; i++)
+		if (!slab->blocks[i].valid)
+			break;
+
+	block = tslab_tblock(slab, slab->number | i, ts);
+	return block && s_journal(db, block, JOURNAL_NEW) == 0 ? block : NULL;
+}
+
+/*
+   s_nextclass()
+
+   Pick the size class for the tblock that will follow `prev`
+   in its series, now that `prev` can no longer take `when`.
+   Blocks that filled up are followed by a block big enough
+   to last about TBLOCK_TARGET_SPAN at the same rate; blocks
+   that ran out of time range instead (a sparse series) are
+   followed by the smallest class of block.
+ */
+static int
+s_nextclass(struct tblock *prev, bolo_msec_t when)
+{
+	double want;
+	int c;
+
+	if (!tblock_isfull(prev))
+		return 0;
+
+	want = when > prev->base
+	     ? (double)tblock_size(prev) * TBLOCK_TARGET_SPAN / (when - prev->base)
+	     : (double)TBLOCK_SIZE;
+
+	for (c = 0; c < TBLOCK_CLASSES - 1; c++)
+		if (tblock_class_size(c) >= want)
+			break;
+	return c;
+}
+
+static struct tblock *
+s_findblock(struct db *db, uint64_t id, bolo_msec_t ts)
+{
+	struct tslab *slab;
+
+	CHECK(db != NULL, "s_findblock() given a NULL db pointer to work with");
+
+	slab = s_findslab(db, id);
+	if (!slab)
+		return NULL;
+
+	return tslab_tblock(slab, id, ts);
+}
+
+/* append a measurement that is no older than anything already
+   written for the series onto the end of its tblock chain. */
+static int
+s_append(struct db *db, struct idx *idx, bolo_msec_t when, bolo_value_t what)
+{
+	struct tblock *block;
+	uint64_t block_id;
+
+	/* find the tblock ID, if we have one */
+	if (btree_find(idx->btree, &block_id, when) != 0) {
+		infof("allocating a new tblock for idx %lu @%lu", idx->number, when);
+		block = s_newblock(db, idx, when, 0, 0);
+		if (!block)
+			return -1;
+
+		infof("inserting block [%08lu] into btree index...", block->number);
+		if (btree_insert(idx->btree, when, block->number) != 0)
+			return -1;
+
+	} else {
+		block = s_findblock(db, block_id, when);
+
+		if (block && (tblock_isfull(block) || !tblock_canhold(block, when)
+		                                   || !s_inpartition(db, block, when))) {
+			struct tblock *new_block;
+
+			new_block = s_newblock(db, idx, when, s_nextclass(block, when), block->number);
+			if (!new_block || s_journal(db, block, JOURNAL_KEPT) != 0)
+				return -1;
+
+			tblock_next(block, new_block);
+			block = new_block;
+
+			if (btree_insert(idx->btree, when, block->number) != 0)
+				return -1;
+
+		} else if (!block && !s_findslab(db, block_id)) {
+			/* the end of the chain expired out from under us
+			   (see db_expire()); start a new one. */
+			block = s_newblock(db, idx, when, 0, block_id);
+			if (!block)
+				return -1;
+
+			if (btree_insert(idx->btree, when, block->number) != 0)
+				return -1;
+
+		} else if (!block) {
+			return -1;
+		}
+	}
+
+	if (s_journal(db, block, JOURNAL_KEPT) != 0
+	 || tblock_insert(block, when, what) != 0)
+		return -1;
+
+	idx->mark = when;
+	return 0;
+}
+
+/* work out the newest timestamp that made it into a tblock,
+   for a series that was read in from disk. */
+static void
+s_findmark(struct db *db, struct idx *idx)
+{
+	struct tblock *block;
+	struct tcursor c;
+	uint64_t id;
+
+	idx->marked = 1;
+	idx->mark = 0;
+	if (btree_find(idx->btree, &id, ~(bolo_msec_t)0) != 0)
+		return;
+
+	for (block = db_findblock(db, id); block && block->next; )
+		block = db_findblock(db, block->next);
+	if (!block || block->cells == 0)
+		return;
+
+	if (block->version != 1) {
+		idx->mark = block->base + block->summary.tsmax;
+		return;
+	}
+
+	tcursor_init(&c, block);
+	while (tcursor_next(&c) == 0)
+		if (c.ts > idx->mark)
+			idx->mark = c.ts;
+}
+
+/* the rollups of a series, as of what has made it into its
+   tblocks (db_rollups() drains the reorder buffer first), or
+   NULL if they have to be rebuilt first (see db_rebuild()). */
+static struct tier *
+s_rollups(struct db *db, struct idx *idx)
+{
+	char path[64];
+	int i, fd, ok;
+
+	if (idx->rollups || idx->rollstale)
+		return idx->rollups;
+
+	if (!idx->marked)
+		s_findmark(db, idx);
+
+	idx->rollups = xcalloc(ROLLUP_TIERS, sizeof(struct tier));
+	ok = 1;
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		rollup_init(&idx->rollups[i], i);
+		s_rollpath(path, sizeof(path), idx->number, i);
+		fd = openat(db->rootfd, path, O_RDONLY);
+		if (fd < 0 || rollup_read(&idx->rollups[i], fd) != 0
+		           || idx->rollups[i].newest != idx->mark)
+			ok = 0;
+		if (fd >= 0)
+			close(fd);
+	}
+	if (ok)
+		return idx->rollups;
+
+	/* missing, damaged, or behind the raw data (from a crash
+	   between syncs, or an older version of bolo); that takes
+	   a pass through every measurement, which is no job for
+	   whoever is waiting on a query. */
+	s_rollstale(db, idx);
+	return NULL;
+}
+
+/* rebuild the rollups of a series from its raw measurements */
+static void
+s_rebuild(struct db *db, struct idx *idx)
+{
+	struct series_cursor c;
+	char path[64];
+	int i;
+
+	infof("rebuilding rollups for idx %lu from raw measurements", idx->number);
+	if (!idx->marked)
+		s_findmark(db, idx);
+
+	idx->rollups = xcalloc(ROLLUP_TIERS, sizeof(struct tier));
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		rollup_init(&idx->rollups[i], i);
+		s_rollpath(path, sizeof(path), idx->number, i);
+		(void)unlinkat(db->rootfd, path, 0);
+	}
+
+	if (s_seriesopen(&c, db, idx, 0, ~(bolo_msec_t)0) == 0)
+		while (series_next(&c) == 0)
+			for (i = 0; i < ROLLUP_TIERS; i++)
+				rollup_add(&idx->rollups[i], c.ts, c.value);
+
+	/* (quarantined blocks are left out, but still count
+	    towards the mark; don't rebuild again next time) */
+	for (i = 0; i < ROLLUP_TIERS; i++)
+		idx->rollups[i].newest = idx->mark;
+
+	idx->rollstale = 0;
+	db->nstale--;
+}
+
+/*
+   db_rebuild()
+
+   Rollups that are missing, damaged or out of date are not
+   rebuilt on the query path; queries read the raw measurements
+   instead, until db_rebuild() gets around to rebuilding up to
+   `n` series' worth of them at a time (in the background).
+
+   Returns 1 if there is more to do, 0 if every series' rollups
+   are current, and -1 on failure.
+ */
+int
+db_rebuild(struct db *db, int n)
+{
+	struct idx *idx;
+
+	CHECK(db != NULL, "db_rebuild() given a NULL db pointer to rebuild rollups in");
+
+	for_each(idx, &db->idx, l) {
+		if (!db->nstale)
+			return 0;
+		if (!idx->rollstale)
+			continue;
+		if (n-- <= 0)
+			return 1;
+		s_rebuild(db, idx);
+	}
+	return 0;
+}
+
+/* expiry took every measurement before `cut` away from a series;
+   its rollups go with them.  the buckets that straddle the cut
+   lost some of theirs, and get rolled up again from the rest. */
+static void
+s_rolltrim(struct db *db, struct idx *idx, bolo_msec_t cut)
+{
+	struct series_cursor c;
+	bolo_msec_t until[ROLLUP_TIERS], last, w;
+	int i;
+
+	last = cut;
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		w = idx->rollups[i].width;
+		until[i] = cut % w ? cut - cut % w + w : cut;
+		rollup_trim(&idx->rollups[i], until[i]);
+		if (until[i] > last)
+			last = until[i];
+	}
+
+	if (last > cut && s_seriesopen(&c, db, idx, cut, last - 1) == 0)
+		while (series_next(&c) == 0)
+			for (i = 0; i < ROLLUP_TIERS; i++)
+				if (c.ts < until[i])
+					rollup_add(&idx->rollups[i], c.ts, c.value);
+}
+
+/* roll a measurement that made it into a tblock up into
+   every tier of its series' rollups */
+static void
+s_rollup(struct idx *idx, bolo_msec_t when, bolo_value_t what)
+{
+	int i;
+
+	if (!idx->rollups)
+		return; /* (db_rebuild() will pick it up) */
+	for (i = 0; i < ROLLUP_TIERS; i++)
+		rollup_add(&idx->rollups[i], when, what);
+}
+
+static int
+s_cellcmp(const void *_a, const void *_b)
+{
+	const struct cell *a = _a, *b = _b;
+
+	if (a->ts != b->ts)
+		return a->ts < b->ts ? -1 : 1;
+	return a->seq - b->seq;
+}
+
+/* merge `n` late measurements (in time order) into `block`,
+   by rewriting it from scratch, in time order.  anything that
+   no longer fits spills over into new tblocks, spliced into the
+   chain right after it. */
+static int
+s_rewrite(struct db *db, struct idx *idx, struct tblock *block, bolo_msec_t *ts, bolo_value_t *what, int n)
+{
+	struct tblock *spill;
+	struct tcursor c;
+	struct cell *cells;
+	uint64_t next;
+	int i, k, total;
+
+	if (s_journal(db, block, JOURNAL_IMAGE) != 0)
+		return -1;
+
+	cells = xcalloc(block->cells + n, sizeof(struct cell));
+	total = 0;
+	tcursor_init(&c, block);
+	while (tcursor_next(&c) == 0) {
+		cells[total].ts    = c.ts;
+		cells[total].value = c.value;
+		cells[total].seq   = total;
+		total++;
+	}
+	for (i = 0; i < n; i++) {
+		cells[total].ts    = ts[i];
+		cells[total].value = what[i];
+		cells[total].seq   = total;
+		total++;
+	}
+	qsort(cells, total, sizeof(struct cell), s_cellcmp);
+
+	next = block->next;
+	tblock_init(block, block->version, block->number, block->base);
+	for (k = 0; k < total; k++)
+		if (!s_inpartition(db, block, cells[k].ts)
+		 || tblock_insert(block, cells[k].ts, cells[k].value) != 0)
+			break;
+
+	while (k < total) {
+		spill = s_newblock(db, idx, cells[k].ts, s_class(tblock_size(block)), block->number);
+		if (!spill)
+			goto fail;
+
+		spill->next = next;
+		tblock_next(block, spill);
+		if (cells[k].ts > block->base
+		 && btree_insert(idx->btree, cells[k].ts, spill->number) != 0)
+			goto fail;
+
+		block = spill;
+		for (; k < total; k++)
+			if (!s_inpartition(db, block, cells[k].ts)
+			 || tblock_insert(block, cells[k].ts, cells[k].value) != 0)
+				break;
+	}
+	/* tblock_init() / tblock_next() left the last block
+	   pointing at whatever followed the original one */
+	if (block->next != next) {
+		block->next = next;
+		tblock_write64(block, 24, next);
+		block->dirty = 1;
+	}
+
+	free(cells);
+	return 0;
+
+fail:
+	free(cells);
+	return -1;
+}
+
+/* merge late measurements (older than the series' mark, and
+   in time order) into the tblocks they belong in. */
+static int
+s_merge(struct db *db, struct idx *idx, bolo_msec_t *ts, bolo_value_t *what, int n)
+{
+	struct tblock *block, *head;
+	uint64_t id, other;
+	int i, j;
+
+	for (i = 0; i < n; i = j) {
+		if (btree_find(idx->btree, &id, ts[i]) != 0)
+			return -1;
+		block = db_findblock(db, id);
+		if (!block)
+			return -1;
+
+		if (ts[i] < block->base) {
+			/* older than the whole series; give it a new head */
+			head = s_newblock(db, idx, ts[i], 0, block->number);
+			if (!head)
+				return -1;
+			tblock_next(head, block);
+			if (btree_insert(idx->btree, ts[i], head->number) != 0)
+				return -1;
+			block = head;
+			id = head->number;
+		}
+
+		/* batch up everything headed for the same block */
+		for (j = i + 1; j < n; j++)
+			if (btree_find(idx->btree, &other, ts[j]) != 0 || other != id)
+				break;
+
+		if (s_rewrite(db, idx, block, ts + i, what + i, j - i) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* write the oldest `n` buffered measurements of a series out
+   to its tblocks.  late arrivals are merged in, in bulk; the
+   rest are appended. */
+static int
+s_drain(struct db *db, struct idx *idx, int n)
+{
+	struct reorder *rob;
+	int i, late;
+
+	rob = idx->rob;
+	if (!rob || n <= 0)
+		return 0;
+	if (n > rob->n)
+		n = rob->n;
+
+	if (!idx->marked)
+		s_findmark(db, idx);
+	(void)s_rollups(db, idx);
+
+	for (late = 0; late < n && rob->ts[late] < idx->mark; late++)
+		;
+	if (late && s_merge(db, idx, rob->ts, rob->value, late) != 0)
+		return -1;
+	for (i = 0; i < late; i++)
+		s_rollup(idx, rob->ts[i], rob->value[i]);
+
+	for (i = late; i < n; i++) {
+		if (s_append(db, idx, rob->ts[i], rob->value[i]) != 0)
+			return -1;
+		s_rollup(idx, rob->ts[i], rob->value[i]);
+	}
+
+	rob->n -= n;
+	memmove(rob->ts,    rob->ts    + n, rob->n * sizeof(rob->ts[0]));
+	memmove(rob->value, rob->value + n, rob->n * sizeof(rob->value[0]));
+	return 0;
+}
+
+static int
+s_drainall(struct db *db)
+{
+	struct idx *idx;
+
+	for_each(idx, &db->idx, l)
+		if (idx->rob && s_drain(db, idx, idx->rob->n) != 0)
+			return -1;
+	return 0;
+}
+
+/* how long should measurements for `name` (a metric|tagset)
+   be kept, according to the first matching retention policy? */
+static bolo_msec_t
+s_keep(struct db *db, const char *name)
+{
+	char metric[256];
+	size_t i, n;
+
+	if (!db->nretention)
+		return 0;
+
+	n = strcspn(name, "|");
+	if (n >= sizeof(metric))
+		n = sizeof(metric) - 1;
+	memcpy(metric, name, n);
+	metric[n] = '\0';
+
+	for (i = 0; i < db->nretention; i++)
+		if (fnmatch(db->retention[i].pattern, metric, 0) == 0)
+			return db->retention[i].keep;
+	return 0;
+}
+
+int
+db_insert(struct db *db, char *name, bolo_msec_t when, bolo_value_t what)
+{
+	struct idx *idx;
+	struct reorder *rob;
+	uint64_t idx_id;
+	char *next;
+	int i;
+
+	CHECK(db != NULL,       "db_insert() given a NULL database to insert into");
+	CHECK(db->main != NULL, "db_insert() given a database without a main.db hash");
+	CHECK(name != NULL,     "db_insert() given a NULL metric|tagset name to insert");
+
+	errno = BOLO_ERDONLY;
+	if (!db->key)
+		return -1;
+
+	errno = ENAMETOOLONG;
+	if (strlen(name) > MAINDB_NAME_MAX)
+		return -1;
+
+	if (db->wal && wal_append(db->wal, name, when, what) != 0)
+		return -1;
+
+	if (hash_get(db->main, &idx, name) != 0) {
+		if (s_newidx(db, &idx, &idx_id) != 0)
+			return -1;
+		CHECK(idx != NULL, "db_insert() failed to get a valid time series index structure after calling s_newidx()");
+
+		if (hash_set(db->main, name, idx) != 0)
+			return -1;
+
+		/* main.db gets it at the next sync */
+		db->fresh = realloc(db->fresh, (db->nfresh + 1) * sizeof(*db->fresh));
+		insist(db->fresh != NULL, "db_insert() unable to allocate memory for the list of new series");
+		db->fresh[db->nfresh] = strdup(name);
+		insist(db->fresh[db->nfresh] != NULL, "db_insert() unable to allocate memory for the name of a new series");
+		db->nfresh++;
+		idx->keep = s_keep(db, name);
+	}
+	CHECK(idx != NULL, "db_insert() failed to get a valid time series index structure from the main.db");
+
+	if (!idx->rob)
+		idx->rob = xmalloc(sizeof(struct reorder));
+	rob = idx->rob;
+
+	/* make room, by writing out the oldest half of the buffer
+	   (in bulk, so that a flood of late measurements can be
+	   merged into their tblocks a batch at a time) */
+	if (rob->n == REORDER_MAX && s_drain(db, idx, REORDER_MAX / 2) != 0)
+		return -1;
+
+	for (i = rob->n; i > 0 && rob->ts[i - 1] > when; i--) {
+		rob->ts[i]    = rob->ts[i - 1];
+		rob->value[i] = rob->value[i - 1];
+	}
+	rob->ts[i]    = when;
+	rob->value[i] = what;
+	rob->n++;
+	if (when > rob->newest)
+		rob->newest = when;
+
+	/* write out everything that has fallen out of the window */
+	if (rob->newest >= REORDER_WINDOW) {
+		for (i = 0; i < rob->n && rob->ts[i] < rob->newest - REORDER_WINDOW; i++)
+			;
+		if (s_drain(db, idx, i) != 0)
+			return -1;
+	}
+
+	/* ingest the tags */
+	next = strchr(name, '|');
+	if (next) *next++ = '\0';
+	s_setmetric(db, name, idx);
+	s_settags(db, next, idx);
+
+	return 0;
+}
+
+int
+db_wal(struct db *db, size_t group)
+{
+	CHECK(db != NULL, "db_wal() given a NULL database to log for");
+
+	errno = BOLO_ERDONLY;
+	if (!db->key)
+		return -1;
+
+	if (!db->wal) {
+		db->wal = xmalloc(sizeof(struct wal));
+		if (wal_open(db->wal, db->rootfd, PATH_TO_WAL, db->key, db->mac) != 0) {
+			free(db->wal);
+			db->wal = NULL;
+			return -1;
+		}
+	}
+	db->wal->group = group;
+	return 0;
+}
+
+int
+db_commit(struct db *db)
+{
+	CHECK(db != NULL, "db_commit() given a NULL database to commit");
+
+	return db->wal ? wal_commit(db->wal) : 0;
+}
+
+struct tblock *
+db_findblock(struct db *db, uint64_t blkid)
+{
+	struct tslab *slab;
+
+	if (blkid == 0)
+		return NULL;
+
+	slab = s_findslab(db, blkid);
+	if (!slab || tslab_load(slab) != 0)
+		return NULL;
+	return slab->blocks + tblock_number(blkid);
+}
+
+/* find the first tblock (still) in the database that the index
+   has a key for, after `ts`.  a chain can have holes in it, when
+   a retention policy was shortened, and newer tslabs expired
+   ahead of the older ones they follow on from. */
+static struct tblock *
+s_skipahead(struct db *db, struct idx *idx, bolo_msec_t ts)
+{
+	struct tblock *block;
+	uint64_t id;
+
+	while (btree_next(idx->btree, &id, &ts) == 0)
+		if ((block = db_findblock(db, id)) != NULL)
+			return block;
+	return NULL;
+}
+
+/* the tblock that follows `block` in its chain, if any */
+static struct tblock *
+s_chainnext(struct db *db, struct idx *idx, struct tblock *block)
+{
+	struct tblock *next;
+
+	if (!block->next)
+		return NULL;
+
+	next = db_findblock(db, block->next);
+	if (!next && idx)
+		next = s_skipahead(db, idx, block->base);
+	return next;
+}
+
+struct tier *
+db_rollups(struct db *db, struct idx *idx)
+{
+	CHECK(db  != NULL, "db_rollups() given a NULL database");
+	CHECK(idx != NULL, "db_rollups() given a NULL time series index");
+
+	/* buffered measurements aren't rolled up until they are
+	   written out, and queries need to see all of them */
+	if (idx->rob && idx->rob->n && s_drain(db, idx, idx->rob->n) != 0)
+		return NULL;
+	return s_rollups(db, idx);
+}
+
+int
+series_open(struct series_cursor *c, struct db *db, struct idx *idx, bolo_msec_t from, bolo_msec_t until)
+{
+	CHECK(c   != NULL, "series_open() given a NULL cursor to open");
+	CHECK(db  != NULL, "series_open() given a NULL database to read");
+	CHECK(idx != NULL, "series_open() given a NULL time series index to read");
+
+	/* measurements still in the reorder buffer have to be
+	   written out to their tblocks before they can be read */
+	if (idx->rob && idx->rob->n && s_drain(db, idx, idx->rob->n) != 0)
+		return -1;
+	return s_seriesopen(c, db, idx, from, until);
+}
+
+static int
+s_seriesopen(struct series_cursor *c, struct db *db, struct idx *idx, bolo_msec_t from, bolo_msec_t until)
+{
+	uint64_t id;
+
+	memset(c, 0, sizeof(*c));
+	c->db    = db;
+	c->idx   = idx;
+	c->from  = from;
+	c->until = until;
+
+	errno = BOLO_ENOBLOCK;
+	if (btree_find(idx->btree, &id, from) != 0)
+		return -1;
+
+	c->next = db_findblock(db, id);
+	if (!c->next)
+		c->next = s_skipahead(db, idx, from);
+	return 0;
+}
+
+struct tblock *
+series_nextblock(struct series_cursor *c)
+{
+	struct tblock *b;
+
+	CHECK(c != NULL, "series_nextblock() given a NULL cursor to advance");
+
+	while ((b = c->next) != NULL) {
+		/* the block chain is chronological; once a block
+		   starts after the range, nothing else can be in it */
+		if (b->base > c->until) {
+			c->next = NULL;
+			break;
+		}
+
+		c->next = s_chainnext(c->db, c->idx, b);
+		if (tblock_overlap(b, c->from, c->until) == TBLOCK_DISJOINT)
+			continue;
+
+		/* don't trust anything in a block that failed its checks */
+		if (c->db->nquarantined && db_isquarantined(c->db, b->number))
+			continue;
+
+		/* start paging in the next block while we work on this one */
+		if (c->next && c->next->base <= c->until)
+			(void)page_advise(&c->next->page, PAGE_WILLNEED);
+
+		c->block = b;
+		tcursor_init(&c->cell, b);
+		return b;
+	}
+
+	c->block = NULL;
+	return NULL;
+}
+
+int
+series_next(struct series_cursor *c)
+{
+	CHECK(c != NULL, "series_next() given a NULL cursor to advance");
+
+	for (;;) {
+		while (c->block && tcursor_next(&c->cell) == 0) {
+			if (c->cell.ts > c->until) {
+				if (tblock_issorted(c->block))
+					break; /* the rest of the block is out of range */
+				continue;
+			}
+			if (c->cell.ts < c->from)
+				continue;
+
+			c->ts    = c->cell.ts;
+			c->value = c->cell.value;
+			return 0;
+		}
+
+		if (!series_nextblock(c))
+			return -1;
+		tcursor_seek(&c->cell, c->from);
+	}
+}
+
+/* the smallest class of tblock that can take `n` cells
+   (in the database's block format), or else the largest. */
+static int
+s_packclass(struct db *db, size_t n)
+{
+	struct tblock b;
+	int c;
+
+	memset(&b, 0, sizeof(b));
+	b.version = db->block_format;
+	for (c = 0; c < TBLOCK_CLASSES - 1; c++) {
+		b.page.len = tblock_class_size(c);
+		if ((size_t)tblock_capacity(&b) >= n)
+			break;
+	}
+	return c;
+}
+
+/* copy every (unquarantined) cell of a series, in time order,
+   into as few tblocks as will hold them, allocated back-to-back,
+   and index them with a new btree.  the series is left pointing
+   at the new btree; the old one is handed back in `old`. */
+static int
+s_compact(struct db *db, struct idx *idx, struct compaction *c, struct btree **old)
+{
+	struct tblock *block, *prev;
+	struct tcursor tc;
+	struct cell *cells;
+	struct btree *t;
+	uint64_t id;
+	size_t n, cap, k, first, seen;
+
+	*old = NULL;
+	if (btree_find(idx->btree, &id, 0) != 0)
+		return 0; /* nothing written yet */
+
+	n = cap = seen = 0;
+	cells = NULL;
+	t = NULL;
+	block = db_findblock(db, id);
+	if (!block)
+		block = s_skipahead(db, idx, btree_first(idx->btree));
+	for (; block; block = s_chainnext(db, idx, block)) {
+		errno = BOLO_EBLKCONT;
+		if (++seen > c->before)
+			goto fail; /* the chain loops back on itself */
+
+		if (db_isquarantined(db, block->number)) {
+			c->dropped++;
+			continue;
+		}
+
+		tcursor_init(&tc, block);
+		while (tcursor_next(&tc) == 0) {
+			if (n == cap) {
+				cap = cap ? cap * 2 : 1024;
+				cells = realloc(cells, cap * sizeof(*cells));
+				insist(cells != NULL, "s_compact() unable to allocate memory for the cells of a time series");
+			}
+			cells[n].ts    = tc.ts;
+			cells[n].value = tc.value;
+			cells[n].seq   = n;
+			n++;
+		}
+	}
+	qsort(cells, n, sizeof(*cells), s_cellcmp);
+
+	t = btmake(&db->bta);
+	if (!t)
+		goto fail;
+
+	prev = NULL;
+	for (k = 0; k < n; ) {
+		block = s_newblock(db, idx, cells[k].ts, s_packclass(db, n - k), prev ? prev->number : 0);
+		if (!block)
+			goto fail;
+
+		if (prev)
+			tblock_next(prev, block);
+		if ((!prev || cells[k].ts > prev->base)
+		 && btree_insert(t, cells[k].ts, block->number) != 0)
+			goto fail;
+
+		for (first = k; k < n; k++)
+			if (!s_inpartition(db, block, cells[k].ts)
+			 || tblock_insert(block, cells[k].ts, cells[k].value) != 0)
+				break;
+
+		errno = BOLO_EBLKFULL;
+		if (k == first)
+			goto fail; /* not even one cell fit in a fresh block */
+
+		prev = block;
+		c->after++;
+	}
+
+	c->series++;
+	c->cells += n;
+	free(cells);
+
+	*old = idx->btree;
+	idx->btree  = t;
+	idx->number = t->id;
+	db->maindirty = 1;
+	return 0;
+
+fail:
+	free(cells);
+	(void)btree_close(t);
+	return -1;
+}
+
+/* unmap a tslab that nothing refers to anymore, and remove
+   its file (and its directory, if that was the last one). */
+static int
+s_reclaim(struct db *db, struct tslab *slab)
+{
+	char path[64], *dir;
+	int rc;
+
+	s_slabpath(path, sizeof(path), slab->number);
+
+	db->nfree -= slab->nfree;
+	db->slabtab[s_slabtab(slab->number)] = NULL;
+	delist(&slab->l);
+	rc = tslab_unmap(slab);
+	free(slab);
+
+	if (unlinkat(db->rootfd, path, 0) != 0)
+		return -1;
+
+	dir = strrchr(path, '/');
+	*dir = '\0';
+	(void)unlinkat(db->rootfd, path, AT_REMOVEDIR); /* ENOTEMPTY is fine */
+	return rc;
+}
+
+/*
+   db_compact()
+
+   Rewrite every time series into densely packed tblocks,
+   series by series, in brand new tslabs, and then reclaim
+   all of the old tslabs.  Blocks written in an older format
+   come out in the current one.
+
+   Nothing refers to the new blocks until db_sync() renames
+   a fresh main.db into place, pointing at the new btrees;
+   a crash before then leaves the old layout as it was (plus
+   a few unreferenced tslabs, which the next compaction will
+   reclaim).  Quarantined blocks are not carried over.
+
+   The caller must have the database to itself throughout.
+ */
+int
+db_compact(struct db *db, struct compaction *c)
+{
+	struct tslab **old, *slab;
+	struct btree **trees;
+	struct idx *idx;
+	size_t nold, nidx, i, dropped;
+	int b, rc, *lost;
+
+	CHECK(db != NULL, "db_compact() given a NULL db pointer to compact");
+	CHECK(c  != NULL, "db_compact() given a NULL compaction to report results in");
+
+	memset(c, 0, sizeof(*c));
+	if (s_drainall(db) != 0)
+		return -1;
+
+	nold = len(&db->slab);
+	old  = xcalloc(nold + 1, sizeof(*old));
+	i = 0;
+	for_each(slab, &db->slab, l) {
+		if (tslab_load(slab) != 0) {
+			free(old);
+			return -1;
+		}
+		old[i++] = slab;
+		for (b = 0; b < TBLOCKS_PER_TSLAB && slab->blocks[b].valid; b++)
+			if (!tslab_isfree(slab, slab->number | b))
+				c->before++;
+		slab->retired = 1;
+	}
+
+	/* everything from here on goes into brand new slabs
+	   (not even into the free tblocks of the old ones) */
+	for (b = 0; b < TBLOCK_CLASSES; b++)
+		db->tail[b] = NULL;
+
+	nidx  = len(&db->idx);
+	trees = xcalloc(nidx + 1, sizeof(*trees));
+	lost  = xcalloc(nidx + 1, sizeof(*lost));
+	i = 0;
+	for_each(idx, &db->idx, l) {
+		dropped = c->dropped;
+		if (s_compact(db, idx, c, &trees[i]) != 0)
+			goto fail;
+		lost[i++] = c->dropped != dropped;
+	}
+
+	/* rollup files are named for the series' (old) index; those
+	   of series that lost quarantined blocks count too much */
+	i = 0;
+	for_each(idx, &db->idx, l) {
+		if (trees[i] && s_rollmove(db, trees[i]->id, idx->number) != 0)
+			goto fail;
+		if (lost[i])
+			s_rollpurge(db, idx);
+		i++;
+	}
+
+	if (db_sync(db) != 0)
+		goto fail;
+
+	/* main.db now points at the new btrees (and blocks);
+	   the old ones are just taking up space. */
+	rc = 0;
+	for (i = 0; i < nidx; i++)
+		if (btree_close(trees[i]) != 0)
+			rc = -1;
+
+	for (i = 0; i < nold; i++) {
+		if (s_reclaim(db, old[i]) != 0)
+			rc = -1;
+		else
+			c->reclaimed++;
+	}
+
+	/* the quarantined blocks are gone now, too */
+	if (db->nquarantined) {
+		free(db->quarantine);
+		db->quarantine   = NULL;
+		db->nquarantined = 0;
+		if (unlinkat(db->rootfd, PATH_TO_QUARANTINE, 0) != 0 && errno != ENOENT)
+			rc = -1;
+	}
+
+	free(old);
+	free(trees);
+	free(lost);
+	return rc;
+
+fail:
+	for (i = 0; i < nold; i++)
+		old[i]->retired = 0;
+
+	/* put the old btrees back; main.db still refers to them */
+	i = 0;
+	for_each(idx, &db->idx, l) {
+		if (i < nidx && trees[i]) {
+			(void)s_rollmove(db, idx->number, trees[i]->id);
+			(void)btree_close(idx->btree);
+			idx->btree  = trees[i];
+			idx->number = trees[i]->id;
+		}
+		i++;
+	}
+	free(old);
+	free(trees);
+	free(lost);
+	return -1;
+}
+
+/*
+   db_sweep()
+
+   Mark every tblock that no time series refers to as free,
+   so that s_newblock() can hand it back out, instead of
+   growing the database.
+
+   A tblock is referred to if it is in the index of a series,
+   or follows on (via its next pointer) from one that is.
+   Blocks end up unreferenced when bolo stops after extending
+   a tslab, but before the index that points into the new
+   tblock gets written out, or when a db_compact() fails part
+   of the way through.
+
+   The caller must have the database to itself throughout.
+ */
+int
+db_sweep(struct db *db, size_t *freed)
+{
+	struct tslab *slab;
+	struct tblock *block;
+	struct idx *idx;
+	uint8_t *seen;
+	uint64_t id;
+	bolo_msec_t ts;
+	size_t k;
+	int b, more, rc;
+
+	CHECK(db != NULL, "db_sweep() given a NULL database");
+
+	if (freed)
+		*freed = 0;
+
+	if (s_drainall(db) != 0)
+		return -1;
+
+	for_each(slab, &db->slab, l)
+		if (tslab_load(slab) != 0)
+			return -1;
+
+	/* one bit for every tblock we can get to from an index,
+	   laid out the same as db->slabtab */
+	seen = xcalloc(db->slabtablen + 1, TBLOCKS_PER_TSLAB / 8);
+	for_each(idx, &db->idx, l) {
+		if (btree_isempty(idx->btree))
+			continue;
+
+		ts = btree_first(idx->btree);
+		for (more = btree_find(idx->btree, &id, ts) == 0; more;
+		     more = btree_next(idx->btree, &id, &ts) == 0) {
+			for (block = db_findblock(db, id); block && block->valid; ) {
+				k = s_slabtab(block->number);
+				b = tblock_number(block->number);
+				if (seen[k * TBLOCKS_PER_TSLAB / 8 + b / 8] & (1 << (b % 8)))
+					break; /* already been down this chain */
+				seen[k * TBLOCKS_PER_TSLAB / 8 + b / 8] |= 1 << (b % 8);
+
+				block = db_findblock(db, block->next);
+			}
+		}
+	}
+
+	rc = 0;
+	for_each(slab, &db->slab, l) {
+		k = s_slabtab(slab->number);
+		for (b = 0; b < TBLOCKS_PER_TSLAB && slab->blocks[b].valid; b++) {
+			id = slab->number | b;
+			if (seen[k * TBLOCKS_PER_TSLAB / 8 + b / 8] & (1 << (b % 8))
+			 || tslab_isfree(slab, id))
+				continue;
+
+			infof("tblock [%#lx] is unreferenced; freeing it for reuse", id);
+			if (tslab_free(slab, id) != 0) {
+				rc = -1;
+				continue;
+			}
+			db->nfree++;
+			if (freed)
+				(*freed)++;
+		}
+	}
+
+	free(seen);
+	return rc;
+}
+
+int
+db_retain(struct db *db, const char *pattern, bolo_msec_t keep)
+{
+	struct idx *idx;
+	char *name;
+
+	CHECK(db != NULL,      "db_retain() given a NULL database");
+	CHECK(pattern != NULL, "db_retain() given a NULL metric pattern");
+
+	db->retention = realloc(db->retention, (db->nretention + 1) * sizeof(*db->retention));
+	insist(db->retention != NULL, "db_retain() unable to allocate memory for a new retention policy");
+	db->retention[db->nretention].pattern = strdup(pattern);
+	db->retention[db->nretention].keep    = keep;
+	db->nretention++;
+
+	hash_each(db->main, &name, &idx)
+		idx->keep = s_keep(db, name);
+	return 0;
+}
+
+/* has `slab` (a partitioned one) outlived its retention? */
+static int
+s_expired(struct tslab *slab, bolo_msec_t now)
+{
+	return slab->until && slab->keep && slab->until + slab->keep <= now;
+}
+
+/* is the tblock `id` gone, or about to be? */
+static int
+s_doomed(struct db *db, uint64_t id, bolo_msec_t now)
+{
+	struct tslab *slab;
+
+	slab = s_findslab(db, id);
+	return !slab || s_expired(slab, now);
+}
+
+/*
+   db_expire()
+
+   Drop the tslabs that have outlived their retention period.
+
+   Since every tblock in a partitioned tslab starts in the same
+   window of time, and the tslab carries the retention period
+   of the series whose tblocks it holds, this comes down to
+   unlinking whole files; measurements are never rewritten.
+
+   Before any file goes away, each index is pruned of its keys
+   up to its oldest surviving tblock, and written back out, so
+   that nothing on-disk ever points into a missing tslab (with
+   one exception: if a retention policy is shortened, the newer
+   tslabs of a series can expire ahead of older ones.  readers
+   step around those holes, via the btree.)
+ */
+int
+db_expire(struct db *db, bolo_msec_t now, size_t *dropped)
+{
+	struct tslab *slab, *tmp;
+	struct idx *idx;
+	struct tier *tiers;
+	bolo_msec_t ts;
+	uint64_t id;
+	size_t n;
+	int i, more, rc;
+
+	CHECK(db != NULL, "db_expire() given a NULL database");
+
+	if (dropped)
+		*dropped = 0;
+
+	n = 0;
+	for_each(slab, &db->slab, l)
+		if (s_expired(slab, now))
+			n++;
+	if (!n)
+		return 0;
+
+	/* anything still buffered might belong in a doomed tblock */
+	if (s_drainall(db) != 0)
+		return -1;
+
+	for_each(idx, &db->idx, l) {
+		if (btree_isempty(idx->btree))
+			continue;
+
+		ts = btree_first(idx->btree);
+		more = btree_find(idx->btree, &id, ts) == 0;
+		while (more && s_doomed(db, id, now))
+			more = btree_next(idx->btree, &id, &ts) == 0;
+
+		if (more && ts == btree_first(idx->btree))
+			continue; /* nothing to prune */
+
+		/* (read the rollups in before the index changes) */
+		tiers = s_rollups(db, idx);
+		if (btree_prune(idx->btree, more ? ts : btree_last(idx->btree) + 1) != 0
+		 || btree_write(idx->btree) != 0)
+			return -1;
+
+		if (btree_isempty(idx->btree)) {
+			idx->mark   = 0;
+			idx->marked = 1;
+		}
+
+		/* the rollups go with the raw measurements (and ones
+		   still waiting on db_rebuild() mustn't outlive them) */
+		if (!tiers) {
+			s_rollpurge(db, idx);
+			continue;
+		}
+		if (more) {
+			s_rolltrim(db, idx, ts);
+		} else {
+			for (i = 0; i < ROLLUP_TIERS; i++) {
+				rollup_trim(&tiers[i], ~(bolo_msec_t)0);
+				tiers[i].newest = 0;
+			}
+		}
+		if (s_rollsync(db, idx) != 0)
+			return -1;
+	}
+
+	rc = 0;
+	for_eachx(slab, tmp, &db->slab, l) {
+		if (!s_expired(slab, now))
+			continue;
+
+		for (i = 0; i < TBLOCK_CLASSES; i++)
+			if (db->tail[i] == slab)
+				db->tail[i] = NULL;
+
+		infof("expiring tslab [%#lx], for the window [%lu, %lu), kept for %lums",
+			slab->number, slab->from, slab->until, slab->keep);
+		if (s_reclaim(db, slab) != 0)
+			rc = -1;
+		else if (dropped)
+			(*dropped)++;
+	}
+	return rc;
+}
+
+#ifdef TEST
+/* LCOV_EXCL_START */
+/* how many measurements a series has, in all, and how many of
+   them are not the 0, 1, 2, ... that the WAL tests write */
+static int
+s_tally(struct db *db, const char *name, int *wrong)
+{
+	struct idx *idx;
+	struct series_cursor c;
+	int n;
+
+	*wrong = 0;
+	if (hash_get(db->main, &idx, name) != 0
+	 || series_open(&c, db, idx, 0, ~(bolo_msec_t)0) != 0)
+		return 0;
+
+	for (n = 0; series_next(&c) == 0; n++)
+		if (c.value != n)
+			(*wrong)++;
+	return n;
+}
+
+/* how many rollup buckets of a series disagree with what a pass
+   through its raw measurements makes of the same stretch of time,
+   counting a tier that misses any of them as one more */
+static int
+s_rollcheck(struct db *db, struct idx *idx, struct tier *tiers)
+{
+	struct series_cursor c;
+	uint64_t count, total, all;
+	double sum;
+	size_t i;
+	int t, bad;
+
+	all = 0;
+	if (series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0)
+		while (series_next(&c) == 0)
+			all++;
+
+	bad = 0;
+	for (t = 0; t < ROLLUP_TIERS; t++) {
+		total = 0;
+		for (i = 0; i < tiers[t].n; i++) {
+			count = 0;
+			sum   = 0.0;
+			if (series_open(&c, db, idx, tiers[t].r[i].start, tiers[t].r[i].start + tiers[t].width - 1) == 0)
+				for (; series_next(&c) == 0; count++)
+					sum += c.value;
+			if (count != tiers[t].r[i].count || sum != tiers[t].r[i].summary.sum)
+				bad++;
+			total += tiers[t].r[i].count;
+		}
+		if (total != all)
+			bad++;
+	}
+	return bad;
+}
+
+struct logged {
+	const char   *name;
+	bolo_msec_t   ts;
+	bolo_value_t  value;
+};
+
+/* insert `n` measurements, commit them to the log (and, if asked,
+   write them out to their tblocks), and then die without syncing
+   or unmounting, the way a crash would; whatever made it into the
+   slab mappings stays there, seals and all */
+static int
+s_crash(const char *path, struct dbkey *key, struct logged *m, int n, int drain)
+{
+	struct db *db;
+	char metric[256];
+	pid_t pid;
+	int i, status;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (pid == 0) {
+		db = db_mount(path, key);
+		if (!db || db_wal(db, 0) != 0)
+			_exit(1);
+		for (i = 0; i < n; i++) {
+			strcpy(metric, m[i].name);
+			if (db_insert(db, metric, m[i].ts, m[i].value) != 0)
+				_exit(1);
+		}
+		if (db_commit(db) != 0 || (drain && s_drainall(db) != 0))
+			_exit(1);
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) != pid)
+		return -1;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+TESTS {
+	struct dbkey *key1, *key2;
+
+	startlog("test:db", 0, LOG_ERRORS);
+	key1 = rand_key(DEFAULT_KEY_SIZE);
+	key2 = rand_key(DEFAULT_KEY_SIZE+1);
+	if (!key1 || !key2)
+		BAIL_OUT("failed to generate random testing keys");
+
+	subtest {
+		struct dbkey *k;
+
+		k = read_key("0123456789abcdef");
+		isnt_null(k, "shoud read_key() properly");
+
+		is_unsigned(k->len, 8, "k[] should by 8 octets long");
+		is_unsigned(k->key[0] & 0xff, 0x01, "k[0] is 0x01");
+		is_unsigned(k->key[1] & 0xff, 0x23, "k[1] is 0x23");
+		is_unsigned(k->key[2] & 0xff, 0x45, "k[2] is 0x45");
+		is_unsigned(k->key[3] & 0xff, 0x67, "k[3] is 0x67");
+		is_unsigned(k->key[4] & 0xff, 0x89, "k[4] is 0x89");
+		is_unsigned(k->key[5] & 0xff, 0xab, "k[5] is 0xab");
+		is_unsigned(k->key[6] & 0xff, 0xcd, "k[6] is 0xcd");
+		is_unsigned(k->key[7] & 0xff, 0xef, "k[7] is 0xef");
+
+		free(k->key);
+		free(k);
+	}
+
+	subtest {
+		char *copy;
+
+#define test_copy(in,out) do { \
+	srand(0x12345678); \
+	copy = s_tmpcopyof(in); \
+	is_string(copy, (out), "s_tmpcopyof(" #in ") should equal " #out); \
+	free(copy); \
+} while (0)
+
+		test_copy("file",            ".file.1b4830b4");
+		test_copy("dir/file",        "dir/.file.1b4830b4");
+		test_copy("rel/ative/path",  "rel/ative/.path.1b4830b4");
+		test_copy("/abso/lute/path", "/abso/lute/.path.1b4830b4");
+
+#undef test_copy
+	}
+
+	subtest {
+		struct db *db;
+		char metric[256];
+
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		db = db_mount("t/tmp/new", key1);
+		is_null(db, "db_mount() should fail with new (empty) new directories");
+
+		db = db_init("t/tmp/old", key1, NULL);
+		is_null(db, "db_init() should fail with old (existing) data directories");
+
+		db = db_init("t/tmp/new", key1, NULL);
+		isnt_null(db, "db_init() should succeed with new (empty) new directories");
+		isnt_null(db->main, "db->main hash table should exist for a new database");
+		ok(isempty(&db->idx), "db->idx list should be empty on a new database");
+		ok(isempty(&db->slab), "db->slab list should be empty on a new database");
+		is_unsigned(db->next_slab, (1 << 11),
+			"first tslab of a new db should be tslab 1");
+		ok(db->tail[0] == NULL,
+			"a new db should have no tslab to put new tblocks into");
+
+		strcpy(metric, "metric|host=localhost,env=test");
+		ok(db_insert(db, metric, 1234567890, 4567.89) == 0,
+			"db_insert() should succeed on fresh database");
+
+		strcpy(metric, "metric|host=localhost,env=test");
+		ok(db_insert(db, metric, 1234567890 + 1, 4567.91) == 0,
+			"db_insert() should succeed twice on fresh database");
+
+		strcpy(metric, "metric|host=localhost,env=test");
+		ok(db_insert(db, metric, 1234567890ul + (1ul << 33), 4567.91) == 0,
+			"db_insert() should succeed after exhausting block capacity (in time)");
+
+		ok(db_sync(db) == 0,
+			"db_sync() should succeed");
+		ok(db_unmount(db) == 0,
+			"db_unmount() should succeed");
+
+
+		db = db_mount("t/tmp/new", key1);
+		isnt_null(db, "db_mount() should succeed with newly-init'd data directories");
+
+		ok(db_unmount(db) == 0,
+			"db_unmount() should succeed");
+	}
+
+	subtest {
+		struct db *db;
+		uint64_t ts;
+		char metric[256];
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		db = db_init("t/tmp/new", key2, NULL);
+		for (ts = 0; ts < TCELLS_PER_TBLOCK * 2 + 1; ts++) {
+			strcpy(metric, "metric|host=localhost,env=test");
+			if (db_insert(db, metric, 10001 + ts, 4567.89) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+
+		ok(hash_isset(db->metrics, "metric"),      "the 'metric' metric should be set in the metric index");
+
+		ok(hash_isset(db->tags, "host"),           "the 'host' tag should be set in the tag index");
+		ok(hash_isset(db->tags, "host=localhost"), "the 'host=localhost' tag should be set in the tag index");
+		ok(hash_isset(db->tags, "env"),            "the 'env' tag should be set in the tag index");
+		ok(hash_isset(db->tags, "env=test"),       "the 'env=test' tag should be set in the tag index");
+
+		ok(db_sync(db) == 0,
+			"db_sync() should succeed");
+		ok(db_unmount(db) == 0,
+			"db_unmount() should succeed");
+
+		db = db_mount("t/tmp/new", key2);
+		isnt_null(db, "mounted t/tmp/new a second time");
+
+		ok(hash_isset(db->metrics, "metric"),      "the 'metric' metric should be set in the metric index (post-read)");
+
+		ok(hash_isset(db->tags, "host"),           "the 'host' tag should be set in the tag index (post-read)");
+		ok(hash_isset(db->tags, "host=localhost"), "the 'host=localhost' tag should be set in the tag index (post-read)");
+		ok(hash_isset(db->tags, "env"),            "the 'env' tag should be set in the tag index (post-read)");
+		ok(hash_isset(db->tags, "env=test"),       "the 'env=test' tag should be set in the tag index (post-read)");
+
+		ok(db_unmount(db) == 0,
+			"db_unmount() should succeed");
+	}
+
+	subtest {
+		struct db *db;
+		struct tblock *block;
+		char metric[256];
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+
+		strcpy(metric, "metric|host=localhost,env=test");
+		if (db_insert(db, metric, 1234567890, 42.0) != 0)
+			BAIL_OUT("failed to insert into db\n");
+		ok(db_findblock(db, 0x800) == NULL, "new measurements should sit in the reorder buffer for a while");
+
+		/* push the first measurement out of the reorder window */
+		strcpy(metric, "metric|host=localhost,env=test");
+		if (db_insert(db, metric, 1234567890 + REORDER_WINDOW + 1, 43.0) != 0)
+			BAIL_OUT("failed to insert into db\n");
+
+		block = db_findblock(db, 0x800);
+		isnt_null(block, "db_findblock() should find the first tblock");
+		is_int(block->cells, 1, "measurements should leave the reorder buffer once they fall out of the window");
+		ok(block->dirty, "tblock should be dirty after an insert");
+		ok(tblock_check(block, key1) != 0, "tblock sealing should be deferred until sync");
+
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(!block->dirty, "tblock should be clean after a db_sync()");
+		ok(tblock_check(block, key1) == 0, "tblock should be properly sealed after a db_sync()");
+		is_int(block->version, TBLOCK_DEFAULT_VERSION, "new tblocks should use the default format version");
+
+		tblock_write32(block, 32, 4);
+		ok(tblock_check(block, key1) != 0, "tblock check should detect tampering with cell data");
+		tblock_write32(block, 32, 0);
+		ok(tblock_check(block, key1) == 0, "tblock check should pass once tampering is reverted");
+
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* databases from before the settings file only ever held BLOKv1 */
+		if (unlink("t/tmp/new/settings") != 0)
+			BAIL_OUT("failed to remove the settings file");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed without a settings file");
+		is_int(db->block_format, 1, "a database without a settings file should keep writing BLOKv1");
+		ok(access("t/tmp/new/settings", F_OK) == 0, "db_mount() should record the block format of an older database");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		db = db_mount("t/tmp/new", NULL);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		is_int(db->block_format, 1, "the recorded block format should persist across remount");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+	}
+
+	subtest {
+		struct db *db;
+		struct idx *idx;
+		struct tier *tiers;
+		struct series_cursor c;
+		char metric[256];
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+
+		/* well within the reorder window, and out of order */
+		strcpy(metric, "fresh|host=a");
+		if (db_insert(db, metric, 1234567890 + 2000, 2.0) != 0)
+			BAIL_OUT("failed to insert into db\n");
+		strcpy(metric, "fresh|host=a");
+		if (db_insert(db, metric, 1234567890, 0.0) != 0)
+			BAIL_OUT("failed to insert into db\n");
+		strcpy(metric, "fresh|host=a");
+		if (db_insert(db, metric, 1234567890 + 1000, 1.0) != 0)
+			BAIL_OUT("failed to insert into db\n");
+		if (hash_get(db->main, &idx, "fresh|host=a") != 0)
+			BAIL_OUT("failed to find the fresh series");
+		is_int(idx->rob->n, 3, "new measurements should sit in the reorder buffer");
+
+		ok(series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0, "series_open() should succeed on a series that is all buffered");
+		is_int(idx->rob->n, 0, "series_open() should write out the reorder buffer");
+		ok(series_next(&c) == 0 && c.ts == 1234567890        && c.value == 0.0, "buffered measurements should be queryable before a sync [0]");
+		ok(series_next(&c) == 0 && c.ts == 1234567890 + 1000 && c.value == 1.0, "buffered measurements should be queryable before a sync [1]");
+		ok(series_next(&c) == 0 && c.ts == 1234567890 + 2000 && c.value == 2.0, "buffered measurements should be queryable before a sync [2]");
+		ok(series_next(&c) != 0, "there should be nothing else in the series");
+
+		strcpy(metric, "fresh|host=a");
+		if (db_insert(db, metric, 1234567890 + 3000, 3.0) != 0)
+			BAIL_OUT("failed to insert into db\n");
+		tiers = db_rollups(db, idx);
+		ok(tiers != NULL, "db_rollups() should succeed");
+		is_unsigned(tiers[0].n, 1, "buffered measurements should make it into the rollups");
+		is_unsigned(tiers[0].r[0].count, 4, "db_rollups() should roll up buffered measurements");
+
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+	}
+
+	subtest {
+		struct db *db;
+		struct dbopts opts;
+		struct tblock *block;
+		struct tcursor c;
+		char metric[256];
+		bolo_msec_t ts[60000];
+		double v[60000];
+		int i, n, bad;
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		memset(&opts, 0, sizeof(opts));
+		opts.block_format = 3;
+		db = db_init("t/tmp/new", key1, &opts);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+
+		/* a mix of regular and irregular intervals (including
+		   one that goes backwards), and of repeated, slowly
+		   changing, and completely random values; enough of
+		   the latter to spill over into a second block. */
+		for (i = 0; i < 60000; i++) {
+			ts[i] = 1234567890 + i * 1000
+			      + (i % 7 == 0 ? (i * 7919) % 5000 : 0)
+			      - (i == 100 ? 50000 : 0);
+			v[i]  = i < 1000  ? 42.0
+			      : i < 2000  ? 42.0 + i * 0.25
+			      :             (double)((i * 2654435761u) % 1000000007u) / 3.0;
+
+			strcpy(metric, "metric|host=localhost,env=test");
+			if (db_insert(db, metric, ts[i], v[i]) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+
+		/* the reorder buffer puts everything in time order */
+		for (i = 1; i < 60000; i++) {
+			bolo_msec_t t = ts[i];
+			double x = v[i];
+			for (n = i; n > 0 && ts[n - 1] > t; n--) {
+				ts[n] = ts[n - 1];
+				v[n]  = v[n - 1];
+			}
+			ts[n] = t;
+			v[n]  = x;
+		}
+
+		block = db_findblock(db, 0x800);
+		isnt_null(block, "db_findblock() should find the first tblock");
+		is_int(block->version, 3, "new tblocks should use the format chosen at db_init()");
+		ok(tblock_isfull(block), "the first (compressed) tblock should have filled up");
+		ok(block->enc.bits / block->cells < 96, "compressed tblock should beat 96 bits/measurement");
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		is_int(db->block_format, 3, "block format should persist across remount");
+
+		n = bad = 0;
+		for (block = db_findblock(db, 0x800); block; block = db_findblock(db, block->next)) {
+			if (tblock_check(block, key1) != 0)
+				bad++;
+			tcursor_init(&c, block);
+			while (tcursor_next(&c) == 0) {
+				if (n >= 60000 || c.ts != ts[n] || c.value != v[n])
+					bad++;
+				n++;
+			}
+		}
+		is_int(n, 60000, "tcursor should walk every measurement across all tblocks");
+		is_int(bad, 0, "tcursor should decode every measurement exactly (and all seals should check)");
+
+		strcpy(metric, "metric|host=localhost,env=test");
+		ok(db_insert(db, metric, ts[59999] + 1000, 1.5) == 0, "should be able to keep appending after a remount");
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		for (block = db_findblock(db, 0x800); block->next; block = db_findblock(db, block->next))
+			;
+		tcursor_init(&c, block);
+		while (tcursor_next(&c) == 0)
+			;
+		ok(c.ts == ts[59999] + 1000 && c.value == 1.5, "appended measurement should decode after a remount");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+	}
+
+	subtest {
+		struct db *db;
+		struct dbopts opts;
+		struct tblock *block;
+		struct tslab *slab;
+		char metric[256];
+		int i;
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		memset(&opts, 0, sizeof(opts));
+		opts.mac = "blake2b";
+		db = db_init("t/tmp/new", key1, &opts);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+		is_int(db->mac, MAC_BLAKE2B, "db should use the MAC chosen at db_init()");
+
+		for (i = 0; i < 10; i++) {
+			strcpy(metric, "metric|host=localhost,env=test");
+			if (db_insert(db, metric, 1234567890 + i * (bolo_msec_t)MAX_U32, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		is_int(db->mac, MAC_BLAKE2B, "MAC algorithm should persist across remount");
+
+		slab = item(db->slab.next, struct tslab, l);
+		is_int(slab->mac, MAC_BLAKE2B, "slab header should record the MAC algorithm");
+
+		block = db_findblock(db, 0x800);
+		isnt_null(block, "db_findblock() should find the first tblock");
+		is_int(block->mac, MAC_BLAKE2B, "tblocks should be sealed with their slab's MAC");
+		ok(tblock_check(block, key1) == 0, "BLAKE2b-sealed tblock should check out");
+
+		block->mac = MAC_HMAC_SHA512;
+		ok(tblock_check(block, key1) != 0, "BLAKE2b-sealed tblock should not pass as HMAC-SHA-512");
+		block->mac = MAC_BLAKE2B;
+
+		tblock_write32(block, 32, 4);
+		ok(tblock_check(block, key1) != 0, "tblock check should detect tampering with cell data");
+		tblock_write32(block, 32, 0);
+		ok(tblock_check(block, key1) == 0, "tblock check should pass once tampering is reverted");
+
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+		ok(db_mount("t/tmp/new", key2) == NULL, "db_mount() should fail with the wrong key");
+	}
+
+	subtest {
+		struct db *db;
+		struct dbopts opts;
+		struct tblock *block;
+		struct tcursor c;
+		struct scan r;
+		char metric[256];
+		bolo_msec_t from, until;
+		size_t want, got;
+		double min, max, sum;
+		int i, n, bad;
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		memset(&opts, 0, sizeof(opts));
+		opts.block_format = 4;
+		db = db_init("t/tmp/new", key1, &opts);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+
+		for (i = 0; i < 50000; i++) {
+			strcpy(metric, "metric|host=localhost,env=test");
+			if (db_insert(db, metric, 1234567890 + i * 1000, (i * 7919) % 1000 - 500.0) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+
+		block = db_findblock(db, 0x800);
+		isnt_null(block, "db_findblock() should find the first tblock");
+		is_int(block->version, 4, "new tblocks should use the (columnar) format chosen at db_init()");
+		is_int(block->cells, tblock_capacity(block), "columnar tblocks should fill up");
+		ok(tblock_check(block, key1) == 0, "columnar tblocks should be properly sealed");
+
+		n = bad = 0;
+		for (; block; block = db_findblock(db, block->next)) {
+			tcursor_init(&c, block);
+			while (tcursor_next(&c) == 0) {
+				if (c.ts != 1234567890u + n * 1000 || c.value != (n * 7919) % 1000 - 500.0)
+					bad++;
+				n++;
+			}
+		}
+		is_int(n, 50000, "tcursor should walk every measurement across all columnar tblocks");
+		is_int(bad, 0, "tcursor should read back every columnar measurement exactly");
+
+		from  = 1234567890 + 1000 * 1000 + 1;
+		until = 1234567890 + 1000 * 31000;
+		want = 0; min = 1e9; max = -1e9; sum = 0.0;
+		for (i = 1001; i <= 31000; i++) {
+			double v = (i * 7919) % 1000 - 500.0;
+			want++; sum += v;
+			if (v < min) min = v;
+			if (v > max) max = v;
+		}
+
+		/* the range spans several tblocks */
+		got = 0;
+		scan_init(&r);
+		for (block = db_findblock(db, 0x800); block; block = db_findblock(db, block->next)) {
+			got += tblock_count(block, from, until);
+			tblock_reduce(block, from, until, &r);
+		}
+		is_unsigned(got, want, "tblock_count() should count cells within the range");
+		is_unsigned(r.count, want, "tblock_reduce() should count cells within the range");
+		ok(r.min == min && r.max == max && r.sum == sum, "tblock_reduce() should find the min / max / sum within the range");
+		is_unsigned(tblock_count(db_findblock(db, 0x800), 0, 1234567889), 0, "tblock_count() should find nothing before the block");
+
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+	}
+
+	subtest {
+		struct db *db;
+		struct idx *idx;
+		struct tslab *slab;
+		struct tblock *block;
+		char metric[256];
+		uint64_t id, last;
+		int i, bad;
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+
+		/* one sample every ten minutes, vs. one every second */
+		for (i = 0; i < 1400; i++) {
+			strcpy(metric, "sparse|host=localhost");
+			if (db_insert(db, metric, 1234567890 + i * 600000ul, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		for (i = 0; i < 2000; i++) {
+			strcpy(metric, "dense|host=localhost");
+			if (db_insert(db, metric, 1234567890 + i * 1000ul, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+
+		if (hash_get(db->main, &idx, "sparse|host=localhost") != 0
+		 || btree_find(idx->btree, &id, 1234567890) != 0)
+			BAIL_OUT("failed to find the sparse series");
+		block = db_findblock(db, id);
+		is_unsigned(tblock_size(block), tblock_class_size(0), "new series should start out in the smallest tblock class");
+		ok(tblock_isfull(block), "sparse series should have filled its first tblock");
+		block = db_findblock(db, block->next);
+		isnt_null(block, "sparse series should have a second tblock");
+		is_unsigned(tblock_size(block), tblock_class_size(0), "sparse series should stay in the smallest tblock class");
+
+		if (hash_get(db->main, &idx, "dense|host=localhost") != 0
+		 || btree_find(idx->btree, &id, 1234567890) != 0)
+			BAIL_OUT("failed to find the dense series");
+		block = db_findblock(db, id);
+		is_unsigned(tblock_size(block), tblock_class_size(0), "new series should start out in the smallest tblock class");
+		block = db_findblock(db, block->next);
+		isnt_null(block, "dense series should have a second tblock");
+		is_unsigned(tblock_size(block), tblock_class_size(TBLOCK_CLASSES - 1), "dense series should be promoted to the largest tblock class");
+		is_int(block->cells, 2000 - tblock_capacity(db_findblock(db, id)), "promoted tblock should hold the rest of the dense series");
+
+		isnt_null(db->tail[0], "remounted db should know where to put small tblocks");
+		isnt_null(db->tail[TBLOCK_CLASSES - 1], "remounted db should know where to put large tblocks");
+		ok(db->tail[0] != db->tail[TBLOCK_CLASSES - 1], "tblocks of different classes should live in different tslabs");
+
+		last = bad = 0;
+		for_each(slab, &db->slab, l) {
+			if (slab->number <= last)
+				bad++;
+			last = slab->number;
+		}
+		is_int(bad, 0, "tslabs should be mounted in order, however many threads mapped them");
+		is_unsigned(db->next_slab, last + TBLOCKS_PER_TSLAB, "remounted db should number new tslabs after the last one");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+	}
+
+	subtest {
+		struct db *db;
+		struct dbopts opts;
+		struct idx *idx;
+		struct tblock *block;
+		struct tcursor c;
+		struct tsummary want;
+		char metric[256];
+		uint64_t id;
+		int i, n, v, bad;
+
+		for (v = 2; v <= 4; v++) {
+			if (system("./t/setup/db-init") != 0)
+				BAIL_OUT("t/setup/db-init failed!");
+
+			memset(&opts, 0, sizeof(opts));
+			opts.block_format = v;
+			db = db_init("t/tmp/new", key1, &opts);
+			if (!db)
+				BAIL_OUT("db_init(t/tmp/new) failed");
+
+			for (i = 0; i < 20000; i++) {
+				strcpy(metric, "summary|host=localhost");
+				if (db_insert(db, metric, 1234567890 + i * 1000ul, (i * 7919) % 1000 - 500.0) != 0)
+					BAIL_OUT("failed to insert into db\n");
+			}
+			ok(db_sync(db) == 0, "db_sync() should succeed");
+			ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+			db = db_mount("t/tmp/new", key1);
+			if (!db)
+				BAIL_OUT("db_mount(t/tmp/new) failed");
+			if (hash_get(db->main, &idx, "summary|host=localhost") != 0
+			 || btree_find(idx->btree, &id, 1234567890) != 0)
+				BAIL_OUT("failed to find the summarized series");
+
+			n = bad = 0;
+			for (block = db_findblock(db, id); block; block = db_findblock(db, block->next)) {
+				memset(&want, 0, sizeof(want));
+				tcursor_init(&c, block);
+				for (i = 0; tcursor_next(&c) == 0; i++) {
+					if (i == 0) {
+						want.tsmin = want.tsmax = c.ts - block->base;
+						want.min = want.max = want.first = c.value;
+					}
+					if (c.value < want.min) want.min = c.value;
+					if (c.value > want.max) want.max = c.value;
+					want.tsmax  = c.ts - block->base;
+					want.sum   += c.value;
+					want.sumsq += c.value * c.value;
+					want.last   = c.value;
+				}
+
+				if (block->summary.tsmin != want.tsmin || block->summary.tsmax != want.tsmax
+				 || block->summary.min   != want.min   || block->summary.max   != want.max
+				 || block->summary.sum   != want.sum   || block->summary.sumsq != want.sumsq
+				 || block->summary.first != want.first || block->summary.last  != want.last) {
+					diag("BLOKv%d tblock %#lx has a bad summary", v, block->number);
+					bad++;
+				}
+				if (tblock_check(block, key1) != 0)
+					bad++;
+				n++;
+			}
+			ok(n > 1, "BLOKv%d series should span several tblocks", v);
+			is_int(bad, 0, "BLOKv%d tblock summaries should survive a remount, and be sealed", v);
+
+			block = db_findblock(db, id);
+			is_int(tblock_overlap(block, 0, 1234567889), TBLOCK_DISJOINT,
+				"BLOKv%d tblocks should be disjoint from ranges before them", v);
+			is_int(tblock_overlap(block, 1234567890, 1234567890 + 1000ul * block->cells), TBLOCK_WITHIN,
+				"BLOKv%d tblocks should lie within ranges that cover them", v);
+			is_int(tblock_overlap(block, 1234567891, 1234567890 + 1000ul * block->cells), TBLOCK_OVERLAPS,
+				"BLOKv%d tblocks should overlap ranges that cover only part of them", v);
+
+			ok(db_unmount(db) == 0, "db_unmount() should succeed");
+		}
+	}
+
+	subtest {
+		struct db *db;
+		struct dbopts opts;
+		struct idx *idx;
+		struct tblock *block;
+		struct series_cursor c;
+		char metric[256];
+		bolo_msec_t from, until;
+		int i, n, v, bad, blocks;
+
+		for (v = 1; v <= 4; v++) {
+			if (system("./t/setup/db-init") != 0)
+				BAIL_OUT("t/setup/db-init failed!");
+
+			memset(&opts, 0, sizeof(opts));
+			opts.block_format = v;
+			db = db_init("t/tmp/new", key1, &opts);
+			if (!db)
+				BAIL_OUT("db_init(t/tmp/new) failed");
+
+			for (i = 0; i < 20000; i++) {
+				strcpy(metric, "cursor|host=localhost");
+				if (db_insert(db, metric, 1234567890 + i * 1000ul, i) != 0)
+					BAIL_OUT("failed to insert into db\n");
+			}
+			if (hash_get(db->main, &idx, "cursor|host=localhost") != 0)
+				BAIL_OUT("failed to find the cursor series");
+
+			/* a range right in the middle of the series */
+			from  = 1234567890 + 1000ul * 5000 - 1;
+			until = 1234567890 + 1000ul * 7500;
+			ok(series_open(&c, db, idx, from, until) == 0, "BLOKv%d series_open() should succeed", v);
+			n = bad = 0;
+			while (series_next(&c) == 0) {
+				if (c.ts != 1234567890 + 1000ul * (5000 + n) || c.value != 5000 + n)
+					bad++;
+				n++;
+			}
+			is_int(n, 2501, "BLOKv%d series cursor should yield every cell in range", v);
+			is_int(bad, 0, "BLOKv%d series cursor should yield cells in order", v);
+			ok(series_next(&c) != 0, "BLOKv%d series cursor should stay exhausted", v);
+
+			/* early termination: only blocks that overlap the range */
+			ok(series_open(&c, db, idx, 1234567890, 1234567890 + 1000ul * 10) == 0,
+				"BLOKv%d series_open() should succeed", v);
+			blocks = 0;
+			while ((block = series_nextblock(&c)) != NULL)
+				blocks++;
+			is_int(blocks, 1, "BLOKv%d series cursor should stop after the last block in range", v);
+
+			ok(series_open(&c, db, idx, 1234567890 + 1000ul * 20000, 1234567890 + 1000ul * 30000) == 0,
+				"BLOKv%d series_open() should succeed past the end of the series", v);
+			ok(series_next(&c) != 0, "BLOKv%d series cursor past the end of the series should be empty", v);
+
+			ok(db_unmount(db) == 0, "db_unmount() should succeed");
+		}
+
+		/* out-of-order cells (within a single block) */
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+		for (i = 0; i < 100; i++) {
+			if (i == 50)
+				continue;
+			strcpy(metric, "unsorted|host=localhost");
+			if (db_insert(db, metric, 1234567890 + i * 1000ul, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		if (hash_get(db->main, &idx, "unsorted|host=localhost") != 0)
+			BAIL_OUT("failed to find the unsorted series");
+
+		ok(series_open(&c, db, idx, 1234567890 + 40000, 1234567890 + 60000) == 0,
+			"series_open() should succeed on an unsorted series");
+		block = series_nextblock(&c);
+		isnt_null(block, "series cursor should find the unsorted tblock");
+		ok(tblock_issorted(block), "in-order inserts should leave the tblock sorted");
+		ok(tblock_insert(block, 1234567890 + 50000, 50) == 0, "should be able to append an out-of-order cell");
+		ok(!tblock_issorted(block), "out-of-order appends should mark the tblock as unsorted");
+		ok(series_open(&c, db, idx, 1234567890 + 40000, 1234567890 + 60000) == 0,
+			"series_open() should succeed on an unsorted series");
+		n = bad = 0;
+		while (series_next(&c) == 0) {
+			if (c.ts < 1234567890 + 40000 || c.ts > 1234567890 + 60000)
+				bad++;
+			n++;
+		}
+		is_int(n, 21, "series cursor should find every in-range cell of an unsorted tblock");
+		is_int(bad, 0, "series cursor should only yield in-range cells of an unsorted tblock");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+	}
+
+	subtest {
+		struct db *db;
+		struct dbopts opts;
+		struct idx *idx;
+		struct tblock *block;
+		struct series_cursor c;
+		char metric[256];
+		bolo_msec_t last;
+		int i, n, v, bad, unsorted;
+
+		for (v = 2; v <= 4; v++) {
+			if (system("./t/setup/db-init") != 0)
+				BAIL_OUT("t/setup/db-init failed!");
+
+			memset(&opts, 0, sizeof(opts));
+			opts.block_format = v;
+			db = db_init("t/tmp/new", key1, &opts);
+			if (!db)
+				BAIL_OUT("db_init(t/tmp/new) failed");
+
+			for (i = 0; i < 10000; i++) {
+				strcpy(metric, "late|host=localhost");
+				if (db_insert(db, metric, 1234567890 + i * 1000ul, i) != 0)
+					BAIL_OUT("failed to insert into db\n");
+			}
+			ok(db_sync(db) == 0, "db_sync() should succeed");
+			ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+			db = db_mount("t/tmp/new", key1);
+			if (!db)
+				BAIL_OUT("db_mount(t/tmp/new) failed");
+
+			/* an agent comes back from an outage, and flushes
+			   the measurements it missed (between the existing
+			   ones, in the middle of the series), and one that
+			   is older than anything in the series. */
+			for (i = 0; i < 2000; i++) {
+				strcpy(metric, "late|host=localhost");
+				if (db_insert(db, metric, 1234567890 + (3000 + i) * 1000ul + 500, -i) != 0)
+					BAIL_OUT("failed to merge a late measurement into the db\n");
+			}
+			strcpy(metric, "late|host=localhost");
+			if (db_insert(db, metric, 1234567890 - 1000, -1.0) != 0)
+				BAIL_OUT("failed to merge an ancient measurement into the db\n");
+			ok(db_sync(db) == 0, "db_sync() should succeed");
+
+			if (hash_get(db->main, &idx, "late|host=localhost") != 0)
+				BAIL_OUT("failed to find the late series");
+			ok(series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0, "BLOKv%d series_open() should succeed", v);
+
+			n = bad = unsorted = 0; last = 0;
+			while ((block = series_nextblock(&c)) != NULL) {
+				if (!tblock_issorted(block))
+					unsorted++;
+				if (tblock_check(block, key1) != 0)
+					bad++;
+			}
+			ok(series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0, "BLOKv%d series_open() should succeed", v);
+			while (series_next(&c) == 0) {
+				if (c.ts < last)
+					bad++;
+				last = c.ts;
+				n++;
+			}
+			is_int(n, 12001, "BLOKv%d series should hold every on-time and late measurement", v);
+			is_int(bad, 0, "BLOKv%d merged series should be in time order, and sealed", v);
+			is_int(unsorted, 0, "BLOKv%d merging late measurements should keep every tblock sorted", v);
+
+			ok(series_open(&c, db, idx, 1234567890 - 1000, 1234567890 - 1000) == 0,
+				"BLOKv%d series_open() should succeed before the original start of the series", v);
+			ok(series_next(&c) == 0 && c.value == -1.0, "BLOKv%d ancient measurement should be found first", v);
+
+			ok(series_open(&c, db, idx, 1234567890 + 4000500, 1234567890 + 4001000) == 0,
+				"BLOKv%d series_open() should succeed", v);
+			n = 0;
+			while (series_next(&c) == 0)
+				n++;
+			is_int(n, 2, "BLOKv%d late measurements should interleave with the on-time ones", v);
+
+			ok(db_unmount(db) == 0, "db_unmount() should succeed");
+		}
+	}
+
+	subtest {
+		struct db *db;
+		struct idx *idx;
+		struct tslab *slab;
+		struct series_cursor c;
+		char metric[256];
+		int i, n, rc, bad, steps;
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+
+		/* each measurement is too far from the last to share a
+		   tblock, so we get enough blocks to split the btree */
+		for (i = 0; i < 1200; i++) {
+			strcpy(metric, "lazy|host=localhost");
+			if (db_insert(db, metric, 1234567890 + i * (bolo_msec_t)MAX_U32, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 
-	CHECK(db != NULL, "s_findblock() given a NULL db pointer to work with");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		if (hash_get(db->main, &idx, "lazy|host=localhost") != 0)
+			BAIL_OUT("failed to find the lazy series after remount");
+
+		n = 0;
+		for_each(slab, &db->slab, l)
+			if (slab->loaded)
+				n++;
+		is_int(n, 0, "db_mount() should not map any tblocks up front");
+		ok(!idx->btree->leaf, "1200 tblocks should have split the btree root");
+		is_null(idx->btree->kids[0], "db_mount() should only map btree roots");
+
+		ok(series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0, "series_open() should succeed after a lazy mount");
+		n = bad = 0;
+		while (series_next(&c) == 0) {
+			if (c.ts != 1234567890 + n * (bolo_msec_t)MAX_U32 || c.value != n)
+				bad++;
+			n++;
+		}
+		is_int(n, 1200, "series cursor should map everything it needs on demand");
+		is_int(bad, 0, "series cursor should find the right measurements after a lazy mount");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 
-	slab = s_findslab(db, id);
-	if (!slab)
-		return NULL;
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		if (hash_get(db->main, &idx, "lazy|host=localhost") != 0)
+			BAIL_OUT("failed to find the lazy series after remount");
+
+		steps = 0;
+		while ((rc = db_warmup(db, 1)) == 1)
+			steps++;
+		is_int(rc, 0, "db_warmup() should eventually finish");
+		ok(steps > 0, "db_warmup() should do its work in installments");
+
+		n = 0;
+		for_each(slab, &db->slab, l)
+			if (!slab->loaded)
+				n++;
+		is_int(n, 0, "db_warmup() should map every tslab");
+		isnt_null(idx->btree->kids[0], "db_warmup() should map btree subtrees");
+		is_int(db_warmup(db, 1), 0, "db_warmup() should have nothing left to do");
+
+		strcpy(metric, "lazy|host=localhost");
+		ok(db_insert(db, metric, 1234567890 + 1200 * (bolo_msec_t)MAX_U32, 1200) == 0,
+			"should be able to keep appending after a lazy mount");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+	}
 
-	return tslab_tblock(slab, id, ts);
-}
+	subtest {
+		struct db *db;
+		struct idx *idx;
+		struct tslab *slab;
+		struct tblock *block;
+		struct series_cursor c;
+		struct compaction cr;
+		char metric[256];
+		uint64_t id;
+		size_t nslabs;
+		int i, n, bad;
 
-int
-db_insert(struct db *db, char *name, bolo_msec_t when, bolo_value_t what)
-{
-	struct idx *idx;
-	struct tblock *block;
-	uint64_t idx_id, block_id;
-	char *next;
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
 
-	CHECK(db != NULL,       "db_insert() given a NULL database to insert into");
-	CHECK(db->main != NULL, "db_insert() given a database without a main.db hash");
-	CHECK(name != NULL,     "db_insert() given a NULL metric|tagset name to insert");
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
 
-	errno = BOLO_ERDONLY;
-	if (!db->key)
-		return -1;
+		/* two series, written side by side, so that their
+		   tblocks are interleaved across the same slabs */
+		for (i = 0; i < 5000; i++) {
+			strcpy(metric, "busy|host=a");
+			if (db_insert(db, metric, 1234567890 + i * 1000ul, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+			if (i >= 1000)
+				continue;
+			strcpy(metric, "sparse|host=b");
+			if (db_insert(db, metric, 1234567890 + i * 1000ul, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+
+		/* every backfilled measurement older than the series
+		   gets a brand new (and nearly empty) head tblock */
+		for (i = 1; i <= 20; i++) {
+			strcpy(metric, "sparse|host=b");
+			if (db_insert(db, metric, 1234567890 - i * 1000ul, -i) != 0)
+				BAIL_OUT("failed to backfill the db\n");
+			if (db_sync(db) != 0)
+				BAIL_OUT("db_sync() failed");
+		}
 
-	if (hash_get(db->main, &idx, name) != 0) {
-		if (s_newidx(db, &idx, &idx_id) != 0)
-			return -1;
-		CHECK(idx != NULL, "db_insert() failed to get a valid time series index structure after calling s_newidx()");
+		/* and a series whose only tblock went bad */
+		strcpy(metric, "broken|host=c");
+		if (db_insert(db, metric, 1234567890, 42) != 0)
+			BAIL_OUT("failed to insert into db\n");
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		if (hash_get(db->main, &idx, "broken|host=c") != 0
+		 || btree_find(idx->btree, &id, 0) != 0
+		 || db_quarantine(db, id) != 0)
+			BAIL_OUT("failed to quarantine the broken series");
+
+		nslabs = len(&db->slab);
+		ok(db_compact(db, &cr) == 0, "db_compact() should succeed");
+		is_unsigned(cr.series, 3, "db_compact() should rewrite every series");
+		is_unsigned(cr.cells, 5000 + 1000 + 20, "db_compact() should copy every good measurement");
+		is_unsigned(cr.dropped, 1, "db_compact() should leave the quarantined tblock out");
+		is_unsigned(cr.reclaimed, nslabs, "db_compact() should reclaim every old slab");
+		ok(cr.after < cr.before - 20, "db_compact() should fold the backfilled heads together (%lu -> %lu tblocks)",
+			cr.before, cr.after);
+		is_unsigned(db->nquarantined, 0, "db_compact() should empty the quarantine");
+		ok(faccessat(db->rootfd, "slabs/0000.0000/0000.0000.0000.0800.slab", F_OK, 0) != 0,
+			"db_compact() should remove the old slab files");
+
+		if (hash_get(db->main, &idx, "sparse|host=b") != 0)
+			BAIL_OUT("failed to find the sparse series");
+		ok(series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0, "series_open() should succeed after compaction");
+		n = 0;
+		while ((block = series_nextblock(&c)) != NULL)
+			n++;
+		is_int(n, 1, "the compacted sparse series should fit in a single tblock");
+
+		strcpy(metric, "busy|host=a");
+		ok(db_insert(db, metric, 1234567890 + 5000 * 1000ul, 5000) == 0,
+			"should be able to keep appending after compaction");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 
-		if (hash_set(db->main, name, idx) != 0)
-			return -1;
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed after compaction");
+
+		if (hash_get(db->main, &idx, "busy|host=a") != 0)
+			BAIL_OUT("failed to find the busy series after remount");
+		ok(series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0, "series_open() should succeed");
+		n = bad = 0;
+		while (series_next(&c) == 0) {
+			if (c.ts != 1234567890 + n * 1000ul || c.value != n)
+				bad++;
+			n++;
+		}
+		is_int(n, 5001, "compacted series should keep every measurement");
+		is_int(bad, 0, "compacted series should keep its measurements in order");
+
+		if (hash_get(db->main, &idx, "sparse|host=b") != 0)
+			BAIL_OUT("failed to find the sparse series after remount");
+		ok(series_open(&c, db, idx, 1234567890 - 20000, 1234567890 - 20000) == 0,
+			"series_open() should succeed before the original start of the series");
+		ok(series_next(&c) == 0 && c.value == -20.0, "backfilled measurements should survive compaction");
+
+		n = 0;
+		for_each(slab, &db->slab, l)
+			for (i = 0; tslab_load(slab) == 0 && i < TBLOCKS_PER_TSLAB && slab->blocks[i].valid; i++)
+				if (tblock_check(&slab->blocks[i], key1) != 0)
+					n++;
+		is_int(n, 0, "every compacted tblock should be properly sealed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 	}
-	CHECK(idx != NULL, "db_insert() failed to get a valid time series index structure from the main.db");
-
-	/* find the tblock ID, if we have one */
-	if (btree_find(idx->btree, &block_id, when) != 0) {
-		infof("allocating a new tblock for '%s' @%lu", name, when);
-		block = s_newblock(db, when);
-		if (!block)
-			return -1;
 
-		infof("inserting block [%08lu] into btree index...", block->number);
-		if (btree_insert(idx->btree, when, block->number) != 0)
-			return -1;
+	subtest {
+		struct db *db;
+		struct dbopts opts;
+		struct idx *idx;
+		struct tslab *slab;
+		struct series_cursor c;
+		char metric[256];
+		bolo_msec_t t0, ts;
+		size_t dropped;
+		int i, n, bad;
 
-	} else {
-		block = s_findblock(db, block_id, when);
+#define HOUR 3600000ul
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
 
-		if (block && (tblock_isfull(block) || !tblock_canhold(block, when))) {
-			struct tblock *new_block;
+		memset(&opts, 0, sizeof(opts));
+		opts.partition = HOUR;
+		db = db_init("t/tmp/new", key1, &opts);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+
+		ok(db_retain(db, "cpu",   2 * HOUR) == 0, "db_retain(cpu) should succeed");
+		ok(db_retain(db, "disk*", 1 * HOUR) == 0, "db_retain(disk*) should succeed");
+
+		/* six hours' worth of measurements, once a minute */
+		t0 = 400000 * HOUR;
+		for (i = 0; i < 6 * 60; i++) {
+			ts = t0 + i * 60000ul;
+			strcpy(metric, "cpu|host=a");
+			if (db_insert(db, metric, ts, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+			strcpy(metric, "mem|host=a");
+			if (db_insert(db, metric, ts, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+			strcpy(metric, "diskio|host=a");
+			if (db_insert(db, metric, ts, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
 
-			new_block = s_newblock(db, when);
-			if (!new_block)
-				return -1;
+		n = bad = 0;
+		for_each(slab, &db->slab, l) {
+			n++;
+			if (slab->until != slab->from + HOUR || slab->from % HOUR != 0)
+				bad++;
+		}
+		is_int(n, 6 * 3, "each window should get a slab for each retention period");
+		is_int(bad, 0, "every slab should cover exactly one window");
+
+		ok(db_expire(db, t0 + 6 * HOUR, &dropped) == 0, "db_expire() should succeed");
+		is_unsigned(dropped, 5 + 4, "db_expire() should drop the windows that have been outlived");
+		ok(db_expire(db, t0 + 7 * HOUR, &dropped) == 0, "db_expire() should succeed");
+		is_unsigned(dropped, 1 + 1, "db_expire() should drop one more window each for cpu and disk*");
+		is_unsigned(len(&db->slab), 7, "db_expire() should leave the rest of the slabs alone");
+		ok(faccessat(db->rootfd, "slabs/0000.0000/0000.0000.0000.0800.slab", F_OK, 0) != 0,
+			"db_expire() should remove the expired slab files");
+		ok(db_findblock(db, 0x800 | 1) == NULL, "expired slabs should no longer be looked up");
+		n = 0;
+		for_each(slab, &db->slab, l)
+			if (db_findblock(db, slab->number | 1) != &slab->blocks[1])
+				n++;
+		is_int(n, 0, "every slab left should still be looked up by number");
+
+		if (hash_get(db->main, &idx, "cpu|host=a") != 0)
+			BAIL_OUT("failed to find the cpu series");
+		ok(series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0, "series_open() should succeed after expiry");
+		n = bad = 0;
+		while (series_next(&c) == 0) {
+			if (c.ts != t0 + 5 * HOUR + n * 60000ul)
+				bad++;
+			n++;
+		}
+		is_int(n, 60, "only the last hour of cpu should be left");
+		is_int(bad, 0, "the cpu measurements that are left should be the newest");
 
-			tblock_next(block, new_block);
-			block = new_block;
+		if (hash_get(db->main, &idx, "diskio|host=a") != 0)
+			BAIL_OUT("failed to find the diskio series");
+		ok(btree_isempty(idx->btree), "every diskio measurement should be gone");
 
-			if (btree_insert(idx->btree, when, block->number) != 0)
-				return -1;
+		strcpy(metric, "diskio|host=a");
+		ok(db_insert(db, metric, t0 + 7 * HOUR, 1) == 0, "should be able to insert into a fully expired series");
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 
-		} else if (!block) {
-			return -1;
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed after expiry");
+		is_unsigned(db->partition, HOUR, "the partition width should persist in the settings");
+
+		if (hash_get(db->main, &idx, "mem|host=a") != 0)
+			BAIL_OUT("failed to find the mem series after remount");
+		ok(series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0, "series_open() should succeed");
+		n = 0;
+		while (series_next(&c) == 0)
+			n++;
+		is_int(n, 6 * 60, "series with no retention policy should be kept forever");
+
+		if (hash_get(db->main, &idx, "diskio|host=a") != 0)
+			BAIL_OUT("failed to find the diskio series after remount");
+		ok(series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0 && series_next(&c) == 0
+		 && c.ts == t0 + 7 * HOUR, "new measurements in an expired series should survive a remount");
+
+		/* keeping newer measurements for less time than older ones
+		   leaves a hole at the end of the series, once they expire */
+		ok(db_retain(db, "mem", HOUR) == 0, "db_retain(mem) should succeed");
+		for (i = 6 * 60; i < 7 * 60; i++) {
+			strcpy(metric, "mem|host=a");
+			if (db_insert(db, metric, t0 + i * 60000ul, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
 		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(db_expire(db, t0 + 8 * HOUR, &dropped) == 0, "db_expire() should succeed");
+		is_unsigned(dropped, 2, "db_expire() should drop the last mem window, and the last cpu window");
+
+		strcpy(metric, "mem|host=a");
+		ok(db_insert(db, metric, t0 + 8 * HOUR, 8 * 60) == 0, "should be able to insert past a hole");
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+
+		if (hash_get(db->main, &idx, "mem|host=a") != 0)
+			BAIL_OUT("failed to find the mem series");
+		ok(series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0, "series_open() should succeed");
+		n = bad = 0;
+		while (series_next(&c) == 0) {
+			if (c.value != (n < 6 * 60 ? n : 8 * 60))
+				bad++;
+			n++;
+		}
+		is_int(n, 6 * 60 + 1, "series should be readable across a hole");
+		is_int(bad, 0, "series should skip over the hole");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+#undef HOUR
 	}
 
-	if (tblock_insert(block, when, what) != 0)
-		return -1;
+	subtest {
+		struct db *db;
+		struct dbopts opts;
+		struct idx *idx;
+		struct tier *tiers;
+		char metric[256], path[64];
+		bolo_msec_t t0;
+		uint64_t id;
+		size_t dropped;
+		int i;
+
+#define HOUR 3600000ul
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
 
-	/* ingest the tags */
-	next = strchr(name, '|');
-	if (next) *next++ = '\0';
-	s_setmetric(db, name, idx);
-	s_settags(db, next, idx);
+		memset(&opts, 0, sizeof(opts));
+		opts.partition = HOUR;
+		db = db_init("t/tmp/new", key1, &opts);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+		ok(db_retain(db, "temp", 2 * HOUR) == 0, "db_retain(temp) should succeed");
+
+		/* six hours' worth, every 13 seconds, so that the windows
+		   don't start on a minute (let alone a day) */
+		t0 = 400000 * HOUR;
+		for (i = 0; i * 13000ul < 6 * HOUR; i++) {
+			strcpy(metric, "temp|host=a");
+			if (db_insert(db, metric, t0 + i * 13000ul, i % 10) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		if (hash_get(db->main, &idx, "temp|host=a") != 0)
+			BAIL_OUT("failed to find the temp series");
+		tiers = db_rollups(db, idx);
+		ok(tiers != NULL, "db_rollups() should find the rollups of a series");
+		is_int(tiers ? s_rollcheck(db, idx, tiers) : -1, 0, "rollups should agree with the raw measurements");
+
+		ok(db_expire(db, t0 + 7 * HOUR, &dropped) == 0, "db_expire() should succeed");
+		is_unsigned(dropped, 5, "db_expire() should drop all but the last window");
+		tiers = db_rollups(db, idx);
+		ok(tiers != NULL, "db_expire() should keep the rollups of a series current");
+		is_int(tiers ? s_rollcheck(db, idx, tiers) : -1, 0, "rollups should agree with the raw measurements after an expiry");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 
-	/* FIXME: may need to sync */
-	return 0;
-}
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed after expiry");
+		if (hash_get(db->main, &idx, "temp|host=a") != 0)
+			BAIL_OUT("failed to find the temp series after remount");
+		tiers = db_rollups(db, idx);
+		ok(tiers != NULL, "expired rollups should be written out");
+		is_int(tiers ? s_rollcheck(db, idx, tiers) : -1, 0, "expired rollups should read back as they were");
+
+		/* a quarantined tblock's measurements stop counting */
+		if (btree_find(idx->btree, &id, 0) != 0)
+			BAIL_OUT("failed to find the first temp tblock");
+		ok(db_quarantine(db, id) == 0, "db_quarantine() should succeed");
+		ok(db_rollups(db, idx) == NULL, "quarantine should set the rollups of its series aside");
+		snprintf(path, sizeof(path), "rollups/%016lx.1d", idx->number);
+		ok(faccessat(db->rootfd, path, F_OK, 0) != 0, "quarantine should remove the rollup files of its series");
+		is_unsigned(db->nstale, 1, "one series should be waiting on a rebuild");
+		ok(db_rebuild(db, 16) == 0, "db_rebuild() should succeed");
+		is_unsigned(db->nstale, 0, "db_rebuild() should leave nothing stale");
+		tiers = db_rollups(db, idx);
+		ok(tiers != NULL, "db_rebuild() should bring the rollups back");
+		is_int(tiers ? s_rollcheck(db, idx, tiers) : -1, 0, "rebuilt rollups should leave the quarantined tblock out");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+#undef HOUR
+	}
 
-struct tblock *
-db_findblock(struct db *db, uint64_t blkid)
-{
-	struct tslab *slab;
+	subtest {
+		struct db *db;
+		struct idx *idx;
+		struct tier *tiers;
+		struct compaction cr;
+		char metric[256], path[64];
+		bolo_msec_t t0;
+		uint64_t number;
+		int i;
+
+#define MINUTE 60000ul
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
 
-	if (blkid == 0)
-		return NULL;
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
 
-	for_each(slab, &db->slab, l) {
-		if (slab->number == tslab_number(blkid))
-			return slab->blocks + tblock_number(blkid);
+		/* two days' worth, every 15 seconds */
+		t0 = 20000 * 1440 * MINUTE;
+		for (i = 0; i < 2 * 1440 * 4; i++) {
+			strcpy(metric, "load|host=a");
+			if (db_insert(db, metric, t0 + i * 15000ul, i % 4) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+
+		if (hash_get(db->main, &idx, "load|host=a") != 0)
+			BAIL_OUT("failed to find the load series");
+		tiers = db_rollups(db, idx);
+		ok(tiers != NULL, "db_rollups() should find the rollups of a series");
+		is_unsigned(tiers[0].n, 2 * 1440, "there should be a 1m rollup for every minute");
+		is_unsigned(tiers[1].n, 2 * 24,   "there should be a 1h rollup for every hour");
+		is_unsigned(tiers[2].n, 2,        "there should be a 1d rollup for every day");
+		is_unsigned(tiers[2].r[1].count, 1440 * 4, "1d rollups should count every measurement in the day");
+		is_within(tiers[1].r[0].summary.sum, 60 * 6, 0.001, "1h rollups should sum every measurement in the hour");
+		is_within(tiers[0].r[0].summary.max, 3, 0.001, "1m rollups should track the maximum");
+		is_unsigned(tiers[0].newest, t0 + (2 * 1440 * 4 - 1) * 15000ul,
+			"rollups should be current up to the newest measurement");
+
+		snprintf(path, sizeof(path), "rollups/%016lx.1h", idx->number);
+		ok(faccessat(db->rootfd, path, F_OK, 0) == 0, "db_sync() should write out the rollups");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* lose one tier; the rest should load, and the lost one rebuilt */
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		if (hash_get(db->main, &idx, "load|host=a") != 0)
+			BAIL_OUT("failed to find the load series after remount");
+		ok(unlinkat(db->rootfd, path, 0) == 0, "removed the 1h rollup file");
+		ok(db_rollups(db, idx) == NULL, "missing rollups should not be rebuilt on the query path");
+		ok(db_rebuild(db, 0) == 1, "db_rebuild() should have a series to rebuild");
+		ok(db_rebuild(db, 16) == 0, "db_rebuild() should succeed");
+		tiers = db_rollups(db, idx);
+		if (!tiers)
+			BAIL_OUT("db_rebuild() didn't rebuild the load series' rollups");
+		is_unsigned(tiers[1].n, 2 * 24, "missing rollups should be rebuilt from the raw measurements");
+		is_within(tiers[1].r[47].summary.sum, 60 * 6, 0.001, "rebuilt rollups should agree with the originals");
+
+		strcpy(metric, "load|host=a");
+		ok(db_insert(db, metric, t0 + 2 * 1440 * MINUTE, 10) == 0, "should be able to keep inserting");
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		is_unsigned(tiers[2].n, 3, "new measurements should roll up at ingest");
+
+		number = idx->number;
+		ok(db_compact(db, &cr) == 0, "db_compact() should succeed");
+		snprintf(path, sizeof(path), "rollups/%016lx.1d", idx->number);
+		ok(number == idx->number || faccessat(db->rootfd, path, F_OK, 0) == 0,
+			"db_compact() should carry the rollup files over to the new index");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed after compaction");
+		if (hash_get(db->main, &idx, "load|host=a") != 0)
+			BAIL_OUT("failed to find the load series after compaction");
+		tiers = db_rollups(db, idx);
+		if (!tiers)
+			BAIL_OUT("failed to read the load series' rollups after compaction");
+		is_unsigned(tiers[2].n, 3, "rollups should survive compaction");
+		is_unsigned(tiers[2].r[2].count, 1, "compacted rollups should be current");
+
+		strcpy(metric, "load|host=a");
+		ok(db_insert(db, metric, t0 + 2 * 1440 * MINUTE + 1000, 11) == 0, "should be able to keep inserting");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		if (hash_get(db->main, &idx, "load|host=a") != 0)
+			BAIL_OUT("failed to find the load series after remount");
+		tiers = db_rollups(db, idx);
+		ok(tiers != NULL, "db_unmount() should write out current rollups");
+		is_unsigned(tiers ? tiers[2].r[2].count : 0, 2, "db_unmount() should write out what was rolled up since the last sync");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+#undef MINUTE
 	}
 
-	return NULL;
-}
+	subtest {
+		struct db *db;
+		struct idx *idx;
+		struct tslab *slab;
+		struct series_cursor c;
+		char metric[256];
+		uint64_t id;
+		size_t freed, nslabs;
+		uint8_t octet;
+		pid_t pid;
+		int i, n, fd, status;
 
-#ifdef TEST
-/* LCOV_EXCL_START */
-TESTS {
-	struct dbkey *key1, *key2;
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
 
-	startlog("test:db", 0, LOG_ERRORS);
-	key1 = rand_key(DEFAULT_KEY_SIZE);
-	key2 = rand_key(DEFAULT_KEY_SIZE+1);
-	if (!key1 || !key2)
-		BAIL_OUT("failed to generate random testing keys");
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
 
-	subtest {
-		struct dbkey *k;
+		/* every measurement too far from the last for one tblock */
+		for (i = 0; i < 10; i++) {
+			strcpy(metric, "kept|host=a");
+			if (db_insert(db, metric, 1234567890 + i * (bolo_msec_t)MAX_U32, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* these make it into tblocks, but never into main.db;
+		   the slabs and btrees get written out, but we crash
+		   (without a write-ahead log) before main.db does */
+		pid = fork();
+		if (pid < 0)
+			BAIL_OUT("fork() failed");
+		if (pid == 0) {
+			db = db_mount("t/tmp/new", key1);
+			if (!db)
+				_exit(1);
+			for (i = 0; i < 5; i++) {
+				strcpy(metric, "lost|host=b");
+				if (db_insert(db, metric, 1234567890 + i * (bolo_msec_t)MAX_U32, i) != 0)
+					_exit(1);
+			}
+			_exit(s_drainall(db) == 0 && s_syncall(db) == 0 ? 0 : 1);
+		}
+		ok(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+			"inserting and crashing should succeed");
 
-		k = read_key("0123456789abcdef");
-		isnt_null(k, "shoud read_key() properly");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		ok(!hash_isset(db->main, "lost|host=b"), "an unsynced series should not survive a remount");
+		is_unsigned(db->nfree, 0, "nothing should be free until the database is swept");
+
+		ok(db_sweep(db, &freed) == 0, "db_sweep() should succeed");
+		is_unsigned(freed, 5, "db_sweep() should free the tblocks of the lost series");
+		is_unsigned(db->nfree, 5, "db_sweep() should count the tblocks it freed");
+		ok(tslab_isfree(item(db->slab.next, struct tslab, l), 0x800 | 12), "lost tblocks should be marked free");
+		ok(!tslab_isfree(item(db->slab.next, struct tslab, l), 0x800 | 9), "referenced tblocks should not be marked free");
+		ok(db_sweep(db, &freed) == 0 && freed == 0, "a second db_sweep() should find nothing new to free");
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 
-		is_unsigned(k->len, 8, "k[] should by 8 octets long");
-		is_unsigned(k->key[0] & 0xff, 0x01, "k[0] is 0x01");
-		is_unsigned(k->key[1] & 0xff, 0x23, "k[1] is 0x23");
-		is_unsigned(k->key[2] & 0xff, 0x45, "k[2] is 0x45");
-		is_unsigned(k->key[3] & 0xff, 0x67, "k[3] is 0x67");
-		is_unsigned(k->key[4] & 0xff, 0x89, "k[4] is 0x89");
-		is_unsigned(k->key[5] & 0xff, 0xab, "k[5] is 0xab");
-		is_unsigned(k->key[6] & 0xff, 0xcd, "k[6] is 0xcd");
-		is_unsigned(k->key[7] & 0xff, 0xef, "k[7] is 0xef");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		is_unsigned(db->nfree, 5, "free tblocks should be remembered across a remount");
+
+		/* new tblocks come out of the free ones, nearest first */
+		nslabs = len(&db->slab);
+		strcpy(metric, "kept|host=a");
+		ok(db_insert(db, metric, 1234567890 + 10 * (bolo_msec_t)MAX_U32, 10) == 0, "should be able to insert");
+		strcpy(metric, "fresh|host=c");
+		ok(db_insert(db, metric, 1234567890, 0) == 0, "should be able to insert into a new series");
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+
+		if (hash_get(db->main, &idx, "kept|host=a") != 0)
+			BAIL_OUT("failed to find the kept series");
+		ok(btree_find(idx->btree, &id, 1234567890 + 10 * (bolo_msec_t)MAX_U32) == 0 && id == (0x800 | 10),
+			"a series should reuse the free tblock right after its last one");
+		if (hash_get(db->main, &idx, "fresh|host=c") != 0)
+			BAIL_OUT("failed to find the fresh series");
+		ok(btree_find(idx->btree, &id, 1234567890) == 0 && id == (0x800 | 11),
+			"new series should reuse the lowest-numbered free tblock");
+		is_unsigned(db->nfree, 3, "reused tblocks should no longer be free");
+		is_unsigned(len(&db->slab), nslabs, "reusing tblocks should not grow the database");
+
+		if (hash_get(db->main, &idx, "kept|host=a") != 0)
+			BAIL_OUT("failed to find the kept series");
+		ok(series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0, "series_open() should succeed");
+		n = 0;
+		while (series_next(&c) == 0 && c.value == n)
+			n++;
+		is_int(n, 11, "a series should read back cleanly through a reused tblock");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* a free map that doesn't check out frees nothing */
+		fd = open("t/tmp/new/slabs/0000.0000/0000.0000.0000.0800.slab", O_RDWR);
+		if (fd < 0 || pread(fd, &octet, 1, TSLAB_FREEMAP_OFFSET + 8 + 1) != 1)
+			BAIL_OUT("failed to read the free map");
+		octet ^= 0xff;
+		if (pwrite(fd, &octet, 1, TSLAB_FREEMAP_OFFSET + 8 + 1) != 1)
+			BAIL_OUT("failed to tamper with the free map");
+		close(fd);
 
-		free(k->key);
-		free(k);
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed with a bad free map");
+		is_unsigned(db->nfree, 0, "a tampered free map should be ignored");
+		n = 0;
+		for_each(slab, &db->slab, l)
+			for (i = 0; i < TBLOCKS_PER_TSLAB; i++)
+				if (tslab_isfree(slab, slab->number | i))
+					n++;
+		is_int(n, 0, "no tblocks should be free, per a tampered free map");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 	}
 
 	subtest {
-		char *copy;
+		struct db *db;
+		struct hmac_sha512 hc;
+		uint8_t header[TSLAB_HEADER_SIZE], msg[TSLAB_HEADER_SIZE];
+		char metric[256];
+		size_t i;
+		int fd, wrong;
 
-#define test_copy(in,out) do { \
-	srand(0x12345678); \
-	copy = s_tmpcopyof(in); \
-	is_string(copy, (out), "s_tmpcopyof(" #in ") should equal " #out); \
-	free(copy); \
-} while (0)
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
 
-		test_copy("file",            ".file.1b4830b4");
-		test_copy("dir/file",        "dir/.file.1b4830b4");
-		test_copy("rel/ative/path",  "rel/ative/.path.1b4830b4");
-		test_copy("/abso/lute/path", "/abso/lute/.path.1b4830b4");
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+		strcpy(metric, "old|host=a");
+		if (db_insert(db, metric, 1234567890, 0) != 0)
+			BAIL_OUT("failed to insert into db\n");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* seal the slab header the way the old sha512_feed() did:
+		   over 64 zeros and the tail end of (padded key ^ ipad) */
+		memset(msg, 0, sizeof(msg));
+		if (key1->len <= SHA512_BLOCK)
+			for (i = 64; i < TSLAB_HEADER_SIZE && i < key1->len; i++)
+				msg[i] = key1->key[i];
+		for (i = 64; i < TSLAB_HEADER_SIZE; i++)
+			msg[i] ^= 0x36;
+		hmac_sha512_start(&hc, &key1->hmac);
+		hmac_sha512_feed(&hc, msg, sizeof(msg));
+		hmac_sha512_done(&hc);
+
+		fd = open("t/tmp/new/slabs/0000.0000/0000.0000.0000.0800.slab", O_RDWR);
+		if (fd < 0 || pread(fd, header, sizeof(header), 0) != sizeof(header))
+			BAIL_OUT("failed to read the tslab header");
+		if (hmac_sha512_raw(&hc, header + TSLAB_HEADER_SIZE - SHA512_DIGEST, SHA512_DIGEST) != 0
+		 || pwrite(fd, header, sizeof(header), 0) != sizeof(header))
+			BAIL_OUT("failed to reseal the tslab header, the old way");
+
+		errno = 0;
+		ok(db_mount("t/tmp/new", key1) == NULL, "db_mount() should refuse an old-style tslab header seal");
+		is_int(errno, BOLO_EBADHMAC, "db_mount() should fail the old-style seal as a bad HMAC");
+
+		db = db_upgrade("t/tmp/new", key1);
+		isnt_null(db, "db_upgrade() should accept an old-style tslab header seal");
+		if (!db)
+			BAIL_OUT("db_upgrade(t/tmp/new) failed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		if (pread(fd, header, sizeof(header), 0) != sizeof(header))
+			BAIL_OUT("failed to re-read the tslab header");
+		close(fd);
+		ok(mac_check(key1, MAC_HMAC_SHA512, header, sizeof(header)) == 0,
+			"db_upgrade() should reseal the tslab header properly");
 
-#undef test_copy
+		db = db_mount("t/tmp/new", key1);
+		isnt_null(db, "db_mount() should succeed once the tslab header is resealed");
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		is_int(s_tally(db, "old|host=a", &wrong), 1, "the upgraded database should still have its measurements");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 	}
 
 	subtest {
 		struct db *db;
+		struct tslab *slab;
 		char metric[256];
-
+		size_t bsize, freed;
+		int i, fd, wrong;
 
 		if (system("./t/setup/db-init") != 0)
 			BAIL_OUT("t/setup/db-init failed!");
 
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+		for (i = 0; i < 3; i++) {
+			strcpy(metric, "kept|host=a");
+			if (db_insert(db, metric, 1234567890 + i * (bolo_msec_t)MAX_U32, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		bsize = item(db->slab.next, struct tslab, l)->block_size;
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* crash right after tslab_extend() grows the slab,
+		   but before the new tblock header makes it to disk */
+		fd = open("t/tmp/new/slabs/0000.0000/0000.0000.0000.0800.slab", O_RDWR);
+		if (fd < 0 || ftruncate(fd, 4096 + 4 * bsize) != 0)
+			BAIL_OUT("failed to grow the slab by a blank tblock");
+
 		db = db_mount("t/tmp/new", key1);
-		is_null(db, "db_mount() should fail with new (empty) new directories");
+		isnt_null(db, "db_mount() should accept a tblock with a blank header");
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		ok(db_warmup(db, 100) == 0, "db_warmup() should load a tblock with a blank header");
+		slab = item(db->slab.next, struct tslab, l);
+		ok(slab->blocks[3].valid && slab->blocks[3].version != 0 && slab->blocks[3].cells == 0,
+			"a blank tblock should load as an empty one");
+		ok(db_sweep(db, &freed) == 0, "db_sweep() should succeed");
+		is_unsigned(freed, 1, "db_sweep() should free the blank tblock for reuse");
+		is_int(s_tally(db, "kept|host=a", &wrong), 3, "the rest of the slab should be untouched");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* anything else we don't recognize is corruption */
+		if (pwrite(fd, "JUNKv9", 6, 4096 + 3 * bsize) != 6)
+			BAIL_OUT("failed to scribble over the tblock header");
+		close(fd);
 
-		db = db_init("t/tmp/old", key1);
-		is_null(db, "db_init() should fail with old (existing) data directories");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		errno = 0;
+		ok(db_warmup(db, 100) != 0, "db_warmup() should refuse a tblock with an unrecognized header");
+		is_int(errno, BOLO_EBADSLAB, "an unrecognized tblock header should fail as a bad slab");
+		ok(db_findblock(db, 0x800 | 0) == NULL, "no tblocks should be looked up in a slab that fails to load");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+	}
 
-		db = db_init("t/tmp/new", key1);
-		isnt_null(db, "db_init() should succeed with new (empty) new directories");
-		isnt_null(db->main, "db->main hash table should exist for a new database");
-		ok(isempty(&db->idx), "db->idx list should be empty on a new database");
-		ok(isempty(&db->slab), "db->slab list should be empty on a new database");
-		is_unsigned(tslab_number(db->next_tblock), (1 << 11),
-			"first tblock address of a new db should be in tslab 1");
-		is_unsigned(tblock_number(db->next_tblock), 0,
-			"first tblock address of a new db should be in tblock 0");
+	subtest {
+		struct db *db;
+		struct stat st;
+		struct logged logged[20];
+		char metric[256];
+		int i, fd, wrong;
 
-		strcpy(metric, "metric|host=localhost,env=test");
-		ok(db_insert(db, metric, 1234567890, 4567.89) == 0,
-			"db_insert() should succeed on fresh database");
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
 
-		strcpy(metric, "metric|host=localhost,env=test");
-		ok(db_insert(db, metric, 1234567890 + 1, 4567.91) == 0,
-			"db_insert() should succeed twice on fresh database");
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+		ok(db_wal(db, 0) == 0, "db_wal() should succeed");
 
-		strcpy(metric, "metric|host=localhost,env=test");
-		ok(db_insert(db, metric, 1234567890ul + (1ul << 33), 4567.91) == 0,
-			"db_insert() should succeed after exhausting block capacity (in time)");
+		for (i = 0; i < 10; i++) {
+			strcpy(metric, "wal|host=a");
+			if (db_insert(db, metric, 1234567890 + i * 1000, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		ok(db_commit(db) == 0, "db_commit() should succeed");
+		ok(stat("t/tmp/new/wal", &st) == 0 && st.st_size > 0, "db_commit() should write to the write-ahead log");
+
+		/* what a crash just before the log is emptied leaves */
+		ok(s_drainall(db) == 0, "draining the reorder buffers should succeed");
+		ok(stat("t/tmp/new/journal", &st) == 0 && st.st_size > 0, "new tblocks should be journaled");
+		if (system("cp t/tmp/new/wal t/tmp/wal.synced") != 0
+		 || system("cp t/tmp/new/journal t/tmp/journal.synced") != 0)
+			BAIL_OUT("failed to copy the write-ahead log");
+
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(stat("t/tmp/new/wal", &st) == 0 && st.st_size == 0, "db_sync() should empty the write-ahead log");
+		ok(stat("t/tmp/new/journal", &st) == 0 && st.st_size == 0, "db_sync() should empty the block journal");
+
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* these make it into tblocks, but not into main.db;
+		   only the log knows about the second series */
+		for (i = 10; i < 20; i++) {
+			logged[(i - 10) * 2].name      = "wal|host=a";
+			logged[(i - 10) * 2].ts        = 1234567890 + i * 1000;
+			logged[(i - 10) * 2].value     = i;
+			logged[(i - 10) * 2 + 1].name  = "wal|host=b";
+			logged[(i - 10) * 2 + 1].ts    = 1234567890 + i * 1000;
+			logged[(i - 10) * 2 + 1].value = i - 10;
+		}
+		ok(s_crash("t/tmp/new", key1, logged, 20, 0) == 0, "writing to the log and crashing should succeed");
 
-		ok(db_sync(db) == 0,
-			"db_sync() should succeed");
-		ok(db_unmount(db) == 0,
-			"db_unmount() should succeed");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		is_int(s_tally(db, "wal|host=a", &wrong), 20, "a replayed series should have every measurement, once");
+		is_int(wrong, 0, "a replayed series should have the right measurements");
+		is_int(s_tally(db, "wal|host=b", &wrong), 10, "an unsynced series should survive a remount, via the log");
+		is_int(wrong, 0, "an unsynced series should be replayed intact");
+		ok(stat("t/tmp/new/wal", &st) == 0 && st.st_size == 0, "replay should empty the write-ahead log");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* a log that was already synced replays to nothing new */
+		if (system("cp t/tmp/wal.synced t/tmp/new/wal") != 0
+		 || system("cp t/tmp/journal.synced t/tmp/new/journal") != 0)
+			BAIL_OUT("failed to restore the write-ahead log");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		is_int(s_tally(db, "wal|host=a", &wrong), 20, "replaying a synced log should not duplicate measurements");
+		is_int(wrong, 0, "replaying a synced log should leave the series as it was");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* half a frame, torn off by a crash */
+		if (system("cp t/tmp/wal.synced t/tmp/new/wal") != 0
+		 || system("cp t/tmp/journal.synced t/tmp/new/journal") != 0)
+			BAIL_OUT("failed to restore the write-ahead log");
+		fd = open("t/tmp/new/wal", O_WRONLY|O_APPEND);
+		if (fd < 0 || write(fd, "WALFv1\0\0\x01\0\0\0\xff\xff", 14) != 14)
+			BAIL_OUT("failed to tear the write-ahead log");
+		close(fd);
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed with a torn write-ahead log");
+		is_int(s_tally(db, "wal|host=a", &wrong), 20, "a torn frame should not be replayed");
+		ok(stat("t/tmp/new/wal", &st) == 0 && st.st_size == 0, "a torn frame should be discarded");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+		unlink("t/tmp/wal.synced");
+		unlink("t/tmp/journal.synced");
+
+		/* a clean unmount checkpoints, leaving nothing to replay */
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		ok(db_wal(db, 0) == 0, "db_wal() should succeed");
+		strcpy(metric, "wal|host=a");
+		if (db_insert(db, metric, 1234567890 + 20 * 1000, 20) != 0)
+			BAIL_OUT("failed to insert into db\n");
+		ok(db_commit(db) == 0, "db_commit() should succeed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+		ok(stat("t/tmp/new/wal", &st) == 0 && st.st_size == 0, "db_unmount() should empty the write-ahead log");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		is_int(s_tally(db, "wal|host=a", &wrong), 21, "db_unmount() should sync what was committed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+	}
 
+	subtest {
+		struct db *db;
+		struct idx *idx;
+		struct series_cursor c;
+		struct logged logged[105];
+		char metric[256];
+		int i, n, fives, sixes, sevens, nines;
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+		strcpy(metric, "dup|host=a");
+		if (db_insert(db, metric, 1234567890, 5.0) != 0)
+			BAIL_OUT("failed to insert into db\n");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* the same measurement again (it happens), and a pair of
+		   identical ones, all of which make it into the tblocks
+		   (but not a checkpoint) before the crash */
+		logged[0].name = "dup|host=a"; logged[0].ts = 1234567890;        logged[0].value = 5.0;
+		logged[1].name = "dup|host=a"; logged[1].ts = 1234567890 + 1000; logged[1].value = 6.0;
+		logged[2].name = "dup|host=a"; logged[2].ts = 1234567890 + 1000; logged[2].value = 6.0;
+		for (i = 3; i < 104; i++) {
+			logged[i].name  = "dup|host=a";
+			logged[i].ts    = 1234567890 + i * 1000;
+			logged[i].value = i;
+		}
+		/* (late enough to be merged into its tblock) */
+		logged[104].name = "dup|host=a"; logged[104].ts = 1234567890 + 500; logged[104].value = 9.0;
+		ok(s_crash("t/tmp/new", key1, logged, 105, 1) == 0, "writing to the log and tblocks, and crashing, should succeed");
 
 		db = db_mount("t/tmp/new", key1);
-		isnt_null(db, "db_mount() should succeed with newly-init'd data directories");
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		if (hash_get(db->main, &idx, "dup|host=a") != 0)
+			BAIL_OUT("failed to find the dup series");
+		n = fives = sixes = nines = 0;
+		if (series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0)
+			for (; series_next(&c) == 0; n++) {
+				if (c.ts == 1234567890        && c.value == 5.0) fives++;
+				if (c.ts == 1234567890 + 1000 && c.value == 6.0) sixes++;
+				if (c.ts == 1234567890 + 500  && c.value == 9.0) nines++;
+			}
+		is_int(n, 106, "replay should not duplicate measurements that made it into a tblock");
+		is_int(fives, 2, "replay should keep a measurement logged again after a checkpoint");
+		is_int(sixes, 2, "replay should keep identical measurements that made it into a tblock");
+		is_int(nines, 1, "replay should not duplicate a late measurement merged into a tblock");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* and again, with none of it making it into a tblock */
+		logged[0].ts = 1234567890 + 200000; logged[0].value = 7.0;
+		logged[1].ts = 1234567890 + 200000; logged[1].value = 7.0;
+		logged[2].ts = 1234567890;          logged[2].value = 5.0;
+		ok(s_crash("t/tmp/new", key1, logged, 3, 0) == 0, "writing to the log, and crashing, should succeed");
 
-		ok(db_unmount(db) == 0,
-			"db_unmount() should succeed");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		if (hash_get(db->main, &idx, "dup|host=a") != 0)
+			BAIL_OUT("failed to find the dup series");
+		n = fives = sevens = 0;
+		if (series_open(&c, db, idx, 0, ~(bolo_msec_t)0) == 0)
+			for (; series_next(&c) == 0; n++) {
+				if (c.ts == 1234567890          && c.value == 5.0) fives++;
+				if (c.ts == 1234567890 + 200000 && c.value == 7.0) sevens++;
+			}
+		is_int(n, 109, "replay should insert every measurement that didn't make it into a tblock");
+		is_int(fives, 3, "replay should not mistake a new measurement for one already in a tblock");
+		is_int(sevens, 2, "replay should keep identical measurements that only made it into the log");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 	}
 
 	subtest {
 		struct db *db;
-		uint64_t ts;
+		struct idx *idx;
+		struct tslab *slab;
+		struct tblock *block;
+		struct stat st;
+		ino_t ino;
+		off_t size;
 		char metric[256];
+		int i, fd;
 
 		if (system("./t/setup/db-init") != 0)
 			BAIL_OUT("t/setup/db-init failed!");
 
-		db = db_init("t/tmp/new", key2);
-		for (ts = 0; ts < TCELLS_PER_TBLOCK * 2 + 1; ts++) {
-			strcpy(metric, "metric|host=localhost,env=test");
-			if (db_insert(db, metric, 10001 + ts, 4567.89) != 0)
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+
+		for (i = 0; i < 50; i++) {
+			strcpy(metric, "quiet|host=a");
+			if (db_insert(db, metric, 1234567890 + i * (bolo_msec_t)MAX_U32, i) != 0)
 				BAIL_OUT("failed to insert into db\n");
 		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+
+		slab = item(db->slab.next, struct tslab, l);
+		if (hash_get(db->main, &idx, "quiet|host=a") != 0)
+			BAIL_OUT("failed to find the quiet series");
+		ok(!tslab_isdirty(slab), "tslabs should be clean after a db_sync()");
+		ok(!btree_isdirty(idx->btree), "btrees should be clean after a db_sync()");
+		ok(!db->maindirty, "main.db should be clean after a db_sync()");
+
+		if (stat("t/tmp/new/main.db", &st) != 0)
+			BAIL_OUT("failed to stat main.db");
+		ino = st.st_ino;
+		ok(db_sync(db) == 0, "db_sync() should succeed with nothing to do");
+		ok(stat("t/tmp/new/main.db", &st) == 0 && st.st_ino == ino,
+			"main.db should not be rewritten when nothing changed");
+
+		strcpy(metric, "quiet|host=a");
+		ok(db_insert(db, metric, 1234567890 + 50 * (bolo_msec_t)MAX_U32, 50) == 0, "should be able to insert");
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(stat("t/tmp/new/main.db", &st) == 0 && st.st_ino == ino,
+			"main.db should not be rewritten for measurements in existing series");
+		block = db_findblock(db, 0x800 | 50);
+		isnt_null(block, "db_findblock() should find the new tblock");
+		ok(!block->dirty && !block->unsynced, "new tblocks should be sealed and synced by db_sync()");
+		ok(tblock_check(block, key1) == 0, "new tblocks should pass integrity checks after db_sync()");
+		ok(!tslab_isdirty(slab) && !btree_isdirty(idx->btree), "everything should be clean after a db_sync()");
+
+		strcpy(metric, "fresh|host=b");
+		ok(db_insert(db, metric, 1234567890, 0) == 0, "should be able to insert into a new series");
+		ok(!db->maindirty, "new series should not need main.db rewritten");
+		is_unsigned(db->nfresh, 1, "new series should be queued for main.db");
+		size = st.st_size;
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(stat("t/tmp/new/main.db", &st) == 0 && st.st_ino == ino,
+			"main.db should be appended to (not rewritten) when a series is added");
+		is_unsigned(st.st_size, size + 10 + strlen("fresh|host=b"),
+			"main.db should grow by one record per new series");
+		is_unsigned(db->mainlen, st.st_size, "db->mainlen should track the size of main.db");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 
-		ok(hash_isset(db->metrics, "metric"),      "the 'metric' metric should be set in the metric index");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		ok(hash_isset(db->main, "fresh|host=b"), "new series should survive a remount");
+		is_int(s_tally(db, "quiet|host=a", &i), 51, "every measurement should survive a remount");
+
+		/* half a record, as if we crashed partway through an append */
+		fd = open("t/tmp/new/main.db", O_WRONLY|O_APPEND);
+		if (fd < 0 || write(fd, "\x01\x08\0\0\0\0\0\0\x20", 9) != 9)
+			BAIL_OUT("failed to tear main.db");
+		close(fd);
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 
-		ok(hash_isset(db->tags, "host"),           "the 'host' tag should be set in the tag index");
-		ok(hash_isset(db->tags, "host=localhost"), "the 'host=localhost' tag should be set in the tag index");
-		ok(hash_isset(db->tags, "env"),            "the 'env' tag should be set in the tag index");
-		ok(hash_isset(db->tags, "env=test"),       "the 'env=test' tag should be set in the tag index");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed on a torn main.db");
+		ok(hash_isset(db->main, "fresh|host=b"), "a torn main.db should keep its intact records");
+		ok(db->maindirty, "a torn main.db should be rewritten at the next sync");
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(stat("t/tmp/new/main.db", &st) == 0 && st.st_size == (off_t)db->mainlen,
+			"db_sync() should drop the torn record");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+	}
 
-		ok(db_sync(db) == 0,
-			"db_sync() should succeed");
-		ok(db_unmount(db) == 0,
-			"db_unmount() should succeed");
+	subtest {
+		struct db *db;
+		struct idx *idx;
+		uint64_t number;
+		char metric[256], magic[6];
+		FILE *f;
+		int fd, i;
 
-		db = db_mount("t/tmp/new", key2);
-		isnt_null(db, "mounted t/tmp/new a second time");
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
 
-		ok(hash_isset(db->metrics, "metric"),      "the 'metric' metric should be set in the metric index (post-read)");
+		db = db_init("t/tmp/new", key1, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+		for (i = 0; i < 10; i++) {
+			strcpy(metric, "legacy|host=a");
+			if (db_insert(db, metric, 1234567890 + i * 1000, i) != 0)
+				BAIL_OUT("failed to insert into db\n");
+		}
+		if (hash_get(db->main, &idx, "legacy|host=a") != 0)
+			BAIL_OUT("failed to find the legacy series");
+		number = idx->number;
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* the old, plain-text main.db format */
+		f = fopen("t/tmp/new/main.db", "w");
+		if (!f)
+			BAIL_OUT("failed to rewrite main.db");
+		fprintf(f, "legacy|host=a\t%lu\n", number);
+		fclose(f);
 
-		ok(hash_isset(db->tags, "host"),           "the 'host' tag should be set in the tag index (post-read)");
-		ok(hash_isset(db->tags, "host=localhost"), "the 'host=localhost' tag should be set in the tag index (post-read)");
-		ok(hash_isset(db->tags, "env"),            "the 'env' tag should be set in the tag index (post-read)");
-		ok(hash_isset(db->tags, "env=test"),       "the 'env=test' tag should be set in the tag index (post-read)");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed on a plain-text main.db");
+		ok(hash_isset(db->main, "legacy|host=a"), "db_mount() should read a plain-text main.db");
+		ok(db->maindirty, "a plain-text main.db should be upgraded at the next sync");
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		fd = open("t/tmp/new/main.db", O_RDONLY);
+		ok(fd >= 0 && read(fd, magic, 6) == 6 && memcmp(magic, "MAINv1", 6) == 0,
+			"db_sync() should rewrite a plain-text main.db in the journal format");
+		if (fd >= 0) close(fd);
 
-		ok(db_unmount(db) == 0,
-			"db_unmount() should succeed");
+		db = db_mount("t/tmp/new", key1);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed after upgrading main.db");
+		is_int(s_tally(db, "legacy|host=a", &i), 10, "every measurement should survive the upgrade");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
 	}
 
 	free(key1->key); free(key1);
@@ -19,7 +19,9 @@
 #define BOLO_ENOBLOCK  __bolo_errno(12)
 #define BOLO_EBLKCONT  __bolo_errno(13)
 #define BOLO_ERDONLY   __bolo_errno(14)
+#define BOLO_EBADCONF  __bolo_errno(15)
+#define BOLO_EBADROLL  __bolo_errno(16)
 
-#define BOLO_ERROR_TOP __bolo_errno(14)
+#define BOLO_ERROR_TOP __bolo_errno(16)
 
 #endif
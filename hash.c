@@ -1,34 +1,75 @@
 #include "bolo.h"
 
-static unsigned int
-s_hash_djb2(const char *key)
+/* a 64-bit multiply-and-shift hash, a word at a time
+   (instead of an octet at a time, like djb2), finished
+   off with the murmur3 64-bit finalizer */
+static uint64_t
+s_hash_mix64(const char *key)
 {
-	unsigned int h = 5381;
-
-	for (; *key; key++)
-		h = ((h << 5) + h) + *key; /* h * 33 + c */
+	uint64_t h, w;
+	size_t n;
+
+	n = strlen(key);
+	h = 0x9e3779b97f4a7c15ULL ^ n;
+	for (; n >= 8; n -= 8, key += 8) {
+		memcpy(&w, key, 8);
+		h ^= w;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 29;
+	}
+	w = 0;
+	memcpy(&w, key, n);
+	h ^= w;
 
+	h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
 	return h;
 }
 
-#define s_hash s_hash_djb2
-
-struct hbkt {
-	char *   key;
-	void *   ptr;
-	uint64_t val;
+#define s_hash(k) ((uint32_t)s_hash_mix64(k))
+
+/* hash tables are open-addressed, with Robin Hood probing:
+   each slot remembers how far it is from its home slot
+   (plus one, so that 0 means empty), and an insert that
+   has probed further than an occupant takes its place, and
+   carries on inserting that one instead.  that keeps probe
+   sequences short and even, and lets a lookup stop as soon
+   as it has probed further than the occupant it's looking at.
+
+   each slot also keeps the (32-bit) hash of its key, which
+   is both where the key lives (modulo the table size) and a
+   fingerprint that saves most of the strcmp()s. */
+struct hslot {
+	char    *key;
+	void    *ptr;
+	uint32_t hash;
+	uint32_t dist;
+};
 
-	struct hbkt *next;
+struct htab {
+	struct hslot *slots;
+	size_t        cap;  /* always a power of two (or 0) */
 };
 
-#define HASH_STRIDE  255
+/* tables grow (double) when they are 80% full.  rather than
+   move every key at once (a noticeable pause, for a million
+   keys), the old table sticks around, and each insert after
+   the resize moves the next HASH_MIGRATE of its slots into
+   the new table; lookups check both.  the old table is never
+   modified while this is going on, so its probe sequences
+   stay intact; slots before `moved` are simply ignored. */
+#define HASH_MINCAP  16
+#define HASH_MIGRATE 8
 struct hash {
 	size_t nset;
-	struct hbkt *hbkts[HASH_STRIDE];
+	struct htab tab;    /* the table new keys go into */
+	struct htab old;    /* the table being migrated, if any */
+	size_t      moved;  /* how many slots of old have been migrated */
 
 	/* for iteration */
-	int i;
-	struct hbkt *last;
+	size_t i;
+	struct hslot *last;
 };
 
 struct hash *
@@ -40,23 +81,103 @@ hash_new()
 void
 hash_free(struct hash *h)
 {
-	int i;
-	struct hbkt *b, *tmp;
+	size_t i;
 
 	if (!h)
 		return;
 
-	for (i = 0; i < HASH_STRIDE; i++) {
-		for (b = h->hbkts[i]; b; ) {
-			free(b->key);
+	for (i = 0; i < h->tab.cap; i++)
+		if (h->tab.slots[i].dist)
+			free(h->tab.slots[i].key);
+	for (i = h->moved; i < h->old.cap; i++)
+		if (h->old.slots[i].dist)
+			free(h->old.slots[i].key);
+
+	free(h->tab.slots);
+	free(h->old.slots);
+	free(h);
+}
+
+/* find `key` in `t`, ignoring the first `from` slots */
+static struct hslot *
+s_find(struct htab *t, size_t from, const char *key, uint32_t hash)
+{
+	struct hslot *s;
+	size_t i, mask;
+	uint32_t d;
+
+	if (!t->cap)
+		return NULL;
+
+	mask = t->cap - 1;
+	for (i = hash & mask, d = 1; ; i = (i + 1) & mask, d++) {
+		s = &t->slots[i];
+		if (s->dist < d)
+			return NULL; /* (empty slots have a dist of 0) */
+		if (s->hash == hash && streq(s->key, key))
+			return i < from ? NULL : s;
+	}
+}
 
-			tmp = b->next;
-			free(b);
-			b = tmp;
+/* put a key (that isn't already there) into `t` */
+static void
+s_place(struct htab *t, char *key, void *ptr, uint32_t hash)
+{
+	struct hslot in, tmp;
+	size_t i, mask;
+
+	in.key  = key;
+	in.ptr  = ptr;
+	in.hash = hash;
+	in.dist = 1;
+
+	mask = t->cap - 1;
+	for (i = hash & mask; ; i = (i + 1) & mask, in.dist++) {
+		if (!t->slots[i].dist) {
+			t->slots[i] = in;
+			return;
+		}
+		if (t->slots[i].dist < in.dist) {
+			tmp = t->slots[i];
+			t->slots[i] = in;
+			in = tmp;
 		}
 	}
+}
 
-	free(h);
+/* move (up to) `n` more slots from the old table into the new */
+static void
+s_migrate(struct hash *h, size_t n)
+{
+	struct hslot *s;
+
+	for (; n > 0 && h->moved < h->old.cap; n--) {
+		s = &h->old.slots[h->moved++];
+		if (s->dist)
+			s_place(&h->tab, s->key, s->ptr, s->hash);
+	}
+
+	if (h->old.cap && h->moved == h->old.cap) {
+		free(h->old.slots);
+		h->old.slots = NULL;
+		h->old.cap   = 0;
+		h->moved     = 0;
+	}
+}
+
+static void
+s_grow(struct hash *h)
+{
+	/* finish off the last resize first; with a few slots
+	   moved per insert, it has long since finished anyway */
+	s_migrate(h, h->old.cap);
+
+	h->old   = h->tab;
+	h->moved = 0;
+	h->tab.cap   = h->old.cap ? h->old.cap * 2 : HASH_MINCAP;
+	h->tab.slots = xcalloc(h->tab.cap, sizeof(struct hslot));
+
+	s_migrate(h, 0); /* (frees an empty old table) */
 }
 
 void
@@ -72,24 +193,39 @@ _hash_ebegn(struct hash *h, void *key, void *val)
 void
 _hash_enext(struct hash *h, void *key, void *val)
 {
+	struct hslot *s;
+
 	CHECK(h != NULL,                  "hash_each() { ... } given a NULL hash to iterate over");
 	CHECK(key != NULL || val != NULL, "hash_each() { ... } given NULL key and value destination pointers");
 
-	while (h->i < HASH_STRIDE && !h->last) {
-		h->last = h->hbkts[h->i++];
+	/* the new table, and then whatever is left of the old one.
+	   (inserting into the hash mid-iteration moves keys around) */
+	h->last = NULL;
+	for (; h->i < h->tab.cap + h->old.cap; h->i++) {
+		if (h->i < h->tab.cap)
+			s = &h->tab.slots[h->i];
+		else if (h->i - h->tab.cap >= h->moved)
+			s = &h->old.slots[h->i - h->tab.cap];
+		else
+			continue;
+
+		if (s->dist) {
+			h->last = s;
+			h->i++;
+			break;
+		}
 	}
 
 	if (h->last) {
 		if (key) *(char **)key = h->last->key;
 		if (val) *(void **)val = h->last->ptr;
-		h->last = h->last->next;
 	}
 }
 
 int
 _hash_edone(struct hash *h)
 {
-	return h->i >= HASH_STRIDE && h->last == NULL;
+	return h->last == NULL;
 }
 
 size_t
@@ -102,51 +238,51 @@ hash_nset(struct hash *h)
 int
 hash_set(struct hash *h, const char *key, void *val)
 {
-	unsigned int k;
-	struct hbkt *b;
+	struct hslot *s;
+	uint32_t k;
 
 	CHECK(h != NULL,   "hash_set() given a NULL hash to insert into");
 	CHECK(key != NULL, "hash_set() given a NULL key to insert");
 
-	k = s_hash(key) % HASH_STRIDE;
+	k = s_hash(key);
 
 	/* check existing data */
-	for (b = h->hbkts[k]; b; b = b->next) {
-		if (!streq(b->key, key))
-			continue;
-
-		b->ptr = val;
+	s = s_find(&h->tab, 0, key, k);
+	if (!s)
+		s = s_find(&h->old, h->moved, key, k);
+	if (s) {
+		s->ptr = val;
 		return 0;
 	}
 
-	/* not in existing data, prepend a new hbkt */
-	b = xalloc(1, sizeof(struct hbkt));
-	b->key = strdup(key);
-	b->ptr = val;
-	b->next = h->hbkts[k];
-	h->hbkts[k] = b;
+	/* not in existing data, insert a new slot */
+	if ((h->nset + 1) * 5 > h->tab.cap * 4)
+		s_grow(h);
+
+	s_place(&h->tab, strdup(key), val, k);
 	h->nset++;
+	s_migrate(h, HASH_MIGRATE);
 	return 0;
 }
 
 int
 hash_get(struct hash *h, void *dst, const char *key)
 {
-	unsigned int k;
-	struct hbkt *b;
+	struct hslot *s;
+	uint32_t k;
 
 	CHECK(h != NULL,   "hash_get() given a NULL hash to query");
 	CHECK(key != NULL, "hash_get() given a NULL key to lookup");
 
-	k = s_hash(key) % HASH_STRIDE;
+	k = s_hash(key);
 
 	/* check existing data */
-	for (b = h->hbkts[k]; b; b = b->next) {
-		if (!streq(b->key, key))
-			continue;
-
+	s = s_find(&h->tab, 0, key, k);
+	if (!s)
+		s = s_find(&h->old, h->moved, key, k);
+	if (s) {
 		if (dst)
-			*(void **)dst = b->ptr;
+			*(void **)dst = s->ptr;
 		return 0;
 	}
 
@@ -213,8 +349,9 @@ int
 hash_write(struct hash *h, int to, hash_writer_fn writer, void *udata)
 {
 	FILE *out;
-	int i, fd;
-	struct hbkt *b;
+	int fd;
+	char *k;
+	void *v;
 
 	CHECK(h != NULL, "hash_write() given a NULL hash pointer to write");
 	CHECK(to >= 0,   "hash_write() given an invalid file descriptor to write to");
@@ -234,9 +371,8 @@ hash_write(struct hash *h, int to, hash_writer_fn writer, void *udata)
 		return -1;
 	}
 
-	for (i = 0; i < HASH_STRIDE; i++)
-		for (b = h->hbkts[i]; b; b = b->next)
-			fprintf(out, "%s\t%lu\n", b->key, writer(b->key, b->ptr, udata));
+	hash_each(h, &k, &v)
+		fprintf(out, "%s\t%lu\n", k, writer(k, v, udata));
 
 	fclose(out);
 	return 0;
@@ -351,20 +487,67 @@ TESTS {
 	subtest {
 		struct hash *h;
 		char *key;
-		int i;
-		struct data d;
+		int i, bad;
+		struct data d[2], *v;
 
 		h = hash_new();
 		is_unsigned(hash_nset(h), 0, "hash initially has 0 keys");
-		for (i = 0; i < HASH_STRIDE + 1; i++) {
+		for (i = 0; i < 100000; i++) {
 			if (asprintf(&key, "key%d", i) <= 0)
 				BAIL_OUT("failed to generate a key for pigeon-hole test");
 
+			if (hash_set(h, key, &d[i % 2]) != 0)
+				fail("failed to set key %s => (data) in pigeon-hole test", key);
+			free(key);
+		}
+		is_unsigned(hash_nset(h), 100000, "each unique key/value increments hash cardinality");
+
+		for (bad = i = 0; i < 100000; i++) {
+			if (asprintf(&key, "key%d", i) <= 0)
+				BAIL_OUT("failed to generate a key for pigeon-hole test");
+			if (hash_get(h, &v, key) != 0 || v != &d[i % 2])
+				bad++;
+			free(key);
+		}
+		is_int(bad, 0, "every key should be retrievable after the hash has grown");
+
+		hash_free(h);
+	}
+
+	subtest {
+		struct hash *h;
+		struct data d, *v;
+		char *key;
+		int i, n, bad;
+
+		/* stop partway through migrating to a bigger table */
+		h = hash_new();
+		for (i = 0; i < 13; i++) {
+			if (asprintf(&key, "key%d", i) <= 0)
+				BAIL_OUT("failed to generate a key for migration test");
 			if (hash_set(h, key, &d) != 0)
-				fail("failed to set key %s => (data) in pigeon-hole test");
+				BAIL_OUT("failed to set a key for migration test");
 			free(key);
 		}
-		is_unsigned(hash_nset(h), HASH_STRIDE + 1, "each unique key/value increments hash cardinality");
+		ok(h->old.cap > 0 && h->moved < h->old.cap, "hash should be midway through a resize");
+
+		for (bad = i = 0; i < 13; i++) {
+			if (asprintf(&key, "key%d", i) <= 0)
+				BAIL_OUT("failed to generate a key for migration test");
+			if (hash_get(h, &v, key) != 0 || v != &d)
+				bad++;
+			free(key);
+		}
+		is_int(bad, 0, "every key should be retrievable mid-resize");
+
+		ok(hash_set(h, "key3", NULL) == 0, "should be able to overwrite a key mid-resize");
+		ok(hash_get(h, &v, "key3") == 0 && v == NULL, "overwritten key should have its new value");
+		is_unsigned(hash_nset(h), 13, "overwriting a key mid-resize should not add to the hash");
+
+		n = 0;
+		hash_each(h, &key, &v)
+			n++;
+		is_int(n, 13, "hash_each() should visit every key exactly once mid-resize");
 
 		hash_free(h);
 	}
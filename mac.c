@@ -0,0 +1,481 @@
+#include "bolo.h"
+
+/* block (and slab) seals are computed with one of several
+   keyed MAC algorithms, chosen per database at `bolo init`,
+   and recorded in each slab header:
+
+     MAC_HMAC_SHA512  (0)  HMAC-SHA-512; the original, and the
+                           default.  slabs from before there was
+                           a choice have a zero there, too.
+
+     MAC_BLAKE2B      (1)  keyed BLAKE2b-512 (RFC 7693), which
+                           is a good deal faster than SHA-512,
+                           and needs no HMAC construction on top
+                           of it to be used as a MAC.
+
+   both produce 64-octet digests, so the on-disk layout of
+   slabs and blocks doesn't change with the algorithm. */
+
+/* on x86-64 CPUs with AVX2, the BLAKE2b compression function
+   runs one row of its 4x4 working state per 256-bit register,
+   so that each column (and then diagonal) step does four G
+   mixes at once.  build with -DBLAKE2B_SIMD=0 to leave it out. */
+#ifndef BLAKE2B_SIMD
+#define BLAKE2B_SIMD 1
+#endif
+
+#if BLAKE2B_SIMD && defined(__x86_64__) && defined(__GNUC__)
+#  define BLAKE2B_AVX2 1
+#  include <immintrin.h>
+#endif
+
+/***************************************************************  BLAKE2b  ***/
+
+/* BLAKE2b uses the same IV as SHA-512 */
+static const uint64_t IV[8] = {
+	0x6a09e667f3bcc908ul, 0xbb67ae8584caa73bul, 0x3c6ef372fe94f82bul, 0xa54ff53a5f1d36f1ul,
+	0x510e527fade682d1ul, 0x9b05688c2b3e6c1ful, 0x1f83d9abfb41bd6bul, 0x5be0cd19137e2179ul,
+};
+
+static const uint8_t SIGMA[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+};
+
+#define ROTR64(x,n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define G(a,b,c,d,x,y) do { \
+	v[a] = v[a] + v[b] + (x); v[d] = ROTR64(v[d] ^ v[a], 32); \
+	v[c] = v[c] + v[d];       v[b] = ROTR64(v[b] ^ v[c], 24); \
+	v[a] = v[a] + v[b] + (y); v[d] = ROTR64(v[d] ^ v[a], 16); \
+	v[c] = v[c] + v[d];       v[b] = ROTR64(v[b] ^ v[c], 63); \
+} while (0)
+
+#ifdef BLAKE2B_AVX2
+__attribute__((target("avx2"), optimize("O2")))
+static void
+blake2b_compress4(struct blake2b *c, const uint64_t *m, int last)
+{
+	__m256i a, b, cc, d, a0, b0;
+	const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15,  8,  9,
+	                                     2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15,  8,  9);
+	const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15,  8,  9, 10,
+	                                     3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15,  8,  9, 10);
+	int r;
+
+#define v_rotr32(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define v_rotr24(x) _mm256_shuffle_epi8((x), r24)
+#define v_rotr16(x) _mm256_shuffle_epi8((x), r16)
+#define v_rotr63(x) _mm256_or_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+#define G4(x,y) do { \
+	a  = _mm256_add_epi64(_mm256_add_epi64(a, b), (x)); d = v_rotr32(_mm256_xor_si256(d, a)); \
+	cc = _mm256_add_epi64(cc, d);                       b = v_rotr24(_mm256_xor_si256(b, cc)); \
+	a  = _mm256_add_epi64(_mm256_add_epi64(a, b), (y)); d = v_rotr16(_mm256_xor_si256(d, a)); \
+	cc = _mm256_add_epi64(cc, d);                       b = v_rotr63(_mm256_xor_si256(b, cc)); \
+} while (0)
+#define M4(i,j,k,l) _mm256_set_epi64x(m[SIGMA[r][(l)]], m[SIGMA[r][(k)]], m[SIGMA[r][(j)]], m[SIGMA[r][(i)]])
+
+	a  = a0 = _mm256_loadu_si256((const __m256i *)&c->state[0]);
+	b  = b0 = _mm256_loadu_si256((const __m256i *)&c->state[4]);
+	cc = _mm256_loadu_si256((const __m256i *)&IV[0]);
+	d  = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&IV[4]),
+	                      _mm256_set_epi64x(0, last ? -1 : 0, c->bytes[1], c->bytes[0]));
+
+	for (r = 0; r < 12; r++) {
+		/* columns */
+		G4(M4(0, 2, 4, 6), M4(1, 3, 5, 7));
+
+		/* diagonals: rotate rows b, c and d left by 1, 2 and 3 lanes */
+		b  = _mm256_permute4x64_epi64(b,  _MM_SHUFFLE(0, 3, 2, 1));
+		cc = _mm256_permute4x64_epi64(cc, _MM_SHUFFLE(1, 0, 3, 2));
+		d  = _mm256_permute4x64_epi64(d,  _MM_SHUFFLE(2, 1, 0, 3));
+		G4(M4(8, 10, 12, 14), M4(9, 11, 13, 15));
+		b  = _mm256_permute4x64_epi64(b,  _MM_SHUFFLE(2, 1, 0, 3));
+		cc = _mm256_permute4x64_epi64(cc, _MM_SHUFFLE(1, 0, 3, 2));
+		d  = _mm256_permute4x64_epi64(d,  _MM_SHUFFLE(0, 3, 2, 1));
+	}
+
+	_mm256_storeu_si256((__m256i *)&c->state[0], _mm256_xor_si256(a0, _mm256_xor_si256(a, cc)));
+	_mm256_storeu_si256((__m256i *)&c->state[4], _mm256_xor_si256(b0, _mm256_xor_si256(b, d)));
+
+#undef v_rotr32
+#undef v_rotr24
+#undef v_rotr16
+#undef v_rotr63
+#undef G4
+#undef M4
+}
+#endif
+
+/* set to force the scalar compression function,
+   for testing the SIMD code against it. */
+static int blake2b_scalar = 0;
+
+static void
+blake2b_compress(struct blake2b *c, int last)
+{
+	uint64_t v[16], m[16];
+	int i, r;
+
+	for (i = 0; i < 16; i++)
+		m[i] = (uint64_t)c->block[i * 8 + 0]       | (uint64_t)c->block[i * 8 + 1] <<  8
+		     | (uint64_t)c->block[i * 8 + 2] << 16 | (uint64_t)c->block[i * 8 + 3] << 24
+		     | (uint64_t)c->block[i * 8 + 4] << 32 | (uint64_t)c->block[i * 8 + 5] << 40
+		     | (uint64_t)c->block[i * 8 + 6] << 48 | (uint64_t)c->block[i * 8 + 7] << 56;
+
+#ifdef BLAKE2B_AVX2
+	if (!blake2b_scalar && __builtin_cpu_supports("avx2")) {
+		blake2b_compress4(c, m, last);
+		return;
+	}
+#endif
+
+	for (i = 0; i < 8; i++) {
+		v[i]     = c->state[i];
+		v[i + 8] = IV[i];
+	}
+	v[12] ^= c->bytes[0];
+	v[13] ^= c->bytes[1];
+	if (last)
+		v[14] = ~v[14];
+
+	for (r = 0; r < 12; r++) {
+		G(0, 4,  8, 12, m[SIGMA[r][ 0]], m[SIGMA[r][ 1]]);
+		G(1, 5,  9, 13, m[SIGMA[r][ 2]], m[SIGMA[r][ 3]]);
+		G(2, 6, 10, 14, m[SIGMA[r][ 4]], m[SIGMA[r][ 5]]);
+		G(3, 7, 11, 15, m[SIGMA[r][ 6]], m[SIGMA[r][ 7]]);
+		G(0, 5, 10, 15, m[SIGMA[r][ 8]], m[SIGMA[r][ 9]]);
+		G(1, 6, 11, 12, m[SIGMA[r][10]], m[SIGMA[r][11]]);
+		G(2, 7,  8, 13, m[SIGMA[r][12]], m[SIGMA[r][13]]);
+		G(3, 4,  9, 14, m[SIGMA[r][14]], m[SIGMA[r][15]]);
+	}
+
+	for (i = 0; i < 8; i++)
+		c->state[i] ^= v[i] ^ v[i + 8];
+}
+
+void
+blake2b_init(struct blake2b *c, const void *key, size_t len)
+{
+	CHECK(c != NULL,  "blake2b_init() given a NULL blake2b context to initialize");
+	CHECK(len <= 64,  "blake2b_init() given a key longer than 64 octets");
+	CHECK(key != NULL || len == 0, "blake2b_init() given a NULL key");
+
+	memset(c, 0, sizeof(*c));
+	memcpy(c->state, IV, sizeof(IV));
+	/* parameter block: digest length, key length, fanout 1, depth 1 */
+	c->state[0] ^= 0x01010000 ^ (len << 8) ^ BLAKE2B_DIGEST;
+
+	/* a key goes in as a whole (zero-padded) first block */
+	if (len > 0) {
+		memcpy(c->block, key, len);
+		c->used = BLAKE2B_BLOCK;
+	}
+}
+
+void
+blake2b_feed(struct blake2b *c, const void *buf, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		/* the final block has to go through blake2b_done(),
+		   so only compress a full block once more data shows */
+		if (c->used == BLAKE2B_BLOCK) {
+			c->bytes[0] += BLAKE2B_BLOCK;
+			if (c->bytes[0] < BLAKE2B_BLOCK)
+				c->bytes[1]++; /* rollover */
+			blake2b_compress(c, 0);
+			c->used = 0;
+		}
+
+		n = MIN(len, BLAKE2B_BLOCK - c->used);
+		memcpy(c->block + c->used, buf, n);
+		c->used += n;
+		buf  = (const uint8_t *)buf + n;
+		len -= n;
+	}
+}
+
+void
+blake2b_done(struct blake2b *c, void *digest)
+{
+	int i;
+
+	CHECK(c != NULL,      "blake2b_done() given a NULL blake2b context to finish");
+	CHECK(digest != NULL, "blake2b_done() given a NULL buffer for the digest");
+
+	c->bytes[0] += c->used;
+	if (c->bytes[0] < c->used)
+		c->bytes[1]++; /* rollover */
+	memset(c->block + c->used, 0, BLAKE2B_BLOCK - c->used);
+	blake2b_compress(c, 1);
+
+	for (i = 0; i < BLAKE2B_DIGEST; i++)
+		((uint8_t *)digest)[i] = (uint8_t)(c->state[i / 8] >> (8 * (i % 8)));
+}
+
+/*******************************************************************  MAC  ***/
+
+const char *
+mac_name(int alg)
+{
+	switch (alg) {
+	case MAC_HMAC_SHA512: return "hmac-sha512";
+	case MAC_BLAKE2B:     return "blake2b";
+	default:              return NULL;
+	}
+}
+
+int
+mac_parse(const char *name)
+{
+	CHECK(name != NULL, "mac_parse() given a NULL algorithm name to parse");
+
+	if (streq(name, "hmac-sha512")) return MAC_HMAC_SHA512;
+	if (streq(name, "blake2b"))     return MAC_BLAKE2B;
+	return -1;
+}
+
+void
+mac_key(struct dbkey *k)
+{
+	uint8_t digest[BLAKE2B_DIGEST];
+	struct blake2b c;
+
+	CHECK(k != NULL,    "mac_key() given a NULL key to derive MAC states from");
+	CHECK(k->len > 0,   "mac_key() given an empty key");
+
+	hmac_sha512_key(&k->hmac, k->key, k->len);
+
+	/* BLAKE2b keys top out at 64 octets (and our keys are
+	   usually 128); longer keys get hashed down to size. */
+	if (k->len > BLAKE2B_DIGEST) {
+		blake2b_init(&c, NULL, 0);
+		blake2b_feed(&c, k->key, k->len);
+		blake2b_done(&c, digest);
+		blake2b_init(&k->blake2b, digest, BLAKE2B_DIGEST);
+	} else {
+		blake2b_init(&k->blake2b, k->key, k->len);
+	}
+}
+
+void
+mac_start(struct mac *m, struct dbkey *k, int alg)
+{
+	CHECK(m != NULL, "mac_start() given a NULL mac context to initialize");
+	CHECK(k != NULL, "mac_start() given a NULL key to seal with");
+
+	m->alg = alg;
+	switch (alg) {
+	case MAC_HMAC_SHA512: hmac_sha512_start(&m->u.hmac, &k->hmac); break;
+	case MAC_BLAKE2B:     memcpy(&m->u.blake2b, &k->blake2b, sizeof(k->blake2b)); break;
+	default:              insist(0, "mac_start() given an unrecognized MAC algorithm");
+	}
+}
+
+void
+mac_feed(struct mac *m, const void *buf, size_t len)
+{
+	switch (m->alg) {
+	case MAC_HMAC_SHA512: hmac_sha512_feed(&m->u.hmac, buf, len); break;
+	case MAC_BLAKE2B:     blake2b_feed(&m->u.blake2b, buf, len);  break;
+	}
+}
+
+void
+mac_done(struct mac *m, void *digest)
+{
+	switch (m->alg) {
+	case MAC_HMAC_SHA512:
+		hmac_sha512_done(&m->u.hmac);
+		if (hmac_sha512_raw(&m->u.hmac, digest, MAC_DIGEST) != 0)
+			memset(digest, 0, MAC_DIGEST);
+		break;
+
+	case MAC_BLAKE2B:
+		blake2b_done(&m->u.blake2b, digest);
+		break;
+	}
+}
+
+/* seal / check a buffer whose last MAC_DIGEST octets hold the
+   MAC of everything before them (and of MAC_DIGEST zeros). */
+static void
+s_digest(struct dbkey *k, int alg, const void *buf, size_t len, void *digest)
+{
+	struct mac m;
+	uint8_t zeros[MAC_DIGEST];
+
+	memset(zeros, 0, MAC_DIGEST);
+	mac_start(&m, k, alg);
+	mac_feed(&m, buf, len - MAC_DIGEST);
+	mac_feed(&m, zeros, MAC_DIGEST);
+	mac_done(&m, digest);
+}
+
+void
+mac_seal(struct dbkey *k, int alg, const void *buf, size_t len)
+{
+	CHECK(k != NULL,         "mac_seal() given a NULL key to seal with");
+	CHECK(buf != NULL,       "mac_seal() given a NULL buffer to seal");
+	CHECK(len > MAC_DIGEST,  "mac_seal() given an invalid buffer length");
+
+	s_digest(k, alg, buf, len, (uint8_t *)buf + len - MAC_DIGEST);
+}
+
+int
+mac_check(struct dbkey *k, int alg, const void *buf, size_t len)
+{
+	uint8_t digest[MAC_DIGEST];
+
+	CHECK(k != NULL,         "mac_check() given a NULL key to validate the seal with");
+	CHECK(buf != NULL,       "mac_check() given a NULL buffer to check");
+	CHECK(len > MAC_DIGEST,  "mac_check() given an invalid buffer length");
+
+	s_digest(k, alg, buf, len, digest);
+	return memcmp(digest, (uint8_t *)buf + len - MAC_DIGEST, MAC_DIGEST);
+}
+
+#ifdef TEST
+/* LCOV_EXCL_START */
+static void
+s_hex(const uint8_t *digest, char *hex)
+{
+	int i;
+
+	for (i = 0; i < BLAKE2B_DIGEST; i++)
+		snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+}
+
+TESTS {
+	subtest {
+		struct blake2b c;
+		uint8_t digest[BLAKE2B_DIGEST];
+		char hex[2 * BLAKE2B_DIGEST + 1];
+
+		blake2b_init(&c, NULL, 0);
+		blake2b_feed(&c, "abc", 3);
+		blake2b_done(&c, digest);
+		s_hex(digest, hex);
+		is_string(hex, "ba80a53f981c4d0d6a2797b69f12f6e94c212f14685ac4b74b12bb6fdbffa2d1"
+		               "7d87c5392aab792dc252d5de4533cc9518d38aa8dbf1925ab92386edd4009923",
+		  "RFC-7693 BLAKE2b-512('abc')");
+
+		blake2b_init(&c, NULL, 0);
+		blake2b_done(&c, digest);
+		s_hex(digest, hex);
+		is_string(hex, "786a02f742015903c6c6fd852552d272912f4740e15847618a86e217f71f5419"
+		               "d25e1031afee585313896444934eb04b903a685b1448b755d56f701afe9be2ce",
+		  "BLAKE2b-512('')");
+	}
+
+	subtest {
+		struct blake2b c;
+		uint8_t key[64], in[255], digest[BLAKE2B_DIGEST];
+		char hex[2 * BLAKE2B_DIGEST + 1];
+		int i;
+
+		for (i = 0; i < 64;  i++) key[i] = i;
+		for (i = 0; i < 255; i++) in[i]  = i;
+
+		blake2b_init(&c, key, sizeof(key));
+		blake2b_done(&c, digest);
+		s_hex(digest, hex);
+		is_string(hex, "10ebb67700b1868efb4417987acf4690ae9d972fb7a590c2f02871799aaa4786"
+		               "b5e996e8f0f4eb981fc214b005f42d2ff4233499391653df7aefcbc13fc51568",
+		  "keyed BLAKE2b-512 of nothing");
+
+		blake2b_init(&c, key, sizeof(key));
+		blake2b_feed(&c, in, 128);
+		blake2b_done(&c, digest);
+		s_hex(digest, hex);
+		is_string(hex, "72065ee4dd91c2d8509fa1fc28a37c7fc9fa7d5b3f8ad3d0d7a25626b57b1b44"
+		               "788d4caf806290425f9890a3a2a35a905ab4b37acfd0da6e4517b2525c9651e4",
+		  "keyed BLAKE2b-512 of exactly one block");
+
+		blake2b_init(&c, key, sizeof(key));
+		blake2b_feed(&c, in, 100);
+		blake2b_feed(&c, in + 100, 155);
+		blake2b_done(&c, digest);
+		s_hex(digest, hex);
+		is_string(hex, "142709d62e28fcccd0af97fad0f8465b971e82201dc51070faa0372aa43e9248"
+		               "4be1c1e73ba10906d5d1853db6a4106e0a7bf9800d373d6dee2d46d62ef2a461",
+		  "keyed BLAKE2b-512 of 255 octets, fed in pieces");
+	}
+
+	subtest {
+		struct blake2b c;
+		uint8_t in[1000], simd[BLAKE2B_DIGEST], scalar[BLAKE2B_DIGEST];
+		int i;
+
+		for (i = 0; i < 1000; i++) in[i] = (uint8_t)(i * 7 + 3);
+
+		blake2b_init(&c, "key", 3);
+		blake2b_feed(&c, in, sizeof(in));
+		blake2b_done(&c, simd);
+
+		blake2b_scalar = 1;
+		blake2b_init(&c, "key", 3);
+		blake2b_feed(&c, in, sizeof(in));
+		blake2b_done(&c, scalar);
+		blake2b_scalar = 0;
+
+		ok(memcmp(simd, scalar, BLAKE2B_DIGEST) == 0,
+			"BLAKE2b compression should agree with and without SIMD");
+	}
+
+	subtest {
+		struct dbkey key1, key2, *k1, *k2;
+		char box[100];
+		int alg;
+
+		is_string(mac_name(MAC_HMAC_SHA512), "hmac-sha512", "MAC 0 is HMAC-SHA-512");
+		is_string(mac_name(MAC_BLAKE2B),     "blake2b",     "MAC 1 is BLAKE2b");
+		is_null(mac_name(42), "there is no MAC 42");
+		is_int(mac_parse("blake2b"), MAC_BLAKE2B, "mac_parse() knows blake2b");
+		is_int(mac_parse("md5"), -1, "mac_parse() doesn't know md5");
+
+		key1.key = "\xde\xca\xfb\xad"; key1.len = 4; mac_key(k1 = &key1);
+		key2.key = "\xde\xad\xbe\xef"; key2.len = 4; mac_key(k2 = &key2);
+
+		for (alg = MAC_HMAC_SHA512; alg <= MAC_BLAKE2B; alg++) {
+			memset(box, 0, sizeof(box));
+			memcpy(box, "test", 4);
+
+			ok(mac_check(k1, alg, box, sizeof(box)) != 0,
+				"%s: mac_check() should fail on an unsealed box", mac_name(alg));
+
+			mac_seal(k1, alg, box, sizeof(box));
+			ok(mac_check(k1, alg, box, sizeof(box)) == 0,
+				"%s: mac_check() should succeed on a sealed box", mac_name(alg));
+			ok(mac_check(k2, alg, box, sizeof(box)) != 0,
+				"%s: mac_check() should fail with the wrong key", mac_name(alg));
+			ok(mac_check(k1, !alg, box, sizeof(box)) != 0,
+				"%s: mac_check() should fail with the wrong algorithm", mac_name(alg));
+
+			box[3] ^= 0x01;
+			ok(mac_check(k1, alg, box, sizeof(box)) != 0,
+				"%s: mac_check() should fail on a tampered-with box", mac_name(alg));
+		}
+
+		ok(hmac_sha512_check(k1->key, k1->len, box, sizeof(box)) != 0,
+			"(sanity) the BLAKE2b seal is not an HMAC-SHA-512 seal");
+		box[3] ^= 0x01;
+		mac_seal(k1, MAC_HMAC_SHA512, box, sizeof(box));
+		ok(hmac_sha512_check(k1->key, k1->len, box, sizeof(box)) == 0,
+			"MAC_HMAC_SHA512 seals are plain HMAC-SHA-512 seals");
+	}
+}
+/* LCOV_EXCL_STOP */
+#endif
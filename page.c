@@ -26,6 +26,7 @@ page_map(struct page *p, int fd, off_t start, size_t len)
 
 	p->fd   = fd;
 	p->len  = len;
+	p->borrowed = 0;
 	p->data = mmap(
 		NULL,         /* let kernel choose address */
 		p->len,       /* map the whole file        */
@@ -53,6 +54,55 @@ page_sync(struct page *p)
 	return msync(p->data, p->len, MS_SYNC);
 }
 
+int
+page_syncrange(struct page *p, size_t offset, size_t len)
+{
+	CHECK(p != NULL,              "page_syncrange() given a NULL page to synchronize");
+	CHECK(p->data != NULL,        "page_syncrange() given a page without a mapped region");
+	CHECK(offset + len <= p->len, "page_syncrange() given an out-of-range region to synchronize");
+	CHECK((offset & (sysconf(_SC_PAGESIZE) - 1)) == 0,
+	                              "page_syncrange() given a region that is not page-aligned");
+
+	return msync((uint8_t *)p->data + offset, len, MS_SYNC);
+}
+
+void
+page_borrow(struct page *p, struct page *from, size_t offset, size_t len)
+{
+	CHECK(p != NULL,                    "page_borrow() given a NULL page to map");
+	CHECK(from != NULL,                 "page_borrow() given a NULL page to borrow from");
+	CHECK(from->data != NULL,           "page_borrow() given an unmapped page to borrow from");
+	CHECK(offset + len <= from->len,    "page_borrow() given an out-of-range region to borrow");
+	CHECK((offset & (sysconf(_SC_PAGESIZE) - 1)) == 0,
+	                                    "page_borrow() given a region that is not page-aligned");
+
+	p->fd       = from->fd;
+	p->data     = (uint8_t *)from->data + offset;
+	p->len      = len;
+	p->borrowed = 1;
+}
+
+int
+page_advise(struct page *p, int hint)
+{
+	int advice;
+
+	CHECK(p != NULL,       "page_advise() given a NULL page to advise on");
+	CHECK(p->data != NULL, "page_advise() given an unmapped page to advise on");
+
+	switch (hint) {
+	case PAGE_SEQUENTIAL: advice = MADV_SEQUENTIAL; break;
+	case PAGE_WILLNEED:   advice = MADV_WILLNEED;   break;
+#ifdef MADV_HUGEPAGE
+	case PAGE_HUGE:       advice = MADV_HUGEPAGE;   break;
+#endif
+	default:              advice = MADV_NORMAL;     break;
+	}
+
+	/* these are only ever hints; the kernel is free to refuse */
+	return madvise(p->data, p->len, advice);
+}
+
 int
 page_unmap(struct page *p)
 {
@@ -61,13 +111,18 @@ page_unmap(struct page *p)
 	if (!p || !p->data || !p->len)
 		return 0; /* already unmapped */
 
+	if (p->borrowed)
+		goto done; /* the lender unmaps */
+
 	rc = munmap(p->data, p->len);
 	if (rc != 0)
 		return -1;
 
+done:
 	p->data = NULL;
 	p->len = 0;
 	p->fd = -1;
+	p->borrowed = 0;
 
 	return 0;
 }
@@ -229,6 +284,29 @@ TESTS {
 
 
 	ok(page_sync(&p)  == 0, "page_sync() should succeed");
+
+	subtest {
+		struct page sub;
+		size_t pgsz;
+
+		pgsz = sysconf(_SC_PAGESIZE);
+		memset(&sub, 0, sizeof(sub));
+		page_borrow(&sub, &p, 0, pgsz);
+		ok(sub.borrowed, "page_borrow() should mark the page as borrowed");
+		is_unsigned(page_read8(&sub, 0), 0x41,
+			"borrowed pages should see the lender's data");
+		page_write8(&sub, 1, 0x44);
+		is_unsigned(page_read8(&p, 1), 0x44,
+			"lenders should see writes to borrowed pages");
+		ok(page_sync(&sub) == 0, "page_sync() of a borrowed page should succeed");
+		ok(page_syncrange(&p, 0, pgsz) == 0, "page_syncrange() should succeed");
+		ok(page_advise(&sub, PAGE_WILLNEED) == 0, "page_advise() should accept hints");
+		ok(page_unmap(&sub) == 0, "page_unmap() of a borrowed page should succeed");
+		is_null(sub.data, "page_unmap() of a borrowed page should clear it out");
+		is_unsigned(page_read8(&p, 0), 0x41,
+			"page_unmap() of a borrowed page should leave the lender mapped");
+	}
+
 	ok(page_unmap(&p) == 0, "page_unmap() should succeed");
 }
 /* LCOV_EXCL_STOP */
@@ -275,19 +275,163 @@ query_free(struct query *q)
 	free(q);
 }
 
+/* feed every measurement in a block that falls within
+   [from, until] into a bucket consolidation function.
+   min / max / sum only need a single reduced value per
+   block, which tblock_reduce() can compute without ever
+   visiting the measurements one at a time. */
+static void
+s_sample(struct cf *bkt, struct tblock *block, bolo_msec_t from, bolo_msec_t until)
+{
+	struct tcursor c;
+	struct scan r;
+
+	/* blocks that lie entirely inside (or outside) of the
+	   bucket can be consolidated from their summary alone */
+	switch (tblock_overlap(block, from, until)) {
+	case TBLOCK_DISJOINT:
+		return;
+
+	case TBLOCK_WITHIN:
+		if (cf_summary(bkt, block->cells, &block->summary) == 0)
+			return;
+		break;
+	}
+
+	switch (bkt->type) {
+	case CF_MIN:
+	case CF_MAX:
+	case CF_SUM:
+		scan_init(&r);
+		tblock_reduce(block, from, until, &r);
+		if (r.count)
+			cf_sample(bkt, bkt->type == CF_MIN ? r.min
+			             : bkt->type == CF_MAX ? r.max : r.sum);
+		return;
+	}
+
+	tcursor_init(&c, block);
+	tcursor_seek(&c, from);
+	while (tcursor_next(&c) == 0) {
+		if (c.ts > until && tblock_issorted(block))
+			break;
+		if (c.ts >= from && c.ts <= until)
+			cf_sample(bkt, c.value);
+	}
+}
+
+/* consolidate every in-range measurement of a single series
+   into the buckets of a resultset, in one sequential sweep
+   through its blocks.  blocks that fit entirely inside of a
+   single bucket go through s_sample(), so that they can be
+   consolidated from their summary; everything else is fed
+   into the right bucket, one measurement at a time. */
+static void
+s_bucket(struct cf **bkts, struct resultset *rset, struct series_cursor *c)
+{
+	struct tblock *block;
+	bolo_msec_t width;
+	size_t j;
+
+	width = rset->results[0].finish - rset->results[0].start + 1;
+	while ((block = series_nextblock(c)) != NULL) {
+		if (block->version != 1) {
+			j = (block->base + block->summary.tsmin - c->from) / width;
+			if (block->base + block->summary.tsmin >= c->from && j < rset->len
+			 && tblock_overlap(block, rset->results[j].start,
+			                          rset->results[j].finish) == TBLOCK_WITHIN) {
+				s_sample(bkts[j], block, rset->results[j].start,
+				                         rset->results[j].finish);
+				continue;
+			}
+		}
+
+		tcursor_seek(&c->cell, c->from);
+		while (tcursor_next(&c->cell) == 0) {
+			if (c->cell.ts > c->until) {
+				if (tblock_issorted(block))
+					break;
+				continue;
+			}
+			if (c->cell.ts < c->from)
+				continue;
+
+			cf_sample(bkts[(c->cell.ts - c->from) / width], c->cell.value);
+		}
+	}
+}
+
+/* consolidate every measurement of a series in [from, until]
+   into a single bucket, from the widest rollup buckets (of
+   tier `t`) that fit inside of that range.  the ragged ends
+   on either side are covered by the next finer tier down,
+   and so on, until whatever is left is narrower than the
+   finest tier, and gets consolidated from raw measurements.
+   everything goes into the bucket in time order. */
+static void
+s_cover(struct cf *bkt, struct db *db, struct idx *idx, struct tier *tiers, int t,
+        bolo_msec_t from, bolo_msec_t until)
+{
+	struct series_cursor c;
+	struct tblock *block;
+	struct tier *tier;
+	bolo_msec_t lo, hi;
+	size_t i;
+
+	if (t < 0) {
+		if (series_open(&c, db, idx, from, until) != 0)
+			return;
+		while ((block = series_nextblock(&c)) != NULL)
+			s_sample(bkt, block, from, until);
+		return;
+	}
+
+	/* [lo, hi) is every whole rollup bucket in the range */
+	tier = &tiers[t];
+	lo = from + (tier->width - from % tier->width) % tier->width;
+	hi = until + 1 - (until + 1) % tier->width;
+	if (lo >= hi) {
+		s_cover(bkt, db, idx, tiers, t - 1, from, until);
+		return;
+	}
+
+	if (lo > from)
+		s_cover(bkt, db, idx, tiers, t - 1, from, lo - 1);
+	for (i = rollup_find(tier, lo); i < tier->n && tier->r[i].start < hi; i++)
+		if (cf_summary(bkt, tier->r[i].count, &tier->r[i].summary) != 0)
+			return; /* s_tier() keeps medians off of the rollups */
+	if (hi <= until)
+		s_cover(bkt, db, idx, tiers, t - 1, hi, until);
+}
+
+/* which rollup tier (if any) should a bucketed retrieve start
+   from?  the coarsest one whose buckets fit inside of the query
+   buckets; consolidation functions that need every measurement
+   (i.e. median) can't use the rollups at all. */
+static int
+s_tier(struct query *q)
+{
+	int t;
+
+	if (q->bucket.cf == CF_MEDIAN)
+		return -1;
+
+	for (t = ROLLUP_TIERS - 1; t >= 0; t--)
+		if (rollup_width(t) <= 1000ul * q->bucket.stride)
+			return t;
+	return -1;
+}
+
 #define QOPS_STACK_MAX 64
 
 static int
 s_qfield_exec(struct query *q, struct db *db, struct query_ctx *ctx, struct qfield *f)
 {
-	int i, j, k, strides, top, aggregated;
+	int i, j, k, strides, top, aggregated, tier;
 	struct resultset *stack[QOPS_STACK_MAX], *tmp;
-	struct cf *bkt, *aggr;
+	struct cf **bkts, *aggr;
 	struct multidx *set;
 
-	/* allocate the consolidation function context */
-	bkt = cf_new(q->bucket.cf, q->bucket.samples);
-
 	aggregated = 0;
 	top = -1;
 	for (i = 0; ; i++) {
@@ -318,7 +462,6 @@ s_qfield_exec(struct query *q, struct db *db, struct query_ctx *ctx, struct qfie
 			}
 
 			f->result = stack[top];
-			cf_free(bkt);
 			return 0;
 
 		case QOP_PUSH:
@@ -338,54 +481,31 @@ s_qfield_exec(struct query *q, struct db *db, struct query_ctx *ctx, struct qfie
 				/* see how many results there are */
 				n = 0;
 				for (set = f->ops[i].data.push.set; set; set = set->next) {
+					struct series_cursor c;
 					struct tblock *block;
-					uint64_t blkid;
 
-					if (btree_find(set->idx->btree, &blkid, from) != 0) {
+					if (series_open(&c, db, set->idx, from, until) != 0) {
 						fprintf(stderr, "failed to btree_find on metric %s\n", f->ops[i].data.push.metric);
 						return -1;
 					}
-
-					block = db_findblock(db, blkid);
-					while (block) {
-						int k;
-						bolo_msec_t ts;
-
-						for (k = 0; k < block->cells; k++) {
-							ts = tblock_ts(block, k);
-							if (ts >= from && ts <= until)
-								n++;
-						}
-
-						block = db_findblock(db, block->next);
-					}
+					while ((block = series_nextblock(&c)) != NULL)
+						n += tblock_count(block, from, until);
 				}
 				/* allocate a resultset */
 				tmp = xalloc(1, sizeof(*tmp) + sizeof(struct result) * n);
 				tmp->len = n; n = 0;
 				for (set = f->ops[i].data.push.set; set; set = set->next) {
-					struct tblock *block;
-					uint64_t blkid;
+					struct series_cursor c;
 
-					if (btree_find(set->idx->btree, &blkid, from) != 0) {
+					if (series_open(&c, db, set->idx, from, until) != 0) {
 						fprintf(stderr, "failed to btree_find on metric %s\n", f->ops[i].data.push.metric);
+						free_resultset(tmp);
 						return -1;
 					}
-
-					block = db_findblock(db, blkid);
-					while (block) {
-						int k;
-						for (k = 0; k < block->cells; k++) {
-							bolo_msec_t ts;
-
-							ts = tblock_ts(block, k);
-							if (ts >= from && ts <= until) {
-								tmp->results[n].finish = tmp->results[n].start = ts;
-								tmp->results[n].value = tblock_value(block, k);
-								n++;
-							}
-						}
-						block = db_findblock(db, block->next);
+					while (series_next(&c) == 0) {
+						tmp->results[n].finish = tmp->results[n].start = c.ts;
+						tmp->results[n].value = c.value;
+						n++;
 					}
 				}
 				stack[top] = tmp;
@@ -397,36 +517,54 @@ s_qfield_exec(struct query *q, struct db *db, struct query_ctx *ctx, struct qfie
 				                           ctx->now / 1000 + q->from,
 				                           ctx->now / 1000 + q->until);
 
-				/* consolidate the sample set on bucketing parameters */
+				if (stack[top]->len == 0)
+					break;
+
+				/* one consolidation function context per bucket */
+				bkts = xalloc(stack[top]->len, sizeof(struct cf *));
 				for (j = 0; (unsigned)j < stack[top]->len; j++) {
-					cf_reset(bkt);
-					for (set = f->ops[i].data.push.set; set; set = set->next) {
-						struct tblock *block;
-						uint64_t blkid;
-
-						if (btree_find(set->idx->btree, &blkid, stack[top]->results[j].start) != 0) {
-							fprintf(stderr, "failed to btree_find on metric %s\n", f->ops[i].data.push.metric);
-							cf_free(bkt);
-							free_resultset(stack[top]);
-							return -1;
-						}
-
-						block = db_findblock(db, blkid);
-						while (block) {
-							int k;
-							bolo_msec_t ts;
-
-							for (k = 0; k < block->cells; k++) {
-								ts = tblock_ts(block, k);
-								if (ts >= stack[top]->results[j].start && ts <= stack[top]->results[j].finish)
-									cf_sample(bkt, tblock_value(block, k));
-							}
-
-							block = db_findblock(db, block->next);
-						}
+					bkts[j] = cf_new(q->bucket.cf, q->bucket.samples);
+					cf_reset(bkts[j]);
+				}
+
+				/* consolidate the sample set on bucketing parameters,
+				   from the rollups if the buckets are wide enough, or
+				   with a single pass through each series if not */
+				tier = s_tier(q);
+				for (set = f->ops[i].data.push.set; set; set = set->next) {
+					struct series_cursor c;
+					struct tier *tiers;
+
+					if (tier >= 0 && (tiers = db_rollups(db, set->idx)) != NULL) {
+						for (j = 0; (unsigned)j < stack[top]->len; j++)
+							s_cover(bkts[j], db, set->idx, tiers, tier,
+							        stack[top]->results[j].start, stack[top]->results[j].finish);
+						continue;
+					}
+
+					if (series_open(&c, db, set->idx, stack[top]->results[0].start,
+					                                  stack[top]->results[stack[top]->len - 1].finish) != 0) {
+						fprintf(stderr, "failed to btree_find on metric %s\n", f->ops[i].data.push.metric);
+						for (j = 0; (unsigned)j < stack[top]->len; j++)
+							cf_free(bkts[j]);
+						free(bkts);
+						free_resultset(stack[top]);
+						return -1;
 					}
-					stack[top]->results[j].value = cf_value(bkt);
+					s_bucket(bkts, stack[top], &c);
+				}
+
+				for (j = 0; (unsigned)j < stack[top]->len; j++) {
+					/* deltas are measured from the last value of the
+					   previous bucket (or zero, if it was empty) */
+					if (q->bucket.cf == CF_DELTA && bkts[j]->n)
+						bkts[j]->rsv[0] = j > 0 && bkts[j-1]->n ? bkts[j-1]->rsv[1] : 0.0;
+
+					stack[top]->results[j].value = cf_value(bkts[j]);
 				}
+				for (j = 0; (unsigned)j < stack[top]->len; j++)
+					cf_free(bkts[j]);
+				free(bkts);
 			}
 			break;
 
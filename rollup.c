@@ -0,0 +1,350 @@
+#include "bolo.h"
+#include <sys/stat.h>
+
+/* ROLLUP file format:
+
+     0 "ROLLv1" (6)  (resv) (2)
+     8 ENDIAN CANARY (4)  (resv) (4)
+    16 WIDTH (8)
+    24 NEWEST (8)
+    32 buckets ...
+
+   each bucket is: START (8), COUNT (8), MIN, MAX, SUM, SUMSQ,
+   FIRST, LAST (8 each, IEEE-754), and then TSMIN / TSMAX (4
+   each), for 72 octets.  everything is in host byte order;
+   a file written on a host with a different byte order will
+   fail its canary check, and get rebuilt from raw data. */
+#define ENDIAN_MAGIC 2127639116U
+#define HEADER_SIZE  32
+#define BUCKET_SIZE  72
+
+static const bolo_msec_t WIDTHS[ROLLUP_TIERS] = {
+	60 * 1000ul,           /* 1m */
+	60 * 60 * 1000ul,      /* 1h */
+	24 * 60 * 60 * 1000ul, /* 1d */
+};
+
+static const char *NAMES[ROLLUP_TIERS] = { "1m", "1h", "1d" };
+
+void
+rollup_init(struct tier *t, int tier)
+{
+	CHECK(t != NULL, "rollup_init() given a NULL tier to initialize");
+	CHECK(tier >= 0 && tier < ROLLUP_TIERS, "rollup_init() given an invalid tier");
+
+	memset(t, 0, sizeof(*t));
+	t->width = WIDTHS[tier];
+}
+
+void
+rollup_free(struct tier *t)
+{
+	if (!t)
+		return;
+
+	free(t->r);
+	t->r = NULL;
+	t->n = t->cap = t->dirty = t->ondisk = 0;
+}
+
+bolo_msec_t
+rollup_width(int tier)
+{
+	CHECK(tier >= 0 && tier < ROLLUP_TIERS, "rollup_width() given an invalid tier");
+	return WIDTHS[tier];
+}
+
+const char *
+rollup_name(int tier)
+{
+	CHECK(tier >= 0 && tier < ROLLUP_TIERS, "rollup_name() given an invalid tier");
+	return NAMES[tier];
+}
+
+size_t
+rollup_find(struct tier *t, bolo_msec_t ts)
+{
+	size_t lo, hi, mid;
+
+	CHECK(t != NULL, "rollup_find() given a NULL tier to search");
+
+	/* first bucket that starts at (or after) ts */
+	lo = 0; hi = t->n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (t->r[mid].start < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* make room for a new bucket at r[i] */
+static struct rollup *
+s_insert(struct tier *t, size_t i, bolo_msec_t start)
+{
+	if (t->n == t->cap) {
+		t->cap = t->cap ? t->cap * 2 : 64;
+		t->r = realloc(t->r, t->cap * sizeof(*t->r));
+		insist(t->r != NULL, "rollup_add() unable to allocate memory for more buckets");
+	}
+
+	memmove(&t->r[i + 1], &t->r[i], (t->n - i) * sizeof(*t->r));
+	memset(&t->r[i], 0, sizeof(*t->r));
+	t->r[i].start = start;
+	t->n++;
+	return &t->r[i];
+}
+
+void
+rollup_add(struct tier *t, bolo_msec_t when, bolo_value_t what)
+{
+	struct rollup *r;
+	bolo_msec_t start;
+	uint32_t rel;
+	size_t i;
+
+	CHECK(t != NULL, "rollup_add() given a NULL tier to roll up into");
+
+	start = when - when % t->width;
+	rel   = (uint32_t)(when - start);
+
+	/* almost everything lands in the newest bucket */
+	if (t->n && t->r[t->n - 1].start == start)
+		i = t->n - 1;
+	else if (!t->n || t->r[t->n - 1].start < start)
+		s_insert(t, i = t->n, start);
+	else if ((i = rollup_find(t, start)) == t->n || t->r[i].start != start)
+		s_insert(t, i, start);
+
+	r = &t->r[i];
+	if (r->count == 0) {
+		r->summary.tsmin = r->summary.tsmax = rel;
+		r->summary.min   = r->summary.max   = what;
+		r->summary.first = r->summary.last  = what;
+	}
+
+	if (rel  <  r->summary.tsmin) { r->summary.tsmin = rel; r->summary.first = what; }
+	if (rel  >= r->summary.tsmax) { r->summary.tsmax = rel; r->summary.last  = what; }
+	if (what <  r->summary.min)   r->summary.min = what;
+	if (what >  r->summary.max)   r->summary.max = what;
+	r->summary.sum   += what;
+	r->summary.sumsq += what * what;
+	r->count++;
+
+	if (i < t->dirty)
+		t->dirty = i;
+	if (when > t->newest)
+		t->newest = when;
+}
+
+void
+rollup_trim(struct tier *t, bolo_msec_t before)
+{
+	size_t i;
+
+	CHECK(t != NULL, "rollup_trim() given a NULL tier to trim");
+
+	/* drop every bucket that ends before `before` */
+	for (i = 0; i < t->n && t->r[i].start + t->width <= before; i++)
+		;
+	if (i == 0)
+		return;
+
+	memmove(&t->r[0], &t->r[i], (t->n - i) * sizeof(*t->r));
+	t->n -= i;
+	t->dirty = 0; /* everything moved */
+}
+
+static void
+s_pack(uint8_t *buf, struct rollup *r)
+{
+	write64 (buf,  0, r->start);
+	write64 (buf,  8, r->count);
+	write64f(buf, 16, r->summary.min);
+	write64f(buf, 24, r->summary.max);
+	write64f(buf, 32, r->summary.sum);
+	write64f(buf, 40, r->summary.sumsq);
+	write64f(buf, 48, r->summary.first);
+	write64f(buf, 56, r->summary.last);
+	write32 (buf, 64, r->summary.tsmin);
+	write32 (buf, 68, r->summary.tsmax);
+}
+
+static void
+s_unpack(struct rollup *r, const uint8_t *buf)
+{
+	memset(r, 0, sizeof(*r));
+	r->start         = read64 (buf,  0);
+	r->count         = read64 (buf,  8);
+	r->summary.min   = read64f(buf, 16);
+	r->summary.max   = read64f(buf, 24);
+	r->summary.sum   = read64f(buf, 32);
+	r->summary.sumsq = read64f(buf, 40);
+	r->summary.first = read64f(buf, 48);
+	r->summary.last  = read64f(buf, 56);
+	r->summary.tsmin = read32 (buf, 64);
+	r->summary.tsmax = read32 (buf, 68);
+}
+
+int
+rollup_read(struct tier *t, int fd)
+{
+	uint8_t header[HEADER_SIZE], *buf;
+	struct stat st;
+	size_t i, n;
+
+	CHECK(t != NULL, "rollup_read() given a NULL tier to read into");
+	CHECK(fd >= 0,   "rollup_read() given an invalid file descriptor");
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+
+	errno = BOLO_EBADROLL;
+	if (st.st_size < HEADER_SIZE || (st.st_size - HEADER_SIZE) % BUCKET_SIZE != 0)
+		return -1;
+
+	if (pread(fd, header, HEADER_SIZE, 0) != HEADER_SIZE
+	 || memcmp(header, "ROLLv1", 6) != 0
+	 || read32(header, 8) != ENDIAN_MAGIC
+	 || read64(header, 16) != t->width)
+		return -1;
+
+	n   = (st.st_size - HEADER_SIZE) / BUCKET_SIZE;
+	buf = xmalloc(n * BUCKET_SIZE + 1);
+	if (pread(fd, buf, n * BUCKET_SIZE, HEADER_SIZE) != (ssize_t)(n * BUCKET_SIZE)) {
+		free(buf);
+		errno = BOLO_EBADROLL;
+		return -1;
+	}
+
+	rollup_free(t);
+	t->newest = read64(header, 24);
+	t->cap = t->n = t->dirty = t->ondisk = n;
+	t->r = xcalloc(n ? n : 1, sizeof(*t->r));
+	for (i = 0; i < n; i++)
+		s_unpack(&t->r[i], buf + i * BUCKET_SIZE);
+
+	free(buf);
+	return 0;
+}
+
+int
+rollup_write(struct tier *t, int fd)
+{
+	uint8_t header[HEADER_SIZE], *buf;
+	size_t i, n;
+	ssize_t nwrit;
+
+	CHECK(t != NULL, "rollup_write() given a NULL tier to write out");
+	CHECK(fd >= 0,   "rollup_write() given an invalid file descriptor");
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, "ROLLv1", 6);
+	write32(header,  8, ENDIAN_MAGIC);
+	write64(header, 16, t->width);
+	write64(header, 24, t->newest);
+	if (pwrite(fd, header, HEADER_SIZE, 0) != HEADER_SIZE)
+		return -1;
+
+	/* only the buckets that changed since the last write */
+	if (t->dirty < t->n) {
+		n   = t->n - t->dirty;
+		buf = xmalloc(n * BUCKET_SIZE);
+		for (i = 0; i < n; i++)
+			s_pack(buf + i * BUCKET_SIZE, &t->r[t->dirty + i]);
+
+		nwrit = pwrite(fd, buf, n * BUCKET_SIZE, HEADER_SIZE + t->dirty * BUCKET_SIZE);
+		free(buf);
+		if (nwrit != (ssize_t)(n * BUCKET_SIZE))
+			return -1;
+	}
+
+	if (ftruncate(fd, HEADER_SIZE + t->n * BUCKET_SIZE) != 0)
+		return -1;
+
+	t->dirty = t->ondisk = t->n;
+	return 0;
+}
+
+#ifdef TEST
+/* LCOV_EXCL_START */
+TESTS {
+	subtest {
+		struct tier t, u;
+		char file[] = "/tmp/bolo-rollup-XXXXXX";
+		size_t i;
+		int fd, bad;
+
+		rollup_init(&t, 0);
+		is_unsigned(t.width, 60 * 1000, "tier 0 should be one minute wide");
+		is_string(rollup_name(0), "1m", "tier 0 should be called 1m");
+		ok(!rollup_isdirty(&t), "a new tier has nothing to write out");
+
+		/* ten minutes, every ten seconds */
+		for (i = 0; i < 60; i++)
+			rollup_add(&t, 1500000000000ul + i * 10000, i);
+		is_unsigned(t.n, 10, "ten minutes of 10s measurements should fill ten 1m buckets");
+		is_unsigned(t.r[0].count, 6, "each 1m bucket should hold six measurements");
+		ok(t.r[3].summary.min == 18, "bucket min should be tracked");
+		ok(t.r[3].summary.max == 23, "bucket max should be tracked");
+		ok(t.r[3].summary.sum == 18+19+20+21+22+23, "bucket sum should be tracked");
+		ok(t.r[3].summary.first == 18 && t.r[3].summary.last == 23, "bucket first / last should be tracked");
+
+		/* late arrivals land in the right bucket */
+		rollup_add(&t, 1500000000000ul + 3 * 60000 - 5000, -1);
+		is_unsigned(t.r[2].count, 7, "late measurements should be rolled up into their bucket");
+		ok(t.r[2].summary.min == -1 && t.r[2].summary.last == -1, "late measurements can still be the last in their bucket");
+		rollup_add(&t, 1500000000000ul - 120000, 42);
+		is_unsigned(t.n, 11, "measurements before the first bucket get a new bucket");
+		is_unsigned(t.r[0].start, 1500000000000ul - 120000, "the new bucket should go first");
+		is_unsigned(t.dirty, 0, "the whole tier should be dirty");
+
+		fd = mkstemp(file);
+		if (fd < 0)
+			BAIL_OUT("failed to create a temporary file");
+		unlink(file);
+		ok(rollup_write(&t, fd) == 0, "rollup_write() should succeed");
+
+		rollup_add(&t, t.newest + 60000, 99);
+		is_unsigned(t.dirty, 11, "only new buckets should be dirty after a write");
+		ok(rollup_write(&t, fd) == 0, "rollup_write() should succeed");
+
+		rollup_init(&u, 0);
+		ok(rollup_read(&u, fd) == 0, "rollup_read() should succeed");
+		is_unsigned(u.n, t.n, "rollup_read() should read every bucket back");
+		is_unsigned(u.newest, t.newest, "rollup_read() should read the newest timestamp back");
+		for (bad = 0, i = 0; i < t.n; i++)
+			if (u.r[i].start != t.r[i].start || u.r[i].count != t.r[i].count
+			 || u.r[i].summary.sum != t.r[i].summary.sum
+			 || u.r[i].summary.last != t.r[i].summary.last)
+				bad++;
+		is_int(bad, 0, "rollup_read() should read back what was written");
+
+		rollup_trim(&u, u.r[5].start + 1);
+		is_unsigned(u.n, t.n - 5, "rollup_trim() should drop buckets that end before the cutoff");
+		is_unsigned(u.r[0].start, t.r[5].start, "rollup_trim() should keep a bucket that straddles the cutoff");
+		ok(rollup_isdirty(&u), "a trimmed tier should need writing out");
+		ok(rollup_write(&u, fd) == 0, "rollup_write() should succeed after a trim");
+		rollup_free(&u);
+
+		rollup_init(&u, 0);
+		ok(rollup_read(&u, fd) == 0 && u.n == t.n - 5, "trimmed rollups should be written out in full");
+		rollup_free(&u);
+
+		rollup_init(&u, 1);
+		ok(rollup_read(&u, fd) != 0, "rollup_read() should refuse a file for a different tier");
+		rollup_free(&u);
+
+		is_unsigned(rollup_find(&t, 0), 0, "rollup_find() before the first bucket should find it");
+		is_unsigned(rollup_find(&t, t.r[4].start), 4, "rollup_find() should find exact bucket starts");
+		is_unsigned(rollup_find(&t, t.r[4].start + 1), 5, "rollup_find() should find the next bucket");
+		is_unsigned(rollup_find(&t, ~(bolo_msec_t)0), t.n, "rollup_find() past the end should find nothing");
+
+		close(fd);
+		rollup_free(&t);
+	}
+}
+/* LCOV_EXCL_STOP */
+#endif
@@ -0,0 +1,294 @@
+#include "bolo.h"
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define SCAN_X86 1
+#  include <immintrin.h>
+#endif
+
+/* The scan kernels operate on columnar (BLOKv4) data: a
+   contiguous array of 32-bit relative timestamps, and a
+   parallel array of 64-bit IEEE-754 values.  Cells whose
+   timestamp falls within [lo, hi] (inclusive) are counted,
+   and (for scan_reduce) folded into a min / max / sum.
+
+   Each kernel has a portable scalar implementation, and
+   SSE2 / AVX2 implementations on x86 hardware; which one
+   gets used is decided once, at runtime, based on what
+   the CPU says it supports. */
+
+static size_t
+s_count_scalar(const uint32_t *ts, size_t n, uint32_t lo, uint32_t hi)
+{
+	size_t i, c;
+
+	for (c = i = 0; i < n; i++)
+		c += (ts[i] >= lo && ts[i] <= hi);
+	return c;
+}
+
+static void
+s_reduce_scalar(const uint32_t *ts, const double *v, size_t n, uint32_t lo, uint32_t hi, struct scan *r)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (ts[i] < lo || ts[i] > hi)
+			continue;
+		if (v[i] < r->min) r->min = v[i];
+		if (v[i] > r->max) r->max = v[i];
+		r->sum += v[i];
+		r->count++;
+	}
+}
+
+#ifdef SCAN_X86
+/* there are no unsigned 32-bit comparisons in SSE2 / AVX2,
+   so we flip the sign bit of both sides and compare them
+   as signed integers instead. */
+#define BIAS 0x80000000u
+
+__attribute__((target("sse2")))
+static __m128i
+s_inrange128(__m128i t, __m128i lo, __m128i hi)
+{
+	t = _mm_xor_si128(t, _mm_set1_epi32((int)BIAS));
+	return _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi32(lo, t),
+	                                     _mm_cmpgt_epi32(t, hi)),
+	                        _mm_set1_epi32(-1));
+}
+
+__attribute__((target("sse2")))
+static size_t
+s_count_sse2(const uint32_t *ts, size_t n, uint32_t lo, uint32_t hi)
+{
+	size_t i, c;
+	__m128i vlo, vhi, m;
+
+	vlo = _mm_set1_epi32((int)(lo ^ BIAS));
+	vhi = _mm_set1_epi32((int)(hi ^ BIAS));
+
+	for (c = i = 0; i + 4 <= n; i += 4) {
+		m = s_inrange128(_mm_loadu_si128((const __m128i *)(ts + i)), vlo, vhi);
+		c += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m)));
+	}
+	return c + s_count_scalar(ts + i, n - i, lo, hi);
+}
+
+__attribute__((target("sse2")))
+static void
+s_reduce_sse2(const uint32_t *ts, const double *v, size_t n, uint32_t lo, uint32_t hi, struct scan *r)
+{
+	size_t i;
+	double tmp[2];
+	__m128i vlo, vhi, m;
+	__m128d x, m2, mn, mx, sum, pinf, ninf;
+
+	vlo  = _mm_set1_epi32((int)(lo ^ BIAS));
+	vhi  = _mm_set1_epi32((int)(hi ^ BIAS));
+	pinf = _mm_set1_pd(INFINITY);
+	ninf = _mm_set1_pd(-INFINITY);
+	mn   = pinf;
+	mx   = ninf;
+	sum  = _mm_setzero_pd();
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		m = s_inrange128(_mm_loadl_epi64((const __m128i *)(ts + i)), vlo, vhi);
+		r->count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m)) & 0x3);
+
+		/* widen the two 32-bit lane masks to 64-bit lanes */
+		m2 = _mm_castsi128_pd(_mm_unpacklo_epi32(m, m));
+		x  = _mm_loadu_pd(v + i);
+
+		/* out-of-range lanes become identities (+inf, -inf, 0);
+		   putting x first means NaNs are ignored, like the
+		   scalar comparisons do. */
+		mn  = _mm_min_pd(_mm_or_pd(_mm_and_pd(m2, x), _mm_andnot_pd(m2, pinf)), mn);
+		mx  = _mm_max_pd(_mm_or_pd(_mm_and_pd(m2, x), _mm_andnot_pd(m2, ninf)), mx);
+		sum = _mm_add_pd(sum, _mm_and_pd(m2, x));
+	}
+
+	_mm_storeu_pd(tmp, mn);  r->min = MIN(r->min, MIN(tmp[0], tmp[1]));
+	_mm_storeu_pd(tmp, mx);  r->max = MAX(r->max, MAX(tmp[0], tmp[1]));
+	_mm_storeu_pd(tmp, sum); r->sum += tmp[0] + tmp[1];
+
+	s_reduce_scalar(ts + i, v + i, n - i, lo, hi, r);
+}
+
+__attribute__((target("avx2")))
+static size_t
+s_count_avx2(const uint32_t *ts, size_t n, uint32_t lo, uint32_t hi)
+{
+	size_t i, c;
+	__m256i vlo, vhi, bias, t, m;
+
+	vlo  = _mm256_set1_epi32((int)(lo ^ BIAS));
+	vhi  = _mm256_set1_epi32((int)(hi ^ BIAS));
+	bias = _mm256_set1_epi32((int)BIAS);
+
+	for (c = i = 0; i + 8 <= n; i += 8) {
+		t = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(ts + i)), bias);
+		m = _mm256_or_si256(_mm256_cmpgt_epi32(vlo, t), _mm256_cmpgt_epi32(t, vhi));
+		c += 8 - __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(m)));
+	}
+	return c + s_count_scalar(ts + i, n - i, lo, hi);
+}
+
+__attribute__((target("avx2")))
+static void
+s_reduce_avx2(const uint32_t *ts, const double *v, size_t n, uint32_t lo, uint32_t hi, struct scan *r)
+{
+	size_t i;
+	double tmp[4];
+	__m128i vlo, vhi, bias, t, m;
+	__m256d x, m4, mn, mx, sum, pinf, ninf;
+
+	vlo  = _mm_set1_epi32((int)(lo ^ BIAS));
+	vhi  = _mm_set1_epi32((int)(hi ^ BIAS));
+	bias = _mm_set1_epi32((int)BIAS);
+	pinf = _mm256_set1_pd(INFINITY);
+	ninf = _mm256_set1_pd(-INFINITY);
+	mn   = pinf;
+	mx   = ninf;
+	sum  = _mm256_setzero_pd();
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		t = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(ts + i)), bias);
+		m = _mm_or_si128(_mm_cmpgt_epi32(vlo, t), _mm_cmpgt_epi32(t, vhi));
+		r->count += 4 - __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m)));
+
+		/* sign-extend the 32-bit (out-of-range) lane masks to 64-bit lanes */
+		m4 = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(m));
+		x  = _mm256_loadu_pd(v + i);
+
+		mn  = _mm256_min_pd(_mm256_blendv_pd(x, pinf, m4), mn);
+		mx  = _mm256_max_pd(_mm256_blendv_pd(x, ninf, m4), mx);
+		sum = _mm256_add_pd(sum, _mm256_andnot_pd(m4, x));
+	}
+
+	_mm256_storeu_pd(tmp, mn);  r->min = MIN(r->min, MIN(MIN(tmp[0], tmp[1]), MIN(tmp[2], tmp[3])));
+	_mm256_storeu_pd(tmp, mx);  r->max = MAX(r->max, MAX(MAX(tmp[0], tmp[1]), MAX(tmp[2], tmp[3])));
+	_mm256_storeu_pd(tmp, sum); r->sum += (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+
+	s_reduce_scalar(ts + i, v + i, n - i, lo, hi, r);
+}
+#endif
+
+static size_t (*s_count)(const uint32_t *, size_t, uint32_t, uint32_t);
+static void   (*s_reduce)(const uint32_t *, const double *, size_t, uint32_t, uint32_t, struct scan *);
+
+static void
+s_dispatch(void)
+{
+	s_count  = s_count_scalar;
+	s_reduce = s_reduce_scalar;
+
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		s_count  = s_count_avx2;
+		s_reduce = s_reduce_avx2;
+
+	} else if (__builtin_cpu_supports("sse2")) {
+		s_count  = s_count_sse2;
+		s_reduce = s_reduce_sse2;
+	}
+#endif
+}
+
+void
+scan_init(struct scan *r)
+{
+	CHECK(r != NULL, "scan_init() given a NULL scan result to initialize");
+
+	r->count = 0;
+	r->min   = INFINITY;
+	r->max   = -INFINITY;
+	r->sum   = 0.0;
+}
+
+size_t
+scan_count(const uint32_t *ts, size_t n, uint32_t lo, uint32_t hi)
+{
+	if (!s_count)
+		s_dispatch();
+	return s_count(ts, n, lo, hi);
+}
+
+void
+scan_reduce(const uint32_t *ts, const double *v, size_t n, uint32_t lo, uint32_t hi, struct scan *r)
+{
+	CHECK(r != NULL, "scan_reduce() given a NULL scan result to reduce into");
+
+	if (!s_reduce)
+		s_dispatch();
+	s_reduce(ts, v, n, lo, hi, r);
+}
+
+#ifdef TEST
+/* LCOV_EXCL_START */
+static void
+s_check(const char *name,
+        size_t (*count)(const uint32_t *, size_t, uint32_t, uint32_t),
+        void (*reduce)(const uint32_t *, const double *, size_t, uint32_t, uint32_t, struct scan *))
+{
+	uint32_t ts[1027];
+	double v[1027];
+	struct scan want, got;
+	size_t i, n;
+	int bad;
+
+	for (i = 0; i < 1027; i++) {
+		ts[i] = (i * 2654435761u) % 5000;
+		v[i]  = (double)((int)(i * 7919) % 2001 - 1000); /* integral, so sums are exact */
+	}
+	ts[17] = 0;
+	ts[18] = 0xffffffff;
+
+	bad = 0;
+	for (n = 0; n < 1027; n += 113) {
+		if (count(ts, n, 1000, 3999) != s_count_scalar(ts, n, 1000, 3999)) bad++;
+		if (count(ts, n, 0, 0xffffffff) != n) bad++;
+		if (count(ts, n, 4000, 1000) != 0) bad++;
+
+		scan_init(&want); s_reduce_scalar(ts, v, n, 1000, 3999, &want);
+		scan_init(&got);  reduce(ts, v, n, 1000, 3999, &got);
+		if (got.count != want.count || got.min != want.min
+		 || got.max != want.max || got.sum != want.sum)
+			bad++;
+	}
+	is_int(bad, 0, "%s scan kernels should agree with the scalar implementation", name);
+}
+
+TESTS {
+	uint32_t ts[8] = { 10, 20, 30, 40, 50, 60, 70, 80 };
+	double    v[8] = { 1.5, -2.0, NAN, 4.0, 8.0, 0.5, 1.0, 2.0 };
+	struct scan r;
+
+	is_unsigned(scan_count(ts, 8, 25, 65), 4, "scan_count() counts timestamps within the (inclusive) range");
+	is_unsigned(scan_count(ts, 8, 10, 80), 8, "scan_count() range ends are inclusive");
+	is_unsigned(scan_count(ts, 8, 81, 99), 0, "scan_count() finds nothing outside of the range");
+
+	scan_init(&r);
+	scan_reduce(ts, v, 8, 40, 70, &r);
+	is_unsigned(r.count, 4, "scan_reduce() counts cells within the range");
+	ok(r.min == 0.5, "scan_reduce() finds the minimum value within the range");
+	ok(r.max == 8.0, "scan_reduce() finds the maximum value within the range");
+	ok(r.sum == 13.5, "scan_reduce() sums the values within the range");
+
+	s_check("scalar", s_count_scalar, s_reduce_scalar);
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		s_check("SSE2", s_count_sse2, s_reduce_sse2);
+	else
+		pass("SSE2 unavailable on this CPU; skipping");
+
+	if (__builtin_cpu_supports("avx2"))
+		s_check("AVX2", s_count_avx2, s_reduce_avx2);
+	else
+		pass("AVX2 unavailable on this CPU; skipping");
+#endif
+}
+/* LCOV_EXCL_STOP */
+#endif
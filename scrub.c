@@ -0,0 +1,360 @@
+#include "bolo.h"
+#include <time.h>
+#include <sys/wait.h>
+
+static double
+s_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+s_sleep(double secs)
+{
+	struct timespec ts;
+
+	ts.tv_sec  = (time_t)secs;
+	ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+/* pick the next tblock to check, loading slabs as we go;
+   the caller must hold both s->lock (if any) and s->mutex */
+static struct tblock *
+s_next(struct scrub *s)
+{
+	struct tblock *b;
+
+	for (;;) {
+		if (!s->slab) {
+			if (isempty(&s->db->slab))
+				return NULL;
+			s->slab  = item(s->db->slab.next, struct tslab, l);
+			s->block = 0;
+		}
+
+		if (&s->slab->l == &s->db->slab)
+			return NULL; /* all done */
+
+		if (tslab_load(s->slab) != 0) {
+			errorf("scrub: unable to load tslab [%#lx]: %s", s->slab->number, error(errno));
+			s->block = TBLOCKS_PER_TSLAB;
+		}
+
+		if (s->block < TBLOCKS_PER_TSLAB && s->slab->blocks[s->block].valid) {
+			b = &s->slab->blocks[s->block++];
+			return b;
+		}
+
+		s->slab  = item(s->slab->l.next, struct tslab, l);
+		s->block = 0;
+	}
+}
+
+/* stay within our I/O and CPU budgets, by sleeping off
+   whichever of the two we are further ahead of. */
+static void
+s_throttle(struct scrub *s, size_t len, double busy)
+{
+	double wait, ahead;
+
+	wait = 0.0;
+	if (s->duty > 0 && s->duty < 100)
+		wait = busy * (100 - s->duty) / s->duty;
+
+	if (s->rate > 0) {
+		pthread_mutex_lock(&s->mutex);
+		s->bytes += len;
+		ahead = s->started + (double)s->bytes / s->rate - s_now();
+		pthread_mutex_unlock(&s->mutex);
+
+		if (ahead > wait)
+			wait = ahead;
+	}
+
+	if (wait > 0.0)
+		s_sleep(wait);
+}
+
+/* is the block we checked (and found wanting) still there, still
+   sealed, and still exactly what we checked?  if it was rewritten,
+   freed or expired while we weren't holding s->lock, a failure on
+   our copy says nothing about what is there now.  the caller must
+   hold s->lock (if any). */
+static int
+s_unchanged(struct scrub *s, struct tblock *copy)
+{
+	struct tblock *b;
+
+	b = db_findblock(s->db, copy->number);
+	return b && b->valid && !b->dirty
+	    && b->page.len == copy->page.len
+	    && memcmp(b->page.data, copy->page.data, copy->page.len) == 0;
+}
+
+static void *
+s_verifier(void *_s)
+{
+	struct scrub *s;
+	struct tblock *b, copy;
+	double start, busy;
+	void *buf;
+	size_t len, size;
+	int rc;
+
+	s = (struct scrub *)_s;
+	buf  = NULL;
+	size = 0;
+	for (;;) {
+		if (s->lock)
+			pthread_mutex_lock(s->lock);
+
+		/* unsealed blocks are still being written to, and blocks
+		   already in quarantine (or free for reuse) have nothing
+		   left to tell us.  (the quarantine list is only changed
+		   under s->mutex) */
+		pthread_mutex_lock(&s->mutex);
+		while ((b = s_next(s)) != NULL && (b->dirty || db_isquarantined(s->db, b->number)
+		                                             || tslab_isfree(s->slab, b->number)))
+			s->skipped++;
+		pthread_mutex_unlock(&s->mutex);
+
+		if (!b) {
+			if (s->lock)
+				pthread_mutex_unlock(s->lock);
+			free(buf);
+			return NULL;
+		}
+
+		/* check a copy, so that nobody has to wait on the
+		   database while we work through the hashing */
+		len = b->page.len;
+		if (len > size) {
+			free(buf);
+			buf  = xmalloc(len);
+			size = len;
+		}
+		memcpy(buf, b->page.data, len);
+		copy = *b;
+		copy.page.data = buf;
+
+		if (s->lock)
+			pthread_mutex_unlock(s->lock);
+
+		start = s_now();
+		rc    = tblock_check(&copy, s->db->key);
+		busy  = s_now() - start;
+
+		if (rc != 0 && s->lock)
+			pthread_mutex_lock(s->lock);
+
+		pthread_mutex_lock(&s->mutex);
+		if (rc != 0 && s->lock && !s_unchanged(s, &copy)) {
+			s->skipped++;
+		} else {
+			s->checked++;
+			if (rc != 0) {
+				s->bad++;
+				errorf("scrub: tblock [%#lx] failed its integrity check; quarantining it", copy.number);
+				if (db_quarantine(s->db, copy.number) != 0)
+					errorf("scrub: unable to quarantine tblock [%#lx]: %s", copy.number, error(errno));
+			}
+		}
+		pthread_mutex_unlock(&s->mutex);
+
+		if (rc != 0 && s->lock)
+			pthread_mutex_unlock(s->lock);
+
+		s_throttle(s, len, busy);
+	}
+}
+
+int
+scrub_run(struct scrub *s)
+{
+	pthread_t *tids;
+	long i, n;
+
+	CHECK(s != NULL,     "scrub_run() given a NULL scrub to run");
+	CHECK(s->db != NULL, "scrub_run() given a scrub without a database to check");
+
+	errno = BOLO_EBADHMAC;
+	if (!s->db->key)
+		return -1; /* nothing to check seals against */
+
+	n = s->threads > 0 ? s->threads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		n = 1;
+
+	s->checked = s->skipped = s->bad = 0;
+	s->slab    = NULL;
+	s->block   = 0;
+	s->bytes   = 0;
+	s->started = s_now();
+	pthread_mutex_init(&s->mutex, NULL);
+
+	tids = xcalloc(n, sizeof(*tids));
+	for (i = 1; i < n; i++)
+		if (pthread_create(&tids[i], NULL, s_verifier, s) != 0)
+			break;
+	s_verifier(s); /* the calling thread is verifier #0 */
+	while (--i > 0)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
+	pthread_mutex_destroy(&s->mutex);
+	return 0;
+}
+
+#ifdef TEST
+/* LCOV_EXCL_START */
+TESTS {
+	subtest {
+		struct db *db;
+		struct dbkey *key;
+		struct scrub s;
+		struct tblock *block, copy;
+		pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+		char metric[256];
+		int i;
+
+		key = rand_key(DEFAULT_KEY_SIZE);
+		if (!key)
+			BAIL_OUT("failed to generate a random key");
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		db = db_init("t/tmp/new", key, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+
+		/* spread a few series over a good number of tblocks */
+		for (i = 0; i < 300; i++) {
+			snprintf(metric, sizeof(metric), "scrub|host=h%d", i % 3);
+			if (db_insert(db, metric, 1234567890 + (i / 3) * (bolo_msec_t)MAX_U32, i) != 0)
+				BAIL_OUT("failed to insert into db");
+		}
+		ok(db_sync(db) == 0, "db_sync() should succeed");
+
+		memset(&s, 0, sizeof(s));
+		s.db = db;
+		ok(scrub_run(&s) == 0, "scrub_run() should succeed");
+		is_unsigned(s.checked, 300, "scrub should check every (sealed) tblock");
+		is_unsigned(s.bad, 0, "scrub should find nothing wrong with a freshly synced database");
+
+		/* flip a bit in the middle of a block, behind its back */
+		block = db_findblock(db, 0x800 | 42);
+		if (!block)
+			BAIL_OUT("failed to find tblock 0x82a");
+		((uint8_t *)block->page.data)[tblock_hdrsize(block)] ^= 0x10;
+
+		memset(&s, 0, sizeof(s));
+		s.db      = db;
+		s.lock    = &lock;
+		s.threads = 4;
+		ok(scrub_run(&s) == 0, "scrub_run() should succeed with multiple threads");
+		is_unsigned(s.checked, 300, "multi-threaded scrub should check every tblock exactly once");
+		is_unsigned(s.bad, 1, "scrub should catch the corrupted tblock");
+		ok(db_isquarantined(db, 0x800 | 42), "the corrupted tblock should be quarantined");
+		ok(!db_isquarantined(db, 0x800 | 41), "intact tblocks should not be quarantined");
+
+		/* a block that changes while its copy is being checked
+		   is left for the next scrub to look at */
+		copy = *db_findblock(db, 0x800 | 41);
+		copy.page.data = xmalloc(copy.page.len);
+		memcpy(copy.page.data, db_findblock(db, 0x800 | 41)->page.data, copy.page.len);
+		ok(s_unchanged(&s, &copy), "an untouched tblock should match the copy taken of it");
+		((uint8_t *)copy.page.data)[tblock_hdrsize(&copy)] ^= 0x10;
+		ok(!s_unchanged(&s, &copy), "a rewritten tblock should not match the copy taken of it");
+		free(copy.page.data);
+
+		memset(&s, 0, sizeof(s));
+		s.db   = db;
+		s.rate = 16 * 1024 * 1024;
+		s.duty = 50;
+		ok(scrub_run(&s) == 0, "scrub_run() should succeed under a budget");
+		is_unsigned(s.skipped, 1, "scrub should skip tblocks that are already quarantined");
+		is_unsigned(s.bad, 0, "scrub should not re-report quarantined tblocks");
+
+		((uint8_t *)block->page.data)[tblock_hdrsize(block)] ^= 0x10;
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		db = db_mount("t/tmp/new", key);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+		ok(db_isquarantined(db, 0x800 | 42), "quarantine should persist across a remount");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		free(key->key);
+		free(key);
+	}
+
+	subtest {
+		struct db *db;
+		struct dbkey *key;
+		struct scrub s;
+		struct series_cursor c;
+		struct idx *idx;
+		char metric[256];
+		pid_t pid;
+		int i, status;
+
+		key = rand_key(DEFAULT_KEY_SIZE);
+		if (!key)
+			BAIL_OUT("failed to generate a random key");
+
+		if (system("./t/setup/db-init") != 0)
+			BAIL_OUT("t/setup/db-init failed!");
+
+		db = db_init("t/tmp/new", key, NULL);
+		if (!db)
+			BAIL_OUT("db_init(t/tmp/new) failed");
+		strcpy(metric, "crash|host=a");
+		if (db_insert(db, metric, 1234567890, 0) != 0)
+			BAIL_OUT("failed to insert into db");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		/* write to the tblocks, and die before sealing them */
+		pid = fork();
+		if (pid < 0)
+			BAIL_OUT("fork() failed");
+		if (pid == 0) {
+			db = db_mount("t/tmp/new", key);
+			if (!db || db_wal(db, 0) != 0)
+				_exit(1);
+			for (i = 1; i < 100; i++) {
+				strcpy(metric, "crash|host=a");
+				if (db_insert(db, metric, 1234567890 + i * 1000, i) != 0)
+					_exit(1);
+			}
+			if (db_commit(db) != 0
+			 || hash_get(db->main, &idx, "crash|host=a") != 0
+			 || series_open(&c, db, idx, 0, 0) != 0)
+				_exit(1);
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			BAIL_OUT("failed to crash in the middle of writing to the db");
+
+		db = db_mount("t/tmp/new", key);
+		if (!db)
+			BAIL_OUT("db_mount(t/tmp/new) failed");
+
+		memset(&s, 0, sizeof(s));
+		s.db = db;
+		ok(scrub_run(&s) == 0, "scrub_run() should succeed");
+		is_unsigned(s.checked, 1, "scrub should check the tblock written to before the crash");
+		is_unsigned(s.bad, 0, "remounting after a crash should reseal what was written to the tblocks");
+		ok(db_unmount(db) == 0, "db_unmount() should succeed");
+
+		free(key->key);
+		free(key);
+	}
+}
+/* LCOV_EXCL_STOP */
+#endif
@@ -1,5 +1,18 @@
 #include "bolo.h"
 
+/* on x86-64, sha512_feedn() can run four SHA-512 contexts in
+   lockstep, one per 64-bit lane of an AVX2 register.  whether
+   the running CPU actually has AVX2 is decided at runtime;
+   build with -DSHA512_SIMD=0 to leave the AVX2 code out. */
+#ifndef SHA512_SIMD
+#define SHA512_SIMD 1
+#endif
+
+#if SHA512_SIMD && defined(__x86_64__) && defined(__GNUC__)
+#  define SHA512_AVX2 1
+#  include <immintrin.h>
+#endif
+
 #ifdef DEBUG
 static void hexit(const char *msg, const void *buf, size_t start, size_t len)
 {
@@ -227,7 +240,168 @@ sha512_feed(struct sha512 *c, const void *buf, size_t len)
 	}
 
 	if (len) /* store remainder for next feed/done call */
-		memcpy((uint8_t *)c->block, buf, len);
+		memcpy((uint8_t *)c->block + used, buf, len);
+}
+
+#ifdef SHA512_AVX2
+#define SHA512_LANES 4
+
+/* the same compression function as sha512_transform(),
+   run over nblocks consecutive blocks of four separate
+   messages at once.  AVX2 has no 64-bit rotate, so ROTR
+   is done the long way, with a pair of shifts.
+
+   intrinsics are only worth it if they stay in registers,
+   so this gets optimized even in -O0 (debug / test) builds */
+__attribute__((target("avx2"), optimize("O2")))
+static void
+sha512_transform4(uint64_t state[8][SHA512_LANES], const uint8_t *buf[SHA512_LANES], size_t nblocks)
+{
+	__m256i S[8], W[80], t1, t2;
+	__m256i a, b, c, d, e, f, g, h;
+	const uint64_t *m0, *m1, *m2, *m3;
+	size_t n;
+	int t;
+
+#define v_add(x,y)    _mm256_add_epi64((x), (y))
+#define v_xor(x,y)    _mm256_xor_si256((x), (y))
+#define v_and(x,y)    _mm256_and_si256((x), (y))
+#define v_shr(n,x)    _mm256_srli_epi64((x), (n))
+#define v_rotr(n,x)   _mm256_or_si256(_mm256_srli_epi64((x), (n)), _mm256_slli_epi64((x), 64 - (n)))
+#define v_Ch(x,y,z)   v_xor(v_and((x), (y)), _mm256_andnot_si256((x), (z)))
+#define v_Maj(x,y,z)  v_xor(v_xor(v_and((x), (y)), v_and((x), (z))), v_and((y), (z)))
+#define v_SIGMA0(x)   v_xor(v_xor(v_rotr(28, (x)), v_rotr(34, (x))), v_rotr(39, (x)))
+#define v_SIGMA1(x)   v_xor(v_xor(v_rotr(14, (x)), v_rotr(18, (x))), v_rotr(41, (x)))
+#define v_sigma0(x)   v_xor(v_xor(v_rotr( 1, (x)), v_rotr( 8, (x))), v_shr( 7, (x)))
+#define v_sigma1(x)   v_xor(v_xor(v_rotr(19, (x)), v_rotr(61, (x))), v_shr( 6, (x)))
+#define v_word(p,t)   __builtin_bswap64(((const uint64_t *)(p))[(t)])
+
+	for (t = 0; t < 8; t++)
+		S[t] = _mm256_loadu_si256((const __m256i *)state[t]);
+
+	for (n = 0; n < nblocks; n++) {
+		m0 = (const uint64_t *)(buf[0] + n * SHA512_BLOCK);
+		m1 = (const uint64_t *)(buf[1] + n * SHA512_BLOCK);
+		m2 = (const uint64_t *)(buf[2] + n * SHA512_BLOCK);
+		m3 = (const uint64_t *)(buf[3] + n * SHA512_BLOCK);
+
+		/* prepare the W[t] message schedule, for all lanes */
+		for (t = 0; t < 16; t++)
+			W[t] = _mm256_set_epi64x(v_word(m3,t), v_word(m2,t), v_word(m1,t), v_word(m0,t));
+		for (t = 16; t < 80; t++)
+			W[t] = v_add(v_add(v_sigma1(W[t - 2]), W[t - 7]),
+			             v_add(v_sigma0(W[t - 15]), W[t - 16]));
+
+		a = S[0]; b = S[1]; c = S[2]; d = S[3];
+		e = S[4]; f = S[5]; g = S[6]; h = S[7];
+
+#define transform4(a,b,c,d,e,f,g,h) do { \
+	t1 = v_add(v_add(v_add(h, v_SIGMA1(e)), v_add(v_Ch(e,f,g), _mm256_set1_epi64x(K[t]))), W[t]); \
+	t2 = v_add(v_SIGMA0(a), v_Maj(a,b,c)); \
+	d = v_add(d, t1); h = v_add(t1, t2); \
+} while (0)
+		for (t = 0; t < 80; ) {
+			transform4(a, b, c, d, e, f, g, h); t++;
+			transform4(h, a, b, c, d, e, f, g); t++;
+			transform4(g, h, a, b, c, d, e, f); t++;
+			transform4(f, g, h, a, b, c, d, e); t++;
+			transform4(e, f, g, h, a, b, c, d); t++;
+			transform4(d, e, f, g, h, a, b, c); t++;
+			transform4(c, d, e, f, g, h, a, b); t++;
+			transform4(b, c, d, e, f, g, h, a); t++;
+		}
+#undef transform4
+
+		S[0] = v_add(S[0], a); S[1] = v_add(S[1], b); S[2] = v_add(S[2], c); S[3] = v_add(S[3], d);
+		S[4] = v_add(S[4], e); S[5] = v_add(S[5], f); S[6] = v_add(S[6], g); S[7] = v_add(S[7], h);
+	}
+
+	for (t = 0; t < 8; t++)
+		_mm256_storeu_si256((__m256i *)state[t], S[t]);
+
+#undef v_add
+#undef v_xor
+#undef v_and
+#undef v_shr
+#undef v_rotr
+#undef v_Ch
+#undef v_Maj
+#undef v_SIGMA0
+#undef v_SIGMA1
+#undef v_sigma0
+#undef v_sigma1
+#undef v_word
+}
+#endif
+
+/* set to force sha512_feedn() down the scalar path,
+   for testing the SIMD code against it. */
+static int sha512_scalar = 0;
+
+static int
+sha512_simd(void)
+{
+#ifdef SHA512_AVX2
+	return !sha512_scalar && __builtin_cpu_supports("avx2");
+#else
+	return 0;
+#endif
+}
+
+void
+sha512_feedn(struct sha512 **c, const void **buf, const size_t *len, int n)
+{
+	int i;
+#ifdef SHA512_AVX2
+	uint64_t state[8][SHA512_LANES];
+	const uint8_t *p[SHA512_LANES];
+	size_t nblocks, skip;
+	int j, r;
+#endif
+
+	i = 0;
+#ifdef SHA512_AVX2
+	for (; sha512_simd() && i + SHA512_LANES <= n; i += SHA512_LANES) {
+		/* only contexts sitting on a block boundary (no leftovers
+		   from a previous feeding) can be run in lockstep, and only
+		   for as many whole blocks as the shortest of them has. */
+		nblocks = len[i] / SHA512_BLOCK;
+		for (j = i; j < i + SHA512_LANES; j++) {
+			if (c[j]->bytes[0] % SHA512_BLOCK != 0)
+				nblocks = 0;
+			if (len[j] / SHA512_BLOCK < nblocks)
+				nblocks = len[j] / SHA512_BLOCK;
+		}
+
+		if (nblocks > 0) {
+			for (j = 0; j < SHA512_LANES; j++) {
+				p[j] = (const uint8_t *)buf[i + j];
+				for (r = 0; r < 8; r++)
+					state[r][j] = c[i + j]->state[r];
+			}
+
+			sha512_transform4(state, p, nblocks);
+
+			skip = nblocks * SHA512_BLOCK;
+			for (j = 0; j < SHA512_LANES; j++) {
+				for (r = 0; r < 8; r++)
+					c[i + j]->state[r] = state[r][j];
+				c[i + j]->bytes[0] += skip;
+				if (c[i + j]->bytes[0] < skip)
+					c[i + j]->bytes[1]++; /* rollover */
+			}
+		} else {
+			skip = 0;
+		}
+
+		/* whatever is left over goes the slow way */
+		for (j = i; j < i + SHA512_LANES; j++)
+			sha512_feed(c[j], (const uint8_t *)buf[j] + skip, len[j] - skip);
+	}
+#endif
+
+	for (; i < n; i++)
+		sha512_feed(c[i], buf[i], len[i]);
 }
 
 void
@@ -315,40 +489,76 @@ sha512_hex(struct sha512 *c, void *d, size_t len)
 #define HMAC_SHA512_OPAD 0x5c
 
 void
-hmac_sha512_init(struct hmac_sha512 *c, const char *k, size_t len)
+hmac_sha512_key(struct hmac_sha512_key *k, const char *key, size_t len)
 {
-	char ipad[SHA512_BLOCK];
+	struct sha512 c;
+	uint8_t kb[SHA512_BLOCK], pad[SHA512_BLOCK];
 	int i;
 
-	CHECK(c != NULL, "hmac_sha512_init() given a NULL hmac-sha512 context to initialize");
-	CHECK(k != NULL, "hmac_sha512_init() given a NULL encryption key to seal with");
-	CHECK(len > 0,   "hmac_sha512_init() given an invalid encryption key length");
+	CHECK(k != NULL,   "hmac_sha512_key() given a NULL hmac-sha512 key to initialize");
+	CHECK(key != NULL, "hmac_sha512_key() given a NULL encryption key to seal with");
+	CHECK(len > 0,     "hmac_sha512_key() given an invalid encryption key length");
 
-	memset(c->key, 0, SHA512_BLOCK);
+	memset(kb, 0, SHA512_BLOCK);
 	if (len > SHA512_BLOCK) {
-		sha512_init(&c->sha);
-		sha512_feed(&c->sha, k, len);
-		sha512_done(&c->sha);
-		if (sha512_raw(&c->sha, c->key, SHA512_DIGEST))
-			memset(c->key, 0, SHA512_DIGEST);
+		sha512_init(&c);
+		sha512_feed(&c, key, len);
+		sha512_done(&c);
+		if (sha512_raw(&c, kb, SHA512_DIGEST))
+			memset(kb, 0, SHA512_DIGEST);
 		len = SHA512_DIGEST; /* debugging only */
 	} else {
-		memcpy(c->key, k, len);
+		memcpy(kb, key, len);
 	}
 
-	hexit("key", c->key, 0, len);
+	hexit("key", kb, 0, len);
 
-	/* K ^ ipad */
+	/* H(K ^ ipad) */
 	for (i = 0; i < SHA512_BLOCK; i++)
-		ipad[i] = c->key[i] ^ HMAC_SHA512_IPAD;
+		pad[i] = kb[i] ^ HMAC_SHA512_IPAD;
+	hexit("ipad", pad, 0, SHA512_BLOCK);
 
-	hexit("ipad", ipad, 0, SHA512_BLOCK);
+	sha512_init(&c);
+	sha512_feed(&c, pad, SHA512_BLOCK);
+	memcpy(k->inner, c.state, SHA512_DIGEST);
+	hexit("H(K^ipad) h", (const uint8_t *)k->inner, 0, SHA512_DIGEST);
 
-	sha512_init(&c->sha);
-	sha512_feed(&c->sha, ipad, SHA512_BLOCK);
+	/* H(K ^ opad) */
+	for (i = 0; i < SHA512_BLOCK; i++)
+		pad[i] = kb[i] ^ HMAC_SHA512_OPAD;
+	hexit("opad", pad, 0, SHA512_BLOCK);
 
-	hexit("H(K^ipad) h", (const uint8_t *)c->sha.state, 0, SHA512_DIGEST);
-	hexit("H(K^ipad) b", (const uint8_t *)c->sha.block, 0, SHA512_BLOCK);
+	sha512_init(&c);
+	sha512_feed(&c, pad, SHA512_BLOCK);
+	memcpy(k->outer, c.state, SHA512_DIGEST);
+	hexit("H(K^opad) h", (const uint8_t *)k->outer, 0, SHA512_DIGEST);
+}
+
+void
+hmac_sha512_start(struct hmac_sha512 *c, const struct hmac_sha512_key *k)
+{
+	CHECK(c != NULL, "hmac_sha512_start() given a NULL hmac-sha512 context to initialize");
+	CHECK(k != NULL, "hmac_sha512_start() given a NULL hmac-sha512 key to seal with");
+
+	/* both K^ipad and K^opad are exactly one block long,
+	   so the keyed states pick up right on a block boundary */
+	memset(&c->sha, 0, sizeof(c->sha));
+	memcpy(c->sha.state, k->inner, SHA512_DIGEST);
+	memcpy(c->outer,     k->outer, SHA512_DIGEST);
+	c->sha.bytes[0] = SHA512_BLOCK;
+}
+
+void
+hmac_sha512_init(struct hmac_sha512 *c, const char *k, size_t len)
+{
+	struct hmac_sha512_key key;
+
+	CHECK(c != NULL, "hmac_sha512_init() given a NULL hmac-sha512 context to initialize");
+	CHECK(k != NULL, "hmac_sha512_init() given a NULL encryption key to seal with");
+	CHECK(len > 0,   "hmac_sha512_init() given an invalid encryption key length");
+
+	hmac_sha512_key(&key, k, len);
+	hmac_sha512_start(c, &key);
 }
 
 void
@@ -363,8 +573,6 @@ void
 hmac_sha512_done(struct hmac_sha512 *c)
 {
 	uint8_t digest[SHA512_DIGEST];
-	char opad[SHA512_BLOCK];
-	int i;
 
 	/* snag a copy of the inner hash digest */
 	sha512_done(&c->sha);
@@ -374,17 +582,10 @@ hmac_sha512_done(struct hmac_sha512 *c)
 	hexit("final H(K^ipad . m) h", (const uint8_t *)c->sha.state, 0, SHA512_DIGEST);
 	hexit("final H(K^ipad . m) b", (const uint8_t *)c->sha.block, 0, SHA512_BLOCK);
 
-	/* K^opad */
-	for (i = 0; i < SHA512_BLOCK; i++)
-		opad[i] = c->key[i] ^ HMAC_SHA512_OPAD;
-
-	hexit("final opad", opad, 0, SHA512_BLOCK);
-
-	/* calculate the outer digest */
-	sha512_init(&c->sha);
-	sha512_feed(&c->sha, opad,   SHA512_BLOCK);
-	hexit("final H(K^opad) h", (const uint8_t *)c->sha.state, 0, SHA512_DIGEST);
-	hexit("final H(K^opad) b", (const uint8_t *)c->sha.block, 0, SHA512_BLOCK);
+	/* calculate the outer digest, picking up from H(K^opad) */
+	memset(&c->sha, 0, sizeof(c->sha));
+	memcpy(c->sha.state, c->outer, SHA512_DIGEST);
+	c->sha.bytes[0] = SHA512_BLOCK;
 	sha512_feed(&c->sha, digest, SHA512_DIGEST);
 	hexit("final H(K^opad . <digest>) h", (const uint8_t *)c->sha.state, 0, SHA512_DIGEST);
 	hexit("final H(K^opad . <digest>) b", (const uint8_t *)c->sha.block, 0, SHA512_BLOCK);
@@ -408,18 +609,17 @@ hmac_sha512_hex(struct hmac_sha512 *c, void *hmac, size_t len)
 }
 
 void
-hmac_sha512_seal(const char *key, size_t key_len, const void *buf, size_t len)
+hmac_sha512_kseal(const struct hmac_sha512_key *key, const void *buf, size_t len)
 {
 	struct hmac_sha512 c;
 	uint8_t zeros[64];
 
-	CHECK(key != NULL, "hmac_sha512_seal() given a NULL encryption key to seal with");
-	CHECK(key_len > 0, "hmac_sha512_seal() given an invalid encryption key length");
-	CHECK(buf != NULL, "hmac_sha512_seal() given a NULL buffer to seal");
-	CHECK(len > 64,    "hmac_sha512_seal() given an invalid buffer length");
+	CHECK(key != NULL, "hmac_sha512_kseal() given a NULL hmac-sha512 key to seal with");
+	CHECK(buf != NULL, "hmac_sha512_kseal() given a NULL buffer to seal");
+	CHECK(len > 64,    "hmac_sha512_kseal() given an invalid buffer length");
 
 	memset(zeros, 0, 64);
-	hmac_sha512_init(&c, key, key_len);
+	hmac_sha512_start(&c, key);
 	hmac_sha512_feed(&c, (uint8_t *)buf, len - 64);
 	hmac_sha512_feed(&c, zeros, 64);
 	hmac_sha512_done(&c);
@@ -429,19 +629,18 @@ hmac_sha512_seal(const char *key, size_t key_len, const void *buf, size_t len)
 }
 
 int
-hmac_sha512_check(const char *key, size_t key_len, const void *buf, size_t len)
+hmac_sha512_kcheck(const struct hmac_sha512_key *key, const void *buf, size_t len)
 {
 	struct hmac_sha512 c;
 	uint8_t zeros[64];
 	uint8_t digest[64];
 
-	CHECK(key != NULL, "hmac_sha512_check() given a NULL encryption key to validate the seal with");
-	CHECK(key_len > 0, "hmac_sha512_check() given an invalid encryption key length");
-	CHECK(buf != NULL, "hmac_sha512_check() given a NULL buffer to check");
-	CHECK(len > 64,    "hmac_sha512_check() given an invalid buffer length");
+	CHECK(key != NULL, "hmac_sha512_kcheck() given a NULL hmac-sha512 key to validate the seal with");
+	CHECK(buf != NULL, "hmac_sha512_kcheck() given a NULL buffer to check");
+	CHECK(len > 64,    "hmac_sha512_kcheck() given an invalid buffer length");
 
 	memset(zeros, 0, 64);
-	hmac_sha512_init(&c, key, key_len);
+	hmac_sha512_start(&c, key);
 	hmac_sha512_feed(&c, (uint8_t *)buf, len - 64);
 	hmac_sha512_feed(&c, zeros, 64);
 	hmac_sha512_done(&c);
@@ -452,6 +651,30 @@ hmac_sha512_check(const char *key, size_t key_len, const void *buf, size_t len)
 	return memcmp(digest, (uint8_t *)buf + len - 64, 64);
 }
 
+void
+hmac_sha512_seal(const char *key, size_t key_len, const void *buf, size_t len)
+{
+	struct hmac_sha512_key k;
+
+	CHECK(key != NULL, "hmac_sha512_seal() given a NULL encryption key to seal with");
+	CHECK(key_len > 0, "hmac_sha512_seal() given an invalid encryption key length");
+
+	hmac_sha512_key(&k, key, key_len);
+	hmac_sha512_kseal(&k, buf, len);
+}
+
+int
+hmac_sha512_check(const char *key, size_t key_len, const void *buf, size_t len)
+{
+	struct hmac_sha512_key k;
+
+	CHECK(key != NULL, "hmac_sha512_check() given a NULL encryption key to validate the seal with");
+	CHECK(key_len > 0, "hmac_sha512_check() given an invalid encryption key length");
+
+	hmac_sha512_key(&k, key, key_len);
+	return hmac_sha512_kcheck(&k, buf, len);
+}
+
 #ifdef TEST
 /* LCOV_EXCL_START */
 TESTS {
@@ -590,6 +813,91 @@ TESTS {
 			"hmac_sha512_check should fail on sealed crypto box that has been tampered with");
 	}
 
+	subtest {
+		struct hmac_sha512_key k;
+		struct hmac_sha512 c;
+		char hex[2 * SHA512_DIGEST + 1];
+
+		hmac_sha512_key(&k, "Jefe", 4);
+		hmac_sha512_start(&c, &k);
+		hmac_sha512_feed(&c, "what do ya want for nothing?", 28);
+		hmac_sha512_done(&c);
+
+		if (hmac_sha512_hex(&c, hex, 2 * SHA512_DIGEST))
+			BAIL_OUT("sha512_hex() failed");
+
+		hex[2 * SHA512_DIGEST] = '\0';
+		is_string(hex, "164b7a7bfcf819e2e395fbe73b56e0a387bd64222e831fd610270cd7ea250554"
+		               "9758bf75c05a994a6d034f65f8f0e6fdcaeab1a34d4a6b4b636e070a38bce737",
+		  "RFC-4231 HMAC-SHA512 Test Case 2 (with a precomputed key)");
+
+		/* the keyed state can be reused, over and over */
+		hmac_sha512_start(&c, &k);
+		hmac_sha512_feed(&c, "what do ya want ", 16);
+		hmac_sha512_feed(&c, "for nothing?", 12);
+		hmac_sha512_done(&c);
+
+		if (hmac_sha512_hex(&c, hex, 2 * SHA512_DIGEST))
+			BAIL_OUT("sha512_hex() failed");
+
+		hex[2 * SHA512_DIGEST] = '\0';
+		is_string(hex, "164b7a7bfcf819e2e395fbe73b56e0a387bd64222e831fd610270cd7ea250554"
+		               "9758bf75c05a994a6d034f65f8f0e6fdcaeab1a34d4a6b4b636e070a38bce737",
+		  "RFC-4231 HMAC-SHA512 Test Case 2 (reusing a precomputed key)");
+	}
+
+	subtest {
+		/* the first group of four is all on block boundaries, with
+		   lanes of differing length, so it runs in lockstep; the
+		   second has a lane off a block boundary (and one with no
+		   whole blocks), so it falls back; the last three are a
+		   straggler group, too small to run in lockstep at all */
+		size_t len[11] = { 8192, 4096, 1024, 8192,
+		                   8192, 8192, 8192, 100,
+		                   100, 1000, 300 };
+		struct sha512 simd[11], scalar[11], *c[11];
+		const void *buf[11];
+		uint8_t data[11][8192];
+		uint8_t a[SHA512_DIGEST], b[SHA512_DIGEST];
+		int i, j, same;
+
+		for (i = 0; i < 11; i++)
+			for (j = 0; j < 8192; j++)
+				data[i][j] = (uint8_t)(i * 31 + j * 7);
+
+		for (i = 0; i < 11; i++) {
+			sha512_init(&simd[i]);
+			sha512_init(&scalar[i]);
+			c[i]   = &simd[i];
+			buf[i] = data[i];
+		}
+		/* one context that isn't sitting on a block boundary */
+		sha512_feed(&simd[5],   "abc", 3);
+		sha512_feed(&scalar[5], "abc", 3);
+
+		sha512_feedn(c, buf, len, 11);
+		sha512_scalar = 1;
+		for (i = 0; i < 11; i++)
+			c[i] = &scalar[i];
+		sha512_feedn(c, buf, len, 11);
+		sha512_scalar = 0;
+
+		same = 1;
+		for (i = 0; i < 11; i++) {
+			sha512_done(&simd[i]);
+			sha512_done(&scalar[i]);
+			if (sha512_raw(&simd[i], a, SHA512_DIGEST) != 0
+			 || sha512_raw(&scalar[i], b, SHA512_DIGEST) != 0)
+				BAIL_OUT("sha512_raw() failed");
+			if (memcmp(a, b, SHA512_DIGEST) != 0) {
+				diag("sha512_feedn() context #%d digest differs from the scalar digest", i);
+				same = 0;
+			}
+		}
+		ok(same, "sha512_feedn() should agree with plain SHA-512 (simd %s)",
+			sha512_simd() ? "available" : "unavailable");
+	}
+
 	subtest {
 		char box[4 + SHA512_DIGEST];
 		char key[1024];
@@ -0,0 +1,90 @@
+#include "../../bolo.h"
+#include <time.h>
+
+/* t/bench/hash - measure hash_set() / hash_get() throughput
+
+   Builds hashes of 10k, 100k and 1M keys, named like the
+   series in db->main are (metric|tag=value,...), and then
+   looks every one of them up again, and looks up as many
+   keys that aren't there.  Also reports the slowest single
+   hash_set(), since that is where a resize would show up. */
+
+static double
+s_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+s_run(int n)
+{
+	struct hash *h;
+	char **keys, **miss;
+	double start, t, one, worst;
+	void *v;
+	int i, found;
+
+	keys = xcalloc(n, sizeof(char *));
+	miss = xcalloc(n, sizeof(char *));
+	for (i = 0; i < n; i++) {
+		if (asprintf(&keys[i], "cpu.usage|env=prod,host=web%d.example.com,type=user", i) < 0
+		 || asprintf(&miss[i], "cpu.usage|env=test,host=web%d.example.com,type=user", i) < 0) {
+			fprintf(stderr, "failed to generate keys\n");
+			exit(1);
+		}
+	}
+
+	h = hash_new();
+	worst = 0.0;
+	start = s_now();
+	for (i = 0; i < n; i++) {
+		one = s_now();
+		if (hash_set(h, keys[i], keys[i]) != 0) {
+			fprintf(stderr, "hash_set() failed\n");
+			exit(1);
+		}
+		one = s_now() - one;
+		if (one > worst)
+			worst = one;
+	}
+	t = s_now() - start;
+	printf("%8d keys: hash_set  %10.0lf ops/sec  (slowest: %8.1lf us)\n",
+		n, n / t, worst * 1e6);
+
+	found = 0;
+	start = s_now();
+	for (i = 0; i < n; i++)
+		if (hash_get(h, &v, keys[i]) == 0)
+			found++;
+	t = s_now() - start;
+	printf("%8d keys: hash_get  %10.0lf ops/sec  (hits)\n", n, n / t);
+	if (found != n) {
+		fprintf(stderr, "only found %d of %d keys!\n", found, n);
+		exit(1);
+	}
+
+	start = s_now();
+	for (i = 0; i < n; i++)
+		if (hash_get(h, &v, miss[i]) == 0)
+			found++;
+	t = s_now() - start;
+	printf("%8d keys: hash_get  %10.0lf ops/sec  (misses)\n", n, n / t);
+
+	hash_free(h);
+	for (i = 0; i < n; i++) {
+		free(keys[i]);
+		free(miss[i]);
+	}
+	free(keys);
+	free(miss);
+}
+
+int main(int argc, char **argv)
+{
+	s_run(10000);
+	s_run(100000);
+	s_run(1000000);
+	return 0;
+}
@@ -0,0 +1,87 @@
+#include "../../bolo.h"
+#include <sys/syscall.h>
+#include <time.h>
+
+/* t/bench/scan - measure tblock range-scan throughput
+
+   Fills a block of each fixed-size cell format, and then
+   repeatedly counts / reduces (min, max, sum) the cells
+   that fall within the middle half of the block's range.
+   BLOKv4 (columnar) blocks go through the vectorized scan
+   kernels; everything else walks a tcursor. */
+
+#define ROUNDS 200
+
+static double
+s_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+s_fill(struct tblock *b, int version)
+{
+	int fd, i;
+
+	fd = syscall(SYS_memfd_create, "bench", 0);
+	if (fd < 0 || ftruncate(fd, TBLOCK_SIZE) != 0) {
+		fprintf(stderr, "failed to create backing memfd: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	memset(b, 0, sizeof(*b));
+	if (tblock_map(b, fd, 0, TBLOCK_SIZE) != 0) {
+		fprintf(stderr, "failed to map tblock: %s\n", strerror(errno));
+		exit(1);
+	}
+	tblock_init(b, version, 0x800, 1500000000000ul);
+
+	for (i = 0; !tblock_isfull(b); i++) {
+		if (tblock_insert(b, 1500000000000ul + i * 1000, (i * 7919) % 1000 - 500.0) != 0) {
+			fprintf(stderr, "tblock_insert #%d failed: %s\n", i, strerror(errno));
+			exit(1);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct tblock b;
+	struct scan r;
+	bolo_msec_t from, until;
+	double start, t;
+	size_t n;
+	int v, i;
+
+	for (v = 1; v <= 4; v++) {
+		if (v == 3)
+			continue; /* compressed blocks don't hold a fixed number of cells */
+
+		s_fill(&b, v);
+		from  = b.base + 1000ul * b.cells / 4;
+		until = b.base + 1000ul * b.cells * 3 / 4;
+
+		n = 0;
+		start = s_now();
+		for (i = 0; i < ROUNDS; i++)
+			n += tblock_count(&b, from, until);
+		t = s_now() - start;
+		printf("BLOKv%d tblock_count:  %8.1lf M cells/sec (%lu in range)\n",
+			v, ROUNDS * b.cells / t / 1e6, n / ROUNDS);
+
+		start = s_now();
+		for (i = 0; i < ROUNDS; i++) {
+			scan_init(&r);
+			tblock_reduce(&b, from, until, &r);
+		}
+		t = s_now() - start;
+		printf("BLOKv%d tblock_reduce: %8.1lf M cells/sec (min %.0lf, max %.0lf, sum %.0lf)\n",
+			v, ROUNDS * b.cells / t / 1e6, r.min, r.max, r.sum);
+
+		if (tblock_unmap(&b) != 0)
+			fprintf(stderr, "failed to unmap tblock: %s\n", strerror(errno));
+	}
+	return 0;
+}
@@ -0,0 +1,93 @@
+#include "../../bolo.h"
+#include <time.h>
+
+/* t/bench/sha - measure SHA-512 / HMAC-SHA-512 throughput
+
+   Digests a 512k tblock's worth of 8k chunks, one chunk at a
+   time with sha512_feed(), and then all together through
+   sha512_feedn() (which runs four at once, given AVX2).  Then
+   HMACs a batch of small buffers, re-keying for each one (as
+   hmac_sha512_init() does), and again from a precomputed key. */
+
+#define ROUNDS  50
+#define CHUNKS  64
+#define HMACS   200000
+
+static double
+s_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t data[CHUNKS][TBLOCK_CHUNK_SIZE];
+	struct sha512 c[CHUNKS], *cv[CHUNKS];
+	const void *buf[CHUNKS];
+	size_t len[CHUNKS];
+	struct hmac_sha512_key key;
+	struct hmac_sha512 h;
+	char raw[DEFAULT_KEY_SIZE];
+	uint8_t msg[96];
+	double start, t;
+	int i, r;
+
+	if (urand(data, sizeof(data)) != 0 || urand(raw, sizeof(raw)) != 0) {
+		fprintf(stderr, "failed to generate random data\n");
+		return 1;
+	}
+	for (i = 0; i < CHUNKS; i++) {
+		cv[i]  = &c[i];
+		buf[i] = data[i];
+		len[i] = TBLOCK_CHUNK_SIZE;
+	}
+
+	start = s_now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < CHUNKS; i++) {
+			sha512_init(&c[i]);
+			sha512_feed(&c[i], data[i], TBLOCK_CHUNK_SIZE);
+			sha512_done(&c[i]);
+		}
+	}
+	t = s_now() - start;
+	printf("sha512_feed,  one chunk at a time: %8.1lf MB/sec\n",
+		ROUNDS * sizeof(data) / t / 1048576);
+
+	start = s_now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < CHUNKS; i++)
+			sha512_init(&c[i]);
+		sha512_feedn(cv, buf, len, CHUNKS);
+		for (i = 0; i < CHUNKS; i++)
+			sha512_done(&c[i]);
+	}
+	t = s_now() - start;
+	printf("sha512_feedn, all chunks at once:  %8.1lf MB/sec\n",
+		ROUNDS * sizeof(data) / t / 1048576);
+
+	memset(msg, 0x42, sizeof(msg));
+	start = s_now();
+	for (i = 0; i < HMACS; i++) {
+		hmac_sha512_init(&h, raw, sizeof(raw));
+		hmac_sha512_feed(&h, msg, sizeof(msg));
+		hmac_sha512_done(&h);
+	}
+	t = s_now() - start;
+	printf("hmac-sha512 (%lu octets), keyed every time: %10.0lf hmacs/sec\n",
+		sizeof(msg), HMACS / t);
+
+	hmac_sha512_key(&key, raw, sizeof(raw));
+	start = s_now();
+	for (i = 0; i < HMACS; i++) {
+		hmac_sha512_start(&h, &key);
+		hmac_sha512_feed(&h, msg, sizeof(msg));
+		hmac_sha512_done(&h);
+	}
+	t = s_now() - start;
+	printf("hmac-sha512 (%lu octets), precomputed key:  %10.0lf hmacs/sec\n",
+		sizeof(msg), HMACS / t);
+	return 0;
+}
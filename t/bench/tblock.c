@@ -0,0 +1,93 @@
+#include "../../bolo.h"
+#include <sys/syscall.h>
+#include <time.h>
+
+/* t/bench/tblock - measure tblock_insert() throughput
+
+   Compares re-sealing the tblock after every single insert
+   (eager) against deferring the seal until the block is
+   synced (deferred), for each of the block format versions.
+   BLOKv3 (compressed) blocks are given as many inserts as
+   a BLOKv2 block can hold, for an apples-to-apples rate. */
+
+#define EAGER_INSERTS 2000
+
+static double
+s_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+s_block(struct tblock *b, struct dbkey *key, int version)
+{
+	int fd;
+
+	fd = syscall(SYS_memfd_create, "bench", 0);
+	if (fd < 0 || ftruncate(fd, TBLOCK_SIZE) != 0) {
+		fprintf(stderr, "failed to create backing memfd: %s\n", strerror(errno));
+		return -1;
+	}
+
+	b->key = key;
+	if (tblock_map(b, fd, 0, TBLOCK_SIZE) != 0) {
+		fprintf(stderr, "failed to map tblock: %s\n", strerror(errno));
+		return -1;
+	}
+	tblock_init(b, version, 0x800, 1500000000000ul);
+	return 0;
+}
+
+static double
+s_run(struct dbkey *key, int version, int n, int eager)
+{
+	struct tblock b;
+	double start;
+	int i;
+
+	memset(&b, 0, sizeof(b));
+	if (s_block(&b, key, version) != 0)
+		exit(1);
+	tblock_seal(&b);
+
+	start = s_now();
+	for (i = 0; i < n; i++) {
+		if (tblock_insert(&b, 1500000000000ul + i * 1000, i * 1.5) != 0) {
+			fprintf(stderr, "tblock_insert #%d failed: %s\n", i, strerror(errno));
+			exit(1);
+		}
+		if (eager)
+			tblock_seal(&b);
+	}
+	if (tblock_sync(&b) != 0) {
+		fprintf(stderr, "tblock_sync failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	return n / (s_now() - start);
+}
+
+int main(int argc, char **argv)
+{
+	struct dbkey key;
+	char raw[DEFAULT_KEY_SIZE];
+	int v, n;
+
+	key.key = raw;
+	key.len = sizeof(raw);
+	if (urand(key.key, key.len) != 0) {
+		fprintf(stderr, "failed to generate a random key\n");
+		return 1;
+	}
+	mac_key(&key);
+
+	for (v = 1; v <= 4; v++) {
+		n = v == 1 ? TCELLS_PER_TBLOCK : TCELLS_PER_TBLOCK_V2;
+		printf("BLOKv%d tblock_insert, sealed on every insert:  %12.0lf inserts/sec (%d inserts)\n",
+			v, s_run(&key, v, EAGER_INSERTS, 1), EAGER_INSERTS);
+		printf("BLOKv%d tblock_insert, sealed at sync / full:   %12.0lf inserts/sec (%d inserts)\n",
+			v, s_run(&key, v, n, 0), n);
+	}
+	return 0;
+}
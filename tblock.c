@@ -1,44 +1,253 @@
 #include "bolo.h"
 
-int
-tblock_map(struct tblock *b, int fd, off_t offset, size_t len)
+/* BLOKv3 header fields, beyond the common 32 bytes */
+#define V3_CELLS  32
+#define V3_BITS   36
+#define V3_REL    40
+#define V3_LEAD   44
+#define V3_TRAIL  45
+#define V3_DELTA  48
+#define V3_VALUE  56
+
+#define v3data(b) ((uint8_t *)(b)->page.data + TBLOCK_V3_HEADER_SIZE)
+
+/* BLOKv3 bitstreams are written most-significant bit
+   first; the data region starts out zeroed, so writes
+   only ever have to OR new bits in. */
+static void
+s_putbits(uint8_t *p, uint32_t *bit, uint64_t v, int n)
 {
-	CHECK(b != NULL, "tblock_map() given a NULL tblock to map");
+	int off, take;
+
+	while (n > 0) {
+		off  = *bit & 7;
+		take = MIN(n, 8 - off);
+		p[*bit >> 3] |= ((v >> (n - take)) & ((1u << take) - 1)) << (8 - off - take);
+		*bit += take;
+		n    -= take;
+	}
+}
+
+static uint64_t
+s_getbits(const uint8_t *p, uint32_t *bit, int n)
+{
+	int off, take;
+	uint64_t v;
+
+	v = 0;
+	while (n > 0) {
+		off  = *bit & 7;
+		take = MIN(n, 8 - off);
+		v = (v << take) | ((p[*bit >> 3] >> (8 - off - take)) & ((1u << take) - 1));
+		*bit += take;
+		n    -= take;
+	}
+	return v;
+}
+
+static uint64_t
+s_rawbits(double v)
+{
+	uint64_t u;
+	memcpy(&u, &v, sizeof(u));
+	return u;
+}
 
+static double
+s_double(uint64_t u)
+{
+	double v;
+	memcpy(&v, &u, sizeof(v));
+	return v;
+}
+
+/* offsets of the summary fields, relative to tblock_summaryat() */
+#define SUM_TSMIN  0
+#define SUM_TSMAX  4
+#define SUM_MIN    8
+#define SUM_MAX   16
+#define SUM_SUM   24
+#define SUM_SUMSQ 32
+#define SUM_FIRST 40
+#define SUM_LAST  48
+#define SUM_FLAGS 56
+
+static void
+s_readsummary(struct tblock *b)
+{
+	size_t at;
+
+	at = tblock_summaryat(b);
+	b->summary.tsmin = tblock_read32 (b, at + SUM_TSMIN);
+	b->summary.tsmax = tblock_read32 (b, at + SUM_TSMAX);
+	b->summary.min   = tblock_read64f(b, at + SUM_MIN);
+	b->summary.max   = tblock_read64f(b, at + SUM_MAX);
+	b->summary.sum   = tblock_read64f(b, at + SUM_SUM);
+	b->summary.sumsq = tblock_read64f(b, at + SUM_SUMSQ);
+	b->summary.first = tblock_read64f(b, at + SUM_FIRST);
+	b->summary.last  = tblock_read64f(b, at + SUM_LAST);
+	b->summary.flags = tblock_read32 (b, at + SUM_FLAGS);
+}
+
+static void
+s_writesummary(struct tblock *b)
+{
+	size_t at;
+
+	at = tblock_summaryat(b);
+	tblock_write32 (b, at + SUM_TSMIN, b->summary.tsmin);
+	tblock_write32 (b, at + SUM_TSMAX, b->summary.tsmax);
+	tblock_write64f(b, at + SUM_MIN,   b->summary.min);
+	tblock_write64f(b, at + SUM_MAX,   b->summary.max);
+	tblock_write64f(b, at + SUM_SUM,   b->summary.sum);
+	tblock_write64f(b, at + SUM_SUMSQ, b->summary.sumsq);
+	tblock_write64f(b, at + SUM_FIRST, b->summary.first);
+	tblock_write64f(b, at + SUM_LAST,  b->summary.last);
+	tblock_write32 (b, at + SUM_FLAGS, b->summary.flags);
+}
+
+/* reset a tblock, keeping only its signing key (and MAC) */
+static void
+s_reset(struct tblock *b)
+{
+	struct dbkey *key;
+	int mac;
+
+	key = b->key;
+	mac = b->mac;
 	memset(b, 0, sizeof(*b));
+	b->key = key;
+	b->mac = mac;
+}
 
-	if (page_map(&b->page, fd, offset, len) != 0)
+/* is a header all zeroes, i.e. space that was allocated but
+   never written (say, a crash right after tslab_extend())? */
+static int
+s_blank(const void *p, size_t len)
+{
+	const uint8_t *x = p;
+	while (len-- > 0)
+		if (*x++)
+			return 0;
+	return 1;
+}
+
+/* pick up the header / summary of a freshly-mapped tblock;
+   a blank header leaves the block at version 0 (the caller
+   gets to decide what that means), and an unrecognized one
+   fails with BOLO_EBADSLAB. */
+static int
+s_load(struct tblock *b)
+{
+	     if (memcmp(b->page.data, "BLOKv1", 6) == 0) b->version = 1;
+	else if (memcmp(b->page.data, "BLOKv2", 6) == 0) b->version = 2;
+	else if (memcmp(b->page.data, "BLOKv3", 6) == 0) b->version = 3;
+	else if (memcmp(b->page.data, "BLOKv4", 6) == 0) b->version = 4;
+	else if (s_blank(b->page.data, TBLOCK_HEADER_SIZE))
+		return 0; /* never initialized; leave it at version 0 */
+	else {
+		errorf("tblock_map() found an unrecognized block header (%02x %02x %02x %02x %02x %02x); refusing to map it",
+		       tblock_read8(b, 0), tblock_read8(b, 1), tblock_read8(b, 2),
+		       tblock_read8(b, 3), tblock_read8(b, 4), tblock_read8(b, 5));
+		errno = BOLO_EBADSLAB;
 		return -1;
+	}
 
-	b->cells  = tblock_read16(b,  6);
 	b->base   = tblock_read64(b,  8);
 	b->number = tblock_read64(b, 16);
 	b->next   = tblock_read64(b, 24);
+	b->chunks = 0;
+
+	if (b->version == 3) {
+		b->cells     = tblock_read32(b, V3_CELLS);
+		b->enc.bits  = tblock_read32(b, V3_BITS);
+		b->enc.rel   = tblock_read32(b, V3_REL);
+		b->enc.lead  = tblock_read8 (b, V3_LEAD);
+		b->enc.trail = tblock_read8 (b, V3_TRAIL);
+		b->enc.delta = (int64_t)tblock_read64(b, V3_DELTA);
+		b->enc.value = tblock_read64(b, V3_VALUE);
+
+		insist(b->enc.bits <= tblock_v3bits(b), "tblock_map() detected a corrupt block; encoded data is larger than allowed");
+
+	} else {
+		b->cells  = tblock_read16(b,  6);
+		insist(b->cells <= tblock_capacity(b), "tblock_map() detected a corrupt block; number of used cells is larger than allowed");
+	}
+
+	if (b->version != 1)
+		s_readsummary(b);
+	return 0;
+}
 
-	insist(b->cells <= TCELLS_PER_TBLOCK, "tblock_map() detected a corrupt block; number of used cells is larger than allowed");
+int
+tblock_map(struct tblock *b, int fd, off_t offset, size_t len)
+{
+	int esave;
+
+	CHECK(b != NULL, "tblock_map() given a NULL tblock to map");
+
+	s_reset(b);
+	if (page_map(&b->page, fd, offset, len) != 0)
+		return -1;
+	if (s_load(b) != 0) {
+		esave = errno;
+		if (page_unmap(&b->page) == 0)
+			errno = esave;
+		return -1;
+	}
 	return 0;
 }
 
-void tblock_init(struct tblock *b, uint64_t number, bolo_msec_t base)
+int
+tblock_borrow(struct tblock *b, struct page *from, size_t offset, size_t len)
+{
+	CHECK(b != NULL, "tblock_borrow() given a NULL tblock to map");
+
+	s_reset(b);
+	page_borrow(&b->page, from, offset, len);
+	return s_load(b);
+}
+
+void tblock_init(struct tblock *b, int version, uint64_t number, bolo_msec_t base)
 {
 	CHECK(b != NULL,            "tblock_init() given a NULL tblock to initialize");
 	CHECK(b->page.data != NULL, "tblock_init() given an unmapped tblock to initialize");
+	CHECK(version >= 1 && version <= 4, "tblock_init() given an unrecognized block format version");
+
+	b->valid   = 1;
+	b->version = version;
+	b->cells   = 0;
+	b->number  = number;
+	b->base    = base;
 
-	b->valid  = 1;
-	b->cells  = 0;
-	b->number = number;
-	b->base   = base;
+	memset(&b->enc, 0, sizeof(b->enc));
+	b->enc.lead = 0xff;
+	memset(&b->summary, 0, sizeof(b->summary));
 
-	memset(b->page.data, 0, TBLOCK_HEADER_SIZE);
-	memcpy(b->page.data, "BLOKv1", 6);
+	/* every chunk needs hashing, the first time around */
+	b->chunks = ~0ul;
 
-	tblock_write64(b,  6, b->cells);
+	/* v3 bitstreams rely on the data region being zeroed */
+	memset(b->page.data, 0, version == 3 ? tblock_chunktable(b) : TBLOCK_HEADER_SIZE);
+	memcpy(b->page.data, version == 1 ? "BLOKv1"
+	                   : version == 2 ? "BLOKv2"
+	                   : version == 3 ? "BLOKv3"
+	                   :                "BLOKv4", 6);
+
+	if (version != 3)
+		tblock_write64(b,  6, b->cells);
 	tblock_write64(b,  8, b->base);
 	tblock_write64(b, 16, b->number);
 	tblock_write64(b, 24, b->next);
 
-	if (b->key)
-		tblock_seal(b, b->key);
+	if (version == 3) {
+		tblock_write8(b, V3_LEAD,  b->enc.lead);
+		tblock_write8(b, V3_TRAIL, b->enc.trail);
+	}
+	if (version != 1)
+		s_writesummary(b);
+
+	tblock_seal(b);
 }
 
 int tblock_isfull(struct tblock *b)
@@ -46,7 +255,9 @@ int tblock_isfull(struct tblock *b)
 	CHECK(b != NULL, "tblock_isfull() given a NULL tblock to query");
 
 	errno = BOLO_EBLKFULL;
-	return b->cells == TCELLS_PER_TBLOCK;
+	if (b->version == 3)
+		return b->enc.bits + TBLOCK_V3_MAX_CELL_BITS > tblock_v3bits(b);
+	return b->cells == tblock_capacity(b);
 }
 
 int
@@ -58,6 +269,143 @@ tblock_canhold(struct tblock *b, bolo_msec_t when)
 	return when - b->base <  MAX_U32;
 }
 
+static void
+s_touch(struct tblock *b, size_t offset, size_t len)
+{
+	int lo, hi;
+
+	b->dirty = 1;
+	if (b->version == 1)
+		return;
+
+	lo = (offset           - tblock_hdrsize(b)) / TBLOCK_CHUNK_SIZE;
+	hi = (offset + len - 1 - tblock_hdrsize(b)) / TBLOCK_CHUNK_SIZE;
+	for (; lo <= hi; lo++)
+		b->chunks |= 1ul << lo;
+}
+
+/* append a single cell to a BLOKv3 bitstream.
+
+   timestamps are stored as the difference between this
+   cell's delta and the previous cell's delta (which is
+   almost always 0 for regularly-sampled series):
+
+     '0'                    delta-of-delta is 0
+     '10'   +  7 bits       in [-63, 64]
+     '110'  +  9 bits       in [-255, 256]
+     '1110' + 12 bits       in [-2047, 2048]
+     '1111' + 64 bits       anything else
+
+   values are XOR'd against the previous value, and only
+   the meaningful (non-zero) bits of that XOR are stored:
+
+     '0'                    same value as before
+     '10' + bits            fits in the previous window
+     '11' + 5 bits leading zeros
+          + 6 bits (length - 1)
+          + bits            opens a new window
+
+   the very first cell is stored raw, as a 32-bit relative
+   timestamp and a 64-bit value. */
+static void
+s_encode(struct tblock *b, uint32_t rel, double what)
+{
+	uint8_t *p;
+	uint32_t bit;
+	uint64_t raw, x;
+	int64_t delta, dod;
+	int lead, trail, len;
+
+	p   = v3data(b);
+	bit = b->enc.bits;
+	raw = s_rawbits(what);
+
+	if (b->cells == 0) {
+		s_putbits(p, &bit, rel, 32);
+		s_putbits(p, &bit, raw, 64);
+		b->enc.delta = 0;
+		goto done;
+	}
+
+	delta = (int64_t)rel - (int64_t)b->enc.rel;
+	dod   = delta - b->enc.delta;
+
+	     if (dod == 0)                    s_putbits(p, &bit, 0, 1);
+	else if (dod >=   -63 && dod <=   64) { s_putbits(p, &bit, 0x2, 2); s_putbits(p, &bit, dod +   63,  7); }
+	else if (dod >=  -255 && dod <=  256) { s_putbits(p, &bit, 0x6, 3); s_putbits(p, &bit, dod +  255,  9); }
+	else if (dod >= -2047 && dod <= 2048) { s_putbits(p, &bit, 0xe, 4); s_putbits(p, &bit, dod + 2047, 12); }
+	else                                  { s_putbits(p, &bit, 0xf, 4); s_putbits(p, &bit, (uint64_t)dod, 64); }
+	b->enc.delta = delta;
+
+	x = raw ^ b->enc.value;
+	if (x == 0) {
+		s_putbits(p, &bit, 0, 1);
+		goto done;
+	}
+
+	lead  = __builtin_clzll(x);
+	trail = __builtin_ctzll(x);
+	if (lead > 31)
+		lead = 31;
+
+	if (b->enc.lead != 0xff && lead >= b->enc.lead && trail >= b->enc.trail) {
+		s_putbits(p, &bit, 0x2, 2);
+		s_putbits(p, &bit, x >> b->enc.trail, 64 - b->enc.lead - b->enc.trail);
+
+	} else {
+		len = 64 - lead - trail;
+		s_putbits(p, &bit, 0x3, 2);
+		s_putbits(p, &bit, lead, 5);
+		s_putbits(p, &bit, len - 1, 6);
+		s_putbits(p, &bit, x >> trail, len);
+		b->enc.lead  = lead;
+		b->enc.trail = trail;
+	}
+
+done:
+	s_touch(b, TBLOCK_V3_HEADER_SIZE + (b->enc.bits >> 3),
+	           ((bit + 7) >> 3) - (b->enc.bits >> 3));
+
+	b->enc.bits  = bit;
+	b->enc.rel   = rel;
+	b->enc.value = raw;
+	b->cells++;
+
+	tblock_write32(b, V3_CELLS, b->cells);
+	tblock_write32(b, V3_BITS,  b->enc.bits);
+	tblock_write32(b, V3_REL,   b->enc.rel);
+	tblock_write8 (b, V3_LEAD,  b->enc.lead);
+	tblock_write8 (b, V3_TRAIL, b->enc.trail);
+	tblock_write64(b, V3_DELTA, (uint64_t)b->enc.delta);
+	tblock_write64(b, V3_VALUE, b->enc.value);
+}
+
+/* fold a new cell into the block's running summary, and
+   write it through to the summary region of the block.
+   must be called before the cell count is incremented. */
+static void
+s_summarize(struct tblock *b, uint32_t rel, double what)
+{
+	if (b->cells == 0) {
+		b->summary.tsmin = b->summary.tsmax = rel;
+		b->summary.min   = b->summary.max   = what;
+		b->summary.sum   = b->summary.sumsq = 0.0;
+		b->summary.first = what;
+	}
+
+	if (rel  < b->summary.tsmax) b->summary.flags |= TSUMMARY_UNSORTED;
+	if (rel  < b->summary.tsmin) b->summary.tsmin = rel;
+	if (rel  > b->summary.tsmax) b->summary.tsmax = rel;
+	if (what < b->summary.min)   b->summary.min   = what;
+	if (what > b->summary.max)   b->summary.max   = what;
+	b->summary.sum   += what;
+	b->summary.sumsq += what * what;
+	b->summary.last   = what;
+
+	s_writesummary(b);
+	s_touch(b, tblock_summaryat(b), TBLOCK_SUMMARY_SIZE);
+}
+
 int
 tblock_insert(struct tblock *b, bolo_msec_t when, double what)
 {
@@ -70,19 +418,417 @@ tblock_insert(struct tblock *b, bolo_msec_t when, double what)
 		return -1;
 
 	CHECK(when - b->base < MAX_U32, "tblock_insert() given a timestamp that is beyond the range of this block");
-	tblock_write32 (b, 32 + b->cells * 12,     when - b->base);
-	tblock_write64f(b, 32 + b->cells * 12 + 4, what);
-	tblock_write16 (b, 6, ++b->cells);
-	if (b->key)
-		tblock_seal(b, b->key);
+	if (b->version != 1)
+		s_summarize(b, when - b->base, what);
+
+	if (b->version == 3) {
+		s_encode(b, when - b->base, what);
+
+	} else if (b->version == 4) {
+		tblock_write32 (b, TBLOCK_HEADER_SIZE + b->cells * 4, when - b->base);
+		tblock_write64f(b, tblock_v4values(b) + b->cells * 8, what);
+		tblock_write16 (b, 6, ++b->cells);
+
+		s_touch(b, TBLOCK_HEADER_SIZE + (b->cells - 1) * 4, 4);
+		s_touch(b, tblock_v4values(b) + (b->cells - 1) * 8, 8);
+
+	} else {
+		tblock_write32 (b, 32 + b->cells * 12,     when - b->base);
+		tblock_write64f(b, 32 + b->cells * 12 + 4, what);
+		tblock_write16 (b, 6, ++b->cells);
+		s_touch(b, 32 + (b->cells - 1) * 12, 12);
+	}
+
+	/* re-sealing the whole block on every insert is
+	   prohibitively expensive; defer it until the block
+	   is synced or unmapped, unless the block just filled
+	   up (in which case it will never change again). */
+	if (tblock_isfull(b))
+		tblock_seal(b);
 	return 0;
 }
 
+/* mark every chunk of `b` for re-hashing at the next seal, for
+   when the seal it has on-disk might predate what it holds */
+void
+tblock_rehash(struct tblock *b)
+{
+	CHECK(b != NULL, "tblock_rehash() given a NULL tblock to rehash");
+
+	b->dirty  = 1;
+	b->chunks = ~0ul;
+}
+
 void
 tblock_next(struct tblock *b, struct tblock *next)
 {
 	b->next = next->number;
 	tblock_write64(b, 24, b->next);
-	if (b->key)
-		tblock_seal(b, b->key);
+	b->dirty = 1;
+}
+
+/* digest each of the chunks in the `which` bitmap into its
+   slot in digests[]; with (unkeyed) BLAKE2b for blocks that
+   are sealed by MAC_BLAKE2B, and SHA-512 otherwise.  chunks
+   are independent messages, so sha512_feedn() is free to
+   hash several of them at once. */
+static void
+s_chunks(struct tblock *b, uint64_t which, uint8_t *digests)
+{
+	struct sha512 c[TBLOCK_CHUNKS], *cv[TBLOCK_CHUNKS];
+	struct blake2b b2;
+	const void *buf[TBLOCK_CHUNKS];
+	size_t start, len[TBLOCK_CHUNKS];
+	int i, n;
+
+	for (i = n = 0; i < (int)tblock_nchunks(b); i++) {
+		if (!(which & (1ul << i)))
+			continue;
+
+		start  = tblock_hdrsize(b) + i * TBLOCK_CHUNK_SIZE;
+		buf[n] = (uint8_t *)b->page.data + start;
+		len[n] = MIN(TBLOCK_CHUNK_SIZE, tblock_chunktable(b) - start);
+		n++;
+	}
+
+	if (b->mac == MAC_BLAKE2B) {
+		for (i = n = 0; i < (int)tblock_nchunks(b); i++) {
+			if (!(which & (1ul << i)))
+				continue;
+
+			blake2b_init(&b2, NULL, 0);
+			blake2b_feed(&b2, buf[n], len[n]);
+			blake2b_done(&b2, digests + i * BLAKE2B_DIGEST);
+			n++;
+		}
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		cv[i] = &c[i];
+		sha512_init(cv[i]);
+	}
+	sha512_feedn(cv, buf, len, n);
+
+	for (i = n = 0; i < (int)tblock_nchunks(b); i++) {
+		if (!(which & (1ul << i)))
+			continue;
+
+		sha512_done(cv[n]);
+		if (sha512_raw(cv[n], digests + i * SHA512_DIGEST, SHA512_DIGEST) != 0)
+			memset(digests + i * SHA512_DIGEST, 0, SHA512_DIGEST);
+		n++;
+	}
+}
+
+/* BLOKv2 blocks are sealed with a MAC over the header
+   and the table of chunk digests; the chunk data itself
+   is covered (indirectly) by those digests. */
+static void
+s_mac2(struct tblock *b, struct dbkey *k, void *digest)
+{
+	struct mac m;
+
+	mac_start(&m, k, b->mac);
+	mac_feed(&m, b->page.data, tblock_hdrsize(b));
+	mac_feed(&m, (uint8_t *)b->page.data + tblock_chunktable(b),
+	             tblock_nchunks(b) * SHA512_DIGEST);
+	mac_done(&m, digest);
+}
+
+void
+tblock_seal(struct tblock *b)
+{
+	CHECK(b != NULL, "tblock_seal() given a NULL tblock to seal");
+
+	if (!b->key)
+		goto done;
+
+	if (b->version == 1) {
+		mac_seal(b->key, b->mac, b->page.data, b->page.len);
+		goto done;
+	}
+
+	s_chunks(b, b->chunks, (uint8_t *)b->page.data + tblock_chunktable(b));
+	s_mac2(b, b->key, (uint8_t *)b->page.data + tblock_size(b) - SHA512_DIGEST);
+
+done:
+	b->dirty    = 0;
+	b->chunks   = 0;
+	b->unsynced = 1;
+}
+
+int
+tblock_check(struct tblock *b, struct dbkey *k)
+{
+	uint8_t digest[SHA512_DIGEST];
+	uint8_t table[TBLOCK_CHUNKS * SHA512_DIGEST];
+
+	CHECK(b != NULL, "tblock_check() given a NULL tblock to check");
+	CHECK(k != NULL, "tblock_check() given a NULL key to check the seal with");
+
+	errno = BOLO_EBADHMAC;
+	if (b->version == 1)
+		return mac_check(k, b->mac, b->page.data, b->page.len) == 0 ? 0 : -1;
+
+	s_chunks(b, ~0ul, table);
+	if (memcmp(table, (uint8_t *)b->page.data + tblock_chunktable(b), tblock_nchunks(b) * SHA512_DIGEST) != 0)
+		return -1;
+
+	s_mac2(b, k, digest);
+	return memcmp(digest, (uint8_t *)b->page.data + tblock_size(b) - SHA512_DIGEST, SHA512_DIGEST) == 0 ? 0 : -1;
+}
+
+int
+tblock_sync(struct tblock *b)
+{
+	CHECK(b != NULL, "tblock_sync() given a NULL tblock to synchronize");
+
+	if (b->dirty)
+		tblock_seal(b);
+	if (!b->unsynced)
+		return 0;
+
+	if (page_sync(&b->page) != 0)
+		return -1;
+	b->unsynced = 0;
+	return 0;
+}
+
+int
+tblock_unmap(struct tblock *b)
+{
+	CHECK(b != NULL, "tblock_unmap() given a NULL tblock to unmap");
+
+	if (b->dirty && b->page.data)
+		tblock_seal(b);
+	return page_unmap(&b->page);
+}
+
+void
+tcursor_init(struct tcursor *c, struct tblock *b)
+{
+	CHECK(c != NULL, "tcursor_init() given a NULL cursor to initialize");
+	CHECK(b != NULL, "tcursor_init() given a NULL tblock to walk");
+
+	memset(c, 0, sizeof(*c));
+	c->block = b;
+}
+
+static int
+s_decode(struct tcursor *c)
+{
+	const uint8_t *p;
+	int64_t dod;
+	int len;
+
+	p = v3data(c->block);
+	if (c->n == 0) {
+		c->rel = s_getbits(p, &c->bit, 32);
+		c->raw = s_getbits(p, &c->bit, 64);
+		return 0;
+	}
+
+	     if (!s_getbits(p, &c->bit, 1)) dod = 0;
+	else if (!s_getbits(p, &c->bit, 1)) dod = (int64_t)s_getbits(p, &c->bit,  7) -   63;
+	else if (!s_getbits(p, &c->bit, 1)) dod = (int64_t)s_getbits(p, &c->bit,  9) -  255;
+	else if (!s_getbits(p, &c->bit, 1)) dod = (int64_t)s_getbits(p, &c->bit, 12) - 2047;
+	else                                dod = (int64_t)s_getbits(p, &c->bit, 64);
+	c->delta += dod;
+	c->rel    = (uint32_t)((int64_t)c->rel + c->delta);
+
+	if (!s_getbits(p, &c->bit, 1))
+		return 0;
+
+	if (s_getbits(p, &c->bit, 1)) {
+		c->lead  = s_getbits(p, &c->bit, 5);
+		len      = s_getbits(p, &c->bit, 6) + 1;
+		c->trail = 64 - c->lead - len;
+	}
+	if (c->bit + 64 - c->lead - c->trail > c->block->enc.bits)
+		return -1;
+	c->raw ^= s_getbits(p, &c->bit, 64 - c->lead - c->trail) << c->trail;
+	return 0;
+}
+
+int
+tcursor_next(struct tcursor *c)
+{
+	CHECK(c != NULL, "tcursor_next() given a NULL cursor to advance");
+
+	if (c->n >= c->block->cells)
+		return -1;
+
+	if (c->block->version == 4) {
+		c->ts    = c->block->base + tblock_tscol(c->block)[c->n];
+		c->value = tblock_valcol(c->block)[c->n];
+		c->n++;
+		return 0;
+	}
+
+	if (c->block->version != 3) {
+		c->ts    = tblock_ts(c->block, c->n);
+		c->value = tblock_value(c->block, c->n);
+		c->n++;
+		return 0;
+	}
+
+	if (s_decode(c) != 0)
+		return -1;
+
+	c->ts    = c->block->base + c->rel;
+	c->value = s_double(c->raw);
+	c->n++;
+	return 0;
+}
+
+static inline bolo_msec_t
+s_tsat(struct tblock *b, int n)
+{
+	return b->version == 4 ? b->base + tblock_tscol(b)[n]
+	                       : tblock_ts(b, n);
+}
+
+void
+tcursor_seek(struct tcursor *c, bolo_msec_t when)
+{
+	struct tcursor peek;
+	int lo, hi, mid;
+
+	CHECK(c != NULL, "tcursor_seek() given a NULL cursor to position");
+	CHECK(c->n == 0,  "tcursor_seek() given a cursor that has already been advanced");
+
+	if (!tblock_issorted(c->block) || c->block->cells == 0
+	 || when <= c->block->base + c->block->summary.tsmin)
+		return;
+
+	if (c->block->version == 3) {
+		/* no random access into a bitstream; decode ahead,
+		   without committing to the cell we stop on. */
+		for (;;) {
+			peek = *c;
+			if (tcursor_next(&peek) != 0 || peek.ts >= when)
+				return;
+			*c = peek;
+		}
+	}
+
+	lo = 0;
+	hi = c->block->cells;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (s_tsat(c->block, mid) < when) lo = mid + 1;
+		else                              hi = mid;
+	}
+	c->n = lo;
+}
+
+/* translate an absolute [from, until] range (in ms) into
+   the relative timestamps used inside of a block.  returns
+   non-zero if the block cannot hold any cells in range. */
+static int
+s_relrange(struct tblock *b, bolo_msec_t from, bolo_msec_t until, uint32_t *lo, uint32_t *hi)
+{
+	if (until < b->base || from > until || (from > b->base && from - b->base > MAX_U32))
+		return -1;
+
+	*lo = from  < b->base           ? 0       : from - b->base;
+	*hi = until - b->base > MAX_U32 ? MAX_U32 : until - b->base;
+	return 0;
+}
+
+int
+tblock_overlap(struct tblock *b, bolo_msec_t from, bolo_msec_t until)
+{
+	bolo_msec_t lo, hi;
+
+	CHECK(b != NULL, "tblock_overlap() given a NULL tblock to check");
+
+	if (b->cells == 0 || from > until)
+		return TBLOCK_DISJOINT;
+	if (b->version == 1)
+		return TBLOCK_OVERLAPS;
+
+	lo = b->base + b->summary.tsmin;
+	hi = b->base + b->summary.tsmax;
+	if (hi < from || lo > until)
+		return TBLOCK_DISJOINT;
+	if (lo >= from && hi <= until)
+		return TBLOCK_WITHIN;
+	return TBLOCK_OVERLAPS;
+}
+
+size_t
+tblock_count(struct tblock *b, bolo_msec_t from, bolo_msec_t until)
+{
+	struct tcursor c;
+	uint32_t lo, hi;
+	size_t n;
+
+	CHECK(b != NULL, "tblock_count() given a NULL tblock to scan");
+
+	if (s_relrange(b, from, until, &lo, &hi) != 0)
+		return 0;
+
+	switch (tblock_overlap(b, from, until)) {
+	case TBLOCK_DISJOINT: return 0;
+	case TBLOCK_WITHIN:   return b->cells;
+	}
+
+	if (b->version == 4)
+		return scan_count(tblock_tscol(b), b->cells, lo, hi);
+
+	n = 0;
+	tcursor_init(&c, b);
+	tcursor_seek(&c, from);
+	while (tcursor_next(&c) == 0) {
+		if (c.ts > until && tblock_issorted(b))
+			break;
+		if (c.ts >= from && c.ts <= until)
+			n++;
+	}
+	return n;
+}
+
+void
+tblock_reduce(struct tblock *b, bolo_msec_t from, bolo_msec_t until, struct scan *r)
+{
+	struct tcursor c;
+	uint32_t lo, hi;
+
+	CHECK(b != NULL, "tblock_reduce() given a NULL tblock to scan");
+	CHECK(r != NULL, "tblock_reduce() given a NULL scan result to reduce into");
+
+	if (s_relrange(b, from, until, &lo, &hi) != 0)
+		return;
+
+	switch (tblock_overlap(b, from, until)) {
+	case TBLOCK_DISJOINT:
+		return;
+
+	case TBLOCK_WITHIN:
+		if (b->summary.min < r->min) r->min = b->summary.min;
+		if (b->summary.max > r->max) r->max = b->summary.max;
+		r->sum   += b->summary.sum;
+		r->count += b->cells;
+		return;
+	}
+
+	if (b->version == 4) {
+		scan_reduce(tblock_tscol(b), tblock_valcol(b), b->cells, lo, hi, r);
+		return;
+	}
+
+	tcursor_init(&c, b);
+	tcursor_seek(&c, from);
+	while (tcursor_next(&c) == 0) {
+		if (c.ts > until && tblock_issorted(b))
+			break;
+		if (c.ts < from || c.ts > until)
+			continue;
+		if (c.value < r->min) r->min = c.value;
+		if (c.value > r->max) r->max = c.value;
+		r->sum += c.value;
+		r->count++;
+	}
 }
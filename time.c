@@ -30,6 +30,31 @@ bolo_s(const struct timeval *tv)
 	return tv->tv_sec;
 }
 
+bolo_msec_t
+bolo_duration(const char *s)
+{
+	bolo_msec_t n;
+	const char *p;
+
+	if (!s || !*s)
+		return INVALID_MS;
+
+	n = 0;
+	for (p = s; *p >= '0' && *p <= '9'; p++)
+		n = n * 10 + (*p - '0');
+	if (p == s)
+		return INVALID_MS;
+
+	if (streq(p, "ms")) return n;
+	if (streq(p, "")
+	 || streq(p, "s"))  return n * 1000;
+	if (streq(p, "m"))  return n * 1000 * 60;
+	if (streq(p, "h"))  return n * 1000 * 3600;
+	if (streq(p, "d"))  return n * 1000 * 86400;
+	if (streq(p, "w"))  return n * 1000 * 86400 * 7;
+	return INVALID_MS;
+}
+
 #ifdef TEST
 /* LCOV_EXCL_START */
 TESTS {
@@ -46,6 +71,17 @@ TESTS {
 
 	ok(bolo_ms(NULL) != INVALID_MS, "bolo_ms(NULL) returns now");
 	ok(bolo_s(NULL)  != INVALID_S,  "bolo_s(NULL) returns now");
+
+	is_unsigned(bolo_duration("250ms"), 250,                "bolo_duration(250ms)");
+	is_unsigned(bolo_duration("45"),    45000,              "bolo_duration(45) is in seconds");
+	is_unsigned(bolo_duration("45s"),   45000,              "bolo_duration(45s)");
+	is_unsigned(bolo_duration("5m"),    300000,             "bolo_duration(5m)");
+	is_unsigned(bolo_duration("36h"),   129600000,          "bolo_duration(36h)");
+	is_unsigned(bolo_duration("400d"),  34560000000ul,      "bolo_duration(400d) doesn't overflow");
+	is_unsigned(bolo_duration("2w"),    1209600000,         "bolo_duration(2w)");
+	is_unsigned(bolo_duration("3y"),    INVALID_MS,         "bolo_duration() rejects unknown units");
+	is_unsigned(bolo_duration("d"),     INVALID_MS,         "bolo_duration() requires a number");
+	is_unsigned(bolo_duration(""),      INVALID_MS,         "bolo_duration() rejects the empty string");
 }
 /* LCOV_EXCL_STOP */
 #endif
@@ -7,40 +7,194 @@
                and LE as [hex 4c 32 d1 7e] */
 #define ENDIAN_MAGIC 2127639116U
 
+/* ask for transparent huge pages on the slab mapping?
+   (the kernel may or may not honor this for file-backed
+    mappings, depending on filesystem and THP settings) */
+#ifndef TSLAB_HUGEPAGES
+#define TSLAB_HUGEPAGES 0
+#endif
+
+/* is this a block size (as a log2) that we know about? */
+static int
+s_validsize(int log2)
+{
+	int c;
+
+	for (c = 0; c < TBLOCK_CLASSES; c++)
+		if (tblock_class_log2(c) == log2)
+			return 1;
+	return 0;
+}
+
+/* slabs written before sha512_feed() stopped clobbering the
+   start of a partially-filled block were sealed over 64 zero
+   octets, followed by whatever was left in the block buffer
+   from hashing K^ipad: octets 64 - 87 of (padded key ^ ipad).
+   such a seal covers none of the header, so it is only taken
+   on an explicit upgrade (see db_upgrade()), which reseals
+   the header properly, on the spot. */
+static int
+s_legacyseal(struct dbkey *k, const char *header)
+{
+	struct hmac_sha512 c;
+	uint8_t msg[TSLAB_HEADER_SIZE], digest[SHA512_DIGEST];
+	size_t i;
+
+	memset(msg, 0, sizeof(msg));
+	if (k->len <= SHA512_BLOCK) /* longer keys are hashed down to 64 octets */
+		for (i = 64; i < TSLAB_HEADER_SIZE && i < k->len; i++)
+			msg[i] = k->key[i];
+	for (i = 64; i < TSLAB_HEADER_SIZE; i++)
+		msg[i] ^= 0x36;
+
+	hmac_sha512_start(&c, &k->hmac);
+	hmac_sha512_feed(&c, msg, sizeof(msg));
+	hmac_sha512_done(&c);
+	if (hmac_sha512_raw(&c, digest, SHA512_DIGEST) != 0)
+		return 0;
+
+	return memcmp(digest, header + TSLAB_HEADER_SIZE - SHA512_DIGEST, SHA512_DIGEST) == 0;
+}
+
+/* map the whole slab, header and all 2048 blocks, in one go.
+   the file only grows as blocks are extended, but mapping past
+   the end of the file is fine so long as nobody touches it;
+   tblocks borrow their windows out of this one mapping. */
+static int
+s_mapslab(struct tslab *s)
+{
+	memset(&s->map, 0, sizeof(s->map));
+	if (page_map(&s->map, s->fd, 0, 4096 + (size_t)TBLOCKS_PER_TSLAB * s->block_size) != 0)
+		return -1;
+
+	if (TSLAB_HUGEPAGES)
+		(void)page_advise(&s->map, PAGE_HUGE);
+	return 0;
+}
+
+/* pick up the free map from the header page.  one that was
+   never written (i.e. in older slabs) is all zeros, and frees
+   nothing; one that fails its seal is ignored, since the worst
+   a lost free map can do is leak a few blocks, whereas a forged
+   one could hand out blocks that are still in use. */
+static void
+s_readfree(struct tslab *s)
+{
+	uint8_t buf[TSLAB_FREEMAP_SIZE];
+	size_t i;
+
+	memset(s->freemap, 0, sizeof(s->freemap));
+	s->nfree = s->freedirty = 0;
+
+	if (pread(s->fd, buf, sizeof(buf), TSLAB_FREEMAP_OFFSET) != sizeof(buf))
+		return;
+	for (i = 0; i < sizeof(buf) && !buf[i]; i++)
+		;
+	if (i == sizeof(buf))
+		return; /* never written */
+
+	if (read64(buf, 0) != s->number
+	 || (s->key && mac_check(s->key, s->mac, buf, sizeof(buf)) != 0)) {
+		errorf("tslab [%#lx] has a bad free map; ignoring it", s->number);
+		return;
+	}
+
+	memcpy(s->freemap, buf + 8, sizeof(s->freemap));
+	for (i = 0; i < TBLOCKS_PER_TSLAB; i++)
+		if (s->freemap[i / 8] & (1 << (i % 8)))
+			s->nfree++;
+}
+
+static int
+s_writefree(struct tslab *s)
+{
+	uint8_t buf[TSLAB_FREEMAP_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+	write64(buf, 0, s->number);
+	memcpy(buf + 8, s->freemap, sizeof(s->freemap));
+	if (s->key)
+		mac_seal(s->key, s->mac, buf, sizeof(buf));
+
+	if (pwrite(s->fd, buf, sizeof(buf), TSLAB_FREEMAP_OFFSET) != sizeof(buf))
+		return -1;
+
+	s->freedirty = 0;
+	return 0;
+}
+
 int tslab_map(struct tslab *s, int fd)
 {
 	CHECK(s != NULL, "tslab_map() given a NULL tslab to map");
 	CHECK(fd >= 0,   "tslab_map() given an invalid file descriptor");
 
-	int i, rc;
-	char header[TSLAB_HEADER_SIZE];
-	ssize_t nread;
+	char header[TSLAB_V2_HEADER_SIZE];
+	ssize_t nread, len;
 	off_t n;
+	int esave, legacy;
 
 	errno = BOLO_EBADSLAB;
-	nread = read(fd, header, TSLAB_HEADER_SIZE);
+	nread = read(fd, header, TSLAB_V2_HEADER_SIZE);
 	if (nread < 0) /* read error! */
 		return -1;
 
-	if (nread != TSLAB_HEADER_SIZE) /* short read! */
+	if (memcmp(header, "SLABv1", 6) == 0)
+		len = TSLAB_HEADER_SIZE;
+	else if (memcmp(header, "SLABv2", 6) == 0)
+		len = TSLAB_V2_HEADER_SIZE;
+	else /* not a slab! */
 		return -1;
 
-	if (memcmp(header, "SLABv1", 6) != 0) /* not a slab! */
+	if (nread < len) /* short read! */
 		return -1;
 
-	/* check the HMAC */
-	errno = BOLO_EBADHMAC;
-	if (s->key && hmac_check(s->key->key, s->key->len, header, TSLAB_HEADER_SIZE) != 0)
+	/* which MAC sealed this slab (and its blocks)? */
+	s->mac = read8(header, 7);
+	if (!mac_name(s->mac))
 		return -1;
 
+	/* check the MAC */
+	errno = BOLO_EBADHMAC;
+	legacy = 0;
+	if (s->key && mac_check(s->key, s->mac, header, len) != 0) {
+		if (len != TSLAB_HEADER_SIZE || s->mac != MAC_HMAC_SHA512 || !s_legacyseal(s->key, header))
+			return -1;
+		if (!s->upgrade) {
+			errorf("tslab [%#lx] header has an old-style seal that does not cover it; "
+			       "run `bolo fsck --upgrade` to reseal it", read64(header, 16));
+			errno = BOLO_EBADHMAC;
+			return -1;
+		}
+		legacy = 1;
+	}
+
 	/* check host endianness vs file endianness */
 	errno = BOLO_EENDIAN;
 	if (read32(header, 8) != ENDIAN_MAGIC)
 		return -1;
 
+	errno = BOLO_EBADSLAB;
+	if (!s_validsize(read8(header, 6)))
+		return -1;
+
+	if (legacy) {
+		mac_seal(s->key, s->mac, header, len);
+		if (pwrite(fd, header, len, 0) != len || fsync(fd) != 0)
+			return -1;
+		warningf("resealed the old-style header seal of tslab [%#lx]", read64(header, 16));
+	}
+
 	s->fd         = fd;
 	s->block_size = (1 << read8(header, 6));
 	s->number     = read64(header, 16);
+	s->reserved   = 0;
+
+	s->from = s->until = s->keep = 0;
+	if (len == TSLAB_V2_HEADER_SIZE) {
+		s->from  = read64(header, 24);
+		s->until = read64(header, 32);
+		s->keep  = read64(header, 40);
+	}
 
 	n = lseek(s->fd, 0, SEEK_END);
 	if (n < 0)
@@ -51,20 +205,75 @@ int tslab_map(struct tslab *s, int fd)
 	if (n == 0) /* orphaned header */
 		return -1;
 
-	/* scan blocks! */
+	if (s_mapslab(s) != 0)
+		return -1;
+
+	s_readfree(s);
+	s->retired = 0;
+
 	memset(s->blocks, 0, sizeof(s->blocks));
+	s->loaded = 0;
+	if (s->lazy)
+		return 0; /* tslab_load() will pick up the blocks */
+
+	if (tslab_load(s) == 0)
+		return 0;
+
+	/* don't leave the slab mapping lying around */
+	esave = errno;
+	if (page_unmap(&s->map) == 0)
+		errno = esave;
+	return -1;
+}
+
+int tslab_load(struct tslab *s)
+{
+	int i, rc;
+	off_t n;
+
+	CHECK(s != NULL, "tslab_load() given a NULL tslab to load");
+
+	if (s->loaded)
+		return 0;
+
+	n = lseek(s->fd, 0, SEEK_END);
+	if (n < 0)
+		return -1;
+	n -= 4096;
+
+	/* scan blocks! */
 	lseek(s->fd, 4096, SEEK_SET);
 	for (i = 0; i < TBLOCKS_PER_TSLAB && n > 0; i++, n -= s->block_size) {
 		s->blocks[i].key = s->key;
-		rc = tblock_map(&s->blocks[i], s->fd,
-		                4096 + i * s->block_size, /* grab the i'th block */
-		                s->block_size);
-		if (rc != 0)
+		s->blocks[i].mac = s->mac;
+		rc = tblock_borrow(&s->blocks[i], &s->map,
+		                   4096 + i * s->block_size, /* grab the i'th block */
+		                   s->block_size);
+		if (rc != 0) {
+			errorf("tslab [%#lx] block %d is corrupt; refusing to load the slab", s->number, i);
+
+			/* forget the blocks we did pick up */
+			while (--i >= 0)
+				rc = tblock_unmap(&s->blocks[i]);
+			memset(s->blocks, 0, sizeof(s->blocks));
+			errno = BOLO_EBADSLAB;
 			return -1;
+		}
+
+		if (s->blocks[i].version == 0) {
+			/* allocated, but the header never made it to disk
+			   (a crash right after tslab_extend(), say); there
+			   was never any data here, so start it over as an
+			   empty block, for the next sweep to reclaim. */
+			warningf("tslab [%#lx] block %d has a blank header; reinitializing it as an empty block", s->number, i);
+			tblock_init(&s->blocks[i], s->block_format ? s->block_format : TBLOCK_DEFAULT_VERSION,
+			            tslab_number(s->number) | i, 0);
+		}
 
 		s->blocks[i].valid = 1;
 	}
 
+	s->loaded = 1;
 	return 0;
 }
 
@@ -84,47 +293,97 @@ int tslab_unmap(struct tslab *s)
 			ok = -1;
 	}
 
+	if (page_unmap(&s->map) != 0)
+		ok = -1;
 	close(s->fd);
 	return ok;
 }
 
+int tslab_isdirty(struct tslab *s)
+{
+	int i;
+
+	CHECK(s != NULL, "tslab_isdirty() given a NULL tslab to check");
+
+	if (s->freedirty)
+		return 1;
+	for (i = 0; i < TBLOCKS_PER_TSLAB && s->blocks[i].valid; i++)
+		if (s->blocks[i].dirty || s->blocks[i].unsynced)
+			return 1;
+	return 0;
+}
+
 int tslab_sync(struct tslab *s)
 {
-	int i, ok;
+	int i, j, ok;
 
 	CHECK(s != NULL, "tslab_sync() given a NULL tslab to synchronize");
 
+	/* seal whatever changed, and then msync each run of
+	   adjacent changed blocks in one go; blocks that have
+	   not changed since the last sync are left alone. */
 	ok = 0;
-	for (i = 0; i < TBLOCKS_PER_TSLAB; i++) {
-		if (!s->blocks[i].valid)
-			break;
+	for (i = 0; i < TBLOCKS_PER_TSLAB && s->blocks[i].valid; i = j + 1) {
+		for (j = i; j < TBLOCKS_PER_TSLAB && s->blocks[j].valid; j++) {
+			if (s->blocks[j].dirty)
+				tblock_seal(&s->blocks[j]);
+			if (!s->blocks[j].unsynced)
+				break;
+		}
+		if (j == i)
+			continue;
 
-		if (tblock_sync(&s->blocks[i]) != 0)
+		if (page_syncrange(&s->map, 4096 + (size_t)i * s->block_size,
+		                            (size_t)(j - i) * s->block_size) != 0) {
 			ok = -1;
+			continue;
+		}
+		for (; i < j; i++)
+			s->blocks[i].unsynced = 0;
 	}
 
+	if (s->freedirty && s_writefree(s) != 0)
+		ok = -1;
+
 	return ok;
 }
 
 int tslab_init(struct tslab *s, int fd, uint64_t number, uint32_t block_size)
 {
-	char header[TSLAB_HEADER_SIZE];
-	size_t nwrit;
+	char header[TSLAB_V2_HEADER_SIZE];
+	size_t nwrit, len;
+	int log2;
 
 	CHECK(s != NULL, "tslab_init() given a NULL tslab to initialize");
-	CHECK(block_size == (1 << 19), "tslab_init() given a non-standard block size");
+
+	for (log2 = 0; (1u << log2) < block_size; log2++)
+		;
+	CHECK((1u << log2) == block_size && s_validsize(log2),
+	      "tslab_init() given a non-standard block size");
+
+	CHECK(s->from <= s->until, "tslab_init() given a tslab with a backwards time window");
+
+	/* only slabs that belong to a time window need the
+	   bigger (v2) header, to say which window that is */
+	len = s->until ? TSLAB_V2_HEADER_SIZE : TSLAB_HEADER_SIZE;
 
 	memset(header, 0, sizeof(header));
-	memcpy(header, "SLABv1", 6);
-	write8(header,   6, 19); /* from block_size, ostensibly */
+	memcpy(header, s->until ? "SLABv2" : "SLABv1", 6);
+	write8(header,   6, log2);
+	write8(header,   7, s->mac);
 	write32(header,  8, ENDIAN_MAGIC);
 	write64(header, 16, tslab_number(number));
+	if (s->until) {
+		write64(header, 24, s->from);
+		write64(header, 32, s->until);
+		write64(header, 40, s->keep);
+	}
 	if (s->key)
-		hmac_seal(s->key->key, s->key->len, header, sizeof(header));
+		mac_seal(s->key, s->mac, header, len);
 
 	lseek(fd, 0, SEEK_SET);
-	nwrit = write(fd, header, sizeof(header));
-	if (nwrit != sizeof(header))
+	nwrit = write(fd, header, len);
+	if (nwrit != len)
 		return -1;
 
 	/* align to a page boundary */
@@ -135,9 +394,15 @@ int tslab_init(struct tslab *s, int fd, uint64_t number, uint32_t block_size)
 	s->fd         = fd;
 	s->block_size = block_size;
 	s->number     = number;
+	s->reserved   = 0;
+	s->loaded     = 1; /* nothing to load */
+	s->nfree      = 0;
+	s->freedirty  = 0;
+	s->retired    = 0;
+	memset(s->freemap, 0, sizeof(s->freemap));
 	memset(s->blocks, 0, sizeof(s->blocks));
 
-	return 0;
+	return s_mapslab(s);
 }
 
 int tslab_isfull(struct tslab *s)
@@ -146,6 +411,9 @@ int tslab_isfull(struct tslab *s)
 
 	CHECK(s != NULL, "tslab_isfull() given a NULL tslab to query");
 
+	if (tslab_load(s) != 0)
+		return 1; /* can't extend what we can't read */
+
 	for (i = 0; i < TBLOCKS_PER_TSLAB; i++)
 		if (!s->blocks[i].valid)
 			return 0; /* this block is avail; slab is not full */
@@ -161,6 +429,9 @@ int tslab_extend(struct tslab *s, bolo_msec_t base)
 
 	CHECK(s != NULL, "tslab_extend() given a NULL tslab to extend");
 
+	if (tslab_load(s) != 0)
+		return -1;
+
 	/* seek to the end of the fd, so we can extend it */
 	if (lseek(s->fd, 0, SEEK_END) < 0)
 		return -1;
@@ -172,10 +443,20 @@ int tslab_extend(struct tslab *s, bolo_msec_t base)
 
 		len   = s->block_size;
 		start = sysconf(_SC_PAGESIZE) + i * len;
-		CHECK(len == (1 << 19), "tslab_extend() was told to extend a tslab with a non-standard block size");
 
 		/* track the encryption key */
 		s->blocks[i].key = s->key;
+		s->blocks[i].mac = s->mac;
+
+		/* reserve the next stretch of the slab on-disk, so that
+		   blocks land in large contiguous extents.  this is only
+		   advisory; if it fails, the write below still grows the
+		   file (sparsely) the old-fashioned way. */
+		if (start + (off_t)len > s->reserved) {
+			s->reserved = MIN(start + TSLAB_PREALLOC,
+			                  (off_t)(sysconf(_SC_PAGESIZE) + TBLOCKS_PER_TSLAB * len));
+			(void)fprealloc(s->fd, start, s->reserved - start);
+		}
 
 		/* extend the file descriptor one TBLOCK's worth */
 		if (lseek(s->fd, start + len - 1, SEEK_SET) < 0)
@@ -183,14 +464,17 @@ int tslab_extend(struct tslab *s, bolo_msec_t base)
 		if (write(s->fd, "\0", 1) != 1)
 			return -1;
 
-		/* map the new block into memory */
-		if (tblock_map(&s->blocks[i], s->fd, start, len) == 0) {
-			tblock_init(&s->blocks[i], tslab_number(s->number) | i, base);
+		/* carve the new block out of the slab mapping */
+		if (tblock_borrow(&s->blocks[i], &s->map, start, len) == 0) {
+			tblock_init(&s->blocks[i], s->block_format ? s->block_format : TBLOCK_DEFAULT_VERSION,
+			            tslab_number(s->number) | i, base);
 			return 0;
 		}
 
-		/* map failed; truncate the fd back to previous size */
+		/* map failed; truncate the fd back to previous size
+		   (which also releases anything we preallocated) */
 		ftruncate(s->fd, start);
+		s->reserved = 0;
 		lseek(s->fd, 0, SEEK_END);
 
 		/* ... and signal failure */
@@ -206,6 +490,9 @@ tslab_tblock(struct tslab *s, uint64_t id, bolo_msec_t ts)
 {
 	CHECK(s != NULL, "tslab_tblock() given a NULL tslab to query");
 
+	if (tslab_load(s) != 0)
+		return NULL;
+
 	errno = BOLO_ENOBLOCK;
 	if (tslab_number(id) != s->number)
 		return NULL;
@@ -224,3 +511,68 @@ tslab_tblock(struct tslab *s, uint64_t id, bolo_msec_t ts)
 	}
 	return &(s->blocks[tblock_number(id)]);
 }
+
+int
+tslab_free(struct tslab *s, uint64_t id)
+{
+	int i;
+
+	CHECK(s != NULL, "tslab_free() given a NULL tslab");
+
+	if (tslab_load(s) != 0)
+		return -1;
+
+	errno = BOLO_ENOBLOCK;
+	i = tblock_number(id);
+	if (tslab_number(id) != s->number || !s->blocks[i].valid)
+		return -1;
+
+	if (!(s->freemap[i / 8] & (1 << (i % 8)))) {
+		s->freemap[i / 8] |= 1 << (i % 8);
+		s->nfree++;
+		s->freedirty = 1;
+	}
+	return 0;
+}
+
+int
+tslab_isfree(struct tslab *s, uint64_t id)
+{
+	int i;
+
+	CHECK(s != NULL, "tslab_isfree() given a NULL tslab");
+
+	i = tblock_number(id);
+	return tslab_number(id) == s->number && (s->freemap[i / 8] & (1 << (i % 8)));
+}
+
+/* hand a free block back out, wiped clean and starting at `ts`.
+   the free map on-disk still has it as free until the next
+   tslab_sync(), by which point whatever refers to it now has
+   been (or is about to be) written out. */
+struct tblock *
+tslab_reuse(struct tslab *s, uint64_t id, bolo_msec_t ts)
+{
+	struct tblock *b;
+	int i;
+
+	CHECK(s != NULL, "tslab_reuse() given a NULL tslab");
+
+	if (tslab_load(s) != 0)
+		return NULL;
+
+	errno = BOLO_ENOBLOCK;
+	if (!tslab_isfree(s, id) || !s->blocks[tblock_number(id)].valid)
+		return NULL;
+
+	i = tblock_number(id);
+	s->freemap[i / 8] &= ~(1 << (i % 8));
+	s->nfree--;
+	s->freedirty = 1;
+
+	b = &s->blocks[i];
+	b->next = 0;
+	tblock_init(b, s->block_format ? s->block_format : TBLOCK_DEFAULT_VERSION,
+	            tslab_number(s->number) | i, ts);
+	return b;
+}
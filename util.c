@@ -28,6 +28,8 @@ static const char *errors[] = {
 	/* BOLO_ENOBLOCK */  "No such database block",
 	/* BOLO_EBLKCONT */  "Block continuity broken",
 	/* BOLO_ERDONLY */   "Database is read-only",
+	/* BOLO_EBADCONF */  "Invalid database settings file",
+	/* BOLO_EBADROLL */  "Corrupt rollup file detected",
 };
 
 const char *
@@ -150,6 +152,22 @@ mktree(int dirfd, const char *path, mode_t mode)
 	return 0;
 }
 
+int
+fprealloc(int fd, off_t offset, size_t len)
+{
+	CHECK(fd >= 0,     "fprealloc() given an invalid file descriptor");
+	CHECK(offset >= 0, "fprealloc() given an invalid offset to preallocate from");
+
+#ifdef FALLOC_FL_KEEP_SIZE
+	/* KEEP_SIZE reserves the extents without moving EOF, so
+	   file size remains the high-water mark of what's in use */
+	return fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len);
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
 char *
 deslash(char *s)
 {
@@ -415,6 +433,27 @@ TESTS {
 			"stat(t/tmp/a/b/c/d/FILE) should fail, even after we call mktree()");
 	}
 
+	subtest {
+		struct stat st;
+		int fd;
+
+		fd = memfd("prealloc");
+		if (write(fd, "x", 1) != 1)
+			BAIL_OUT("failed to write to prealloc memfd");
+
+		if (fprealloc(fd, 0, 1 << 20) != 0) {
+			ok(errno == EOPNOTSUPP || errno == ENOSYS,
+				"fprealloc() should only fail if the filesystem can't preallocate");
+		} else {
+			pass("fprealloc() should succeed where fallocate() is supported");
+		}
+
+		if (fstat(fd, &st) != 0)
+			BAIL_OUT("failed to fstat() prealloc memfd");
+		is_int(st.st_size, 1, "fprealloc() should not change the size of the file");
+		close(fd);
+	}
+
 	subtest {
 		struct list lst;
 		struct data A, B, C, D;
@@ -0,0 +1,316 @@
+#include "bolo.h"
+
+/* WAL file format:
+
+   the log is a run of frames, each one holding a group of
+   measurements that were committed (and fsync'd) together.
+
+     0 "WALFv1" (6)  (resv) (2)
+     8 COUNT (4)  LENGTH (4)
+    16 records ...
+       MAC (64)
+
+   each record is: TIMESTAMP (8), VALUE (8, IEEE-754), NAME
+   LENGTH (2), and then the metric|tagset name itself (not
+   NUL-terminated).  LENGTH covers the whole frame, header and
+   MAC included.  the MAC (of whatever kind the database seals
+   its tslabs with) covers everything before it, so a frame
+   that was torn by a crash, or tampered with, never replays.
+   everything is in host byte order. */
+#define FRAME_HEADER 16
+#define RECORD_SIZE  18
+
+/* no frame should ever get this big; a LENGTH bigger than this
+   is garbage, and not worth allocating memory for */
+#define FRAME_MAX (256 << 20)
+
+int
+wal_open(struct wal *w, int dirfd, const char *path, struct dbkey *key, int mac)
+{
+	struct stat st;
+
+	CHECK(w != NULL,    "wal_open() given a NULL wal to open");
+	CHECK(path != NULL, "wal_open() given a NULL path to open");
+
+	memset(w, 0, sizeof(*w));
+	w->fd = openat(dirfd, path, O_RDWR|O_CREAT|O_APPEND, 0666);
+	if (w->fd < 0)
+		return -1;
+
+	if (fstat(w->fd, &st) != 0) {
+		close(w->fd);
+		w->fd = -1;
+		return -1;
+	}
+
+	w->key       = key;
+	w->mac       = mac;
+	w->group     = WAL_GROUP;
+	w->committed = st.st_size;
+	return 0;
+}
+
+int
+wal_close(struct wal *w)
+{
+	int rc;
+
+	CHECK(w != NULL, "wal_close() given a NULL wal to close");
+
+	rc = close(w->fd);
+	free(w->buf);
+	memset(w, 0, sizeof(*w));
+	w->fd = -1;
+	return rc;
+}
+
+int
+wal_append(struct wal *w, const char *name, bolo_msec_t ts, bolo_value_t value)
+{
+	size_t n;
+
+	CHECK(w != NULL,    "wal_append() given a NULL wal to append to");
+	CHECK(name != NULL, "wal_append() given a NULL metric name to log");
+
+	n = strlen(name);
+	errno = ENAMETOOLONG;
+	if (n > 0xffff)
+		return -1;
+
+	/* leave room for the MAC, too */
+	if (w->len + FRAME_HEADER + RECORD_SIZE + n + MAC_DIGEST > w->cap) {
+		w->cap = (w->len + FRAME_HEADER + RECORD_SIZE + n + MAC_DIGEST) * 2;
+		w->buf = realloc(w->buf, w->cap);
+		insist(w->buf != NULL, "wal_append() unable to allocate memory for the log buffer");
+	}
+	if (w->len == 0)
+		w->len = FRAME_HEADER;
+
+	write64 (w->buf, w->len,      ts);
+	write64f(w->buf, w->len +  8, value);
+	write16 (w->buf, w->len + 16, n);
+	memcpy(w->buf + w->len + RECORD_SIZE, name, n);
+	w->len += RECORD_SIZE + n;
+	w->pending++;
+
+	if (w->group && w->pending >= w->group)
+		return wal_commit(w);
+	return 0;
+}
+
+int
+wal_commit(struct wal *w)
+{
+	size_t off;
+	ssize_t nwrit;
+
+	CHECK(w != NULL, "wal_commit() given a NULL wal to commit");
+
+	if (w->pending == 0)
+		return 0;
+
+	memset(w->buf, 0, FRAME_HEADER);
+	memcpy(w->buf, "WALFv1", 6);
+	write32(w->buf,  8, w->pending);
+	write32(w->buf, 12, w->len + MAC_DIGEST);
+	memset(w->buf + w->len, 0, MAC_DIGEST);
+	w->len += MAC_DIGEST;
+	if (w->key)
+		mac_seal(w->key, w->mac, w->buf, w->len);
+
+	for (off = 0; off < w->len; off += nwrit) {
+		nwrit = write(w->fd, w->buf + off, w->len - off);
+		if (nwrit < 0 && errno == EINTR)
+			nwrit = 0;
+		else if (nwrit <= 0)
+			goto fail;
+	}
+	if (fdatasync(w->fd) != 0)
+		goto fail;
+
+	w->committed += w->len;
+	w->len = w->pending = 0;
+	return 0;
+
+fail:
+	/* don't leave half a frame behind for the next one to
+	   be appended after; replay would stop short of it. */
+	(void)ftruncate(w->fd, w->committed);
+	w->len -= MAC_DIGEST;
+	return -1;
+}
+
+int
+wal_replay(struct wal *w, wal_replay_fn fn, void *udata)
+{
+	uint8_t header[FRAME_HEADER], *frame;
+	char name[0xffff + 1];
+	size_t off, at, len, count, i, n;
+
+	CHECK(w != NULL,  "wal_replay() given a NULL wal to replay");
+	CHECK(fn != NULL, "wal_replay() given a NULL replay function");
+
+	for (off = 0; off < w->committed; off += len) {
+		if (pread(w->fd, header, FRAME_HEADER, off) != FRAME_HEADER
+		 || memcmp(header, "WALFv1", 6) != 0)
+			break;
+
+		count = read32(header,  8);
+		len   = read32(header, 12);
+		if (len < FRAME_HEADER + MAC_DIGEST || len > FRAME_MAX || off + len > w->committed)
+			break;
+
+		frame = xmalloc(len);
+		if (pread(w->fd, frame, len, off) != (ssize_t)len
+		 || (w->key && mac_check(w->key, w->mac, frame, len) != 0)) {
+			free(frame);
+			break;
+		}
+
+		/* check every record fits before replaying any of them */
+		for (at = FRAME_HEADER, i = 0; i < count && at + RECORD_SIZE <= len - MAC_DIGEST; i++)
+			at += RECORD_SIZE + read16(frame, at + 16);
+		if (i != count || at != len - MAC_DIGEST) {
+			free(frame);
+			break;
+		}
+
+		for (at = FRAME_HEADER, i = 0; i < count; i++) {
+			n = read16(frame, at + 16);
+			memcpy(name, frame + at + RECORD_SIZE, n);
+			name[n] = '\0';
+			if (fn(name, read64(frame, at), read64f(frame, at + 8), udata) != 0) {
+				free(frame);
+				return -1;
+			}
+			at += RECORD_SIZE + n;
+		}
+		free(frame);
+	}
+
+	/* anything past the last good frame was torn by a crash,
+	   or can't be trusted; drop it, so that new frames don't
+	   end up stranded behind it. */
+	if (off < w->committed) {
+		errorf("discarding %lu octets of write-ahead log past the last intact frame (at offset %lu)",
+			w->committed - off, off);
+		if (ftruncate(w->fd, off) != 0)
+			return -1;
+		w->committed = off;
+	}
+	return 0;
+}
+
+int
+wal_reset(struct wal *w)
+{
+	CHECK(w != NULL, "wal_reset() given a NULL wal to reset");
+
+	if (ftruncate(w->fd, 0) != 0 || fdatasync(w->fd) != 0)
+		return -1;
+
+	w->committed = w->len = w->pending = 0;
+	return 0;
+}
+
+#ifdef TEST
+/* LCOV_EXCL_START */
+struct seen {
+	int n;
+	int bad;
+};
+
+static int
+s_count(const char *name, bolo_msec_t ts, bolo_value_t v, void *_s)
+{
+	struct seen *s = _s;
+
+	if (strcmp(name, s->n % 2 ? "mem|host=b" : "cpu|host=a") != 0
+	 || ts != 1500000000000ul + s->n * 1000ul || v != s->n)
+		s->bad++;
+	s->n++;
+	return 0;
+}
+
+TESTS {
+	subtest {
+		struct dbkey key;
+		struct wal w;
+		struct seen s;
+		char file[] = "/tmp/bolo-wal-XXXXXX";
+		uint8_t octet;
+		off_t size;
+		int fd, i;
+
+		key.key = "\xde\xca\xfb\xad"; key.len = 4; mac_key(&key);
+
+		fd = mkstemp(file);
+		if (fd < 0)
+			BAIL_OUT("failed to create a temporary file");
+		close(fd);
+
+		ok(wal_open(&w, AT_FDCWD, file, &key, MAC_HMAC_SHA512) == 0, "wal_open() should succeed");
+		w.group = 4;
+		for (i = 0; i < 10; i++)
+			if (wal_append(&w, i % 2 ? "mem|host=b" : "cpu|host=a", 1500000000000ul + i * 1000ul, i) != 0)
+				BAIL_OUT("wal_append() failed");
+		is_unsigned(w.pending, 2, "wal_append() should commit a group at a time");
+		ok(w.committed > 0, "committed groups should be on-disk");
+		ok(wal_commit(&w) == 0, "wal_commit() should succeed");
+		is_unsigned(w.pending, 0, "wal_commit() should commit whatever is pending");
+		size = w.committed;
+		ok(wal_close(&w) == 0, "wal_close() should succeed");
+
+		ok(wal_open(&w, AT_FDCWD, file, &key, MAC_HMAC_SHA512) == 0, "wal_open() should succeed");
+		memset(&s, 0, sizeof(s));
+		ok(wal_replay(&w, s_count, &s) == 0, "wal_replay() should succeed");
+		is_int(s.n, 10, "wal_replay() should replay every committed measurement");
+		is_int(s.bad, 0, "wal_replay() should replay measurements in order, intact");
+
+		/* half of a frame, as if we crashed partway through a commit */
+		for (i = 10; i < 12; i++)
+			if (wal_append(&w, i % 2 ? "mem|host=b" : "cpu|host=a", 1500000000000ul + i * 1000ul, i) != 0)
+				BAIL_OUT("wal_append() failed");
+		if (write(w.fd, w.buf, w.len / 2) != (ssize_t)(w.len / 2))
+			BAIL_OUT("failed to tear the log");
+		ok(wal_close(&w) == 0, "wal_close() should succeed");
+
+		ok(wal_open(&w, AT_FDCWD, file, &key, MAC_HMAC_SHA512) == 0, "wal_open() should succeed");
+		memset(&s, 0, sizeof(s));
+		ok(wal_replay(&w, s_count, &s) == 0, "wal_replay() should succeed on a torn log");
+		is_int(s.n, 10, "wal_replay() should stop at a torn frame");
+		is_unsigned(w.committed, size, "wal_replay() should truncate the torn frame");
+
+		for (i = 10; i < 12; i++)
+			if (wal_append(&w, i % 2 ? "mem|host=b" : "cpu|host=a", 1500000000000ul + i * 1000ul, i) != 0)
+				BAIL_OUT("wal_append() failed");
+		ok(wal_commit(&w) == 0, "wal_commit() should succeed after a truncation");
+		memset(&s, 0, sizeof(s));
+		ok(wal_replay(&w, s_count, &s) == 0, "wal_replay() should succeed");
+		is_int(s.n, 12, "new frames should replay after the old ones");
+		is_int(s.bad, 0, "new frames should replay intact");
+
+		/* flip a bit in the last frame (not through w.fd;
+		   pwrite() to an O_APPEND descriptor appends) */
+		fd = open(file, O_RDWR);
+		if (fd < 0 || pread(fd, &octet, 1, size + 20) != 1)
+			BAIL_OUT("failed to read the log");
+		octet ^= 0x01;
+		if (pwrite(fd, &octet, 1, size + 20) != 1)
+			BAIL_OUT("failed to tamper with the log");
+		close(fd);
+		memset(&s, 0, sizeof(s));
+		ok(wal_replay(&w, s_count, &s) == 0, "wal_replay() should succeed on a tampered log");
+		is_int(s.n, 10, "wal_replay() should not replay a tampered frame");
+
+		ok(wal_reset(&w) == 0, "wal_reset() should succeed");
+		memset(&s, 0, sizeof(s));
+		ok(wal_replay(&w, s_count, &s) == 0, "wal_replay() should succeed on an empty log");
+		is_int(s.n, 0, "wal_reset() should empty the log");
+		ok(wal_close(&w) == 0, "wal_close() should succeed");
+
+		unlink(file);
+	}
+}
+/* LCOV_EXCL_STOP */
+#endif